@@ -0,0 +1,195 @@
+#!/usr/bin/env python3
+#
+# Mock Nominatim server for the nominatim_fdw benchmarks.
+#
+# Serves the /search, /reverse and /lookup endpoints in the XML format of
+# Nominatim. The responses are modelled after responses recorded from
+# nominatim.openstreetmap.org, and their size follows the request like the
+# real server does: one place per requested osm_id (lookup) or up to
+# 'limit' places (search), a country sized polygon if one is requested and
+# a long list of names if namedetails are requested. Latency and errors can
+# be injected to see how the extension copes with slow or failing servers.
+#
+# Usage: mock_nominatim.py [--port 8080] [--latency-ms 0] [--jitter-ms 0]
+#                          [--error-rate 0.0] [--error-status 503]
+
+import argparse
+import math
+import random
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from urllib.parse import parse_qs, urlparse
+from xml.sax.saxutils import quoteattr, escape
+
+ATTRIBUTION = "Data © OpenStreetMap contributors, ODbL 1.0. http://osm.org/copyright"
+TIMESTAMP = "Sat, 18 Apr 2026 10:12:43 +00:00"
+
+ADDRESS = [
+    ("house_number", "63"),
+    ("road", "Neubrückenstraße"),
+    ("suburb", "Altstadt"),
+    ("city_district", "Münster-Mitte"),
+    ("city", "Münster"),
+    ("state", "Nordrhein-Westfalen"),
+    ("ISO3166-2-lvl4", "DE-NW"),
+    ("postcode", "48143"),
+    ("country", "Deutschland"),
+    ("country_code", "de"),
+]
+
+EXTRATAGS = [
+    ("wikidata", "Q2742"),
+    ("wikipedia", "de:Münster"),
+    ("population", "320946"),
+    ("opening_hours", "Mo-Fr 09:00-18:00; Sa 10:00-16:00"),
+    ("website", "https://www.stadt-muenster.de"),
+]
+
+DISPLAY_NAME = "63, Neubrückenstraße, Altstadt, Münster-Mitte, Münster, Nordrhein-Westfalen, 48143, Deutschland"
+
+# languages used for the names of the huge namedetails responses
+LANGUAGES = ["af", "ar", "be", "bg", "br", "ca", "cs", "cy", "da", "de", "el", "en", "eo", "es",
+             "et", "eu", "fa", "fi", "fr", "fy", "ga", "gd", "gl", "he", "hi", "hr", "hu", "hy",
+             "id", "is", "it", "ja", "ka", "kk", "ko", "ku", "la", "lb", "lt", "lv", "mk", "mn",
+             "ms", "mt", "nl", "no", "oc", "pl", "pt", "ro", "ru", "sk", "sl", "sq", "sr", "sv",
+             "ta", "th", "tr", "uk", "ur", "vi", "zh"]
+
+
+def flag(params, name, default="0"):
+    return params.get(name, [default])[0] in ("1", "true")
+
+
+def polygon_wkt(lon, lat, vertices):
+    """A closed ring around lon/lat, as large as the polygon of a country."""
+    points = []
+    for i in range(vertices):
+        angle = 2 * math.pi * i / vertices
+        radius = 2.0 + 0.3 * math.sin(angle * 17)
+        points.append("%.7f %.7f" % (lon + radius * math.cos(angle), lat + radius * math.sin(angle)))
+    points.append(points[0])
+    return "POLYGON((%s))" % ",".join(points)
+
+
+def place_attributes(n, lon, lat, params, args):
+    attrs = [
+        ("place_id", str(133480000 + n)),
+        ("osm_type", "node"),
+        ("osm_id", str(5166700000 + n)),
+        ("ref", "Neubrückenstraße 63"),
+        ("lat", "%.7f" % lat),
+        ("lon", "%.7f" % lon),
+        ("boundingbox", "%.7f,%.7f,%.7f,%.7f" % (lat - 0.0005, lat + 0.0005, lon - 0.0005, lon + 0.0005)),
+        ("place_rank", "30"),
+        ("address_rank", "30"),
+        ("class", "building"),
+        ("type", "yes"),
+        ("importance", "0.00000999999999995449"),
+    ]
+    if flag(params, "polygon_text"):
+        attrs.append(("geotext", polygon_wkt(lon, lat, args.polygon_vertices)))
+    return "".join(" %s=%s" % (k, quoteattr(v)) for k, v in attrs)
+
+
+def place_children(params, args, address_tag="addressparts"):
+    out = []
+    if flag(params, "addressdetails", "1"):
+        parts = "".join("<%s>%s</%s>" % (k, escape(v), k) for k, v in ADDRESS)
+        out.append(parts if address_tag is None else "<%s>%s</%s>" % (address_tag, parts, address_tag))
+    if flag(params, "extratags"):
+        out.append("<extratags>%s</extratags>" % "".join(
+            "<tag key=%s value=%s/>" % (quoteattr(k), quoteattr(v)) for k, v in EXTRATAGS))
+    if flag(params, "namedetails"):
+        names = ["<name desc=\"name\">Münster</name>"]
+        for i in range(args.namedetails):
+            lang = LANGUAGES[i % len(LANGUAGES)]
+            names.append("<name desc=\"name:%s%s\">Münster (%s) %d</name>" %
+                         (lang, "" if i < len(LANGUAGES) else ":%d" % i, lang, i))
+        out.append("<namedetails>%s</namedetails>" % "".join(names))
+    return "".join(out)
+
+
+def search_response(params, args, count):
+    querystring = params.get("q", [""])[0]
+    places = []
+    for n in range(count):
+        lon, lat = 7.6261347 + n * 0.001, 51.9606649 + n * 0.001
+        places.append("<place%s display_name=%s>%s</place>" % (
+            place_attributes(n, lon, lat, params, args), quoteattr(DISPLAY_NAME),
+            place_children(params, args, address_tag=None)))
+    return ("<?xml version=\"1.0\" encoding=\"UTF-8\" ?>\n"
+            "<searchresults timestamp=%s attribution=%s querystring=%s exclude_place_ids=%s more_url=%s>%s</searchresults>" % (
+                quoteattr(TIMESTAMP), quoteattr(ATTRIBUTION), quoteattr(querystring),
+                quoteattr(",".join(str(133480000 + n) for n in range(count))),
+                quoteattr("https://nominatim.openstreetmap.org/search?q=" + querystring),
+                "".join(places)))
+
+
+def reverse_response(params, args):
+    lon = float(params.get("lon", ["7.6261347"])[0])
+    lat = float(params.get("lat", ["51.9606649"])[0])
+    return ("<?xml version=\"1.0\" encoding=\"UTF-8\" ?>\n"
+            "<reversegeocode timestamp=%s attribution=%s querystring=%s><result%s>%s</result>%s</reversegeocode>" % (
+                quoteattr(TIMESTAMP), quoteattr(ATTRIBUTION), quoteattr("lat=%s&lon=%s" % (lat, lon)),
+                place_attributes(0, lon, lat, params, args), escape(DISPLAY_NAME),
+                place_children(params, args)))
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def do_GET(self):
+        args = self.server.args
+        url = urlparse(self.path)
+        params = parse_qs(url.query)
+
+        delay = args.latency_ms + (random.uniform(-args.jitter_ms, args.jitter_ms) if args.jitter_ms else 0)
+        if delay > 0:
+            time.sleep(delay / 1000.0)
+
+        if args.error_rate > 0 and random.random() < args.error_rate:
+            return self.reply(args.error_status, "<error><code>%d</code><message>injected error</message></error>" % args.error_status)
+
+        if url.path.endswith("/search"):
+            body = search_response(params, args, min(int(params.get("limit", ["10"])[0]), 40))
+        elif url.path.endswith("/lookup"):
+            ids = [i for i in params.get("osm_ids", [""])[0].split(",") if i]
+            body = search_response(params, args, len(ids)).replace("searchresults", "lookupresults")
+        elif url.path.endswith("/reverse"):
+            body = reverse_response(params, args)
+        else:
+            return self.reply(404, "<error><code>404</code><message>unknown endpoint</message></error>")
+
+        self.reply(200, body)
+
+    def reply(self, status, body):
+        data = body.encode("utf-8")
+        self.send_response(status)
+        self.send_header("Content-Type", "text/xml; charset=utf-8")
+        self.send_header("Content-Length", str(len(data)))
+        self.end_headers()
+        self.wfile.write(data)
+
+    def log_message(self, format, *args):
+        pass
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Mock Nominatim server for the nominatim_fdw benchmarks")
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=8080)
+    parser.add_argument("--latency-ms", type=float, default=0, help="delay of every response")
+    parser.add_argument("--jitter-ms", type=float, default=0, help="random variation of the delay")
+    parser.add_argument("--error-rate", type=float, default=0.0, help="share of requests answered with an error")
+    parser.add_argument("--error-status", type=int, default=503, help="HTTP status of the injected errors")
+    parser.add_argument("--polygon-vertices", type=int, default=20000, help="vertices of requested polygons")
+    parser.add_argument("--namedetails", type=int, default=500, help="names of requested namedetails")
+    args = parser.parse_args()
+
+    server = ThreadingHTTPServer((args.host, args.port), Handler)
+    server.daemon_threads = True
+    server.args = args
+    server.serve_forever()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,431 @@
+/**********************************************************************
+ *
+ * nominatim_fdw - PostgreSQL Nominatim Extension
+ *
+ * nominatim_fdw is free software: you can redistribute it and/or modify
+ * it under the terms of the MIT Licence.
+ *
+ * Copyright (C) 2024-2026 Jim Jones <jim.jones@uni-muenster.de>
+ *
+ **********************************************************************/
+
+/*
+ * Microbenchmarks of the request building and response parsing of
+ * nominatim_fdw (nominatim_parser.c), run without PostgreSQL or network.
+ *
+ * Every response of the corpus is parsed repeatedly for at least the given
+ * time, once into full records and once into points only, and the time
+ * spent in libxml2 (XML parsing) and in the extension (building the records)
+ * is reported per response and per place, together with the allocations
+ * and bytes the records need per response. The records are allocated in an
+ * arena reset after every response, as the extension allocates them in a
+ * memory context.
+ *
+ * With -c it checks the results of functions whose output can be computed
+ * without a server, e.g. the snapping of reverse coordinates, instead.
+ *
+ * Usage: parser_bench [-t seconds] response.xml ...
+ *        parser_bench -c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <libxml/parser.h>
+
+#include "nominatim_parser.h"
+
+#define ARENA_BLOCK_SIZE (1024 * 1024)
+#define ARENA_ALIGN(len) (((len) + 15) & ~((size_t)15))
+
+typedef struct ArenaBlock
+{
+    struct ArenaBlock *next;
+    size_t size;
+    size_t used;
+} ArenaBlock;
+
+/* memory of the parsed records, released all at once after each response */
+typedef struct Arena
+{
+    ArenaBlock *blocks;
+    long allocations;
+    size_t bytes;
+} Arena;
+
+/* size of a chunk, stored right before it so that it can be copied on realloc */
+typedef struct ArenaChunk
+{
+    size_t size;
+    size_t padding;
+} ArenaChunk;
+
+/* coordinates of a reverse request and the center of the grid cell they are snapped to */
+typedef struct SnapCase
+{
+    int zoom;
+    int grid;
+    double lon;
+    double lat;
+    double snapped_lon;
+    double snapped_lat;
+} SnapCase;
+
+static const SnapCase snap_cases[] = {
+    /* the whole map is one cell at zoom 0, four at zoom 1 */
+    {0, 256, 7.6261347, 51.9606649, 0.0, 0.0},
+    {1, 256, 7.6261347, 51.9606649, 90.0, 66.513260443},
+    /* nearby points share a cell at zoom 10, but not at zoom 18 */
+    {10, 16, 7.6261347, 51.9606649, 7.635498047, 51.964577110},
+    {10, 16, 7.6265, 51.961, 7.635498047, 51.964577110},
+    {18, 16, 7.6261347, 51.9606649, 7.626099586, 51.960689934},
+    {18, 16, 7.6265, 51.961, 7.626528740, 51.961007267},
+    {18, 16, -58.3815591, -34.6037232, -58.381562233, -34.603717945},
+    /* no zoom means the server default, 18, which is also the maximum */
+    {-1, 16, 7.6261347, 51.9606649, 7.626099586, 51.960689934},
+    {25, 16, 7.6261347, 51.9606649, 7.626099586, 51.960689934},
+    /* latitudes beyond +-85.0511 are clamped into the outer rows */
+    {2, 256, 10.0, 90.0, 45.0, 79.171334641},
+    {2, 256, 10.0, -90.0, 45.0, -79.171334641},
+    {18, 16, 7.6261347, 90.0, 7.626099586, 85.051125078},
+    {18, 16, 7.6261347, -90.0, 7.626099586, -85.051125078},
+    /* lon 180 is in the last column, lon -180 in the first one */
+    {10, 16, 180.0, 0.0, 179.989013672, -0.010986328},
+    {10, 16, -180.0, 0.0, -179.989013672, -0.010986328},
+    /* the last cells are cut by the edges of the map if grid doesn't divide it */
+    {3, 100, 180.0, -90.0, 180.0, -85.051128780},
+};
+
+typedef struct BenchResult
+{
+    long iterations;
+    long places;
+    double xml_ns;
+    double build_ns;
+    long allocations;
+    size_t bytes;
+} BenchResult;
+
+static void *ArenaAllocRaw(Arena *arena, size_t size)
+{
+    size_t needed = ARENA_ALIGN(sizeof(ArenaChunk) + size);
+    ArenaBlock *block = arena->blocks;
+    ArenaChunk *chunk;
+
+    if (!block || block->size - block->used < needed)
+    {
+        int large = needed > ARENA_BLOCK_SIZE / 4;
+        size_t block_size = large ? needed : ARENA_BLOCK_SIZE;
+
+        block = malloc(ARENA_ALIGN(sizeof(ArenaBlock)) + block_size);
+        if (!block)
+        {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+
+        block->size = block_size;
+        block->used = 0;
+
+        /* large chunks get a block of their own behind the current one */
+        if (large && arena->blocks)
+        {
+            block->next = arena->blocks->next;
+            arena->blocks->next = block;
+        }
+        else
+        {
+            block->next = arena->blocks;
+            arena->blocks = block;
+        }
+    }
+
+    chunk = (ArenaChunk *)((char *)block + ARENA_ALIGN(sizeof(ArenaBlock)) + block->used);
+    chunk->size = size;
+    block->used += needed;
+
+    arena->allocations++;
+    arena->bytes += size;
+
+    return chunk + 1;
+}
+
+static void *ArenaAlloc(size_t size, void *arg)
+{
+    return memset(ArenaAllocRaw((Arena *)arg, size), 0, size);
+}
+
+static void *ArenaRealloc(void *ptr, size_t size, void *arg)
+{
+    void *result = ArenaAllocRaw((Arena *)arg, size);
+
+    if (ptr)
+    {
+        size_t old = ((ArenaChunk *)ptr - 1)->size;
+
+        memcpy(result, ptr, old < size ? old : size);
+    }
+
+    return result;
+}
+
+/* releases all chunks, keeping the first block for the next response */
+static void ArenaReset(Arena *arena)
+{
+    ArenaBlock *block = arena->blocks;
+
+    if (!block)
+        return;
+
+    while (block->next)
+    {
+        ArenaBlock *next = block->next;
+
+        block->next = next->next;
+        free(next);
+    }
+
+    block->used = 0;
+}
+
+static double Now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void CountPlace(NominatimRecord *place, void *arg)
+{
+    (*(long *)arg)++;
+}
+
+static char *ReadFile(const char *path, size_t *size)
+{
+    FILE *file = fopen(path, "rb");
+    char *data;
+
+    if (!file)
+    {
+        perror(path);
+        exit(1);
+    }
+
+    fseek(file, 0, SEEK_END);
+    *size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    data = malloc(*size + 1);
+    if (!data || fread(data, 1, *size, file) != *size)
+    {
+        fprintf(stderr, "could not read %s\n", path);
+        exit(1);
+    }
+
+    fclose(file);
+    return data;
+}
+
+/*
+ * Parses a response until min_time nanoseconds have passed, with the same
+ * libxml2 options as the extension.
+ */
+static BenchResult BenchResponse(const char *data, size_t size, int reverse, int flags, double min_time)
+{
+    Arena arena = {0};
+    NominatimAllocator allocator = {ArenaAlloc, ArenaRealloc, &arena};
+    BenchResult result = {0};
+    double start = Now();
+
+    do
+    {
+        double t0 = Now();
+        xmlDocPtr doc = xmlReadMemory(data, size, NULL, NULL, XML_PARSE_NOBLANKS | XML_PARSE_NONET);
+        double t1 = Now();
+        int rc;
+
+        if (!doc)
+        {
+            fprintf(stderr, "invalid XML document\n");
+            exit(1);
+        }
+
+        if (reverse)
+            rc = nominatim_parse_reverse(doc, flags, &allocator, CountPlace, &result.places);
+        else
+            rc = nominatim_parse_search(doc, flags, &allocator, CountPlace, &result.places);
+
+        result.build_ns += Now() - t1;
+        result.xml_ns += t1 - t0;
+
+        if (rc != NOMINATIM_PARSE_OK)
+        {
+            fprintf(stderr, "could not parse response: %d\n", rc);
+            exit(1);
+        }
+
+        xmlFreeDoc(doc);
+        ArenaReset(&arena);
+        result.iterations++;
+    } while (Now() - start < min_time);
+
+    result.allocations = arena.allocations;
+    result.bytes = arena.bytes;
+    ArenaReset(&arena);
+    free(arena.blocks);
+
+    return result;
+}
+
+static void PrintResult(const char *name, const char *mode, size_t size, BenchResult *r)
+{
+    double places = r->places > 0 ? (double)r->places / r->iterations : 0;
+    double total_ns = (r->xml_ns + r->build_ns) / r->iterations;
+
+    printf("%-32s %-6s %10zu %6.0f %12.1f %12.1f %12.1f %10.1f %12.1f\n",
+           name, mode, size, places,
+           r->xml_ns / r->iterations / 1000.0,
+           r->build_ns / r->iterations / 1000.0,
+           places > 0 ? total_ns / places : 0,
+           (double)r->allocations / r->iterations,
+           (double)r->bytes / r->iterations / 1024.0);
+}
+
+/* builds typical search and reverse request URLs */
+static void BenchURL(double min_time)
+{
+    Arena arena = {0};
+    NominatimAllocator allocator = {ArenaAlloc, ArenaRealloc, &arena};
+    NominatimRequestParams search = {0};
+    NominatimRequestParams reverse = {0};
+    long iterations = 0;
+    double start = Now();
+    double elapsed;
+
+    search.url = "https://nominatim.openstreetmap.org";
+    search.request_type = NOMINATIM_REQUEST_SEARCH;
+    search.format = "xml";
+    search.query = "Neubrückenstraße 63, 48143 Münster";
+    search.accept_language = "en-US,en;q=0.9";
+    search.email = "someone@example.org";
+    search.zoom = -1;
+    search.limit = 10;
+    search.dedupe = 1;
+    search.addressdetails = 1;
+
+    reverse = search;
+    reverse.request_type = NOMINATIM_REQUEST_REVERSE;
+    reverse.query = NULL;
+    reverse.limit = 0;
+    reverse.lon = 7.6261347;
+    reverse.lat = 51.9606649;
+    reverse.zoom = 16;
+    reverse.reverse_grid = 16;
+
+    do
+    {
+        NominatimBuffer url;
+
+        nominatim_buffer_init(&url, &allocator);
+        nominatim_build_url(&search, &url);
+        nominatim_buffer_init(&url, &allocator);
+        nominatim_build_url(&reverse, &url);
+        ArenaReset(&arena);
+        iterations++;
+    } while ((elapsed = Now() - start) < min_time);
+
+    printf("\nURL building: %.1f ns per URL, %.1f allocations per URL\n",
+           elapsed / iterations / 2, (double)arena.allocations / iterations / 2);
+
+    free(arena.blocks);
+}
+
+/* checks nominatim_snap_to_grid against snap_cases, returns the number of failures */
+static int CheckSnapToGrid(void)
+{
+    int failures = 0;
+
+    for (int i = 0; i < sizeof(snap_cases) / sizeof(snap_cases[0]); i++)
+    {
+        const SnapCase *c = &snap_cases[i];
+        double lon = c->lon;
+        double lat = c->lat;
+
+        nominatim_snap_to_grid(c->zoom, c->grid, &lon, &lat);
+
+        if (fabs(lon - c->snapped_lon) > 1e-9 || fabs(lat - c->snapped_lat) > 1e-9)
+        {
+            printf("snap_to_grid(zoom=%d, grid=%d, %.9f, %.9f): got %.9f, %.9f, expected %.9f, %.9f\n",
+                   c->zoom, c->grid, c->lon, c->lat, lon, lat, c->snapped_lon, c->snapped_lat);
+            failures++;
+        }
+    }
+
+    printf("snap_to_grid: %d of %d cases passed\n",
+           (int)(sizeof(snap_cases) / sizeof(snap_cases[0])) - failures,
+           (int)(sizeof(snap_cases) / sizeof(snap_cases[0])));
+
+    return failures;
+}
+
+int main(int argc, char **argv)
+{
+    double min_time = 1e9;
+    int first = 1;
+
+    if (argc == 2 && strcmp(argv[1], "-c") == 0)
+        return CheckSnapToGrid() > 0 ? 1 : 0;
+
+    if (argc > 2 && strcmp(argv[1], "-t") == 0)
+    {
+        min_time = atof(argv[2]) * 1e9;
+        first = 3;
+    }
+
+    if (first >= argc)
+    {
+        fprintf(stderr, "usage: %s [-t seconds] response.xml ...\n       %s -c\n", argv[0], argv[0]);
+        return 1;
+    }
+
+    xmlInitParser();
+
+    printf("%-32s %-6s %10s %6s %12s %12s %12s %10s %12s\n",
+           "response", "mode", "bytes", "places", "xml us", "build us", "ns/place", "allocs", "alloc KB");
+
+    for (int i = first; i < argc; i++)
+    {
+        const char *name = strrchr(argv[i], '/') ? strrchr(argv[i], '/') + 1 : argv[i];
+        size_t size;
+        char *data = ReadFile(argv[i], &size);
+        xmlDocPtr doc = xmlReadMemory(data, size, NULL, NULL, XML_PARSE_NOBLANKS | XML_PARSE_NONET);
+        int reverse;
+        BenchResult result;
+
+        if (!doc || !xmlDocGetRootElement(doc))
+        {
+            fprintf(stderr, "%s: invalid XML document\n", argv[i]);
+            return 1;
+        }
+
+        reverse = xmlStrcmp(xmlDocGetRootElement(doc)->name, (xmlChar *)"reversegeocode") == 0;
+        xmlFreeDoc(doc);
+
+        result = BenchResponse(data, size, reverse, 0, min_time);
+        PrintResult(name, "full", size, &result);
+
+        result = BenchResponse(data, size, reverse, NOMINATIM_PARSE_POINTS_ONLY, min_time);
+        PrintResult(name, "points", size, &result);
+
+        free(data);
+    }
+
+    BenchURL(min_time);
+
+    xmlCleanupParser();
+
+    return 0;
+}
@@ -0,0 +1,216 @@
+#!/usr/bin/env python3
+#
+# Replays a workload captured with nominatim_fdw.capture_file.
+#
+# The captured requests are sent to a target server at their original
+# pace, or 5x or 10x faster (--speed), each at its captured offset from the
+# first request, so that requests that overlapped in the capture overlap
+# in the replay as well. Requests/s, latency percentiles, errors and how
+# late the requests could be started are reported, and written as JSON
+# with --output. With --dump the captured requests are printed instead.
+#
+#   replay_capture.py --target http://127.0.0.1:18080 --speed 5 capture.bin
+#   replay_capture.py --dump capture.bin
+#
+# The email parameter is redacted in the capture and is sent as captured.
+
+import argparse
+import datetime
+import json
+import struct
+import sys
+import threading
+import time
+import urllib.error
+import urllib.request
+from concurrent.futures import ThreadPoolExecutor
+
+CAPTURE_VERSION = 1
+REQUEST_TYPES = ("search", "reverse", "lookup")
+HEADER = struct.Struct("<BBHqIIB")
+
+
+def percentile(values, p):
+    if not values:
+        return None
+    values = sorted(values)
+    return values[min(len(values) - 1, int(round(p / 100.0 * (len(values) - 1))))]
+
+
+def read_capture(path):
+    """Returns the captured requests, ordered by start time."""
+    requests = []
+
+    with open(path, "rb") as f:
+        data = f.read()
+
+    pos = 0
+    while pos + 4 <= len(data):
+        (length,) = struct.unpack_from("<I", data, pos)
+        record = data[pos + 4:pos + 4 + length]
+        pos += 4 + length
+
+        if len(record) < length:
+            print("warning: ignoring truncated record at the end of %s" % path, file=sys.stderr)
+            break
+
+        version, rtype, status, start, duration, pid, retries = HEADER.unpack_from(record, 0)
+        if version != CAPTURE_VERSION:
+            sys.exit("%s: unsupported capture version %d" % (path, version))
+
+        off = HEADER.size
+        (name_len,) = struct.unpack_from("<H", record, off)
+        server = record[off + 2:off + 2 + name_len].decode()
+        off += 2 + name_len
+        (params_len,) = struct.unpack_from("<I", record, off)
+        params = record[off + 4:off + 4 + params_len].decode()
+
+        requests.append({
+            "type": REQUEST_TYPES[rtype] if rtype < len(REQUEST_TYPES) else str(rtype),
+            "status": status,
+            "start_us": start,
+            "duration_us": duration,
+            "pid": pid,
+            "retries": retries,
+            "server": server,
+            "params": params,
+        })
+
+    requests.sort(key=lambda r: r["start_us"])
+    return requests
+
+
+def max_concurrency(intervals):
+    """Highest number of overlapping (start, end) intervals."""
+    events = sorted([(s, 1) for s, _ in intervals] + [(e, -1) for _, e in intervals])
+    current = peak = 0
+    for _, delta in events:
+        current += delta
+        peak = max(peak, current)
+    return peak
+
+
+def dump(requests):
+    for r in requests:
+        start = datetime.datetime.fromtimestamp(r["start_us"] / 1e6, datetime.timezone.utc)
+        print("%s\t%d\t%s\t%s\t%d\t%.3f\t%d\t%s" %
+              (start.isoformat(timespec="microseconds"), r["pid"], r["server"], r["type"],
+               r["status"], r["duration_us"] / 1000.0, r["retries"], r["params"]))
+
+
+def replay(requests, target, speed, timeout, max_workers):
+    t0 = requests[0]["start_us"]
+    results = []
+    lock = threading.Lock()
+
+    def send(r, scheduled):
+        started = time.monotonic()
+        status = 0
+        try:
+            with urllib.request.urlopen("%s/%s?%s" % (target, r["type"], r["params"]), timeout=timeout) as response:
+                response.read()
+                status = response.status
+        except urllib.error.HTTPError as e:
+            status = e.code
+        except Exception:
+            pass
+        finished = time.monotonic()
+
+        with lock:
+            results.append({"status": status, "start": started, "end": finished,
+                            "latency_ms": (finished - started) * 1000.0,
+                            "lag_ms": (started - scheduled) * 1000.0})
+
+    begin = time.monotonic()
+
+    with ThreadPoolExecutor(max_workers=max_workers) as pool:
+        for r in requests:
+            scheduled = begin + (r["start_us"] - t0) / 1e6 / speed
+            delay = scheduled - time.monotonic()
+            if delay > 0:
+                time.sleep(delay)
+            pool.submit(send, r, scheduled)
+
+    elapsed = time.monotonic() - begin
+    captured = (max(r["start_us"] + r["duration_us"] for r in requests) - t0) / 1e6
+    latencies = [r["latency_ms"] for r in results]
+    lags = [r["lag_ms"] for r in results]
+    errors = {}
+    for r in results:
+        if not 200 <= r["status"] < 300:
+            errors[str(r["status"])] = errors.get(str(r["status"]), 0) + 1
+
+    return {
+        "requests": len(results),
+        "speed": speed,
+        "captured_seconds": captured,
+        "replay_seconds": elapsed,
+        "captured_requests_per_second": len(requests) / captured if captured > 0 else None,
+        "requests_per_second": len(results) / elapsed if elapsed > 0 else None,
+        "captured_max_concurrency": max_concurrency(
+            [(r["start_us"], r["start_us"] + r["duration_us"]) for r in requests]),
+        "max_concurrency": max_concurrency([(r["start"], r["end"]) for r in results]),
+        "errors": errors,
+        "latency_ms": {
+            "mean": sum(latencies) / len(latencies) if latencies else None,
+            "p50": percentile(latencies, 50),
+            "p95": percentile(latencies, 95),
+            "p99": percentile(latencies, 99),
+            "max": max(latencies) if latencies else None,
+        },
+        "start_lag_ms": {
+            "p50": percentile(lags, 50),
+            "p99": percentile(lags, 99),
+            "max": max(lags) if lags else None,
+        },
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Replays a workload captured with nominatim_fdw.capture_file.")
+    parser.add_argument("capture", help="capture file")
+    parser.add_argument("--target", help="URL of the Nominatim server to replay the requests against")
+    parser.add_argument("--speed", type=float, default=1.0, help="replay speed, e.g. 1, 5 or 10 (default 1)")
+    parser.add_argument("--server", help="only replay the requests sent to this foreign server")
+    parser.add_argument("--timeout", type=float, default=30.0, help="request timeout in seconds (default 30)")
+    parser.add_argument("--max-workers", type=int, default=256, help="maximum concurrent requests (default 256)")
+    parser.add_argument("--output", help="write the results as JSON to this file")
+    parser.add_argument("--dump", action="store_true", help="print the captured requests and exit")
+    args = parser.parse_args()
+
+    requests = read_capture(args.capture)
+    if args.server:
+        requests = [r for r in requests if r["server"] == args.server]
+
+    if args.dump:
+        dump(requests)
+        return
+
+    if not args.target:
+        parser.error("--target is required unless --dump is given")
+    if args.speed <= 0:
+        parser.error("--speed must be greater than zero")
+    if not requests:
+        sys.exit("no requests to replay")
+
+    result = replay(requests, args.target.rstrip("/"), args.speed, args.timeout, args.max_workers)
+
+    print("%d requests in %.1f s (captured: %.1f s) at %gx" %
+          (result["requests"], result["replay_seconds"], result["captured_seconds"], args.speed))
+    print("%.1f requests/s (captured: %.1f requests/s), max concurrency %d (captured: %d)" %
+          (result["requests_per_second"] or 0, result["captured_requests_per_second"] or 0,
+           result["max_concurrency"], result["captured_max_concurrency"]))
+    print("latency p50 %.3f ms  p95 %.3f ms  p99 %.3f ms  max %.3f ms" %
+          (result["latency_ms"]["p50"], result["latency_ms"]["p95"],
+           result["latency_ms"]["p99"], result["latency_ms"]["max"]))
+    print("start lag p50 %.3f ms  p99 %.3f ms" % (result["start_lag_ms"]["p50"], result["start_lag_ms"]["p99"]))
+    print("errors: %s" % (", ".join("%s: %d" % e for e in sorted(result["errors"].items())) or "none"))
+
+    if args.output:
+        with open(args.output, "w") as f:
+            json.dump(dict(capture=args.capture, target=args.target, **result), f, indent=2)
+        print("results written to %s" % args.output)
+
+
+if __name__ == "__main__":
+    main()
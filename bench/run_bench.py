@@ -0,0 +1,189 @@
+#!/usr/bin/env python3
+#
+# Offline benchmark of nominatim_fdw (make bench).
+#
+# Starts the mock Nominatim server, points the foreign server 'bench' of the
+# target database at it and runs the pgbench workloads in workloads/ at
+# several concurrency levels. Requests/s, latency percentiles and the memory
+# of a backend after running each workload are written as JSON, so that the
+# results of two builds can be compared.
+#
+# The target database is taken from the usual libpq environment variables
+# (PGHOST, PGPORT, PGDATABASE, PGUSER). Settings:
+#
+#   BENCH_CLIENTS       concurrency levels (default "1 4 16")
+#   BENCH_DURATION      seconds per run (default 10)
+#   BENCH_WORKLOADS     workloads to run (default: all in workloads/)
+#   BENCH_MEMORY_CALLS  calls of each workload before measuring the memory
+#                       of the backend (default 200, 0 disables it)
+#   BENCH_PORT          port of the mock server (default 18080)
+#   BENCH_LATENCY_MS    latency injected by the mock server (default 0)
+#   BENCH_JITTER_MS     random variation of the latency (default 0)
+#   BENCH_ERROR_RATE    share of requests failing with HTTP 503 (default 0)
+#   BENCH_OUTPUT        result file (default bench-results.json)
+#   PGBENCH, PSQL       client programs (default: from PATH)
+
+import json
+import os
+import re
+import subprocess
+import sys
+import tempfile
+import time
+import urllib.request
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+WORKLOAD_DIR = os.path.join(BENCH_DIR, "workloads")
+
+
+def env(name, default):
+    return os.environ.get(name, default)
+
+
+def psql(sql, *args):
+    return subprocess.run([env("PSQL", "psql"), "-X", "-q", "-At", "-v", "ON_ERROR_STOP=1", *args],
+                          input=sql, text=True, capture_output=True, check=True).stdout.strip()
+
+
+def percentile(values, p):
+    if not values:
+        return None
+    values = sorted(values)
+    return values[min(len(values) - 1, int(round(p / 100.0 * (len(values) - 1))))]
+
+
+def start_mock(port):
+    mock = subprocess.Popen([sys.executable, os.path.join(BENCH_DIR, "mock_nominatim.py"),
+                             "--port", str(port),
+                             "--latency-ms", env("BENCH_LATENCY_MS", "0"),
+                             "--jitter-ms", env("BENCH_JITTER_MS", "0"),
+                             "--error-rate", env("BENCH_ERROR_RATE", "0")])
+
+    for _ in range(50):
+        try:
+            urllib.request.urlopen("http://127.0.0.1:%d/reverse?lon=0&lat=0" % port, timeout=1)
+            return mock
+        except Exception:
+            time.sleep(0.1)
+
+    mock.kill()
+    sys.exit("mock Nominatim server did not start on port %d" % port)
+
+
+def run_pgbench(workload, clients, duration):
+    """Runs a workload and returns its throughput and latencies (ms)."""
+    with tempfile.TemporaryDirectory() as logdir:
+        prefix = os.path.join(logdir, "bench")
+        result = subprocess.run([env("PGBENCH", "pgbench"), "-n", "-f", workload,
+                                 "-c", str(clients), "-j", str(clients), "-T", str(duration),
+                                 "-l", "--log-prefix", prefix],
+                                text=True, capture_output=True)
+
+        if result.returncode != 0 and "tps" not in result.stdout:
+            sys.exit("pgbench failed:\n%s" % result.stderr)
+
+        latencies = []
+        failed = 0
+
+        for name in os.listdir(logdir):
+            with open(os.path.join(logdir, name)) as log:
+                for line in log:
+                    fields = line.split()
+                    if len(fields) > 2 and fields[2].isdigit():
+                        latencies.append(int(fields[2]) / 1000.0)
+                    else:
+                        failed += 1
+
+    tps = re.search(r"tps = ([0-9.]+)", result.stdout)
+
+    return {
+        "transactions": len(latencies),
+        "failed": failed,
+        "tps": float(tps.group(1)) if tps else None,
+        "latency_ms": {
+            "mean": sum(latencies) / len(latencies) if latencies else None,
+            "p50": percentile(latencies, 50),
+            "p99": percentile(latencies, 99),
+            "max": max(latencies) if latencies else None,
+        },
+    }
+
+
+def backend_memory(workload, calls):
+    """Memory of a backend (pg_backend_memory_contexts, PostgreSQL 14+) after
+    running a workload 'calls' times."""
+    if calls <= 0 or int(psql("SHOW server_version_num")) < 140000:
+        return None
+
+    with open(workload) as f:
+        script = f.read()
+
+    # psql has no random(): fix the pgbench variables to a value per call
+    body = []
+    for i in range(calls):
+        body.append(re.sub(r"\\set (\w+) random\((\d+), *(\d+)\)",
+                           lambda m: "\\set %s %d" % (m.group(1), int(m.group(2)) + i % (int(m.group(3)) - int(m.group(2)) + 1)),
+                           script))
+    body.append("SELECT sum(total_bytes) FROM pg_backend_memory_contexts;")
+
+    return int(psql("\n".join(body)).splitlines()[-1])
+
+
+def main():
+    port = int(env("BENCH_PORT", "18080"))
+    duration = int(env("BENCH_DURATION", "10"))
+    clients = [int(c) for c in env("BENCH_CLIENTS", "1 4 16").split()]
+    memory_calls = int(env("BENCH_MEMORY_CALLS", "200"))
+    workloads = env("BENCH_WORKLOADS", " ".join(sorted(f[:-4] for f in os.listdir(WORKLOAD_DIR) if f.endswith(".sql")))).split()
+    output = env("BENCH_OUTPUT", "bench-results.json")
+
+    mock = start_mock(port)
+
+    try:
+        psql("""
+            CREATE EXTENSION IF NOT EXISTS nominatim_fdw;
+            DROP SERVER IF EXISTS bench CASCADE;
+            CREATE SERVER bench FOREIGN DATA WRAPPER nominatim_fdw OPTIONS (url 'http://127.0.0.1:%d');
+            CREATE USER MAPPING FOR CURRENT_USER SERVER bench;
+        """ % port)
+
+        report = {
+            "timestamp": time.strftime("%Y-%m-%dT%H:%M:%SZ", time.gmtime()),
+            "server_version": psql("SHOW server_version"),
+            "extension_version": psql("SELECT extversion FROM pg_extension WHERE extname = 'nominatim_fdw'"),
+            "settings": {
+                "duration": duration,
+                "latency_ms": float(env("BENCH_LATENCY_MS", "0")),
+                "jitter_ms": float(env("BENCH_JITTER_MS", "0")),
+                "error_rate": float(env("BENCH_ERROR_RATE", "0")),
+            },
+            "results": [],
+        }
+
+        for name in workloads:
+            workload = os.path.join(WORKLOAD_DIR, name + ".sql")
+
+            for c in clients:
+                print("%-20s %3d clients ... " % (name, c), end="", flush=True)
+                result = dict(workload=name, clients=c, **run_pgbench(workload, c, duration))
+                report["results"].append(result)
+                print("%8.1f requests/s  p50 %8.3f ms  p99 %8.3f ms" %
+                      (result["tps"] or 0, result["latency_ms"]["p50"] or 0, result["latency_ms"]["p99"] or 0))
+
+            memory = backend_memory(workload, memory_calls)
+            for result in report["results"]:
+                if result["workload"] == name:
+                    result["backend_memory_bytes"] = memory
+
+        psql("DROP SERVER bench CASCADE;")
+    finally:
+        mock.terminate()
+
+    with open(output, "w") as f:
+        json.dump(report, f, indent=2)
+
+    print("results written to %s" % output)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,3 @@
+-- lookup of 50 ids, 50 places
+\set n random(1, 100000)
+SELECT count(*) FROM nominatim_lookup('bench', osm_ids => 'N' || :n || ',W1,W2,W3,W4,W5,W6,W7,W8,W9,W10,W11,W12,W13,W14,W15,W16,W17,W18,W19,W20,W21,W22,W23,W24,W25,W26,W27,W28,W29,W30,W31,W32,W33,W34,W35,W36,W37,W38,W39,W40,W41,W42,W43,W44,W45,W46,W47,W48,W49');
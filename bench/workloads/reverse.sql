@@ -0,0 +1,4 @@
+-- single reverse request, one place
+\set x random(0, 1000000)
+\set y random(0, 1000000)
+SELECT count(*) FROM nominatim_reverse('bench', lon => 7.5 + :x / 10000000.0, lat => 51.9 + :y / 10000000.0);
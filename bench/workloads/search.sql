@@ -0,0 +1,3 @@
+-- single search request, 10 places with address details
+\set n random(1, 100000)
+SELECT count(*) FROM nominatim_search('bench', q => 'Neubrückenstraße ' || :n || ', Münster');
@@ -0,0 +1,3 @@
+-- search request with a long list of names per place
+\set n random(1, 100000)
+SELECT count(*) FROM nominatim_search('bench', q => 'Münster ' || :n, namedetails => true, extratags => true);
@@ -0,0 +1,3 @@
+-- search request for a country, with its polygon as WKT
+\set n random(1, 100000)
+SELECT count(*) FROM nominatim_search('bench', q => 'Deutschland ' || :n, polygon => 'polygon_text', limit_result => 1);
@@ -71,4 +71,560 @@ CREATE FUNCTION nominatim_reverse(
     polygon_threshold double precision DEFAULT 0.0,
     email text DEFAULT '')
 RETURNS SETOF NominatimReverseGeocode AS 'MODULE_PATHNAME', 'nominatim_fdw_reverse'
-LANGUAGE C VOLATILE STRICT PARALLEL SAFE;
\ No newline at end of file
+LANGUAGE C VOLATILE STRICT PARALLEL SAFE;
+
+/* raw variants returning the unparsed response body */
+CREATE FUNCTION nominatim_search_raw(
+    server_name text, 
+    q text DEFAULT '',
+    amenity text DEFAULT '',
+    street text DEFAULT '', 
+    city text DEFAULT '',
+    county text DEFAULT '',
+    state text DEFAULT '',
+    country text DEFAULT '',
+    postalcode text DEFAULT '',
+    extratags boolean DEFAULT false,
+    addressdetails boolean DEFAULT true,
+    namedetails boolean DEFAULT false,
+    polygon text DEFAULT '',
+    accept_language text DEFAULT '',    
+    countrycodes text DEFAULT '',
+    layer text DEFAULT '',
+    featuretype text DEFAULT '',
+    exclude_place_ids text DEFAULT '',
+    viewbox text DEFAULT '',
+    bounded boolean DEFAULT false,
+    polygon_threshold double precision DEFAULT 0.0,
+    email text DEFAULT '',
+    dedupe boolean DEFAULT true,
+    limit_result int DEFAULT 0,
+    entrances boolean DEFAULT false)
+RETURNS jsonb AS 'MODULE_PATHNAME', 'nominatim_fdw_search_raw'
+LANGUAGE C VOLATILE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION nominatim_search_raw_xml(
+    server_name text, 
+    q text DEFAULT '',
+    amenity text DEFAULT '',
+    street text DEFAULT '', 
+    city text DEFAULT '',
+    county text DEFAULT '',
+    state text DEFAULT '',
+    country text DEFAULT '',
+    postalcode text DEFAULT '',
+    extratags boolean DEFAULT false,
+    addressdetails boolean DEFAULT true,
+    namedetails boolean DEFAULT false,
+    polygon text DEFAULT '',
+    accept_language text DEFAULT '',    
+    countrycodes text DEFAULT '',
+    layer text DEFAULT '',
+    featuretype text DEFAULT '',
+    exclude_place_ids text DEFAULT '',
+    viewbox text DEFAULT '',
+    bounded boolean DEFAULT false,
+    polygon_threshold double precision DEFAULT 0.0,
+    email text DEFAULT '',
+    dedupe boolean DEFAULT true,
+    limit_result int DEFAULT 0,
+    entrances boolean DEFAULT false)
+RETURNS xml AS 'MODULE_PATHNAME', 'nominatim_fdw_search_raw'
+LANGUAGE C VOLATILE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION nominatim_lookup_raw(
+    server_name text, 
+    osm_ids text,
+    extratags boolean DEFAULT false,
+    addressdetails boolean DEFAULT true,
+    namedetails boolean DEFAULT false,
+    polygon text DEFAULT '',
+    entrances boolean DEFAULT false,    
+    accept_language text DEFAULT '',    
+    polygon_threshold double precision DEFAULT 0.0,
+    email text DEFAULT '')
+RETURNS jsonb AS 'MODULE_PATHNAME', 'nominatim_fdw_lookup_raw'
+LANGUAGE C VOLATILE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION nominatim_lookup_raw_xml(
+    server_name text, 
+    osm_ids text,
+    extratags boolean DEFAULT false,
+    addressdetails boolean DEFAULT true,
+    namedetails boolean DEFAULT false,
+    polygon text DEFAULT '',
+    entrances boolean DEFAULT false,    
+    accept_language text DEFAULT '',    
+    polygon_threshold double precision DEFAULT 0.0,
+    email text DEFAULT '')
+RETURNS xml AS 'MODULE_PATHNAME', 'nominatim_fdw_lookup_raw'
+LANGUAGE C VOLATILE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION nominatim_reverse_raw(
+    server_name text, 
+    lon double precision DEFAULT 0,
+    lat double precision DEFAULT 0,
+    zoom int DEFAULT -1,
+    layer text DEFAULT '',
+    extratags boolean DEFAULT false,
+    addressdetails boolean DEFAULT true,
+    namedetails boolean DEFAULT false,
+    polygon text DEFAULT '',
+    accept_language text DEFAULT '',
+    entrances boolean DEFAULT false,
+    polygon_threshold double precision DEFAULT 0.0,
+    email text DEFAULT '')
+RETURNS jsonb AS 'MODULE_PATHNAME', 'nominatim_fdw_reverse_raw'
+LANGUAGE C VOLATILE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION nominatim_reverse_raw_xml(
+    server_name text, 
+    lon double precision DEFAULT 0,
+    lat double precision DEFAULT 0,
+    zoom int DEFAULT -1,
+    layer text DEFAULT '',
+    extratags boolean DEFAULT false,
+    addressdetails boolean DEFAULT true,
+    namedetails boolean DEFAULT false,
+    polygon text DEFAULT '',
+    accept_language text DEFAULT '',
+    entrances boolean DEFAULT false,
+    polygon_threshold double precision DEFAULT 0.0,
+    email text DEFAULT '')
+RETURNS xml AS 'MODULE_PATHNAME', 'nominatim_fdw_reverse_raw'
+LANGUAGE C VOLATILE STRICT PARALLEL SAFE;
+
+/* slim point-only variants */
+CREATE TYPE NominatimPoint AS (
+  place_id bigint,
+  osm_id bigint,
+  osm_type text,
+  display_name text,
+  lon double precision,
+  lat double precision
+);
+
+CREATE FUNCTION nominatim_search_point(
+    server_name text, 
+    q text DEFAULT '',
+    amenity text DEFAULT '',
+    street text DEFAULT '', 
+    city text DEFAULT '',
+    county text DEFAULT '',
+    state text DEFAULT '',
+    country text DEFAULT '',
+    postalcode text DEFAULT '',
+    accept_language text DEFAULT '',    
+    countrycodes text DEFAULT '',
+    layer text DEFAULT '',
+    featuretype text DEFAULT '',
+    exclude_place_ids text DEFAULT '',
+    viewbox text DEFAULT '',
+    bounded boolean DEFAULT false,
+    email text DEFAULT '',
+    dedupe boolean DEFAULT true,
+    limit_result int DEFAULT 0)
+RETURNS SETOF NominatimPoint AS 'MODULE_PATHNAME', 'nominatim_fdw_search_point'
+LANGUAGE C VOLATILE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION nominatim_reverse_point(
+    server_name text, 
+    lon double precision DEFAULT 0,
+    lat double precision DEFAULT 0,
+    zoom int DEFAULT -1,
+    layer text DEFAULT '',
+    accept_language text DEFAULT '',
+    email text DEFAULT '')
+RETURNS SETOF NominatimPoint AS 'MODULE_PATHNAME', 'nominatim_fdw_reverse_point'
+LANGUAGE C VOLATILE STRICT PARALLEL SAFE;
+
+/*
+ * Geometry variants, only available if PostGIS is installed before
+ * nominatim_fdw. They return the coordinates, the bounding box and the
+ * polygon of each place as PostGIS geometries.
+ */
+DO $$
+DECLARE
+  geom text;
+BEGIN
+  SELECT quote_ident(n.nspname) || '.geometry' INTO geom
+  FROM pg_type t
+  JOIN pg_namespace n ON n.oid = t.typnamespace
+  WHERE t.typname = 'geometry'
+  LIMIT 1;
+
+  /* PostGIS not installed */
+  IF geom IS NULL THEN
+    RETURN;
+  END IF;
+
+  EXECUTE format('
+CREATE TYPE NominatimGeometry AS (
+  osm_id bigint,
+  osm_type text,
+  place_id bigint,
+  display_name text,
+  class text,
+  type text,
+  place_rank int,
+  address_rank int,
+  importance double precision,
+  geom %1$s(Point,4326),
+  envelope %1$s(Polygon,4326),
+  polygon %1$s(Geometry,4326)
+)', geom);
+
+  EXECUTE '
+CREATE FUNCTION nominatim_search_geom(
+    server_name text, 
+    q text DEFAULT '''',
+    amenity text DEFAULT '''',
+    street text DEFAULT '''', 
+    city text DEFAULT '''',
+    county text DEFAULT '''',
+    state text DEFAULT '''',
+    country text DEFAULT '''',
+    postalcode text DEFAULT '''',
+    extratags boolean DEFAULT false,
+    addressdetails boolean DEFAULT true,
+    namedetails boolean DEFAULT false,
+    polygon text DEFAULT '''',
+    accept_language text DEFAULT '''',    
+    countrycodes text DEFAULT '''',
+    layer text DEFAULT '''',
+    featuretype text DEFAULT '''',
+    exclude_place_ids text DEFAULT '''',
+    viewbox text DEFAULT '''',
+    bounded boolean DEFAULT false,
+    polygon_threshold double precision DEFAULT 0.0,
+    email text DEFAULT '''',
+    dedupe boolean DEFAULT true,
+    limit_result int DEFAULT 0,
+    entrances boolean DEFAULT false)
+RETURNS SETOF NominatimGeometry AS ''MODULE_PATHNAME'', ''nominatim_fdw_search''
+LANGUAGE C VOLATILE STRICT PARALLEL SAFE';
+
+  EXECUTE '
+CREATE FUNCTION nominatim_lookup_geom(
+    server_name text, 
+    osm_ids text,
+    extratags boolean DEFAULT false,
+    addressdetails boolean DEFAULT true,
+    namedetails boolean DEFAULT false,
+    polygon text DEFAULT '''',
+    entrances boolean DEFAULT false,    
+    accept_language text DEFAULT '''',    
+    polygon_threshold double precision DEFAULT 0.0,
+    email text DEFAULT '''')
+RETURNS SETOF NominatimGeometry AS ''MODULE_PATHNAME'', ''nominatim_fdw_lookup''
+LANGUAGE C VOLATILE STRICT PARALLEL SAFE';
+
+  EXECUTE '
+CREATE FUNCTION nominatim_reverse_geom(
+    server_name text, 
+    lon double precision DEFAULT 0,
+    lat double precision DEFAULT 0,
+    zoom int DEFAULT -1,
+    layer text DEFAULT '''',
+    extratags boolean DEFAULT false,
+    addressdetails boolean DEFAULT true,
+    namedetails boolean DEFAULT false,
+    polygon text DEFAULT '''',
+    accept_language text DEFAULT '''',
+    entrances boolean DEFAULT false,
+    polygon_threshold double precision DEFAULT 0.0,
+    email text DEFAULT '''')
+RETURNS SETOF NominatimGeometry AS ''MODULE_PATHNAME'', ''nominatim_fdw_reverse''
+LANGUAGE C VOLATILE STRICT PARALLEL SAFE';
+END;
+$$;
+
+/* search fetching further pages on demand */
+CREATE FUNCTION nominatim_search_paged(
+    server_name text, 
+    q text DEFAULT '',
+    amenity text DEFAULT '',
+    street text DEFAULT '', 
+    city text DEFAULT '',
+    county text DEFAULT '',
+    state text DEFAULT '',
+    country text DEFAULT '',
+    postalcode text DEFAULT '',
+    extratags boolean DEFAULT false,
+    addressdetails boolean DEFAULT true,
+    namedetails boolean DEFAULT false,
+    polygon text DEFAULT '',
+    accept_language text DEFAULT '',    
+    countrycodes text DEFAULT '',
+    layer text DEFAULT '',
+    featuretype text DEFAULT '',
+    exclude_place_ids text DEFAULT '',
+    viewbox text DEFAULT '',
+    bounded boolean DEFAULT false,
+    polygon_threshold double precision DEFAULT 0.0,
+    email text DEFAULT '',
+    dedupe boolean DEFAULT true,
+    limit_result int DEFAULT 0,
+    entrances boolean DEFAULT false)
+RETURNS SETOF NominatimRecord AS 'MODULE_PATHNAME', 'nominatim_fdw_search_paged'
+LANGUAGE C VOLATILE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION nominatim_search_cached(
+    server_name text, 
+    q text DEFAULT '',
+    amenity text DEFAULT '',
+    street text DEFAULT '', 
+    city text DEFAULT '',
+    county text DEFAULT '',
+    state text DEFAULT '',
+    country text DEFAULT '',
+    postalcode text DEFAULT '',
+    extratags boolean DEFAULT false,
+    addressdetails boolean DEFAULT true,
+    namedetails boolean DEFAULT false,
+    polygon text DEFAULT '',
+    accept_language text DEFAULT '',    
+    countrycodes text DEFAULT '',
+    layer text DEFAULT '',
+    featuretype text DEFAULT '',
+    exclude_place_ids text DEFAULT '',
+    viewbox text DEFAULT '',
+    bounded boolean DEFAULT false,
+    polygon_threshold double precision DEFAULT 0.0,
+    email text DEFAULT '',
+    dedupe boolean DEFAULT true,
+    limit_result int DEFAULT 0,
+    entrances boolean DEFAULT false)
+RETURNS SETOF NominatimRecord AS 'MODULE_PATHNAME', 'nominatim_fdw_search'
+LANGUAGE C STABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION nominatim_lookup_cached(
+    server_name text, 
+    osm_ids text,
+    extratags boolean DEFAULT false,
+    addressdetails boolean DEFAULT true,
+    namedetails boolean DEFAULT false,
+    polygon text DEFAULT '',
+    entrances boolean DEFAULT false,    
+    accept_language text DEFAULT '',    
+    polygon_threshold double precision DEFAULT 0.0,
+    email text DEFAULT '')
+RETURNS SETOF NominatimRecord AS 'MODULE_PATHNAME', 'nominatim_fdw_lookup'
+LANGUAGE C STABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION nominatim_reverse_cached(
+    server_name text, 
+    lon double precision DEFAULT 0,
+    lat double precision DEFAULT 0,
+    zoom int DEFAULT -1,
+    layer text DEFAULT '',
+    extratags boolean DEFAULT false,
+    addressdetails boolean DEFAULT true,
+    namedetails boolean DEFAULT false,
+    polygon text DEFAULT '',
+    accept_language text DEFAULT '',
+    entrances boolean DEFAULT false,
+    polygon_threshold double precision DEFAULT 0.0,
+    email text DEFAULT '')
+RETURNS SETOF NominatimReverseGeocode AS 'MODULE_PATHNAME', 'nominatim_fdw_reverse'
+LANGUAGE C STABLE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION nominatim_fdw_support(internal)
+RETURNS internal AS 'MODULE_PATHNAME', 'nominatim_fdw_support'
+LANGUAGE C STRICT;
+
+DO $$
+DECLARE
+  f regprocedure;
+BEGIN
+  IF current_setting('server_version_num')::int < 120000 THEN
+    RETURN;
+  END IF;
+
+  FOR f IN
+    SELECT oid FROM pg_proc
+    WHERE probin = 'MODULE_PATHNAME' AND
+          prosrc IN ('nominatim_fdw_search', 'nominatim_fdw_reverse', 'nominatim_fdw_lookup',
+                     'nominatim_fdw_search_point', 'nominatim_fdw_reverse_point', 'nominatim_fdw_search_paged')
+  LOOP
+    EXECUTE format('ALTER FUNCTION %s SUPPORT nominatim_fdw_support', f);
+  END LOOP;
+END;
+$$;
+
+CREATE FUNCTION nominatim_fdw_cache_stats(
+    OUT entries bigint,
+    OUT hits bigint,
+    OUT misses bigint,
+    OUT evictions bigint,
+    OUT coalesced bigint)
+RETURNS record AS 'MODULE_PATHNAME', 'nominatim_fdw_cache_stats'
+LANGUAGE C VOLATILE STRICT PARALLEL SAFE;
+
+CREATE FUNCTION nominatim_fdw_cache_reset()
+RETURNS void AS 'MODULE_PATHNAME', 'nominatim_fdw_cache_reset'
+LANGUAGE C VOLATILE STRICT;
+
+REVOKE ALL ON FUNCTION nominatim_fdw_cache_reset() FROM PUBLIC;
+
+CREATE FUNCTION nominatim_fdw_cache_create(server_name text, cache_table text)
+RETURNS void AS $$
+BEGIN
+  EXECUTE format('CREATE TABLE %s (
+    request_url text NOT NULL,
+    points_only boolean NOT NULL DEFAULT false,
+    records bytea NOT NULL,
+    fetched_at timestamptz NOT NULL DEFAULT now(),
+    PRIMARY KEY (request_url, points_only))', cache_table);
+  EXECUTE format('ALTER SERVER %I OPTIONS (ADD cache_table %L)', server_name, cache_table);
+END;
+$$ LANGUAGE plpgsql;
+
+CREATE FUNCTION nominatim_fdw_cache_expire(server_name text, older_than interval)
+RETURNS bigint AS $$
+DECLARE
+  cache_table text;
+  expired bigint;
+BEGIN
+  SELECT option_value INTO cache_table
+  FROM pg_foreign_server s, pg_options_to_table(s.srvoptions)
+  WHERE s.srvname = server_name AND option_name = 'cache_table';
+
+  IF cache_table IS NULL THEN
+    RAISE EXCEPTION 'server ''%'' has no cache table', server_name
+      USING HINT = 'create one with nominatim_fdw_cache_create()';
+  END IF;
+
+  EXECUTE format('DELETE FROM %s WHERE fetched_at < now() - $1', cache_table::regclass) USING older_than;
+  GET DIAGNOSTICS expired = ROW_COUNT;
+
+  RETURN expired;
+END;
+$$ LANGUAGE plpgsql;
+
+CREATE FUNCTION nominatim_fdw_cache_refresh(
+    server_name text,
+    older_than interval DEFAULT '30 days',
+    max_requests int DEFAULT 100)
+RETURNS bigint AS 'MODULE_PATHNAME', 'nominatim_fdw_cache_refresh'
+LANGUAGE C VOLATILE STRICT;
+
+CREATE FUNCTION nominatim_fdw_cache_prewarm(server_name text)
+RETURNS bigint AS 'MODULE_PATHNAME', 'nominatim_fdw_cache_prewarm'
+LANGUAGE C VOLATILE STRICT;
+
+CREATE FUNCTION nominatim_fdw_stats(
+    OUT server_name text,
+    OUT request_type text,
+    OUT calls bigint,
+    OUT status_2xx bigint,
+    OUT status_3xx bigint,
+    OUT status_4xx bigint,
+    OUT status_5xx bigint,
+    OUT failures bigint,
+    OUT retries bigint,
+    OUT bytes bigint,
+    OUT cache_hits bigint,
+    OUT total_time double precision,
+    OUT min_time double precision,
+    OUT max_time double precision,
+    OUT mean_time double precision,
+    OUT histogram bigint[])
+RETURNS SETOF record AS 'MODULE_PATHNAME', 'nominatim_fdw_stats'
+LANGUAGE C VOLATILE STRICT PARALLEL SAFE;
+
+CREATE VIEW nominatim_fdw_stats AS
+SELECT * FROM nominatim_fdw_stats();
+
+CREATE FUNCTION nominatim_fdw_stats_reset()
+RETURNS void AS 'MODULE_PATHNAME', 'nominatim_fdw_stats_reset'
+LANGUAGE C VOLATILE STRICT;
+
+REVOKE ALL ON FUNCTION nominatim_fdw_stats_reset() FROM PUBLIC;
+
+CREATE FUNCTION nominatim_fdw_activity(
+    OUT pid integer,
+    OUT server_name text,
+    OUT request_type text,
+    OUT url text,
+    OUT started_at timestamptz,
+    OUT attempt integer,
+    OUT bytes bigint)
+RETURNS SETOF record AS 'MODULE_PATHNAME', 'nominatim_fdw_activity'
+LANGUAGE C VOLATILE STRICT PARALLEL SAFE;
+
+CREATE VIEW nominatim_fdw_activity AS
+SELECT * FROM nominatim_fdw_activity();
+
+CREATE FUNCTION nominatim_fdw_recent_requests(
+    OUT pid integer,
+    OUT server_name text,
+    OUT request_type text,
+    OUT url text,
+    OUT started_at timestamptz,
+    OUT duration double precision,
+    OUT http_status integer,
+    OUT retries integer,
+    OUT bytes bigint)
+RETURNS SETOF record AS 'MODULE_PATHNAME', 'nominatim_fdw_recent_requests'
+LANGUAGE C VOLATILE STRICT PARALLEL SAFE;
+
+CREATE VIEW nominatim_fdw_recent_requests AS
+SELECT * FROM nominatim_fdw_recent_requests();
+
+CREATE FUNCTION nominatim_fdw_bench(
+    server_name text,
+    request_type text,
+    sample_queries text[],
+    duration interval DEFAULT '10 seconds',
+    concurrency int DEFAULT 1,
+    OUT requests bigint,
+    OUT errors bigint,
+    OUT requests_per_second double precision,
+    OUT bytes bigint,
+    OUT connections bigint,
+    OUT connect_time double precision,
+    OUT mean_time double precision,
+    OUT p50_time double precision,
+    OUT p90_time double precision,
+    OUT p99_time double precision,
+    OUT max_time double precision,
+    OUT last_error text)
+RETURNS record AS 'MODULE_PATHNAME', 'nominatim_fdw_bench'
+LANGUAGE C VOLATILE STRICT;
+
+REVOKE ALL ON FUNCTION nominatim_fdw_bench(text, text, text[], interval, int) FROM PUBLIC;
+
+CREATE TABLE nominatim_geocode_progress (
+    relation text NOT NULL,
+    job text NOT NULL,
+    batch_start bigint NOT NULL,
+    batch_end bigint NOT NULL,
+    updated bigint NOT NULL,
+    done_at timestamptz NOT NULL DEFAULT now(),
+    PRIMARY KEY (relation, job, batch_start));
+
+SELECT pg_catalog.pg_extension_config_dump('nominatim_geocode_progress', '');
+
+DO $$
+BEGIN
+  /* procedures, which can commit before waiting for the workers, need PostgreSQL 11+ */
+  IF current_setting('server_version_num')::int < 110000 THEN
+    RETURN;
+  END IF;
+
+  EXECUTE '
+CREATE PROCEDURE nominatim_geocode_table(
+    server_name text,
+    relation regclass,
+    address_expr text,
+    target_columns text[],
+    workers int DEFAULT 8,
+    batch_size int DEFAULT 500,
+    INOUT updated bigint DEFAULT NULL)
+AS ''MODULE_PATHNAME'', ''nominatim_geocode_table''
+LANGUAGE C';
+
+  EXECUTE 'REVOKE ALL ON PROCEDURE nominatim_geocode_table(text, regclass, text, text[], int, int, bigint) FROM PUBLIC';
+END;
+$$;
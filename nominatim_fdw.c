@@ -16,6 +16,8 @@
 #include "access/htup_details.h"
 #include "access/sysattr.h"
 #include "access/reloptions.h"
+#include "access/xact.h"
+#include "access/xlog.h"
 #if PG_VERSION_NUM >= 120000
 #include "access/table.h"
 #endif
@@ -23,17 +25,24 @@
 #include "commands/defrem.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <math.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <curl/curl.h>
 #include <utils/builtins.h>
 #include <utils/array.h>
 #include <commands/explain.h>
+#if PG_VERSION_NUM >= 180000
+#include "commands/explain_format.h"
+#endif
 #include <libxml/tree.h>
+#include "nominatim_parser.h"
 #include <catalog/pg_collation.h>
 #include <funcapi.h>
 #include "lib/stringinfo.h"
+#include "lib/ilist.h"
 #include <utils/lsyscache.h>
 #include "utils/datetime.h"
-#include "utils/json.h"
 #include "utils/timestamp.h"
 #include "utils/formatting.h"
 #include "catalog/pg_operator.h"
@@ -41,20 +50,75 @@
 #include "catalog/pg_foreign_table.h"
 #include "catalog/pg_foreign_server.h"
 #include "catalog/pg_user_mapping.h"
+#include "catalog/pg_authid.h"
 #include "catalog/pg_type.h"
 #include "catalog/pg_namespace.h"
+#include "catalog/pg_proc.h"
+#include "catalog/namespace.h"
+#include "executor/spi.h"
 #include "utils/date.h"
 #include <utils/elog.h>
 #include <access/tupdesc.h>
 #include "miscadmin.h"
+#include "utils/memutils.h"
+#include "utils/hsearch.h"
+#include "utils/acl.h"
+#include "utils/guc.h"
+#if PG_VERSION_NUM >= 110000
+#include "utils/regproc.h"
+#endif
+#include "utils/dsa.h"
+#include "utils/snapmgr.h"
+#include "utils/resowner.h"
+#include "postmaster/bgworker.h"
+#include "tcop/tcopprot.h"
+#include "storage/dsm.h"
+#include "storage/fd.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "storage/condition_variable.h"
+#include "pgstat.h"
+#include "port/atomics.h"
+#if PG_VERSION_NUM >= 120000
+#include "nodes/supportnodes.h"
+#endif
+#include "executor/executor.h"
+#include "portability/instr_time.h"
+#include "nodes/makefuncs.h"
+#include "nodes/nodeFuncs.h"
+#include "optimizer/cost.h"
+#include "optimizer/pathnode.h"
+#include "optimizer/planmain.h"
+#include "optimizer/paths.h"
+#include "utils/selfuncs.h"
+#include "storage/latch.h"
+#if PG_VERSION_NUM >= 140000
+#include "executor/execAsync.h"
+#endif
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#endif
+#include "optimizer/restrictinfo.h"
+#if PG_VERSION_NUM >= 120000
+#include "optimizer/optimizer.h"
+#else
+#include "access/heapam.h"
+#include "optimizer/clauses.h"
+#include "optimizer/var.h"
+#define table_open(r, l) heap_open(r, l)
+#define table_close(r, l) heap_close(r, l)
+#endif
 
 #define FDW_VERSION "1.4-dev"
 #define REQUEST_SUCCESS 0
 #define REQUEST_FAIL -1
+#define REQUEST_CACHED 1
+#define REQUEST_PENDING 2
 
-#define NOMINATIM_REQUEST_SEARCH "search"
-#define NOMINATIM_REQUEST_REVERSE "reverse"
-#define NOMINATIM_REQUEST_LOOKUP "lookup"
+#define NOMINATIM_FORMAT_XML "xml"
+#define NOMINATIM_FORMAT_JSONV2 "jsonv2"
 
 #define NOMINATIM_SERVER_OPTION_URL "url"
 #define NOMINATIM_SERVER_OPTION_CONNECTTIMEOUT "connect_timeout"
@@ -64,11 +128,98 @@
 #define NOMINATIM_USERMAPPING_OPTION_PROXYUSER "proxy_user"
 #define NOMINATIM_USERMAPPING_OPTION_PROXYPASSWORD "proxy_password"
 #define NOMINATIM_SERVER_OPTION_LANGUAGE "accept_language"
+#define NOMINATIM_SERVER_OPTION_ASYNC "async_capable"
+#define NOMINATIM_SERVER_OPTION_CACHE_TTL "cache_ttl"
+#define NOMINATIM_SERVER_OPTION_CACHE_NEGATIVE_TTL "cache_negative_ttl"
+#define NOMINATIM_SERVER_OPTION_CACHE_TABLE "cache_table"
+#define NOMINATIM_SERVER_OPTION_REVERSE_GRID "reverse_grid"
+#define NOMINATIM_SERVER_OPTION_MAX_REQUESTS_PER_SECOND "max_requests_per_second"
+#define NOMINATIM_SERVER_OPTION_MAX_CONCURRENT_REQUESTS "max_concurrent_requests"
+#define NOMINATIM_TABLE_OPTION_ENDPOINT "endpoint"
+#define NOMINATIM_TABLE_OPTION_POLYGON "polygon"
+#define NOMINATIM_TABLE_OPTION_EMAIL "email"
 
 #define NOMINATIM_DEFAULT_CONNECTTIMEOUT 300
 #define NOMINATIM_DEFAULT_MAXRETRY 3
 #define NOMINATIM_DEFAULT_MAXREDIRECT 1
 #define NOMINATIM_DEFAULT_LANGUAGE "en-US,en;q=0.9"
+#define NOMINATIM_DEFAULT_CONCURRENT_REQUESTS 1
+
+/* lock_timeout of the writes to the cache table, which give way to other writers */
+#define NOMINATIM_CACHE_LOCK_TIMEOUT "10ms"
+
+/* pause before retrying a failed request, in milliseconds */
+#define NOMINATIM_RETRY_PAUSE_MS 1000
+
+/*
+ * Asynchronous foreign scans wait on an epoll set holding all sockets of
+ * the request and a timerfd, which needs Linux. Elsewhere the scans run
+ * synchronously.
+ */
+#if PG_VERSION_NUM >= 140000 && defined(__linux__)
+#define NOMINATIM_ASYNC_SCANS
+#define NOMINATIM_ASYNC_MAX_EVENTS 16
+#endif
+
+/* number of attributes of the NominatimPoint type */
+#define NOMINATIM_POINT_NATTS 6
+
+/* maximum number of results Nominatim returns in a single search request */
+#define NOMINATIM_MAX_PAGE_SIZE 40
+
+/* spatial reference system of all coordinates returned by Nominatim */
+#define NOMINATIM_SRID 4326
+
+/*
+ * planner estimates: a request is a network round trip, whose cost is derived
+ * from the average latency observed for the server in this session
+ */
+#define NOMINATIM_DEFAULT_LATENCY_MS 50.0
+#define NOMINATIM_COST_PER_MS 20.0
+#define NOMINATIM_REQUEST_COST (NOMINATIM_DEFAULT_LATENCY_MS * NOMINATIM_COST_PER_MS)
+#define NOMINATIM_DEFAULT_RESULT_ROWS 10
+#define NOMINATIM_MAX_LOOKUP_IDS 50
+
+/* typical size of a serialized response, used to size the shared cache's hash table */
+#define NOMINATIM_CACHE_ENTRY_SIZE 4096
+
+/* number of distinct requests that can be coalesced at the same time */
+#define NOMINATIM_MAX_IN_FLIGHT 128
+
+/*
+ * Request statistics: number of server/request type combinations tracked,
+ * and latency histogram buckets. Bucket i holds the requests faster than
+ * 2^i ms, the last one all slower requests.
+ */
+#define NOMINATIM_MAX_SERVER_STATS 64
+#define NOMINATIM_STATS_STATUS_CLASSES 4
+#define NOMINATIM_STATS_BUCKETS 16
+
+/*
+ * Request activity: backends that can report their requests, number of
+ * completed requests kept and size of the (redacted) URLs shown.
+ */
+#define NOMINATIM_MAX_ACTIVITY 128
+#define NOMINATIM_RECENT_REQUESTS 64
+#define NOMINATIM_ACTIVITY_URL_SIZE 1024
+
+/* maximum number of concurrent requests of nominatim_fdw_bench */
+#define NOMINATIM_BENCH_MAX_CONCURRENCY 256
+
+/* maximum number of background workers of nominatim_geocode_table */
+#define NOMINATIM_GEOCODE_MAX_WORKERS 64
+
+/* DSA area of the shared cache, right after the shared state */
+#define NOMINATIM_SHARED_CACHE_AREA(shared) ((char *)(shared) + MAXALIGN(sizeof(NominatimSharedState)))
+#define NOMINATIM_DEFAULT_PAGED_ROWS 1000
+
+/* details a foreign table scan has to request from the server */
+#define NOMINATIM_FETCH_EXTRATAGS 0x01
+#define NOMINATIM_FETCH_NAMEDETAILS 0x02
+#define NOMINATIM_FETCH_ADDRESSDETAILS 0x04
+#define NOMINATIM_FETCH_ENTRANCES 0x08
+#define NOMINATIM_FETCH_POLYGON 0x10
+#define NOMINATIM_FETCH_POLYGON_WKT 0x20
 
 PG_MODULE_MAGIC;
 
@@ -80,6 +231,25 @@ typedef struct NominatimFDWOption
     bool optfound;    /* Flag whether options was specified by user */
 } NominatimFDWOption;
 
+/*
+ * Counters of the requests sent by a foreign table scan, shown by
+ * EXPLAIN ANALYZE. Times are in milliseconds.
+ */
+typedef struct NominatimRequestStats
+{
+    long requests;        /* successful requests */
+    long retries;         /* failed attempts that were retried */
+    long bytes;           /* size of the response bodies */
+    double dns_ms;        /* name resolution */
+    double connect_ms;    /* TCP connect */
+    double tls_ms;        /* TLS handshake */
+    double first_byte_ms; /* from the end of the handshakes to the first byte of the response */
+    double transfer_ms;   /* from the first to the last byte of the response */
+    double parse_ms;      /* XML parsing */
+    double tuple_ms;      /* building the tuples */
+    StringInfo url;       /* URL of the last request */
+} NominatimRequestStats;
+
 typedef struct NominatimFDWState
 {
     int zoom;                  /* Level of detail required for the address. */
@@ -108,6 +278,8 @@ typedef struct NominatimFDWState
     char *polygon_type;        /* One of: polygon_geojson, polygon_text, polygon_kml or polygon_svg*/
     char *email;               /* An e-mail address to identify the requests in the server */
     char *accept_language;     /* Preferred language order for showing search results */
+    char *format;              /* Response format requested from the server: xml or jsonv2 */
+    char *raw_response;        /* Unparsed response body (raw requests only) */
     bool dedupe;               /* Remove duplicates? */
     bool bounded;              /* Exclude results outside the viewbox? */
     bool request_redirect;     /* Enables or disables URL redirecting. */
@@ -115,6 +287,21 @@ typedef struct NominatimFDWState
     bool namedetails;          /* Include a full list of names for the result? */
     bool addressdetails;       /* Include a breakdown of the address into elements? */
     bool entrances;            /* tagged entrances in the result? */
+    bool raw;                  /* Keep the response body as is instead of parsing it into an XML document? */
+    bool points_only;          /* Parse only ids, coordinates and display name of each place? */
+    bool cached;               /* Share responses with identical requests of the same statement? */
+    int cache_ttl;             /* Seconds the records are kept in the shared cache (0 = not cached) */
+    int cache_negative_ttl;    /* Seconds empty results are kept in the shared cache (0 = not cached) */
+    char *cache_key;           /* Key under which the parsed records go into the shared cache (NULL = none) */
+    char *cache_table;         /* Table of the persistent cache (NULL = none) */
+    char *cache_url;           /* URL under which the parsed records go into the cache table (NULL = none) */
+    char *request_url;         /* Replayed request: URL sent as is instead of building it (NULL = none) */
+    int reverse_grid;          /* Edge in pixels of the grid cells reverse coordinates are snapped to (0 = disabled) */
+    double max_requests_per_second; /* Requests this backend may send to the server per second (0 = unlimited) */
+    int max_concurrent_requests; /* Requests of a scan sent at once, e.g. for the elements of "q = ANY(array)" */
+    char *slow_request;        /* Details of a slow request, logged once its records are built (NULL = none) */
+    double slow_request_ms;    /* Duration of the slow request up to the XML parsing */
+    instr_time slow_request_parsed; /* End of the XML parsing of the slow request */
     long request_max_redirect; /* Limit of how many times the URL redirection (jump) may occur. */
     long connect_timeout;      /* Request timeout in seconds */
     long max_retries;          /* Number of re-try attemtps for failed requests */
@@ -123,44 +310,419 @@ typedef struct NominatimFDWState
     float8 polygon_threshold;  /* Tolerance in degrees with which the geometry may differ from the original geometry */
     xmlDocPtr xmldoc;          /* XML document where the results from the request will be stored before parsing */
     List *records;             /* List of records retrieved from the server after parsing */
+    MemoryContext page_context;/* Paging: memory context holding the records of the current page */
+    int page_position;         /* Paging: position of the next record to return from the current page */
+    int max_records;           /* Paging: maximum number of records to return overall (0 = unlimited) */
+    long fetched;              /* Paging: number of records retrieved so far */
+    long pages;                /* Paging: number of pages retrieved so far */
+    bool exhausted;            /* Paging: no further pages to retrieve? */
     ForeignServer *server;     /* Foreign server associated with the request */
+    CURL *curl;                /* cURL handle kept open across requests (NULL = one handle per request) */
+    NominatimRequestStats *stats; /* counters of the requests (NULL = not collected) */
 } NominatimFDWState;
 
-typedef struct NominatimRecord
-{
-    char *timestamp;
-    char *attribution;
-    char *querystring;
-    char *polygon;
-    char *exclude_place_ids;
-    char *more_url;
-    char *place_id;
-    char *osm_type;
-    char *osm_id;
-    char *ref;
-    char *lat;
-    char *lon;
-    char *boundingbox;
-    char *place_rank;
-    char *address_rank;
-    char *display_name;
-    char *class;
-    char *type;
-    char *importance;
-    char *icon;
-    char *extratags;
-    char *addressdetails;
-    char *namedetails;
-    char *addressparts;
-    char *entrances;
-} NominatimRecord;
-
 struct MemoryStruct
 {
     char *memory;
     size_t size;
 };
 
+/*
+ * A request to the Nominatim server, from the moment it is set up until its
+ * response is collected.
+ */
+typedef struct NominatimRequest
+{
+    CURL *curl;                       /* cURL handle performing the request */
+    StringInfoData url;               /* request URL */
+    char errbuf[CURL_ERROR_SIZE];     /* cURL error message */
+    struct MemoryStruct chunk;        /* response body */
+    struct MemoryStruct chunk_header; /* response header */
+    struct curl_slist *headers;       /* request headers */
+    bool waiting;                     /* is the backend waiting for the request to finish? */
+    bool connected;                   /* waiting for the response, past connect and handshakes? */
+    instr_time started;               /* start of the request, for nominatim_fdw.log_min_duration */
+    long retries;                     /* failed attempts retried so far */
+} NominatimRequest;
+
+/*
+ * Concurrent request of a foreign table scan sending one request per
+ * element of "column = ANY(array)", with a cURL handle of its own so that
+ * connections are reused across the elements it sends.
+ */
+typedef struct NominatimScanSlot
+{
+    NominatimFDWState *state; /* request of the element being sent (NULL = idle) */
+    NominatimRequest req;
+    CURL *curl;
+} NominatimScanSlot;
+
+/*
+ * Concurrent request of nominatim_fdw_bench: a copy of the session holding
+ * the sample being sent, with a cURL handle of its own so that connections
+ * are reused across its requests.
+ */
+typedef struct NominatimBenchSlot
+{
+    NominatimFDWState state;
+    NominatimRequest req;
+    MemoryContext context; /* memory of the current request, reset after its response */
+    bool busy;             /* is the request in the multi handle? */
+} NominatimBenchSlot;
+
+/*
+ * Job of nominatim_geocode_table, in a DSM segment shared by its workers.
+ * The table is split into batches of batch_size consecutive primary key
+ * values, aligned to multiples of batch_size so that an interrupted job
+ * resumes with the same batches, and the workers take the next batch from
+ * next_batch until all are done.
+ */
+typedef struct NominatimGeocodeJob
+{
+    Oid database;
+    Oid user;                    /* role the workers connect as */
+    int64 first_batch;           /* smallest key divided by batch_size */
+    int64 batches;               /* number of batches up to the largest key */
+    int64 batch_size;
+    pg_atomic_uint64 next_batch; /* next batch to hand out, relative to first_batch */
+    pg_atomic_uint64 updated;    /* rows updated by all workers */
+    pg_atomic_uint64 skipped;    /* batches already done by an earlier call */
+    pg_atomic_uint32 launched;   /* workers started, sharing max_requests_per_second (0 = not known yet) */
+    pg_atomic_uint32 finished;   /* workers that ran out of batches without an error */
+    char job[17];                /* hash of the job's parameters, key of its progress rows */
+    Size update_sql;             /* offsets in data of the UPDATE of a batch, */
+    Size progress_table;         /* of the progress table */
+    Size relation;               /* and of the table being geocoded */
+    char data[FLEXIBLE_ARRAY_MEMBER];
+} NominatimGeocodeJob;
+
+/* state and results of a nominatim_fdw_bench call */
+typedef struct NominatimBench
+{
+    MemoryContext context;     /* memory of the call, holding the results */
+    CURLM *multi;              /* multi handle performing the requests of all slots */
+    NominatimBenchSlot *slots;
+    int concurrency;           /* number of slots */
+    char **samples;            /* sample queries, osm_ids or "lon,lat" pairs */
+    float8 *lons;              /* reverse: coordinates of the samples */
+    float8 *lats;
+    int nsamples;
+    int64 requests;
+    int64 errors;
+    int64 bytes;
+    int64 connections;         /* connections opened */
+    double connect_ms;         /* time spent opening them, including TLS and proxy handshakes */
+    double *latencies;         /* ms of the successful requests, including parsing */
+    long nlatencies;
+    long maxlatencies;
+    char *last_error;
+} NominatimBench;
+
+/*
+ * Planner information of a foreign table scan, stored in
+ * RelOptInfo->fdw_private.
+ */
+typedef struct NominatimFDWPlanState
+{
+    char *endpoint;          /* one of: search, reverse or lookup */
+    List *param_names;       /* request parameters taken from the restriction clauses (String) */
+    List *local_conds;       /* restriction clauses checked locally */
+    Bitmapset *attrs_used;   /* columns needed by the query */
+    int limit;               /* LIMIT sent to the server (0 = none) */
+    double rows;             /* estimated number of records returned by the server */
+    bool async_capable;      /* can the scan run asynchronously? */
+    Cost request_cost;       /* estimated cost of a request to the server */
+    int array_param;         /* index in param_names of the parameter taken from "= ANY(array)" (-1 = none) */
+    double requests;         /* estimated number of requests per scan: one per array element */
+    int concurrency;         /* requests sent at once (max_concurrent_requests) */
+} NominatimFDWPlanState;
+
+/*
+ * Indexes of the items stored in ForeignScan->fdw_private.
+ */
+enum NominatimFdwScanPrivateIndex
+{
+    NominatimFdwScanPrivateEndpoint,       /* String: endpoint */
+    NominatimFdwScanPrivateParamNames,     /* List of String: request parameters */
+    NominatimFdwScanPrivateFetchFlags,     /* Integer: NOMINATIM_FETCH_* flags */
+    NominatimFdwScanPrivateLimit,          /* Integer: LIMIT sent to the server */
+    NominatimFdwScanPrivateRetrievedAttrs, /* Integer list: columns to fill */
+    NominatimFdwScanPrivateArrayParam      /* Integer: index of the parameter sent once per array element (-1 = none) */
+};
+
+/*
+ * Execution state of a foreign table scan.
+ */
+typedef struct NominatimFDWScanState
+{
+    NominatimFDWState *request;  /* request template built from server and table options */
+    List *param_names;              /* request parameters taken from the conditions */
+    List *param_exprs;              /* ExprStates of the request parameter values */
+    char **param_values;            /* request parameter values of the current scan */
+    List *retrieved_attrs;          /* columns to fill */
+    List *records;                  /* records retrieved from the server */
+    int position;                   /* position of the next record to return */
+    bool executed;                  /* request already sent in this (re)scan? */
+    bool done;                      /* nothing to return in this (re)scan? */
+    MemoryContext batch_context;    /* holds the records of the current (re)scan */
+    int array_param;                /* Array: index of the parameter sent once per element (-1 = none) */
+    char **array_values;            /* Array: distinct elements of the current (re)scan */
+    NominatimFDWState **array_requests; /* Array: request of each element, holding its records */
+    int nelements;                  /* Array: number of elements */
+    int element;                    /* Array: element whose records are being returned */
+    NominatimScanSlot *slots;       /* Array: requests sent at once */
+    int concurrency;                /* Array: number of slots */
+    CURLM *multi;                   /* Async and Array: multi handle performing the requests */
+    NominatimRequest request_async; /* Async: request in progress */
+    NominatimFDWState *pending;     /* Async: state of the request in progress (NULL = none) */
+    bool sent;                      /* Async: is the request in progress in the multi handle? */
+    TimestampTz resume_at;          /* Async: earliest time to send the next attempt of a failed request */
+    int epoll_fd;                   /* Async: epoll set of the sockets of the request and the timer (-1 = none) */
+    int timer_fd;                   /* Async: timerfd armed with cURL's timeout or the next attempt (-1 = none) */
+    NominatimRequestStats stats;    /* EXPLAIN ANALYZE: counters of the requests */
+} NominatimFDWScanState;
+
+/*
+ * Latency of the requests sent to a server in this session, used by the
+ * planner to estimate the cost of further requests, and start of the last
+ * request, used to enforce max_requests_per_second.
+ */
+typedef struct NominatimServerLatency
+{
+    char servername[NAMEDATALEN]; /* hash key: foreign server name */
+    long requests;                /* number of successful requests */
+    double total_ms;              /* sum of their durations in milliseconds */
+    bool throttled;               /* has a request been sent under max_requests_per_second? */
+    instr_time last_request;      /* start of that request */
+} NominatimServerLatency;
+
+static HTAB *server_latency = NULL;
+
+/*
+ * Number of backends sharing the max_requests_per_second of the servers:
+ * the workers of nominatim_geocode_table split it between them.
+ */
+static int throttle_share = 1;
+
+/*
+ * Response body of a request, kept for the rest of the statement so that
+ * identical requests of STABLE function calls are answered locally.
+ */
+typedef struct NominatimCachedResponse
+{
+    char *url;   /* hash key: request URL */
+    char *body;  /* response body */
+    size_t size; /* size of the response body */
+} NominatimCachedResponse;
+
+/*
+ * Shared cache entry: the records of a request, serialized into the DSA
+ * area of the cache.
+ */
+typedef struct NominatimCacheEntry
+{
+    uint64 fingerprint;    /* hash key: fingerprint of the cache key */
+    dsa_pointer data;      /* cache key followed by the serialized records */
+    Size size;             /* size of data */
+    TimestampTz expires;   /* end of validity */
+    dlist_node lru;        /* position in the eviction list, most recently stored first */
+    bool referenced;       /* hit since the entry last passed the end of the eviction list */
+} NominatimCacheEntry;
+
+/*
+ * A cacheable request being sent by a backend. Backends about to send the
+ * same request wait for it to finish and take its records from the shared
+ * cache instead.
+ */
+typedef struct NominatimInFlightRequest
+{
+    uint64 fingerprint;   /* fingerprint of the request's cache key */
+    int leader;           /* pid of the backend sending the request (0 = free slot) */
+    ConditionVariable cv; /* broadcast when the request is done */
+} NominatimInFlightRequest;
+
+/*
+ * Request statistics of a foreign server and request type, shown in the
+ * nominatim_fdw_stats view. Entries are added under the shared lock's
+ * exclusive mode and never removed; their counters are updated lock-free.
+ */
+typedef struct NominatimServerStats
+{
+    Oid dbid;                                                /* database of the foreign server */
+    Oid serverid;                                            /* foreign server */
+    int request_type;                                        /* index in request_types[] */
+    NameData servername;                                     /* server name at the time of the first request */
+    pg_atomic_uint64 calls;                                  /* requests sent to the server */
+    pg_atomic_uint64 status[NOMINATIM_STATS_STATUS_CLASSES]; /* responses per HTTP status class: 2xx, 3xx, 4xx, 5xx */
+    pg_atomic_uint64 failures;                               /* requests without HTTP response */
+    pg_atomic_uint64 retries;                                /* failed attempts retried */
+    pg_atomic_uint64 bytes;                                  /* bytes received */
+    pg_atomic_uint64 cache_hits;                             /* requests answered by a cache instead */
+    pg_atomic_uint64 total_time;                             /* sum of the request times in microseconds */
+    pg_atomic_uint64 min_time;                               /* fastest request in microseconds */
+    pg_atomic_uint64 max_time;                               /* slowest request in microseconds */
+    pg_atomic_uint64 histogram[NOMINATIM_STATS_BUCKETS];     /* requests per latency bucket */
+} NominatimServerStats;
+
+/*
+ * Request a backend is sending, shown in the nominatim_fdw_activity view.
+ * Only the owning backend writes the slot; readers retry until they get a
+ * copy taken while changecount was even and did not change, as
+ * pg_stat_activity does.
+ */
+typedef struct NominatimActivity
+{
+    int pid;                               /* backend owning the slot (0 = free slot) */
+    uint32 changecount;                    /* odd while the owner is updating the slot */
+    bool active;                           /* is a request in progress? */
+    Oid userid;                            /* user sending the request */
+    NameData servername;                   /* foreign server */
+    int request_type;                      /* index in request_types[] */
+    char url[NOMINATIM_ACTIVITY_URL_SIZE]; /* redacted request URL */
+    TimestampTz started_at;                /* start of the request */
+    int attempt;                           /* attempt in progress, 1 for the first one */
+    uint64 bytes;                          /* bytes received by the attempt so far */
+} NominatimActivity;
+
+/*
+ * Completed request, kept in a ring buffer shown in the
+ * nominatim_fdw_recent_requests view.
+ */
+typedef struct NominatimRecentRequest
+{
+    int pid;                               /* backend that sent the request */
+    Oid userid;                            /* user that sent the request */
+    NameData servername;                   /* foreign server */
+    int request_type;                      /* index in request_types[] */
+    char url[NOMINATIM_ACTIVITY_URL_SIZE]; /* redacted request URL */
+    TimestampTz started_at;                /* start of the request */
+    double duration;                       /* milliseconds, including retries */
+    long http_status;                      /* HTTP status of the last attempt (0 = no response) */
+    long retries;                          /* failed attempts that were retried */
+    uint64 bytes;                          /* bytes received by the last attempt */
+} NominatimRecentRequest;
+
+/*
+ * State of nominatim_fdw in shared memory, followed by the DSA area of the
+ * shared cache (if nominatim_fdw.cache_size > 0).
+ */
+typedef struct NominatimSharedState
+{
+    LWLock *lock;                     /* protects the in-flight requests and the request statistics */
+    LWLock *cache_lock;               /* protects the shared cache and its eviction list */
+    dlist_head cache_lru;             /* entries of the shared cache, in eviction order from the tail */
+    int cache_tranche;                /* LWLock tranche of the cache's DSA area */
+    pg_atomic_uint64 cache_hits;      /* requests answered by the shared cache */
+    pg_atomic_uint64 cache_misses;    /* cacheable requests sent to the server */
+    pg_atomic_uint64 cache_evictions; /* entries evicted to make room for new ones */
+    pg_atomic_uint64 coalesced;       /* requests that waited for an identical one instead of being sent */
+    NominatimInFlightRequest inflight[NOMINATIM_MAX_IN_FLIGHT];
+    pg_atomic_uint32 num_server_stats; /* entries of server_stats in use */
+    NominatimServerStats server_stats[NOMINATIM_MAX_SERVER_STATS];
+    NominatimActivity activity[NOMINATIM_MAX_ACTIVITY];
+    uint64 recent_count; /* requests added to recent so far, protected by lock */
+    NominatimRecentRequest recent[NOMINATIM_RECENT_REQUESTS];
+} NominatimSharedState;
+
+/* GUC: size of the shared cache in kB (0 = disabled) */
+static int cache_size = 0;
+
+/* GUC: requests taking at least this many milliseconds are logged (-1 = disabled) */
+static int log_min_duration = -1;
+
+/*
+ * GUC: how requests reach the server. In record mode the responses are also
+ * saved to transport_directory, in replay mode they are read from there
+ * instead of contacting the server.
+ */
+typedef enum NominatimTransport
+{
+    NOMINATIM_TRANSPORT_LIVE,
+    NOMINATIM_TRANSPORT_RECORD,
+    NOMINATIM_TRANSPORT_REPLAY
+} NominatimTransport;
+
+static const struct config_enum_entry transport_options[] =
+    {
+        {"live", NOMINATIM_TRANSPORT_LIVE, false},
+        {"record", NOMINATIM_TRANSPORT_RECORD, false},
+        {"replay", NOMINATIM_TRANSPORT_REPLAY, false},
+        {NULL, 0, false}};
+
+static int transport = NOMINATIM_TRANSPORT_LIVE;
+static char *transport_directory = NULL;
+
+/* GUC: file every request sent to a server is appended to (empty = disabled) */
+static char *capture_file = NULL;
+
+/* version of the records written to nominatim_fdw.capture_file */
+#define NOMINATIM_CAPTURE_VERSION 1
+
+static NominatimSharedState *nominatim_shared = NULL;
+static HTAB *shared_cache = NULL;
+static dsa_area *shared_cache_area = NULL;
+
+/*
+ * Wait events reported while waiting for the server. On PostgreSQL 17+
+ * each has its own name, older versions report them all as "Extension".
+ */
+static bool wait_events_registered = false;
+static uint32 wait_event_connect = PG_WAIT_EXTENSION;
+static uint32 wait_event_response = PG_WAIT_EXTENSION;
+static uint32 wait_event_retry = PG_WAIT_EXTENSION;
+static uint32 wait_event_inflight = PG_WAIT_EXTENSION;
+static uint32 wait_event_ratelimit = PG_WAIT_EXTENSION;
+
+/* activity slot of this backend, and response body of the request it shows */
+static NominatimActivity *activity_slot = NULL;
+static struct MemoryStruct *activity_chunk = NULL;
+
+/* in-flight request this backend is sending (-1 = none) */
+static int inflight_slot = -1;
+static bool inflight_cleanup_registered = false;
+
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+/* request types of the nominatim_fdw_stats view */
+static const char *const request_types[] =
+    {NOMINATIM_REQUEST_SEARCH, NOMINATIM_REQUEST_REVERSE, NOMINATIM_REQUEST_LOOKUP};
+
+/* fields of NominatimRecord, in the order they are serialized into the shared cache */
+static const size_t record_fields[] =
+    {
+        offsetof(NominatimRecord, timestamp),
+        offsetof(NominatimRecord, attribution),
+        offsetof(NominatimRecord, querystring),
+        offsetof(NominatimRecord, polygon),
+        offsetof(NominatimRecord, exclude_place_ids),
+        offsetof(NominatimRecord, more_url),
+        offsetof(NominatimRecord, place_id),
+        offsetof(NominatimRecord, osm_type),
+        offsetof(NominatimRecord, osm_id),
+        offsetof(NominatimRecord, ref),
+        offsetof(NominatimRecord, lat),
+        offsetof(NominatimRecord, lon),
+        offsetof(NominatimRecord, boundingbox),
+        offsetof(NominatimRecord, place_rank),
+        offsetof(NominatimRecord, address_rank),
+        offsetof(NominatimRecord, display_name),
+        offsetof(NominatimRecord, class),
+        offsetof(NominatimRecord, type),
+        offsetof(NominatimRecord, importance),
+        offsetof(NominatimRecord, icon),
+        offsetof(NominatimRecord, extratags),
+        offsetof(NominatimRecord, addressdetails),
+        offsetof(NominatimRecord, namedetails),
+        offsetof(NominatimRecord, addressparts),
+        offsetof(NominatimRecord, entrances)};
+
+static HTAB *statement_cache = NULL;
+static MemoryContext statement_cache_context = NULL;
+static TimestampTz statement_cache_start = 0;
+
 static struct NominatimFDWOption valid_options[] =
     {
         /* Foreign Servers */
@@ -170,6 +732,19 @@ static struct NominatimFDWOption valid_options[] =
         {NOMINATIM_SERVER_OPTION_MAXCONNECTRETRY, ForeignServerRelationId, false, false},
         {NOMINATIM_SERVER_OPTION_MAXREDIRECT, ForeignServerRelationId, false, false},
         {NOMINATIM_SERVER_OPTION_LANGUAGE, ForeignServerRelationId, false, false},
+        {NOMINATIM_SERVER_OPTION_ASYNC, ForeignServerRelationId, false, false},
+        {NOMINATIM_SERVER_OPTION_CACHE_TTL, ForeignServerRelationId, false, false},
+        {NOMINATIM_SERVER_OPTION_CACHE_NEGATIVE_TTL, ForeignServerRelationId, false, false},
+        {NOMINATIM_SERVER_OPTION_CACHE_TABLE, ForeignServerRelationId, false, false},
+        {NOMINATIM_SERVER_OPTION_REVERSE_GRID, ForeignServerRelationId, false, false},
+        {NOMINATIM_SERVER_OPTION_MAX_REQUESTS_PER_SECOND, ForeignServerRelationId, false, false},
+        {NOMINATIM_SERVER_OPTION_MAX_CONCURRENT_REQUESTS, ForeignServerRelationId, false, false},
+        /* Foreign Tables */
+        {NOMINATIM_TABLE_OPTION_ENDPOINT, ForeignTableRelationId, true, false},
+        {NOMINATIM_TABLE_OPTION_POLYGON, ForeignTableRelationId, false, false},
+        {NOMINATIM_TABLE_OPTION_EMAIL, ForeignTableRelationId, false, false},
+        {NOMINATIM_SERVER_OPTION_LANGUAGE, ForeignTableRelationId, false, false},
+        {NOMINATIM_SERVER_OPTION_ASYNC, ForeignTableRelationId, false, false},
         /* User Mapping */
         {NOMINATIM_USERMAPPING_OPTION_PROXYUSER, UserMappingRelationId, false, false},
         {NOMINATIM_USERMAPPING_OPTION_PROXYPASSWORD, UserMappingRelationId, false, false},
@@ -182,6 +757,17 @@ extern Datum nominatim_fdw_version(PG_FUNCTION_ARGS);
 extern Datum nominatim_fdw_search(PG_FUNCTION_ARGS);
 extern Datum nominatim_fdw_reverse(PG_FUNCTION_ARGS);
 extern Datum nominatim_fdw_lookup(PG_FUNCTION_ARGS);
+extern Datum nominatim_fdw_search_raw(PG_FUNCTION_ARGS);
+extern Datum nominatim_fdw_reverse_raw(PG_FUNCTION_ARGS);
+extern Datum nominatim_fdw_lookup_raw(PG_FUNCTION_ARGS);
+extern Datum nominatim_fdw_search_point(PG_FUNCTION_ARGS);
+extern Datum nominatim_fdw_reverse_point(PG_FUNCTION_ARGS);
+extern Datum nominatim_fdw_search_paged(PG_FUNCTION_ARGS);
+extern Datum nominatim_fdw_support(PG_FUNCTION_ARGS);
+extern Datum nominatim_fdw_cache_stats(PG_FUNCTION_ARGS);
+extern Datum nominatim_fdw_cache_reset(PG_FUNCTION_ARGS);
+extern Datum nominatim_fdw_cache_refresh(PG_FUNCTION_ARGS);
+extern Datum nominatim_fdw_cache_prewarm(PG_FUNCTION_ARGS);
 
 PG_FUNCTION_INFO_V1(nominatim_fdw_handler);
 PG_FUNCTION_INFO_V1(nominatim_fdw_validator);
@@ -189,23 +775,289 @@ PG_FUNCTION_INFO_V1(nominatim_fdw_version);
 PG_FUNCTION_INFO_V1(nominatim_fdw_search);
 PG_FUNCTION_INFO_V1(nominatim_fdw_reverse);
 PG_FUNCTION_INFO_V1(nominatim_fdw_lookup);
+PG_FUNCTION_INFO_V1(nominatim_fdw_search_raw);
+PG_FUNCTION_INFO_V1(nominatim_fdw_reverse_raw);
+PG_FUNCTION_INFO_V1(nominatim_fdw_lookup_raw);
+PG_FUNCTION_INFO_V1(nominatim_fdw_search_point);
+PG_FUNCTION_INFO_V1(nominatim_fdw_reverse_point);
+PG_FUNCTION_INFO_V1(nominatim_fdw_search_paged);
+PG_FUNCTION_INFO_V1(nominatim_fdw_support);
+PG_FUNCTION_INFO_V1(nominatim_fdw_cache_stats);
+PG_FUNCTION_INFO_V1(nominatim_fdw_cache_reset);
+PG_FUNCTION_INFO_V1(nominatim_fdw_cache_refresh);
+PG_FUNCTION_INFO_V1(nominatim_fdw_cache_prewarm);
+PG_FUNCTION_INFO_V1(nominatim_fdw_stats);
+PG_FUNCTION_INFO_V1(nominatim_fdw_stats_reset);
+PG_FUNCTION_INFO_V1(nominatim_fdw_activity);
+PG_FUNCTION_INFO_V1(nominatim_fdw_recent_requests);
+PG_FUNCTION_INFO_V1(nominatim_fdw_bench);
+PG_FUNCTION_INFO_V1(nominatim_geocode_table);
+
+void _PG_init(void);
+PGDLLEXPORT void nominatim_geocode_worker_main(Datum main_arg);
 
 static Datum CreateDatum(int pgtype, int pgtypmod, char *value);
 static char *GetAttributeValue(Form_pg_attribute att, struct NominatimRecord *place);
 static NominatimFDWState *InitSession(const char *srvname);
+static NominatimFDWState *InitSearchRequest(FunctionCallInfo fcinfo);
+static NominatimFDWState *InitReverseRequest(FunctionCallInfo fcinfo);
+static NominatimFDWState *InitLookupRequest(FunctionCallInfo fcinfo);
+static void ValidateSearchRequest(NominatimFDWState *state);
+static void ValidateReverseRequest(NominatimFDWState *state);
+static HeapTuple CreatePointTuple(TupleDesc tupdesc, NominatimRecord *place);
+static void AdjustRequestToResultType(NominatimFDWState *state, TupleDesc tupdesc);
+static void FetchNextSearchPage(NominatimFDWState *state);
+static HeapTuple CreateRecordTuple(AttInMetadata *attinmeta, NominatimRecord *place);
+static char *GetGeometryValue(Form_pg_attribute att, struct NominatimRecord *place);
+static Datum ExecuteRawRequest(FunctionCallInfo fcinfo, NominatimFDWState *state);
 static size_t WriteMemoryCallback(void *contents, size_t size, size_t nmemb, void *userp);
 static size_t HeaderCallbackFunction(char *contents, size_t size, size_t nmemb, void *userp);
 static void ParseNominatimSearchData(NominatimFDWState *state);
 static void ParseNominatimReverseData(NominatimFDWState *state);
 static int ExecuteRequest(NominatimFDWState *state);
+static int LookupRequest(NominatimFDWState *state, NominatimRequest *req, bool coalesce);
+static int PrepareRequest(NominatimFDWState *state, NominatimRequest *req);
+static void BuildRequestURL(NominatimFDWState *state, StringInfo url);
+static void *ParserAlloc(size_t size, void *arg);
+static void *ParserRealloc(void *ptr, size_t size, void *arg);
+static void CollectRecord(NominatimRecord *place, void *arg);
+static void CheckParserResult(NominatimFDWState *state, int rc);
+static int CompleteRequest(NominatimFDWState *state, NominatimRequest *req, CURLcode res);
+static int SendRequest(NominatimFDWState *state, NominatimRequest *req);
+static char *GetRecordingPath(const char *url);
+static char *ReadRecordingFile(const char *path, size_t *size);
+static void WriteRecordingFile(const char *path, const char *data, size_t size);
+static void RecordResponse(NominatimFDWState *state, NominatimRequest *req);
+static int ReplayRequest(NominatimFDWState *state, NominatimRequest *req);
+static void AppendCaptureInt(StringInfo buf, uint64 value, int bytes);
+static void CaptureRequest(NominatimFDWState *state, NominatimRequest *req, long retries);
+static void RegisterWaitEvents(void);
+static CURLcode PerformRequest(NominatimRequest *req);
+static int ProgressCallback(void *clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow);
+static char *DescribeSlowRequest(NominatimRequest *req, long retries, double *duration);
+static void LogSlowRequest(NominatimFDWState *state, double duration, const char *detail);
 static int CheckURL(char *url);
+static void CollectRequestStats(NominatimRequestStats *stats, NominatimRequest *req);
+static NominatimServerLatency *GetServerLatency(const char *servername);
+static void RecordRequestLatency(const char *servername, double ms);
+static Cost GetRequestCost(const char *servername);
+static double ThrottleDelay(NominatimFDWState *state);
+static void ThrottleRequest(NominatimFDWState *state, NominatimRequest *req);
+static void PrepareRetry(NominatimFDWState *state, NominatimRequest *req);
+static HTAB *GetStatementCache(void);
+static void ForgetStatementCache(void *arg);
+static uint32 StatementCacheHash(const void *key, Size keysize);
+static int StatementCacheMatch(const void *key1, const void *key2, Size keysize);
+static void CacheResponse(const char *url, const char *body, size_t size);
+static void ReleaseRequest(NominatimFDWState *state, NominatimRequest *req);
+static Size SharedStateSize(void);
+static Size SharedCacheAreaSize(void);
+static long SharedCacheMaxEntries(void);
+#if PG_VERSION_NUM >= 150000
+static void nominatim_shmem_request(void);
+#endif
+static void nominatim_shmem_startup(void);
+static dsa_area *GetSharedCacheArea(void);
+static uint64 HashCacheKey(const char *key);
+static void SerializeRecords(StringInfo buf, List *records);
+static List *DeserializeRecords(const char *data);
+static bool SharedCacheLookup(NominatimFDWState *state, const char *key);
+static bool EvictSharedCacheEntry(dsa_area *area);
+static void RemoveSharedCacheEntry(dsa_area *area, NominatimCacheEntry *entry);
+static void SharedCacheStore(NominatimFDWState *state);
+static char *GetCacheTableName(const char *name);
+static bool PersistentCacheLookup(NominatimFDWState *state, const char *url);
+static void PersistentCacheStore(NominatimFDWState *state);
+static void CacheParsedRecords(NominatimFDWState *state);
+static bool AwaitInFlightRequest(const char *key);
+static void ReleaseInFlightRequest(void);
+static void InFlightXactCallback(XactEvent event, void *arg);
+static void InFlightSubXactCallback(SubXactEvent event, SubTransactionId mySubid, SubTransactionId parentSubid, void *arg);
+static void InFlightExitCallback(int code, Datum arg);
+static void ResetServerStats(NominatimServerStats *entry, bool init);
+static NominatimServerStats *GetServerStats(NominatimFDWState *state);
+static void RecordServerStats(NominatimFDWState *state, NominatimRequest *req, long retries);
+static void RecordCacheHit(NominatimFDWState *state);
+static char *RedactURL(const char *url);
+static NominatimActivity *GetActivitySlot(void);
+static void ReportRequestStart(NominatimFDWState *state, NominatimRequest *req);
+static bool CanSeeRequestURL(Oid userid);
+static void ReportRequestRetry(NominatimRequest *req, long attempt);
+static void ReportRequestEnd(NominatimRequest *req, long retries);
+static void ReportRequestIdle(void);
+static void ActivityXactCallback(XactEvent event, void *arg);
+static void ActivityExitCallback(int code, Datum arg);
+static NominatimFDWState *InitCacheMaintenance(text *srvname);
+static void ReleaseBenchHandles(void *arg);
+static void StartBenchRequest(NominatimBench *bench, NominatimBenchSlot *slot, long sample);
+static void FinishBenchRequest(NominatimBench *bench, NominatimBenchSlot *slot, CURLcode res);
+static int CompareLatency(const void *a, const void *b);
+static double LatencyPercentile(NominatimBench *bench, double p);
+static int64 FloorDiv(int64 a, int64 b);
+static char *BuildGeocodeUpdate(const char *relation, const char *keycolumn, const char *schema,
+                                const char *servername, const char *address_expr, ArrayType *targets);
+static Datum GeocodeTableResult(FunctionCallInfo fcinfo, int64 updated);
+#if PG_VERSION_NUM >= 120000
+static Const *GetConstArg(FuncExpr *expr, const char *name);
+static void EstimateFunctionCall(FuncExpr *expr, double *rows, double *requests);
+#endif
 static bool IsPolygonTypeSupported(char *polygon_type);
 static bool IsLayerValid(char *layer);
 static bool IsFeatureTypeValid(char *layer);
+static bool IsPushdownParameter(const char *endpoint, const char *colname);
+static void SetRequestParameter(NominatimFDWState *state, const char *name, char *value);
+static char *GetPushdownCondition(RelOptInfo *baserel, Oid foreigntableid, const char *endpoint, RestrictInfo *rinfo, Expr **value, bool *is_array);
+static bool IsRequestComplete(const char *endpoint, List *param_names);
+static void ClassifyConditions(RelOptInfo *baserel, Oid foreigntableid, const char *endpoint, List *conditions, List **param_names, List **param_exprs, List **local_conds, int *array_param);
+static double EstimateArrayRequests(PlannerInfo *root, Node *array);
+static bool MatchesParameterColumn(PlannerInfo *root, RelOptInfo *baserel, EquivalenceClass *ec, EquivalenceMember *em, void *arg);
+static void AddNominatimPath(PlannerInfo *root, RelOptInfo *baserel, double rows, double requests, Relids required_outer, bool complete);
+static NominatimFDWState *InitScanRequest(ForeignScanState *node);
+static void SetArrayValues(NominatimFDWScanState *fsstate, Datum value);
+static void ValidateScanRequest(NominatimFDWScanState *fsstate, NominatimFDWState *state);
+static void ParseScanRecords(NominatimFDWState *state, int rc);
+static void ParseScanResponse(ForeignScanState *node, NominatimFDWState *state);
+static void ExecuteScanRequest(ForeignScanState *node);
+static void ExecuteArrayRequests(ForeignScanState *node, NominatimFDWState *state);
+static bool StartArrayRequest(NominatimFDWScanState *fsstate, NominatimScanSlot *slot, NominatimFDWState *state);
+static void FinishArrayRequest(NominatimScanSlot *slot, CURLcode res);
+static void ReleaseScanHandles(void *arg);
+static void nominatimGetForeignRelSize(PlannerInfo *root, RelOptInfo *baserel, Oid foreigntableid);
+static void nominatimGetForeignPaths(PlannerInfo *root, RelOptInfo *baserel, Oid foreigntableid);
+static ForeignScan *nominatimGetForeignPlan(PlannerInfo *root, RelOptInfo *baserel, Oid foreigntableid, ForeignPath *best_path, List *tlist, List *scan_clauses, Plan *outer_plan);
+static void nominatimExplainForeignScan(ForeignScanState *node, ExplainState *es);
+static void nominatimBeginForeignScan(ForeignScanState *node, int eflags);
+static TupleTableSlot *nominatimIterateForeignScan(ForeignScanState *node);
+static void nominatimReScanForeignScan(ForeignScanState *node);
+static void nominatimEndForeignScan(ForeignScanState *node);
+static bool nominatimIsForeignScanParallelSafe(PlannerInfo *root, RelOptInfo *rel, RangeTblEntry *rte);
+#ifdef NOMINATIM_ASYNC_SCANS
+static bool nominatimIsForeignPathAsyncCapable(ForeignPath *path);
+static void nominatimForeignAsyncRequest(AsyncRequest *areq);
+static void nominatimForeignAsyncConfigureWait(AsyncRequest *areq);
+static void nominatimForeignAsyncNotify(AsyncRequest *areq);
+static int AsyncSocketCallback(CURL *easy, curl_socket_t s, int what, void *userp, void *socketp);
+static int AsyncTimerCallback(CURLM *multi, long timeout_ms, void *userp);
+static bool SetAsyncTimer(NominatimFDWScanState *fsstate, long timeout_ms);
+static long AsyncResumeDelay(NominatimFDWScanState *fsstate);
+static bool CollectAsyncResponse(ForeignScanState *node);
+static bool ProcessAsyncRequest(ForeignScanState *node);
+static void SendAsyncRequest(ForeignScanState *node);
+static void StartAsyncRequest(ForeignScanState *node);
+static void AbortAsyncRequest(NominatimFDWScanState *fsstate);
+#endif
+
+/*
+ * _PG_init
+ * ----------
+ * Defines the GUCs of nominatim_fdw and, if the library is loaded via
+ * shared_preload_libraries, reserves its shared memory.
+ */
+void _PG_init(void)
+{
+    DefineCustomIntVariable("nominatim_fdw.cache_size",
+                            "Size of the result cache shared by all backends.",
+                            "Requires nominatim_fdw in shared_preload_libraries. 0 disables the cache.",
+                            &cache_size,
+                            0,
+                            0,
+                            MAX_KILOBYTES,
+                            PGC_POSTMASTER,
+                            GUC_UNIT_KB,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    DefineCustomIntVariable("nominatim_fdw.log_min_duration",
+                            "Sets the minimum duration of requests to be logged.",
+                            "Zero logs all requests, -1 disables logging.",
+                            &log_min_duration,
+                            -1,
+                            -1,
+                            INT_MAX,
+                            PGC_SUSET,
+                            GUC_UNIT_MS,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    DefineCustomEnumVariable("nominatim_fdw.transport",
+                             "Sets how requests reach the Nominatim server.",
+                             "live sends them to the server, record also saves the responses to "
+                             "nominatim_fdw.transport_directory and replay answers them from there "
+                             "without contacting the server.",
+                             &transport,
+                             NOMINATIM_TRANSPORT_LIVE,
+                             transport_options,
+                             PGC_SUSET,
+                             0,
+                             NULL,
+                             NULL,
+                             NULL);
+
+    DefineCustomStringVariable("nominatim_fdw.transport_directory",
+                               "Directory of the responses recorded and replayed by nominatim_fdw.transport.",
+                               "Relative paths are relative to the data directory.",
+                               &transport_directory,
+                               "",
+                               PGC_SUSET,
+                               0,
+                               NULL,
+                               NULL,
+                               NULL);
+
+    DefineCustomStringVariable("nominatim_fdw.capture_file",
+                               "File every request sent to a Nominatim server is appended to.",
+                               "Relative paths are relative to the data directory. An empty string disables the capture.",
+                               &capture_file,
+                               "",
+                               PGC_SUSET,
+                               0,
+                               NULL,
+                               NULL,
+                               NULL);
+
+#if PG_VERSION_NUM >= 150000
+    MarkGUCPrefixReserved("nominatim_fdw");
+#else
+    EmitWarningsOnPlaceholders("nominatim_fdw");
+#endif
+
+    if (!process_shared_preload_libraries_in_progress)
+        return;
+
+#if PG_VERSION_NUM >= 150000
+    prev_shmem_request_hook = shmem_request_hook;
+    shmem_request_hook = nominatim_shmem_request;
+#else
+    RequestAddinShmemSpace(SharedStateSize());
+    RequestNamedLWLockTranche("nominatim_fdw", 2);
+#endif
+
+    prev_shmem_startup_hook = shmem_startup_hook;
+    shmem_startup_hook = nominatim_shmem_startup;
+}
 
 Datum nominatim_fdw_handler(PG_FUNCTION_ARGS)
 {
     FdwRoutine *fdwroutine = makeNode(FdwRoutine);
+
+    fdwroutine->GetForeignRelSize = nominatimGetForeignRelSize;
+    fdwroutine->GetForeignPaths = nominatimGetForeignPaths;
+    fdwroutine->GetForeignPlan = nominatimGetForeignPlan;
+    fdwroutine->ExplainForeignScan = nominatimExplainForeignScan;
+    fdwroutine->BeginForeignScan = nominatimBeginForeignScan;
+    fdwroutine->IterateForeignScan = nominatimIterateForeignScan;
+    fdwroutine->ReScanForeignScan = nominatimReScanForeignScan;
+    fdwroutine->EndForeignScan = nominatimEndForeignScan;
+    fdwroutine->IsForeignScanParallelSafe = nominatimIsForeignScanParallelSafe;
+#ifdef NOMINATIM_ASYNC_SCANS
+    fdwroutine->IsForeignPathAsyncCapable = nominatimIsForeignPathAsyncCapable;
+    fdwroutine->ForeignAsyncRequest = nominatimForeignAsyncRequest;
+    fdwroutine->ForeignAsyncConfigureWait = nominatimForeignAsyncConfigureWait;
+    fdwroutine->ForeignAsyncNotify = nominatimForeignAsyncNotify;
+#endif
+
     PG_RETURN_POINTER(fdwroutine);
 }
 
@@ -216,12 +1068,6 @@ Datum nominatim_fdw_validator(PG_FUNCTION_ARGS)
     ListCell *cell;
     struct NominatimFDWOption *opt;
 
-    if (catalog == ForeignTableRelationId)
-        ereport(ERROR,
-                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-                 errmsg("FOREIGN TABLE not supported"),
-                 errhint("The nominatim_fdw does not support FOREIGN TABLE mapping. Use the query functions instead.")));
-
     /* Initialize found state to not found */
     for (opt = valid_options; opt->optname; opt++)
         opt->optfound = false;
@@ -256,6 +1102,33 @@ Datum nominatim_fdw_validator(PG_FUNCTION_ARGS)
                                  errmsg("invalid %s: '%s'", opt->optname, defGetString(def))));
                 }
 
+                if (strcmp(opt->optname, NOMINATIM_TABLE_OPTION_ENDPOINT) == 0 &&
+                    strcmp(defGetString(def), NOMINATIM_REQUEST_SEARCH) != 0 &&
+                    strcmp(defGetString(def), NOMINATIM_REQUEST_REVERSE) != 0 &&
+                    strcmp(defGetString(def), NOMINATIM_REQUEST_LOOKUP) != 0)
+                    ereport(ERROR,
+                            (errcode(ERRCODE_FDW_INVALID_ATTRIBUTE_VALUE),
+                             errmsg("invalid %s: '%s'", def->defname, defGetString(def)),
+                             errhint("expected values are: search, reverse, lookup")));
+
+                if (strcmp(opt->optname, NOMINATIM_SERVER_OPTION_ASYNC) == 0)
+                {
+                    bool async_capable;
+
+                    if (!parse_bool(defGetString(def), &async_capable))
+                        ereport(ERROR,
+                                (errcode(ERRCODE_FDW_INVALID_ATTRIBUTE_VALUE),
+                                 errmsg("invalid %s: '%s'", def->defname, defGetString(def)),
+                                 errhint("expected values are: true, false")));
+                }
+
+                if (strcmp(opt->optname, NOMINATIM_TABLE_OPTION_POLYGON) == 0 &&
+                    !IsPolygonTypeSupported(defGetString(def)))
+                    ereport(ERROR,
+                            (errcode(ERRCODE_FDW_INVALID_ATTRIBUTE_VALUE),
+                             errmsg("invalid %s: '%s'", def->defname, defGetString(def)),
+                             errhint("expected values are: polygon_geojson, polygon_kml, polygon_svg, polygon_text")));
+
                 if (strcmp(opt->optname, NOMINATIM_SERVER_OPTION_CONNECTTIMEOUT) == 0)
                 {
                     char *endptr;
@@ -269,7 +1142,9 @@ Datum nominatim_fdw_validator(PG_FUNCTION_ARGS)
                                  errhint("expected values are positive integers (timeout in seconds)")));
                 }
 
-                if (strcmp(opt->optname, NOMINATIM_SERVER_OPTION_MAXCONNECTRETRY) == 0 || strcmp(opt->optname, NOMINATIM_SERVER_OPTION_MAXREDIRECT) == 0)
+                if (strcmp(opt->optname, NOMINATIM_SERVER_OPTION_MAXCONNECTRETRY) == 0 || strcmp(opt->optname, NOMINATIM_SERVER_OPTION_MAXREDIRECT) == 0 ||
+                    strcmp(opt->optname, NOMINATIM_SERVER_OPTION_CACHE_TTL) == 0 || strcmp(opt->optname, NOMINATIM_SERVER_OPTION_CACHE_NEGATIVE_TTL) == 0 ||
+                    strcmp(opt->optname, NOMINATIM_SERVER_OPTION_REVERSE_GRID) == 0)
                 {
                     char *endptr;
                     char *retry_str = defGetString(def);
@@ -281,6 +1156,32 @@ Datum nominatim_fdw_validator(PG_FUNCTION_ARGS)
                                  errmsg("invalid %s: '%s'", def->defname, retry_str),
                                  errhint("expected values are positive integers")));
                 }
+
+                if (strcmp(opt->optname, NOMINATIM_SERVER_OPTION_MAX_REQUESTS_PER_SECOND) == 0)
+                {
+                    char *endptr;
+                    char *rate_str = defGetString(def);
+                    double rate_val = strtod(rate_str, &endptr);
+
+                    if (rate_str[0] == '\0' || *endptr != '\0' || !(rate_val > 0))
+                        ereport(ERROR,
+                                (errcode(ERRCODE_FDW_INVALID_ATTRIBUTE_VALUE),
+                                 errmsg("invalid %s: '%s'", def->defname, rate_str),
+                                 errhint("expected values are positive numbers (requests per second)")));
+                }
+
+                if (strcmp(opt->optname, NOMINATIM_SERVER_OPTION_MAX_CONCURRENT_REQUESTS) == 0)
+                {
+                    char *endptr;
+                    char *concurrency_str = defGetString(def);
+                    long concurrency_val = strtol(concurrency_str, &endptr, 10);
+
+                    if (concurrency_str[0] == '\0' || *endptr != '\0' || concurrency_val < 1 || concurrency_val > INT_MAX)
+                        ereport(ERROR,
+                                (errcode(ERRCODE_FDW_INVALID_ATTRIBUTE_VALUE),
+                                 errmsg("invalid %s: '%s'", def->defname, concurrency_str),
+                                 errhint("expected values are positive integers (requests sent at once)")));
+                }
             }
         }
 
@@ -315,452 +1216,2933 @@ Datum nominatim_fdw_version(PG_FUNCTION_ARGS)
 }
 
 /*
- * nominatim_fdw_reverse
+ * IsPushdownParameter
  * ----------
- * Reverse geocoding generates an address from a coordinate given as latitude
- * and longitude.
+ * Checks if a column name corresponds to a request parameter of the given
+ * endpoint, so that conditions like "column = value" can be sent to the
+ * server as part of the request URL.
  *
- * returns SETOF NominatimRecord
+ * returns boolean (true: parameter, false: regular column)
  */
-Datum nominatim_fdw_reverse(PG_FUNCTION_ARGS)
+static bool IsPushdownParameter(const char *endpoint, const char *colname)
 {
-    text *srvname_text = PG_GETARG_TEXT_P(0);
-    float8 lon = PG_GETARG_FLOAT8(1);
-    float8 lat = PG_GETARG_FLOAT8(2);
-    int zoom = PG_GETARG_INT32(3);
-    text *layer = PG_GETARG_TEXT_P(4);
-    bool extratags = PG_GETARG_BOOL(5);
-    bool addressdetails = PG_GETARG_BOOL(6);
-    bool namedetails = PG_GETARG_BOOL(7);
-    text *polygon_text = PG_GETARG_TEXT_P(8);
-    text *language_text = PG_GETARG_TEXT_P(9);
-    bool entrances = PG_GETARG_BOOL(10);
-    float8 polygon_threshold = PG_GETARG_FLOAT8(11);
-    text *email_text = PG_GETARG_TEXT_P(12);
+    if (strcmp(endpoint, NOMINATIM_REQUEST_SEARCH) == 0)
+        return (strcmp(colname, "q") == 0 ||
+                strcmp(colname, "amenity") == 0 ||
+                strcmp(colname, "street") == 0 ||
+                strcmp(colname, "city") == 0 ||
+                strcmp(colname, "county") == 0 ||
+                strcmp(colname, "state") == 0 ||
+                strcmp(colname, "country") == 0 ||
+                strcmp(colname, "postalcode") == 0 ||
+                strcmp(colname, "countrycodes") == 0 ||
+                strcmp(colname, "layer") == 0 ||
+                strcmp(colname, "featuretype") == 0 ||
+                strcmp(colname, "viewbox") == 0 ||
+                strcmp(colname, "exclude_place_ids") == 0);
+    else if (strcmp(endpoint, NOMINATIM_REQUEST_REVERSE) == 0)
+        return (strcmp(colname, "lon") == 0 ||
+                strcmp(colname, "lat") == 0 ||
+                strcmp(colname, "zoom") == 0 ||
+                strcmp(colname, "layer") == 0);
+    else if (strcmp(endpoint, NOMINATIM_REQUEST_LOOKUP) == 0)
+        return strcmp(colname, "osm_ids") == 0;
+
+    return false;
+}
 
-    FuncCallContext *funcctx;
-    TupleDesc tupdesc;
+/*
+ * SetRequestParameter
+ * ----------
+ * Sets a request parameter pushed down from a condition of a foreign
+ * table scan.
+ *
+ * state: NominatimFDWState containing all session data
+ * name: parameter (column) name
+ * value: parameter value as text
+ */
+static void SetRequestParameter(NominatimFDWState *state, const char *name, char *value)
+{
+    elog(DEBUG2, "%s: %s = '%s'", __func__, name, value);
+
+    if (strcmp(name, "q") == 0)
+        state->query = value;
+    else if (strcmp(name, "amenity") == 0)
+        state->amenity = value;
+    else if (strcmp(name, "street") == 0)
+        state->street = value;
+    else if (strcmp(name, "city") == 0)
+        state->city = value;
+    else if (strcmp(name, "county") == 0)
+        state->county = value;
+    else if (strcmp(name, "state") == 0)
+        state->state = value;
+    else if (strcmp(name, "country") == 0)
+        state->country = value;
+    else if (strcmp(name, "postalcode") == 0)
+        state->postalcode = value;
+    else if (strcmp(name, "countrycodes") == 0)
+        state->countrycodes = value;
+    else if (strcmp(name, "layer") == 0)
+        state->layer = value;
+    else if (strcmp(name, "featuretype") == 0)
+        state->feature_type = value;
+    else if (strcmp(name, "viewbox") == 0)
+        state->viewbox = value;
+    else if (strcmp(name, "exclude_place_ids") == 0)
+        state->exclude_place_ids = value;
+    else if (strcmp(name, "osm_ids") == 0)
+        state->osm_ids = value;
+    else if (strcmp(name, "lon") == 0)
+        state->lon = strtod(value, NULL);
+    else if (strcmp(name, "lat") == 0)
+        state->lat = strtod(value, NULL);
+    else if (strcmp(name, "zoom") == 0)
+        state->zoom = (int)strtol(value, NULL, 10);
+}
 
-    if (SRF_IS_FIRSTCALL())
+/*
+ * GetPushdownCondition
+ * ----------
+ * Checks if a restriction clause has the form "column = expression", where
+ * column is a request parameter of the endpoint and expression does not
+ * reference the foreign table itself, so that it can be evaluated before the
+ * request is sent. In join clauses the expression references columns of the
+ * outer relations, which are passed to the scan as parameters on every
+ * rescan. Clauses of the form "column = ANY(array)" and "column IN (...)"
+ * can be pushed down as well: the scan then sends one request per element
+ * of the array.
+ *
+ * is_array: set to true if the clause compares the column with an array
+ *
+ * returns the parameter name (and sets *value) or NULL if the clause
+ * cannot be pushed down
+ */
+static char *GetPushdownCondition(RelOptInfo *baserel, Oid foreigntableid, const char *endpoint,
+                                  RestrictInfo *rinfo, Expr **value, bool *is_array)
+{
+    Node *left;
+    Node *right;
+    Var *var;
+    char *opname;
+    char *colname;
+
+    *is_array = false;
+
+    if (IsA(rinfo->clause, OpExpr))
     {
-        MemoryContext oldcontext;
-        NominatimFDWState *state = InitSession(text_to_cstring(srvname_text));
+        OpExpr *op = (OpExpr *)rinfo->clause;
+        Relids other_relids = rinfo->right_relids;
 
-        funcctx = SRF_FIRSTCALL_INIT();
-        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+        if (list_length(op->args) != 2)
+            return NULL;
 
-        if (language_text && strlen(text_to_cstring(language_text)) > 0)
-            state->accept_language = text_to_cstring(language_text);
-
-        state->lon = lon;
-        state->lat = lat;
-        state->zoom = zoom;
-        state->layer = strcmp(text_to_cstring(layer), "") == 0 ? NULL : text_to_cstring(layer);
-        state->polygon_type = text_to_cstring(polygon_text);
-        state->extratags = extratags;
-        state->addressdetails = addressdetails;
-        state->namedetails = namedetails;
-        state->entrances = entrances;
-        state->polygon_threshold = polygon_threshold;
-        state->email = text_to_cstring(email_text);
-        state->request_type = NOMINATIM_REQUEST_REVERSE;
+        opname = get_opname(op->opno);
 
-        if (state->layer && !IsLayerValid(state->layer))
-            ereport(WARNING,
-                    (errcode(ERRCODE_FDW_INVALID_STRING_FORMAT),
-                     errmsg("unrecognised layer '%s'", state->layer),
-                     errhint("Known values are: address, poi, railway, natural, manmade")));
+        if (!opname || strcmp(opname, "=") != 0)
+            return NULL;
 
-        if (state->feature_type && !IsFeatureTypeValid(state->feature_type))
-            ereport(WARNING,
-                    (errmsg("unrecognized featureType '%s'", state->feature_type),
-                     errhint("Known values are: country, state, city, settlement.")));
+        left = (Node *)linitial(op->args);
+        right = (Node *)lsecond(op->args);
 
+        if (IsA(left, RelabelType))
+            left = (Node *)((RelabelType *)left)->arg;
 
-        if (!IsPolygonTypeSupported(state->polygon_type))
-            ereport(ERROR, (errcode(ERRCODE_FDW_INVALID_STRING_FORMAT),
-                            errmsg("invalid polygon type '%s'", state->polygon_type),
-                            errhint("this parameter expects one of the following formats: polygon_geojson, polygon_kml, polygon_svg, polygon_text")));
+        if (IsA(right, RelabelType))
+            right = (Node *)((RelabelType *)right)->arg;
 
-        if (lat < -90.0 || lat > 90.0)
-            ereport(ERROR,
-                    (errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
-                     errmsg("latitude out of range: %f", lat),
-                     errhint("latitude must be between -90 and 90")));
+        /* "expression = column" */
+        if (!IsA(left, Var) && IsA(right, Var))
+        {
+            Node *tmp = left;
 
-        if (lon < -180.0 || lon > 180.0)
-            ereport(ERROR,
-                    (errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
-                     errmsg("longitude out of range: %f", lon),
-                     errhint("longitude must be between -180 and 180")));
+            left = right;
+            right = tmp;
+            other_relids = rinfo->left_relids;
+        }
 
-        elog(DEBUG2, "\n\n\t=== %s ===\n\tlon: '%f'\n\tlat: '%f'\n\tzoom: '%d'\n\tpolygon_type: '%s'\n\tlayer: '%s'\n", __func__,
-             state->lon,
-             state->lat,
-             state->zoom,
-             state->polygon_type,
-             state->layer);
+        if (bms_is_member(baserel->relid, other_relids))
+            return NULL;
+    }
+    else if (IsA(rinfo->clause, ScalarArrayOpExpr))
+    {
+        ScalarArrayOpExpr *op = (ScalarArrayOpExpr *)rinfo->clause;
+        Bitmapset *attrs = NULL;
 
-        ParseNominatimReverseData(state);
+        /* "column = ANY(array)", but not "column = ALL(array)" */
+        if (!op->useOr || list_length(op->args) != 2)
+            return NULL;
 
-        funcctx->user_fctx = state->records;
+        opname = get_opname(op->opno);
 
-        if (state->records)
-            funcctx->max_calls = state->records->length;
+        if (!opname || strcmp(opname, "=") != 0)
+            return NULL;
 
-        elog(DEBUG2, "  %s: number of records retrieved = %ld ", __func__, funcctx->max_calls);
+        left = (Node *)linitial(op->args);
+        right = (Node *)lsecond(op->args);
 
-        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
-            ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-                            errmsg("function returning record called in context that cannot accept type record")));
-        tupdesc = BlessTupleDesc(tupdesc);
+        if (IsA(left, RelabelType))
+            left = (Node *)((RelabelType *)left)->arg;
 
-        funcctx->attinmeta = TupleDescGetAttInMetadata(tupdesc);
+        /* the array must not depend on the foreign table */
+        pull_varattnos(right, baserel->relid, &attrs);
 
-        MemoryContextSwitchTo(oldcontext);
+        if (!bms_is_empty(attrs))
+            return NULL;
+
+        *is_array = true;
     }
+    else
+        return NULL;
 
-    funcctx = SRF_PERCALL_SETUP();
+    if (!IsA(left, Var))
+        return NULL;
 
-    if (funcctx->call_cntr < funcctx->max_calls)
-    {
-        int natts = funcctx->attinmeta->tupdesc->natts;
-        Datum *values = palloc(natts * sizeof(Datum));
-        bool *nulls = palloc(natts * sizeof(bool));
-        HeapTuple tuple;
-        Datum result;
-        NominatimRecord *place =
-            (NominatimRecord *)list_nth((List *)funcctx->user_fctx,
-                                        (int)funcctx->call_cntr);
+    var = (Var *)left;
 
-        memset(nulls, 0, natts * sizeof(bool));
+    if (var->varno != baserel->relid || var->varlevelsup != 0 || var->varattno <= 0)
+        return NULL;
 
-        for (int i = 0; i < natts; i++)
-        {
-            Form_pg_attribute att = TupleDescAttr(funcctx->attinmeta->tupdesc, i);
-            char *value = GetAttributeValue(att, place);
+    if (contain_volatile_functions(right))
+        return NULL;
 
-            if (value)
-                values[i] = CreateDatum(att->atttypid, att->atttypmod, value);
-            else
-                nulls[i] = true;
-
-            elog(DEBUG2, "%s: %s = '%s'", __func__, att->attname.data, value);
-        }
+#if PG_VERSION_NUM >= 110000
+    colname = get_attname(foreigntableid, var->varattno, false);
+#else
+    colname = get_attname(foreigntableid, var->varattno);
+#endif
 
-        elog(DEBUG2, "%s: creating heap tuple", __func__);
+    if (!IsPushdownParameter(endpoint, colname))
+        return NULL;
 
-        tuple = heap_form_tuple(funcctx->attinmeta->tupdesc, values, nulls);
-        result = HeapTupleGetDatum(tuple);
+    *value = (Expr *)right;
 
-        SRF_RETURN_NEXT(funcctx, result);
-    }
-    else
-        SRF_RETURN_DONE(funcctx);
+    return colname;
 }
 
 /*
- * nominatim_fdw_search
+ * IsRequestComplete
  * ----------
- * Look up a location from a textual description or structured address.
+ * Checks if the given request parameters are enough to send a request to
+ * the endpoint: a search needs a free-form or a structured query, a reverse
+ * geocoding a coordinate pair and a lookup a list of OSM ids.
  *
- * returns SETOF NominatimRecord
+ * returns boolean (true: complete, false: the request is doomed to fail)
  */
-Datum nominatim_fdw_search(PG_FUNCTION_ARGS)
+static bool IsRequestComplete(const char *endpoint, List *param_names)
 {
-    text *srvname_text = PG_GETARG_TEXT_P(0);
-    text *query_text = PG_GETARG_TEXT_P(1);
-    text *amenity_text = PG_GETARG_TEXT_P(2);
-    text *street = PG_GETARG_TEXT_P(3);
-    text *city = PG_GETARG_TEXT_P(4);
-    text *county = PG_GETARG_TEXT_P(5);
-    text *tstate = PG_GETARG_TEXT_P(6);
-    text *country = PG_GETARG_TEXT_P(7);
-    text *postalcode = PG_GETARG_TEXT_P(8);
-    bool extratags = PG_GETARG_BOOL(9);
-    bool addressdetails = PG_GETARG_BOOL(10);
-    bool namedetails = PG_GETARG_BOOL(11);
-    text *polygon_text = PG_GETARG_TEXT_P(12);
-    text *language_text = PG_GETARG_TEXT_P(13);
-    text *countrycodes_text = PG_GETARG_TEXT_P(14);
-    text *layer_text = PG_GETARG_TEXT_P(15);
-    text *featuretype_text = PG_GETARG_TEXT_P(16);
-    text *excludeids_text = PG_GETARG_TEXT_P(17);
-    text *viewbox_text = PG_GETARG_TEXT_P(18);
-    bool bounded = PG_GETARG_BOOL(19);
-    float8 polygon_threshold = PG_GETARG_FLOAT8(20);
-    text *email_text = PG_GETARG_TEXT_P(21);
-    bool dedupe = PG_GETARG_BOOL(22);
-    int limit = PG_GETARG_INT32(23);
-    bool entrances = PG_GETARG_BOOL(24);
+    if (strcmp(endpoint, NOMINATIM_REQUEST_REVERSE) == 0)
+        return list_member(param_names, makeString("lon")) &&
+               list_member(param_names, makeString("lat"));
+    else if (strcmp(endpoint, NOMINATIM_REQUEST_LOOKUP) == 0)
+        return list_member(param_names, makeString("osm_ids"));
+
+    return list_member(param_names, makeString("q")) ||
+           list_member(param_names, makeString("amenity")) ||
+           list_member(param_names, makeString("street")) ||
+           list_member(param_names, makeString("city")) ||
+           list_member(param_names, makeString("county")) ||
+           list_member(param_names, makeString("state")) ||
+           list_member(param_names, makeString("country")) ||
+           list_member(param_names, makeString("postalcode"));
+}
 
-    FuncCallContext *funcctx;
-    TupleDesc tupdesc;
-    NominatimFDWState *state;
+/*
+ * ClassifyConditions
+ * ----------
+ * Splits a list of RestrictInfos into conditions sent to the server as
+ * request parameters and conditions checked locally. Only the first
+ * condition on each parameter can be sent to the server. Further ones are
+ * checked locally against the value that was sent, which is what the
+ * parameter column returns. As the scan sends one request per element of
+ * an array, only one "column = ANY(array)" condition can be sent to the
+ * server.
+ *
+ * param_names: parameter names found so far (String), appended to
+ * param_exprs: value expressions of the parameters, appended to
+ * local_conds: RestrictInfos checked locally, appended to
+ * array_param: index in param_names of the array parameter (-1 = none), set
+ *              if an array condition is sent to the server
+ */
+static void ClassifyConditions(RelOptInfo *baserel, Oid foreigntableid, const char *endpoint, List *conditions,
+                               List **param_names, List **param_exprs, List **local_conds, int *array_param)
+{
+    ListCell *cell;
 
-    if (SRF_IS_FIRSTCALL())
+    foreach (cell, conditions)
     {
-        MemoryContext oldcontext;
-        state = InitSession(text_to_cstring(srvname_text));
+        RestrictInfo *rinfo = lfirst_node(RestrictInfo, cell);
+        Expr *value = NULL;
+        bool is_array = false;
+        char *param = GetPushdownCondition(baserel, foreigntableid, endpoint, rinfo, &value, &is_array);
 
-        funcctx = SRF_FIRSTCALL_INIT();
-        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+        if (param && is_array && *array_param >= 0)
+            param = NULL;
 
-        if (language_text && strlen(text_to_cstring(language_text)) > 0)
-            state->accept_language = text_to_cstring(language_text);
-
-        state->query = text_to_cstring(query_text);
-        state->amenity = text_to_cstring(amenity_text);
-        state->street = text_to_cstring(street);
-        state->city = text_to_cstring(city);
-        state->county = text_to_cstring(county);
-        state->state = text_to_cstring(tstate);
-        state->country = text_to_cstring(country);
-        state->postalcode = text_to_cstring(postalcode);
-        state->polygon_type = text_to_cstring(polygon_text);
-        state->countrycodes = text_to_cstring(countrycodes_text);
-        state->layer = text_to_cstring(layer_text);
-        state->feature_type = text_to_cstring(featuretype_text);
-        state->exclude_place_ids = text_to_cstring(excludeids_text);
-        state->viewbox = text_to_cstring(viewbox_text);
-        state->bounded = bounded;
-        state->polygon_threshold = polygon_threshold;
-        state->email = text_to_cstring(email_text);
-        state->dedupe = dedupe;
-        state->extratags = extratags;
-        state->addressdetails = addressdetails;
-        state->namedetails = namedetails;
-        state->limit = limit;
-        state->entrances = entrances;
-        state->request_type = NOMINATIM_REQUEST_SEARCH;
+        if (param && !list_member(*param_names, makeString(param)))
+        {
+            if (is_array)
+                *array_param = list_length(*param_names);
 
-        if (((state->amenity && strlen(state->amenity) > 0) ||
-             (state->street && strlen(state->street) > 0) ||
-             (state->city && strlen(state->city) > 0) ||
-             (state->county && strlen(state->county) > 0) ||
-             (state->state && strlen(state->state) > 0) ||
-             (state->country && strlen(state->country) > 0) ||
-             (state->postalcode && strlen(state->postalcode) > 0)) &&
-            state->query && strlen(state->query) > 0)
-            ereport(ERROR, (errcode(ERRCODE_FDW_ERROR),
-                            errmsg("bad request => structured query parameters (amenity, street, city, county, state, postalcode, country) cannot be used together with 'q' parameter")));
+            *param_names = lappend(*param_names, makeString(param));
 
-        if ((strlen(state->amenity) == 0 && strlen(state->street) == 0 && strlen(state->city) == 0 && strlen(state->county) == 0 && strlen(state->state) == 0 && strlen(state->country) == 0 && strlen(state->postalcode) == 0) &&
-            strlen(state->query) == 0)
-            ereport(ERROR, (errcode(ERRCODE_FDW_ERROR),
-                            errmsg("bad request => nothing to search for."),
-                            errhint("a '%s' request requires either a 'q' (free form parameter) or one of the structured query parameteres (amenity, street, city, county, state, postalcode, country)", __func__)));
+            if (param_exprs)
+                *param_exprs = lappend(*param_exprs, value);
+        }
+        else if (local_conds)
+            *local_conds = lappend(*local_conds, rinfo);
+    }
+}
 
-        if (state->layer && !IsLayerValid(state->layer))
-            ereport(WARNING,
-                    (errcode(ERRCODE_FDW_INVALID_STRING_FORMAT),
-                     errmsg("unrecognised layer '%s'", state->layer),
-                     errhint("Known values are: address, poi, railway, natural, manmade")));
+/*
+ * nominatimGetForeignRelSize
+ * ----------
+ * Splits the restriction clauses into conditions that are sent to the
+ * server as request parameters and conditions that have to be checked
+ * locally, collects the columns needed by the query and estimates the
+ * number of rows returned by the server.
+ */
+static void nominatimGetForeignRelSize(PlannerInfo *root, RelOptInfo *baserel, Oid foreigntableid)
+{
+    NominatimFDWPlanState *fpinfo = (NominatimFDWPlanState *)palloc0(sizeof(NominatimFDWPlanState));
+    ForeignTable *table = GetForeignTable(foreigntableid);
+    ForeignServer *server = GetForeignServer(table->serverid);
+    List *param_exprs = NIL;
+    ListCell *cell;
+    double rows;
 
-        if (state->feature_type && !IsFeatureTypeValid(state->feature_type))
-            ereport(WARNING,
-                    (errmsg("unrecognized featureType '%s'", state->feature_type),
-                     errhint("Known values are: country, state, city, settlement.")));
+    fpinfo->endpoint = NOMINATIM_REQUEST_SEARCH;
+    fpinfo->limit = 0;
+    fpinfo->async_capable = false;
+    fpinfo->request_cost = GetRequestCost(server->servername);
+    fpinfo->array_param = -1;
+    fpinfo->requests = 1;
+    fpinfo->concurrency = NOMINATIM_DEFAULT_CONCURRENT_REQUESTS;
 
-        if (!IsPolygonTypeSupported(state->polygon_type))
-            ereport(ERROR, (errcode(ERRCODE_FDW_INVALID_STRING_FORMAT),
-                            errmsg("invalid polygon type '%s'", state->polygon_type),
-                            errhint("this parameter expects one of the following formats: polygon_geojson, polygon_kml, polygon_svg, polygon_text")));
+    foreach (cell, server->options)
+    {
+        DefElem *def = lfirst_node(DefElem, cell);
 
-        elog(DEBUG2, "\n\n\t=== %s ===\n\tq:'%s'\n\tpolygon_type: '%s'\n", __func__,
-             state->query,
-             state->polygon_type);
+        if (strcmp(def->defname, NOMINATIM_SERVER_OPTION_ASYNC) == 0)
+            fpinfo->async_capable = defGetBoolean(def);
+        else if (strcmp(def->defname, NOMINATIM_SERVER_OPTION_MAX_CONCURRENT_REQUESTS) == 0)
+            fpinfo->concurrency = (int)strtol(defGetString(def), NULL, 10);
+    }
 
-        ParseNominatimSearchData(state);
+    /* table options override the server ones */
+    foreach (cell, table->options)
+    {
+        DefElem *def = lfirst_node(DefElem, cell);
 
-        funcctx->user_fctx = state->records;
+        if (strcmp(def->defname, NOMINATIM_TABLE_OPTION_ENDPOINT) == 0)
+            fpinfo->endpoint = defGetString(def);
+        else if (strcmp(def->defname, NOMINATIM_SERVER_OPTION_ASYNC) == 0)
+            fpinfo->async_capable = defGetBoolean(def);
+    }
 
-        if (state->records)
-            funcctx->max_calls = state->records->length;
+    ClassifyConditions(baserel, foreigntableid, fpinfo->endpoint, baserel->baserestrictinfo,
+                       &fpinfo->param_names, &param_exprs, &fpinfo->local_conds, &fpinfo->array_param);
 
-        elog(DEBUG2, "  %s: number of records retrieved = %ld ", __func__, funcctx->max_calls);
+    if (fpinfo->array_param >= 0)
+        fpinfo->requests = EstimateArrayRequests(root, (Node *)list_nth(param_exprs, fpinfo->array_param));
 
-        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
-            ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-                            errmsg("function returning record called in context that cannot accept type record")));
-        tupdesc = BlessTupleDesc(tupdesc);
+    /* columns needed for the output and for the local conditions */
+    pull_varattnos((Node *)baserel->reltarget->exprs, baserel->relid, &fpinfo->attrs_used);
 
-        funcctx->attinmeta = TupleDescGetAttInMetadata(tupdesc);
+    foreach (cell, fpinfo->local_conds)
+    {
+        RestrictInfo *rinfo = lfirst_node(RestrictInfo, cell);
 
-        MemoryContextSwitchTo(oldcontext);
+        pull_varattnos((Node *)rinfo->clause, baserel->relid, &fpinfo->attrs_used);
     }
 
-    funcctx = SRF_PERCALL_SETUP();
+    /*
+     * A LIMIT can be passed on to the server if this is the only relation in
+     * the query and no condition has to be checked locally, as every record
+     * returned by the server then makes it to the result.
+     */
+    if (strcmp(fpinfo->endpoint, NOMINATIM_REQUEST_SEARCH) == 0 &&
+        root->limit_tuples > 0 &&
+        fpinfo->local_conds == NIL &&
+        root->parse->sortClause == NIL &&
+        bms_membership(root->all_baserels) == BMS_SINGLETON)
+        fpinfo->limit = (int)Min(root->limit_tuples, (double)NOMINATIM_MAX_PAGE_SIZE);
+
+    if (strcmp(fpinfo->endpoint, NOMINATIM_REQUEST_REVERSE) == 0)
+        rows = 1;
+    else if (fpinfo->limit > 0)
+        rows = fpinfo->limit;
+    else
+        rows = NOMINATIM_DEFAULT_RESULT_ROWS;
+
+    baserel->rows = clamp_row_est(rows * fpinfo->requests *
+                                  clauselist_selectivity(root,
+                                                         extract_actual_clauses(fpinfo->local_conds, false),
+                                                         baserel->relid,
+                                                         JOIN_INNER,
+                                                         NULL));
+    fpinfo->rows = rows;
+    baserel->fdw_private = fpinfo;
+}
 
-    if (funcctx->call_cntr < funcctx->max_calls)
-    {
-        int natts = funcctx->attinmeta->tupdesc->natts;
-        Datum *values = palloc(natts * sizeof(Datum));
-        bool *nulls = palloc(natts * sizeof(bool));
-        HeapTuple tuple;
-        Datum result;
-        NominatimRecord *place =
-            (NominatimRecord *)list_nth((List *)funcctx->user_fctx,
-                                        (int)funcctx->call_cntr);
+/*
+ * EstimateArrayRequests
+ * ----------
+ * Estimates the number of requests of a scan sending one request per
+ * element of "column = ANY(array)", as the planner estimates the number of
+ * elements of such conditions.
+ *
+ * array: array expression of the condition
+ *
+ * returns the estimated number of requests (at least 1)
+ */
+static double EstimateArrayRequests(PlannerInfo *root, Node *array)
+{
+#if PG_VERSION_NUM >= 170000
+    return Max(estimate_array_length(root, array), 1);
+#else
+    return Max(estimate_array_length(array), 1);
+#endif
+}
 
-        memset(nulls, 0, natts * sizeof(bool));
+/*
+ * MatchesParameterColumn
+ * ----------
+ * Callback of generate_implied_equalities_for_column: checks if a member of
+ * an equivalence class is a request parameter column of the foreign table.
+ *
+ * returns boolean (true: parameter column, false: other expression)
+ */
+static bool MatchesParameterColumn(PlannerInfo *root, RelOptInfo *baserel, EquivalenceClass *ec,
+                                   EquivalenceMember *em, void *arg)
+{
+    NominatimFDWPlanState *fpinfo = (NominatimFDWPlanState *)baserel->fdw_private;
+    Oid foreigntableid = *(Oid *)arg;
+    Expr *expr = em->em_expr;
+    Var *var;
 
-        for (int i = 0; i < natts; i++)
-        {
-            Form_pg_attribute att = TupleDescAttr(funcctx->attinmeta->tupdesc, i);
-            char *value = GetAttributeValue(att, place);
+    if (IsA(expr, RelabelType))
+        expr = ((RelabelType *)expr)->arg;
 
-            if (value)
-                values[i] = CreateDatum(att->atttypid, att->atttypmod, value);
-            else
-                nulls[i] = true;
-        }
+    if (!IsA(expr, Var))
+        return false;
 
-        tuple = heap_form_tuple(funcctx->attinmeta->tupdesc, values, nulls);
-        result = HeapTupleGetDatum(tuple);
+    var = (Var *)expr;
 
-        SRF_RETURN_NEXT(funcctx, result);
-    }
-    else
-        SRF_RETURN_DONE(funcctx);
+    if (var->varno != baserel->relid || var->varlevelsup != 0 || var->varattno <= 0)
+        return false;
+
+#if PG_VERSION_NUM >= 110000
+    return IsPushdownParameter(fpinfo->endpoint, get_attname(foreigntableid, var->varattno, false));
+#else
+    return IsPushdownParameter(fpinfo->endpoint, get_attname(foreigntableid, var->varattno));
+#endif
 }
 
 /*
- * nominatim_fdw_lookup
+ * AddNominatimPath
  * ----------
- * Query the address and other details of one or multiple OSM objects like node,
- * way or relation.
+ * Adds a ForeignPath to the relation. Each execution of the path costs a
+ * request to the server, which is expensive to start but cheap per returned
+ * row. Scans sending one request per element of an array send up to
+ * max_concurrent_requests of them at once. Paths whose request parameters
+ * are incomplete would fail at runtime, so they are disabled: they are only
+ * used if nothing else is possible, in which case the scan reports what is
+ * missing.
  *
- * returns SETOF NominatimRecord
+ * rows: estimated number of rows returned by the path
+ * requests: estimated number of requests per execution of the path
  */
-Datum nominatim_fdw_lookup(PG_FUNCTION_ARGS)
+static void AddNominatimPath(PlannerInfo *root, RelOptInfo *baserel, double rows, double requests,
+                             Relids required_outer, bool complete)
 {
-    text *srvname_text = PG_GETARG_TEXT_P(0);
-    text *osm_ids_text = PG_GETARG_TEXT_P(1);
-    bool extratags = PG_GETARG_BOOL(2);
-    bool addressdetails = PG_GETARG_BOOL(3);
-    bool namedetails = PG_GETARG_BOOL(4);
-    text *polygon_text = PG_GETARG_TEXT_P(5);
-    bool entrances = PG_GETARG_BOOL(6);
-    text *language_text = PG_GETARG_TEXT_P(7);
-    float8 polygon_threshold = PG_GETARG_FLOAT8(8);
-    text *email_text = PG_GETARG_TEXT_P(9);
+    NominatimFDWPlanState *fpinfo = (NominatimFDWPlanState *)baserel->fdw_private;
+    ForeignPath *path;
+    Cost startup_cost = fpinfo->request_cost * ceil(requests / fpinfo->concurrency);
+    Cost total_cost;
+
+#if PG_VERSION_NUM < 180000
+    if (!complete)
+        startup_cost += disable_cost;
+#endif
 
-    FuncCallContext *funcctx;
-    TupleDesc tupdesc;
-    NominatimFDWState *state;
+    total_cost = startup_cost + fpinfo->rows * requests * cpu_tuple_cost;
 
-    if (SRF_IS_FIRSTCALL())
-    {
-        MemoryContext oldcontext;
-        funcctx = SRF_FIRSTCALL_INIT();
-        state = InitSession(text_to_cstring(srvname_text));
-        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+    path = create_foreignscan_path(root, baserel,
+                                   NULL,
+                                   rows,
+#if PG_VERSION_NUM >= 180000
+                                   complete ? 0 : 1,
+#endif
+                                   startup_cost,
+                                   total_cost,
+                                   NIL,
+                                   required_outer,
+                                   NULL,
+#if PG_VERSION_NUM >= 170000
+                                   NIL,
+#endif
+                                   NIL);
 
-        state->osm_ids = text_to_cstring(osm_ids_text);
+    /*
+     * The scan is not parallel aware: below a Gather, every worker would run
+     * it in full and send the very same requests. Only parameterized scans
+     * may run in workers, as each worker then sends the requests of its own
+     * outer rows.
+     */
+    if (bms_is_empty(required_outer))
+        path->path.parallel_safe = false;
 
-        if (!state->osm_ids || strlen(state->osm_ids) == 0)
-            ereport(ERROR, (errcode(ERRCODE_FDW_ERROR),
-                            errmsg("bad request => nothing to look up."),
-                            errhint("a nominatim lookup request requires the 'osm_ids' parameter (a comma-separated list of OSM ids)")));
+    add_path(baserel, (Path *)path);
+}
 
-        state->extratags = extratags;
-        state->addressdetails = addressdetails;
-        state->namedetails = namedetails;
-        state->polygon_type = text_to_cstring(polygon_text);
-        state->entrances = entrances;
-        state->accept_language = text_to_cstring(language_text);
-        state->polygon_threshold = polygon_threshold;
-        state->email = text_to_cstring(email_text);
-        state->request_type = NOMINATIM_REQUEST_LOOKUP;
+/*
+ * nominatimGetForeignPaths
+ * ----------
+ * Creates the access paths of a nominatim foreign table: the plain scan,
+ * using the restriction clauses of the table, and one parameterized scan
+ * for each set of outer relations whose join clauses provide request
+ * parameters, e.g. "JOIN places p ON p.q = a.full_address". In a nested
+ * loop the parameterized scan sends one request per outer row, instead of
+ * requesting something the join condition would filter out anyway.
+ */
+static void nominatimGetForeignPaths(PlannerInfo *root, RelOptInfo *baserel, Oid foreigntableid)
+{
+    NominatimFDWPlanState *fpinfo = (NominatimFDWPlanState *)baserel->fdw_private;
+    List *candidates = NIL;
+    List *outer_relids = NIL;
+    ListCell *cell;
 
-        if (!IsPolygonTypeSupported(state->polygon_type))
-            ereport(ERROR, (errcode(ERRCODE_FDW_INVALID_STRING_FORMAT),
-                            errmsg("invalid polygon type '%s'", state->polygon_type),
-                            errhint("this parameter expects one of the following formats: polygon_geojson, polygon_kml, polygon_svg, polygon_text")));
+    AddNominatimPath(root, baserel, baserel->rows, fpinfo->requests, baserel->lateral_relids,
+                     IsRequestComplete(fpinfo->endpoint, fpinfo->param_names));
 
-        elog(DEBUG2, "\n\n\t=== %s ===\n\tosm_ids:'%s'\n\tpolygon_type: '%s'\n", __func__,
-             state->osm_ids,
-             state->polygon_type);
+    /* join clauses that can't be merged into equivalence classes */
+    foreach (cell, baserel->joininfo)
+    {
+        RestrictInfo *rinfo = lfirst_node(RestrictInfo, cell);
 
-        ParseNominatimSearchData(state);
+        if (join_clause_is_movable_to(rinfo, baserel))
+            candidates = lappend(candidates, rinfo);
+    }
 
-        funcctx->user_fctx = state->records;
+    /* join clauses derived from equivalence classes, e.g. "p.q = a.full_address" */
+    if (baserel->has_eclass_joins)
+        candidates = list_concat(candidates,
+                                 generate_implied_equalities_for_column(root,
+                                                                        baserel,
+                                                                        MatchesParameterColumn,
+                                                                        (void *)&foreigntableid,
+                                                                        baserel->lateral_referencers));
 
-        if (state->records)
-            funcctx->max_calls = state->records->length;
+    foreach (cell, candidates)
+    {
+        RestrictInfo *rinfo = lfirst_node(RestrictInfo, cell);
+        Relids required_outer;
+        ParamPathInfo *param_info;
+        List *param_names;
+        List *param_exprs = NIL;
+        List *local_conds = NIL;
+        Expr *value;
+        ListCell *lc;
+        double requests = fpinfo->requests;
+        int array_param = fpinfo->array_param;
+        bool is_array;
+        bool seen = false;
+
+        if (!GetPushdownCondition(baserel, foreigntableid, fpinfo->endpoint, rinfo, &value, &is_array))
+            continue;
+
+        required_outer = bms_union(rinfo->clause_relids, baserel->lateral_relids);
+        required_outer = bms_del_member(required_outer, baserel->relid);
+
+        if (bms_is_empty(required_outer))
+            continue;
+
+        foreach (lc, outer_relids)
+        {
+            if (bms_equal((Relids)lfirst(lc), required_outer))
+                seen = true;
+        }
 
-        elog(DEBUG2, "  %s: number of records retrieved = %ld ", __func__, funcctx->max_calls);
+        if (seen)
+            continue;
 
-        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
-            ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-                            errmsg("function returning record called in context that cannot accept type record")));
-        tupdesc = BlessTupleDesc(tupdesc);
+        outer_relids = lappend(outer_relids, required_outer);
 
-        funcctx->attinmeta = TupleDescGetAttInMetadata(tupdesc);
+        /* all join clauses available with these outer relations */
+        param_info = get_baserel_parampathinfo(root, baserel, required_outer);
+        param_names = list_copy(fpinfo->param_names);
 
-        MemoryContextSwitchTo(oldcontext);
+        ClassifyConditions(baserel, foreigntableid, fpinfo->endpoint, param_info->ppi_clauses,
+                           &param_names, &param_exprs, &local_conds, &array_param);
+
+        /* an array taken from the outer relations, e.g. "p.q = ANY(a.addresses)" */
+        if (array_param != fpinfo->array_param)
+            requests = EstimateArrayRequests(root, (Node *)list_nth(param_exprs, array_param - list_length(fpinfo->param_names)));
+
+        AddNominatimPath(root, baserel,
+                         clamp_row_est(fpinfo->rows * requests *
+                                       clauselist_selectivity(root,
+                                                              extract_actual_clauses(list_concat(list_copy(fpinfo->local_conds), local_conds), false),
+                                                              baserel->relid,
+                                                              JOIN_INNER,
+                                                              NULL)),
+                         requests,
+                         required_outer,
+                         IsRequestComplete(fpinfo->endpoint, param_names));
     }
+}
 
-    funcctx = SRF_PERCALL_SETUP();
+/*
+ * nominatimGetForeignPlan
+ * ----------
+ * Creates the ForeignScan plan node. The pushed down conditions are removed
+ * from the local quals, as they are handled by the server, and their value
+ * expressions are stored in fdw_exprs to be evaluated at execution time. In
+ * parameterized scans the join clauses are part of scan_clauses, and the
+ * outer columns they reference are replaced with executor parameters by the
+ * planner.
+ */
+static ForeignScan *nominatimGetForeignPlan(PlannerInfo *root, RelOptInfo *baserel, Oid foreigntableid,
+                                            ForeignPath *best_path, List *tlist, List *scan_clauses,
+                                            Plan *outer_plan)
+{
+    NominatimFDWPlanState *fpinfo = (NominatimFDWPlanState *)baserel->fdw_private;
+    List *param_names = NIL;
+    List *param_exprs = NIL;
+    List *local_conds = NIL;
+    List *local_exprs = NIL;
+    List *retrieved_attrs = NIL;
+    List *fdw_private;
+    ListCell *cell;
+    int fetch_flags = 0;
+    int array_param = -1;
+    bool wholerow = bms_is_member(0 - FirstLowInvalidHeapAttributeNumber, fpinfo->attrs_used);
+    Relation rel;
+    TupleDesc tupdesc;
 
-    if (funcctx->call_cntr < funcctx->max_calls)
+    foreach (cell, scan_clauses)
     {
-        int natts = funcctx->attinmeta->tupdesc->natts;
-        Datum *values = palloc(natts * sizeof(Datum));
-        bool *nulls = palloc(natts * sizeof(bool));
-        HeapTuple tuple;
-        Datum result;
-        NominatimRecord *place = (NominatimRecord *)list_nth((List *)funcctx->user_fctx,
-                                                             (int)funcctx->call_cntr);
+        RestrictInfo *rinfo = lfirst_node(RestrictInfo, cell);
 
-        memset(nulls, 0, natts * sizeof(bool));
+        if (!rinfo->pseudoconstant)
+            local_conds = lappend(local_conds, rinfo);
+    }
 
-        for (int i = 0; i < natts; i++)
-        {
-            Form_pg_attribute att = TupleDescAttr(funcctx->attinmeta->tupdesc, i);
-            char *value = GetAttributeValue(att, place);
+    ClassifyConditions(baserel, foreigntableid, fpinfo->endpoint, local_conds,
+                       &param_names, &param_exprs, &local_exprs, &array_param);
 
-            if (value)
-                values[i] = CreateDatum(att->atttypid, att->atttypmod, value);
-            else
-                nulls[i] = true;
-        }
+    local_exprs = extract_actual_clauses(local_exprs, false);
 
-        tuple = heap_form_tuple(funcctx->attinmeta->tupdesc, values, nulls);
-        result = HeapTupleGetDatum(tuple);
+    /* columns of parameterized join clauses checked locally */
+    pull_varattnos((Node *)local_exprs, baserel->relid, &fpinfo->attrs_used);
 
-        SRF_RETURN_NEXT(funcctx, result);
+    /*
+     * Only columns used in the query are filled, and details, tags and
+     * polygons are only requested if a column needs them.
+     */
+    rel = table_open(foreigntableid, NoLock);
+    tupdesc = RelationGetDescr(rel);
+
+    for (int i = 0; i < tupdesc->natts; i++)
+    {
+        Form_pg_attribute att = TupleDescAttr(tupdesc, i);
+        char *attname = NameStr(att->attname);
+
+        if (att->attisdropped)
+            continue;
+
+        if (!wholerow && !bms_is_member(att->attnum - FirstLowInvalidHeapAttributeNumber, fpinfo->attrs_used))
+            continue;
+
+        retrieved_attrs = lappend_int(retrieved_attrs, att->attnum);
+
+        if (strcmp(attname, "extratags") == 0)
+            fetch_flags |= NOMINATIM_FETCH_EXTRATAGS;
+        else if (strcmp(attname, "namedetails") == 0)
+            fetch_flags |= NOMINATIM_FETCH_NAMEDETAILS;
+        else if (strcmp(attname, "addressdetails") == 0 || strcmp(attname, "addressparts") == 0)
+            fetch_flags |= NOMINATIM_FETCH_ADDRESSDETAILS;
+        else if (strcmp(attname, "entrances") == 0)
+            fetch_flags |= NOMINATIM_FETCH_ENTRANCES;
+        else if (strcmp(attname, "polygon") == 0)
+            fetch_flags |= att->atttypid == TEXTOID ? NOMINATIM_FETCH_POLYGON : NOMINATIM_FETCH_POLYGON_WKT;
     }
-    else
-        SRF_RETURN_DONE(funcctx);
+
+    table_close(rel, NoLock);
+
+    fdw_private = list_make4(makeString(fpinfo->endpoint),
+                             param_names,
+                             makeInteger(fetch_flags),
+                             makeInteger(fpinfo->limit));
+    fdw_private = lappend(fdw_private, retrieved_attrs);
+    fdw_private = lappend(fdw_private, makeInteger(array_param));
+
+    return make_foreignscan(tlist,
+                            local_exprs,
+                            baserel->relid,
+                            param_exprs,
+                            fdw_private,
+                            NIL,
+                            NIL,
+                            outer_plan);
 }
 
 /*
- * GetAttributeValue
+ * nominatimExplainForeignScan
  * ----------
- * Extracts the value of a given attribute and sets the correspondent property
- * in the NominatimRecord struct. It returs NULL in case of no match.
- *
- * att: a Form_pg_attribute attribute
- * place: a NominatimRecord variable
- *
- * returns SETOF NominatimRecord
+ * Adds the endpoint, the pushed down parameters (and the one whose array
+ * elements are sent one by one) and the limit sent to the server to the
+ * EXPLAIN output. EXPLAIN ANALYZE also shows the number of
+ * requests, retries and bytes received, and how the time was spent; with
+ * VERBOSE the URL of the last request.
  */
-static char *GetAttributeValue(Form_pg_attribute att, struct NominatimRecord *place)
+static void nominatimExplainForeignScan(ForeignScanState *node, ExplainState *es)
 {
+    ForeignScan *fsplan = (ForeignScan *)node->ss.ps.plan;
+    char *endpoint = strVal(list_nth(fsplan->fdw_private, NominatimFdwScanPrivateEndpoint));
+    List *param_names = (List *)list_nth(fsplan->fdw_private, NominatimFdwScanPrivateParamNames);
+    int limit = intVal(list_nth(fsplan->fdw_private, NominatimFdwScanPrivateLimit));
+    int array_param = intVal(list_nth(fsplan->fdw_private, NominatimFdwScanPrivateArrayParam));
 
-    if (strcmp(NameStr(att->attname), "osm_id") == 0)
-        return place->osm_id;
-    else if (strcmp(NameStr(att->attname), "osm_type") == 0)
-        return place->osm_type;
-    else if (strcmp(NameStr(att->attname), "ref") == 0)
-        return place->ref;
-    else if (strcmp(NameStr(att->attname), "class") == 0)
-        return place->class;
-    else if (strcmp(NameStr(att->attname), "type") == 0)
-        return place->type;
-    else if (strcmp(NameStr(att->attname), "display_name") == 0)
+    ExplainPropertyText("Nominatim Endpoint", endpoint, es);
+
+    if (param_names != NIL)
+    {
+        StringInfoData buffer;
+        ListCell *cell;
+
+        initStringInfo(&buffer);
+
+        foreach (cell, param_names)
+        {
+            if (buffer.len > 0)
+                appendStringInfoString(&buffer, ", ");
+            appendStringInfoString(&buffer, strVal(lfirst(cell)));
+        }
+
+        ExplainPropertyText("Nominatim Parameters", buffer.data, es);
+    }
+
+    /* one request per element */
+    if (array_param >= 0)
+        ExplainPropertyText("Nominatim Array Parameter", strVal(list_nth(param_names, array_param)), es);
+
+    if (limit > 0)
+        ExplainPropertyText("Nominatim Limit", psprintf("%d", limit), es);
+
+    /* counters of the requests, collected if the scan ran under EXPLAIN ANALYZE */
+    if (es->analyze && node->fdw_state)
+    {
+        NominatimRequestStats *stats = &((NominatimFDWScanState *)node->fdw_state)->stats;
+
+        ExplainPropertyText("Nominatim Requests",
+                            psprintf("%ld, retries: %ld, bytes received: %ld",
+                                     stats->requests, stats->retries, stats->bytes),
+                            es);
+
+        if (es->timing)
+            ExplainPropertyText("Nominatim Time",
+                                psprintf("dns=%.3f connect=%.3f tls=%.3f first_byte=%.3f transfer=%.3f parse=%.3f tuples=%.3f",
+                                         stats->dns_ms, stats->connect_ms, stats->tls_ms, stats->first_byte_ms,
+                                         stats->transfer_ms, stats->parse_ms, stats->tuple_ms),
+                                es);
+
+        if (es->verbose && stats->url && stats->url->len > 0)
+            ExplainPropertyText("Nominatim URL", RedactURL(stats->url->data), es);
+    }
+}
+
+/*
+ * ReleaseScanHandles
+ * ----------
+ * Memory context reset callback releasing the cURL handles of a scan.
+ */
+static void ReleaseScanHandles(void *arg)
+{
+    NominatimFDWScanState *fsstate = (NominatimFDWScanState *)arg;
+
+    for (int i = 0; i < fsstate->concurrency; i++)
+    {
+        NominatimScanSlot *slot = &fsstate->slots[i];
+
+        if (slot->state)
+        {
+            curl_multi_remove_handle(fsstate->multi, slot->curl);
+            curl_slist_free_all(slot->req.headers);
+            slot->state = NULL;
+        }
+
+        if (slot->curl)
+        {
+            curl_easy_cleanup(slot->curl);
+            slot->curl = NULL;
+        }
+    }
+
+    if (fsstate->multi)
+    {
+        if (fsstate->pending)
+        {
+            if (fsstate->sent)
+                curl_multi_remove_handle(fsstate->multi, fsstate->request_async.curl);
+
+            curl_slist_free_all(fsstate->request_async.headers);
+            fsstate->pending = NULL;
+            fsstate->sent = false;
+        }
+
+        curl_multi_cleanup(fsstate->multi);
+        fsstate->multi = NULL;
+    }
+
+    /* after curl_multi_cleanup, which may still remove sockets from the set */
+    if (fsstate->epoll_fd >= 0)
+    {
+        close(fsstate->epoll_fd);
+        fsstate->epoll_fd = -1;
+    }
+
+    if (fsstate->timer_fd >= 0)
+    {
+        close(fsstate->timer_fd);
+        fsstate->timer_fd = -1;
+    }
+
+    if (fsstate->request->curl)
+    {
+        curl_easy_cleanup(fsstate->request->curl);
+        fsstate->request->curl = NULL;
+    }
+}
+
+/*
+ * nominatimBeginForeignScan
+ * ----------
+ * Prepares the request template of the scan: server settings, table options
+ * and the details required by the query. The pushed down parameters are only
+ * evaluated when the scan starts (or restarts), as they may depend on
+ * parameters of the query.
+ */
+static void nominatimBeginForeignScan(ForeignScanState *node, int eflags)
+{
+    ForeignScan *fsplan = (ForeignScan *)node->ss.ps.plan;
+    NominatimFDWScanState *fsstate;
+    ForeignTable *table;
+    ForeignServer *server;
+    MemoryContextCallback *callback;
+    ListCell *cell;
+    int fetch_flags;
+
+    if (eflags & EXEC_FLAG_EXPLAIN_ONLY)
+        return;
+
+    fsstate = (NominatimFDWScanState *)palloc0(sizeof(NominatimFDWScanState));
+    fsstate->epoll_fd = -1;
+    fsstate->timer_fd = -1;
+    node->fdw_state = fsstate;
+
+    table = GetForeignTable(RelationGetRelid(node->ss.ss_currentRelation));
+    server = GetForeignServer(table->serverid);
+
+    fsstate->request = InitSession(server->servername);
+    fsstate->request->request_type = strVal(list_nth(fsplan->fdw_private, NominatimFdwScanPrivateEndpoint));
+    fsstate->request->polygon_type = "";
+    fsstate->request->zoom = -1;
+    fsstate->request->dedupe = true;
+    fsstate->request->query = "";
+    fsstate->request->amenity = "";
+    fsstate->request->street = "";
+    fsstate->request->city = "";
+    fsstate->request->county = "";
+    fsstate->request->state = "";
+    fsstate->request->country = "";
+    fsstate->request->postalcode = "";
+    fsstate->param_names = (List *)list_nth(fsplan->fdw_private, NominatimFdwScanPrivateParamNames);
+    fsstate->param_exprs = ExecInitExprList(fsplan->fdw_exprs, (PlanState *)node);
+    fsstate->param_values = (char **)palloc0(sizeof(char *) * Max(list_length(fsstate->param_names), 1));
+    fsstate->retrieved_attrs = (List *)list_nth(fsplan->fdw_private, NominatimFdwScanPrivateRetrievedAttrs);
+    fsstate->array_param = intVal(list_nth(fsplan->fdw_private, NominatimFdwScanPrivateArrayParam));
+    fsstate->element = -1;
+    fsstate->request->limit = intVal(list_nth(fsplan->fdw_private, NominatimFdwScanPrivateLimit));
+    fsstate->batch_context = AllocSetContextCreate(node->ss.ps.state->es_query_cxt,
+                                                   "nominatim_fdw scan",
+                                                   ALLOCSET_DEFAULT_SIZES);
+
+    /*
+     * Parameterized scans send a request on every rescan, so the cURL handle
+     * is kept for the whole query. It is released together with the query
+     * memory, which also happens if the query fails.
+     */
+    fsstate->request->curl = curl_easy_init();
+    callback = (MemoryContextCallback *)palloc0(sizeof(MemoryContextCallback));
+    callback->func = ReleaseScanHandles;
+    callback->arg = fsstate;
+    MemoryContextRegisterResetCallback(node->ss.ps.state->es_query_cxt, callback);
+
+    /* EXPLAIN ANALYZE */
+    if (node->ss.ps.instrument)
+    {
+        fsstate->stats.url = makeStringInfo();
+        fsstate->request->stats = &fsstate->stats;
+    }
+
+    fetch_flags = intVal(list_nth(fsplan->fdw_private, NominatimFdwScanPrivateFetchFlags));
+    fsstate->request->extratags = (fetch_flags & NOMINATIM_FETCH_EXTRATAGS) != 0;
+    fsstate->request->namedetails = (fetch_flags & NOMINATIM_FETCH_NAMEDETAILS) != 0;
+    fsstate->request->addressdetails = (fetch_flags & NOMINATIM_FETCH_ADDRESSDETAILS) != 0;
+    fsstate->request->entrances = (fetch_flags & NOMINATIM_FETCH_ENTRANCES) != 0;
+
+    foreach (cell, table->options)
+    {
+        DefElem *def = lfirst_node(DefElem, cell);
+
+        if (strcmp(def->defname, NOMINATIM_TABLE_OPTION_POLYGON) == 0 &&
+            (fetch_flags & NOMINATIM_FETCH_POLYGON))
+            fsstate->request->polygon_type = defGetString(def);
+        else if (strcmp(def->defname, NOMINATIM_TABLE_OPTION_EMAIL) == 0)
+            fsstate->request->email = defGetString(def);
+        else if (strcmp(def->defname, NOMINATIM_SERVER_OPTION_LANGUAGE) == 0)
+            fsstate->request->accept_language = defGetString(def);
+    }
+
+    /* geometry columns can only be built from WKT */
+    if ((fetch_flags & NOMINATIM_FETCH_POLYGON_WKT) ||
+        ((fetch_flags & NOMINATIM_FETCH_POLYGON) && strlen(fsstate->request->polygon_type) == 0))
+        fsstate->request->polygon_type = "polygon_text";
+}
+
+/*
+ * InitScanRequest
+ * ----------
+ * Evaluates the pushed down parameters and builds the request of the
+ * current (re)scan out of the template built in BeginForeignScan. The
+ * request and the records retrieved with it live in the batch context of
+ * the scan. The elements of the array of a "column = ANY(array)" condition
+ * are stored in the scan state instead, and the request is the template of
+ * the requests of the elements.
+ *
+ * returns NominatimFDWState ready to be sent to the server or NULL if the
+ * scan cannot return any rows
+ */
+static NominatimFDWState *InitScanRequest(ForeignScanState *node)
+{
+    NominatimFDWScanState *fsstate = (NominatimFDWScanState *)node->fdw_state;
+    ExprContext *econtext = node->ss.ps.ps_ExprContext;
+    NominatimFDWState *state;
+    MemoryContext oldcontext;
+    ListCell *name;
+    ListCell *expr;
+    int i = 0;
+
+    MemoryContextReset(fsstate->batch_context);
+    oldcontext = MemoryContextSwitchTo(fsstate->batch_context);
+
+    state = (NominatimFDWState *)palloc(sizeof(NominatimFDWState));
+    memcpy(state, fsstate->request, sizeof(NominatimFDWState));
+    state->records = NIL;
+
+    fsstate->records = NIL;
+    fsstate->position = 0;
+    fsstate->done = true;
+    fsstate->nelements = 0;
+    fsstate->element = -1;
+
+    forboth(name, fsstate->param_names, expr, fsstate->param_exprs)
+    {
+        ExprState *exprstate = (ExprState *)lfirst(expr);
+        bool isnull;
+        Datum value = ExecEvalExpr(exprstate, econtext, &isnull);
+        Oid typoutput;
+        bool typisvarlena;
+
+        /* "column = NULL" never matches anything, so there is no need to ask */
+        if (isnull)
+        {
+            MemoryContextSwitchTo(oldcontext);
+            return NULL;
+        }
+
+        /* the elements of an array are sent in requests of their own */
+        if (i == fsstate->array_param)
+        {
+            SetArrayValues(fsstate, value);
+            i++;
+            continue;
+        }
+
+        getTypeOutputInfo(exprType((Node *)exprstate->expr), &typoutput, &typisvarlena);
+        fsstate->param_values[i] = OidOutputFunctionCall(typoutput, value);
+        SetRequestParameter(state, strVal(lfirst(name)), fsstate->param_values[i]);
+        i++;
+    }
+
+    /* the requests of the elements are validated once the elements are set */
+    if (fsstate->array_param < 0)
+        ValidateScanRequest(fsstate, state);
+    else if (fsstate->nelements == 0)
+        state = NULL;
+
+    MemoryContextSwitchTo(oldcontext);
+
+    return state;
+}
+
+/*
+ * SetArrayValues
+ * ----------
+ * Stores the elements of the array of a "column = ANY(array)" condition as
+ * text in the scan state. NULL elements never match, and a record matches
+ * the condition only once no matter how often its element appears in the
+ * array, so only the distinct non-null elements are kept.
+ *
+ * value: the array
+ */
+static void SetArrayValues(NominatimFDWScanState *fsstate, Datum value)
+{
+    ArrayType *array = DatumGetArrayTypeP(value);
+    Oid elemtype = ARR_ELEMTYPE(array);
+    int16 typlen;
+    bool typbyval;
+    char typalign;
+    Oid typoutput;
+    bool typisvarlena;
+    Datum *elems;
+    bool *nulls;
+    int nelems;
+    int n = 0;
+
+    get_typlenbyvalalign(elemtype, &typlen, &typbyval, &typalign);
+    getTypeOutputInfo(elemtype, &typoutput, &typisvarlena);
+    deconstruct_array(array, elemtype, typlen, typbyval, typalign, &elems, &nulls, &nelems);
+
+    fsstate->array_values = (char **)palloc(sizeof(char *) * Max(nelems, 1));
+
+    for (int i = 0; i < nelems; i++)
+    {
+        if (!nulls[i])
+            fsstate->array_values[n++] = OidOutputFunctionCall(typoutput, elems[i]);
+    }
+
+    /* sorted, duplicates end up next to each other */
+    if (n > 1)
+    {
+        int distinct = 1;
+
+        qsort(fsstate->array_values, n, sizeof(char *), pg_qsort_strcmp);
+
+        for (int i = 1; i < n; i++)
+        {
+            if (strcmp(fsstate->array_values[i], fsstate->array_values[distinct - 1]) != 0)
+                fsstate->array_values[distinct++] = fsstate->array_values[i];
+        }
+
+        n = distinct;
+    }
+
+    fsstate->nelements = n;
+}
+
+/*
+ * ValidateScanRequest
+ * ----------
+ * Checks that the pushed down parameters are enough to send the request of
+ * a scan to its endpoint, and validates their values.
+ *
+ * state: NominatimFDWState built by InitScanRequest
+ */
+static void ValidateScanRequest(NominatimFDWScanState *fsstate, NominatimFDWState *state)
+{
+    if (strcmp(state->request_type, NOMINATIM_REQUEST_REVERSE) == 0)
+    {
+        if (!list_member(fsstate->param_names, makeString("lon")) ||
+            !list_member(fsstate->param_names, makeString("lat")))
+            ereport(ERROR, (errcode(ERRCODE_FDW_ERROR),
+                            errmsg("bad request => nothing to reverse geocode."),
+                            errhint("a reverse foreign table requires conditions on the 'lon' and 'lat' columns, e.g. WHERE lon = 7.6 AND lat = 51.9")));
+
+        ValidateReverseRequest(state);
+    }
+    else if (strcmp(state->request_type, NOMINATIM_REQUEST_LOOKUP) == 0)
+    {
+        if (!state->osm_ids || strlen(state->osm_ids) == 0)
+            ereport(ERROR, (errcode(ERRCODE_FDW_ERROR),
+                            errmsg("bad request => nothing to look up."),
+                            errhint("a lookup foreign table requires a condition on the 'osm_ids' column, e.g. WHERE osm_ids = 'W121736959'")));
+    }
+    else
+    {
+        if (strlen(state->query) == 0 && strlen(state->amenity) == 0 && strlen(state->street) == 0 &&
+            strlen(state->city) == 0 && strlen(state->county) == 0 && strlen(state->state) == 0 &&
+            strlen(state->country) == 0 && strlen(state->postalcode) == 0)
+            ereport(ERROR, (errcode(ERRCODE_FDW_ERROR),
+                            errmsg("bad request => nothing to search for."),
+                            errhint("a search foreign table requires a condition on 'q' or on one of the structured query columns (amenity, street, city, county, state, postalcode, country)")));
+
+        ValidateSearchRequest(state);
+    }
+}
+
+/*
+ * ParseScanRecords
+ * ----------
+ * Parses the response of a request of a scan into state->records. Records
+ * taken from the shared cache need no parsing.
+ *
+ * state: NominatimFDWState of the request
+ * rc: result of the request
+ */
+static void ParseScanRecords(NominatimFDWState *state, int rc)
+{
+    instr_time start;
+    instr_time duration;
+
+    if (rc == REQUEST_FAIL)
+        elog(ERROR, "%s -> request failed: '%s'", __func__, state->url);
+
+    INSTR_TIME_SET_CURRENT(start);
+
+    if (rc != REQUEST_CACHED)
+    {
+        if (strcmp(state->request_type, NOMINATIM_REQUEST_REVERSE) == 0)
+            ParseNominatimReverseData(state);
+        else
+            ParseNominatimSearchData(state);
+    }
+
+    if (state->stats)
+    {
+        INSTR_TIME_SET_CURRENT(duration);
+        INSTR_TIME_SUBTRACT(duration, start);
+        state->stats->parse_ms += INSTR_TIME_GET_MILLISEC(duration);
+    }
+}
+
+/*
+ * ParseScanResponse
+ * ----------
+ * Parses the response of the request of the current (re)scan and stores
+ * the records in the scan state. If the response hasn't been collected yet
+ * the request is sent right away.
+ *
+ * state: NominatimFDWState built by InitScanRequest
+ */
+static void ParseScanResponse(ForeignScanState *node, NominatimFDWState *state)
+{
+    NominatimFDWScanState *fsstate = (NominatimFDWScanState *)node->fdw_state;
+    MemoryContext oldcontext = MemoryContextSwitchTo(fsstate->batch_context);
+    int rc = REQUEST_SUCCESS;
+
+    /* send the request first, so that its time isn't counted as parsing */
+    if (!state->xmldoc)
+        rc = ExecuteRequest(state);
+
+    ParseScanRecords(state, rc);
+
+    fsstate->records = state->records;
+    fsstate->done = false;
+
+    MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+ * ExecuteScanRequest
+ * ----------
+ * Evaluates the pushed down parameters, sends the request to the server and
+ * stores the parsed records in the scan state.
+ */
+static void ExecuteScanRequest(ForeignScanState *node)
+{
+    NominatimFDWScanState *fsstate = (NominatimFDWScanState *)node->fdw_state;
+    NominatimFDWState *state = InitScanRequest(node);
+
+    if (!state)
+        return;
+
+    if (fsstate->array_param >= 0)
+        ExecuteArrayRequests(node, state);
+    else
+        ParseScanResponse(node, state);
+}
+
+/*
+ * ExecuteArrayRequests
+ * ----------
+ * Sends one request per element of the array of a "column = ANY(array)"
+ * condition, up to max_concurrent_requests of them at once through the
+ * multi handle of the scan, and parses each response into the records of
+ * its element as soon as it arrives. Elements found in the caches are not
+ * sent, and failed requests are retried one at a time by CompleteRequest.
+ * nominatimIterateForeignScan then returns the records element by element.
+ *
+ * state: request template built by InitScanRequest, without the array
+ *        parameter
+ */
+static void ExecuteArrayRequests(ForeignScanState *node, NominatimFDWState *state)
+{
+    NominatimFDWScanState *fsstate = (NominatimFDWScanState *)node->fdw_state;
+    char *name = strVal(list_nth(fsstate->param_names, fsstate->array_param));
+    int concurrency = Min(state->max_concurrent_requests, fsstate->nelements);
+    MemoryContext oldcontext;
+    int next = 0;
+    int busy = 0;
+
+    if (!fsstate->multi)
+    {
+        fsstate->multi = curl_multi_init();
+
+        if (!fsstate->multi)
+            elog(ERROR, "%s -> unable to create cURL multi handle", __func__);
+    }
+
+    /*
+     * The slots live as long as the query, so that their connections are
+     * reused on rescans. Rescans with more elements get more slots.
+     */
+    if (concurrency > fsstate->concurrency)
+    {
+        NominatimScanSlot *slots = (NominatimScanSlot *)MemoryContextAllocZero(node->ss.ps.state->es_query_cxt,
+                                                                               sizeof(NominatimScanSlot) * concurrency);
+
+        if (fsstate->slots)
+        {
+            memcpy(slots, fsstate->slots, sizeof(NominatimScanSlot) * fsstate->concurrency);
+            pfree(fsstate->slots);
+        }
+
+        fsstate->slots = slots;
+        fsstate->concurrency = concurrency;
+    }
+
+    oldcontext = MemoryContextSwitchTo(fsstate->batch_context);
+
+    fsstate->array_requests = (NominatimFDWState **)palloc(sizeof(NominatimFDWState *) * fsstate->nelements);
+
+    for (int i = 0; i < fsstate->nelements; i++)
+    {
+        NominatimFDWState *element = (NominatimFDWState *)palloc(sizeof(NominatimFDWState));
+
+        memcpy(element, state, sizeof(NominatimFDWState));
+        SetRequestParameter(element, name, fsstate->array_values[i]);
+        ValidateScanRequest(fsstate, element);
+        fsstate->array_requests[i] = element;
+    }
+
+    RegisterWaitEvents();
+
+    while (next < fsstate->nelements || busy > 0)
+    {
+        CURLMsg *msg;
+        int running = 0;
+        int msgs;
+        bool finished = false;
+
+        CHECK_FOR_INTERRUPTS();
+
+        /* keep all slots busy, as far as max_requests_per_second allows */
+        for (int i = 0; i < concurrency && next < fsstate->nelements; i++)
+        {
+            if (fsstate->slots[i].state)
+                continue;
+
+            if (busy > 0 && ThrottleDelay(fsstate->array_requests[next]) > 0)
+                break;
+
+            if (StartArrayRequest(fsstate, &fsstate->slots[i], fsstate->array_requests[next++]))
+                busy++;
+        }
+
+        /* all elements so far were answered from the caches */
+        if (busy == 0)
+            continue;
+
+        curl_multi_perform(fsstate->multi, &running);
+
+        while ((msg = curl_multi_info_read(fsstate->multi, &msgs)) != NULL)
+        {
+            NominatimScanSlot *slot = NULL;
+            CURL *easy = msg->easy_handle;
+            CURLcode res = msg->data.result;
+
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+
+            curl_easy_getinfo(easy, CURLINFO_PRIVATE, (char **)&slot);
+            curl_multi_remove_handle(fsstate->multi, easy);
+            FinishArrayRequest(slot, res);
+            busy--;
+            finished = true;
+        }
+
+        if (!finished)
+        {
+            pgstat_report_wait_start(wait_event_response);
+            curl_multi_wait(fsstate->multi, NULL, 0, 100, NULL);
+            pgstat_report_wait_end();
+        }
+    }
+
+    fsstate->done = false;
+
+    MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+ * StartArrayRequest
+ * ----------
+ * Sets up the request of an array element on the cURL handle of a slot and
+ * adds it to the multi handle of the scan, unless it is answered from the
+ * caches or from the recorded responses, in which case its records are
+ * parsed right away. The request is not coalesced with the same request of
+ * other backends, as the scan would stop sending its other elements while
+ * waiting for it.
+ *
+ * slot: idle slot
+ * state: request of the element
+ *
+ * returns boolean (true: request sent, false: already answered)
+ */
+static bool StartArrayRequest(NominatimFDWScanState *fsstate, NominatimScanSlot *slot, NominatimFDWState *state)
+{
+    int rc;
+
+    if (!slot->curl)
+        slot->curl = curl_easy_init();
+
+    if (!slot->curl)
+        elog(ERROR, "%s -> unable to create cURL handle", __func__);
+
+    state->curl = slot->curl;
+
+    if (PrepareRequest(state, &slot->req) != REQUEST_SUCCESS)
+        elog(ERROR, "%s -> request failed: '%s'", __func__, state->url);
+
+    rc = LookupRequest(state, &slot->req, false);
+
+    if (rc == REQUEST_PENDING && transport == NOMINATIM_TRANSPORT_REPLAY)
+        rc = ReplayRequest(state, &slot->req);
+
+    if (rc != REQUEST_PENDING)
+    {
+        ParseScanRecords(state, rc);
+        return false;
+    }
+
+    ThrottleRequest(state, &slot->req);
+    ReportRequestStart(state, &slot->req);
+
+    curl_easy_setopt(slot->curl, CURLOPT_PRIVATE, (void *)slot);
+    curl_multi_add_handle(fsstate->multi, slot->curl);
+    slot->state = state;
+
+    return true;
+}
+
+/*
+ * FinishArrayRequest
+ * ----------
+ * Collects the response of the request of an array element and parses it
+ * into the records of the element.
+ *
+ * slot: slot of the request, already removed from the multi handle
+ * res: result of the request
+ */
+static void FinishArrayRequest(NominatimScanSlot *slot, CURLcode res)
+{
+    NominatimFDWState *state = slot->state;
+
+    slot->state = NULL;
+
+    ParseScanRecords(state, CompleteRequest(state, &slot->req, res));
+}
+
+/*
+ * nominatimIterateForeignScan
+ * ----------
+ * Returns the next record retrieved from the server. The request is sent
+ * when the first record is requested.
+ */
+static TupleTableSlot *nominatimIterateForeignScan(ForeignScanState *node)
+{
+    NominatimFDWScanState *fsstate = (NominatimFDWScanState *)node->fdw_state;
+    TupleTableSlot *slot = node->ss.ss_ScanTupleSlot;
+    TupleDesc tupdesc = slot->tts_tupleDescriptor;
+    MemoryContext oldcontext;
+    NominatimRecord *place;
+    ListCell *cell;
+    instr_time start;
+    instr_time duration;
+
+    ExecClearTuple(slot);
+
+    if (!fsstate->executed)
+    {
+        ExecuteScanRequest(node);
+        fsstate->executed = true;
+    }
+
+    /* scans of an array return the records of one element after the other */
+    while (fsstate->array_param >= 0 && !fsstate->done &&
+           fsstate->position >= list_length(fsstate->records) &&
+           fsstate->element + 1 < fsstate->nelements)
+    {
+        fsstate->element++;
+        fsstate->records = fsstate->array_requests[fsstate->element]->records;
+        fsstate->position = 0;
+        fsstate->param_values[fsstate->array_param] = fsstate->array_values[fsstate->element];
+    }
+
+    if (fsstate->done || fsstate->position >= list_length(fsstate->records))
+        return slot;
+
+    place = (NominatimRecord *)list_nth(fsstate->records, fsstate->position++);
+
+    if (fsstate->request->stats)
+        INSTR_TIME_SET_CURRENT(start);
+
+    /* the datums live until the next tuple is fetched */
+    oldcontext = MemoryContextSwitchTo(node->ss.ps.ps_ExprContext->ecxt_per_tuple_memory);
+
+    memset(slot->tts_isnull, true, tupdesc->natts * sizeof(bool));
+
+    foreach (cell, fsstate->retrieved_attrs)
+    {
+        int attnum = lfirst_int(cell);
+        Form_pg_attribute att = TupleDescAttr(tupdesc, attnum - 1);
+        char *value = NULL;
+        bool is_param = false;
+        ListCell *name;
+        int i = 0;
+
+        /*
+         * Parameter columns return the value sent to the server, also if the
+         * record has an attribute of the same name (lon and lat of reverse
+         * tables, exclude_place_ids of search tables): their conditions were
+         * removed from the local quals, so the rows must satisfy them.
+         */
+        foreach (name, fsstate->param_names)
+        {
+            if (strcmp(strVal(lfirst(name)), NameStr(att->attname)) == 0)
+            {
+                value = fsstate->param_values[i];
+                is_param = true;
+                break;
+            }
+            i++;
+        }
+
+        if (!is_param)
+            value = GetAttributeValue(att, place);
+
+        if (value)
+        {
+            slot->tts_values[attnum - 1] = CreateDatum(att->atttypid, att->atttypmod, value);
+            slot->tts_isnull[attnum - 1] = false;
+        }
+    }
+
+    MemoryContextSwitchTo(oldcontext);
+
+    if (fsstate->request->stats)
+    {
+        INSTR_TIME_SET_CURRENT(duration);
+        INSTR_TIME_SUBTRACT(duration, start);
+        fsstate->stats.tuple_ms += INSTR_TIME_GET_MILLISEC(duration);
+    }
+
+    return ExecStoreVirtualTuple(slot);
+}
+
+/*
+ * nominatimReScanForeignScan
+ * ----------
+ * Sends the request again in the next iteration if the values of the
+ * pushed down parameters may have changed, e.g. on every outer row of a
+ * parameterized nested loop. Otherwise the records already retrieved are
+ * returned again.
+ */
+static void nominatimReScanForeignScan(ForeignScanState *node)
+{
+    NominatimFDWScanState *fsstate = (NominatimFDWScanState *)node->fdw_state;
+
+#ifdef NOMINATIM_ASYNC_SCANS
+    if (fsstate->pending)
+    {
+        AbortAsyncRequest(fsstate);
+        fsstate->executed = false;
+        return;
+    }
+#endif
+
+    if (node->ss.ps.chgParam != NULL)
+        fsstate->executed = false;
+    else if (fsstate->array_param >= 0)
+    {
+        fsstate->records = NIL;
+        fsstate->position = 0;
+        fsstate->element = -1;
+    }
+    else
+        fsstate->position = 0;
+}
+
+static void nominatimEndForeignScan(ForeignScanState *node)
+{
+    NominatimFDWScanState *fsstate = (NominatimFDWScanState *)node->fdw_state;
+
+    if (!fsstate)
+        return;
+
+#ifdef NOMINATIM_ASYNC_SCANS
+    AbortAsyncRequest(fsstate);
+#endif
+    MemoryContextDelete(fsstate->batch_context);
+}
+
+/*
+ * nominatimIsForeignScanParallelSafe
+ * ----------
+ * Foreign scans don't depend on any state of the leader: every process
+ * sends its own requests with its own cURL handle. This allows scans in
+ * parallel plans, e.g. a parameterized scan on the inner side of a nested
+ * loop over a Parallel Seq Scan, in which every worker sends the requests
+ * of the outer rows it scans. Scans are not parallel aware, so the paths
+ * of unparameterized scans are marked as not parallel safe in
+ * AddNominatimPath.
+ */
+static bool nominatimIsForeignScanParallelSafe(PlannerInfo *root, RelOptInfo *rel, RangeTblEntry *rte)
+{
+    return true;
+}
+
+#ifdef NOMINATIM_ASYNC_SCANS
+/*
+ * nominatimIsForeignPathAsyncCapable
+ * ----------
+ * Foreign scans can run asynchronously if the 'async_capable' option is set
+ * in the server or in the foreign table, so that an Append over several
+ * foreign tables (e.g. a UNION ALL over regional Nominatim servers) waits
+ * for all requests at once instead of sending them one after another.
+ */
+static bool nominatimIsForeignPathAsyncCapable(ForeignPath *path)
+{
+    NominatimFDWPlanState *fpinfo = (NominatimFDWPlanState *)path->path.parent->fdw_private;
+
+    return fpinfo->async_capable;
+}
+
+/*
+ * AsyncSocketCallback
+ * ----------
+ * cURL socket callback: keeps every socket of the request in progress in
+ * the epoll set of the scan, with the events cURL waits for. A request may
+ * use several sockets at once, e.g. while racing IPv4 and IPv6 connections
+ * or after a redirect.
+ */
+static int AsyncSocketCallback(CURL *easy, curl_socket_t s, int what, void *userp, void *socketp)
+{
+    NominatimFDWScanState *fsstate = (NominatimFDWScanState *)userp;
+    struct epoll_event event;
+
+    memset(&event, 0, sizeof(event));
+    event.data.fd = s;
+
+    if (what == CURL_POLL_REMOVE)
+    {
+        /* a socket already closed has left the set by itself */
+        epoll_ctl(fsstate->epoll_fd, EPOLL_CTL_DEL, s, &event);
+        return 0;
+    }
+
+    event.events = ((what & CURL_POLL_IN) ? EPOLLIN : 0) |
+                   ((what & CURL_POLL_OUT) ? EPOLLOUT : 0);
+
+    if (epoll_ctl(fsstate->epoll_fd, EPOLL_CTL_MOD, s, &event) != 0 &&
+        (errno != ENOENT || epoll_ctl(fsstate->epoll_fd, EPOLL_CTL_ADD, s, &event) != 0))
+        return -1;
+
+    return 0;
+}
+
+/*
+ * AsyncTimerCallback
+ * ----------
+ * cURL timer callback: arms the timer of the scan with cURL's timeout, so
+ * that cURL gets to run its timeouts (connect_timeout, name resolution) even
+ * if none of the sockets becomes ready. While the request waits to be sent
+ * the timer belongs to that wait instead.
+ */
+static int AsyncTimerCallback(CURLM *multi, long timeout_ms, void *userp)
+{
+    NominatimFDWScanState *fsstate = (NominatimFDWScanState *)userp;
+
+    if (!fsstate->sent)
+        return 0;
+
+    return SetAsyncTimer(fsstate, timeout_ms) ? 0 : -1;
+}
+
+/*
+ * SetAsyncTimer
+ * ----------
+ * Arms the timer of the scan, which is part of its epoll set.
+ *
+ * timeout_ms: milliseconds until the timer fires (-1 = disarm)
+ *
+ * returns boolean (false: the timer could not be set)
+ */
+static bool SetAsyncTimer(NominatimFDWScanState *fsstate, long timeout_ms)
+{
+    struct itimerspec spec;
+
+    memset(&spec, 0, sizeof(spec));
+
+    if (timeout_ms >= 0)
+    {
+        spec.it_value.tv_sec = timeout_ms / 1000;
+        spec.it_value.tv_nsec = (timeout_ms % 1000) * 1000000L;
+
+        /* a zero value disarms the timer, but cURL means "right away" */
+        if (timeout_ms == 0)
+            spec.it_value.tv_nsec = 1;
+    }
+
+    return timerfd_settime(fsstate->timer_fd, 0, &spec, NULL) == 0;
+}
+
+/*
+ * AsyncResumeDelay
+ * ----------
+ * Milliseconds until the request in progress may be sent: after the pause
+ * following a failed attempt, and as soon as max_requests_per_second allows.
+ */
+static long AsyncResumeDelay(NominatimFDWScanState *fsstate)
+{
+    long secs;
+    int usecs;
+    long delay = (long)ceil(ThrottleDelay(fsstate->pending));
+
+    TimestampDifference(GetCurrentTimestamp(), fsstate->resume_at, &secs, &usecs);
+
+    return Max(delay, secs * 1000 + (usecs + 999) / 1000);
+}
+
+/*
+ * CollectAsyncResponse
+ * ----------
+ * Checks if the request in progress is finished. Failed attempts are sent
+ * again after a pause, up to max_retries times, without blocking the other
+ * subplans. Once the request is finished its response is parsed into the
+ * records of the scan.
+ *
+ * returns boolean (true: request finished, false: still in progress)
+ */
+static bool CollectAsyncResponse(ForeignScanState *node)
+{
+    NominatimFDWScanState *fsstate = (NominatimFDWScanState *)node->fdw_state;
+    NominatimFDWState *state = fsstate->pending;
+    MemoryContext oldcontext;
+    CURLMsg *msg;
+    CURLcode res = CURLE_OK;
+    bool finished = false;
+    int msgs;
+
+    while ((msg = curl_multi_info_read(fsstate->multi, &msgs)) != NULL)
+    {
+        if (msg->msg == CURLMSG_DONE)
+        {
+            res = msg->data.result;
+            finished = true;
+        }
+    }
+
+    if (!finished)
+        return false;
+
+    curl_multi_remove_handle(fsstate->multi, fsstate->request_async.curl);
+    fsstate->sent = false;
+
+    if (res != CURLE_OK && fsstate->request_async.retries < state->max_retries)
+    {
+        PrepareRetry(state, &fsstate->request_async);
+        fsstate->resume_at = TimestampTzPlusMilliseconds(GetCurrentTimestamp(), NOMINATIM_RETRY_PAUSE_MS);
+
+        if (!SetAsyncTimer(fsstate, AsyncResumeDelay(fsstate)))
+            elog(ERROR, "%s -> unable to set timer: %m", __func__);
+
+        return false;
+    }
+
+    fsstate->pending = NULL;
+
+    oldcontext = MemoryContextSwitchTo(fsstate->batch_context);
+
+    if (CompleteRequest(state, &fsstate->request_async, res) != REQUEST_SUCCESS)
+        elog(ERROR, "%s -> request failed: '%s'", __func__, state->url);
+
+    MemoryContextSwitchTo(oldcontext);
+
+    ParseScanResponse(node, state);
+
+    return true;
+}
+
+/*
+ * ProcessAsyncRequest
+ * ----------
+ * Lets cURL process the sockets of the request in progress that are ready,
+ * and its timeout if the timer fired. A request waiting to be sent is sent
+ * once its timer fires. Never waits: the executor waits on the epoll set of
+ * the scan together with the other subplans.
+ *
+ * returns boolean (true: request finished, false: still in progress)
+ */
+static bool ProcessAsyncRequest(ForeignScanState *node)
+{
+    NominatimFDWScanState *fsstate = (NominatimFDWScanState *)node->fdw_state;
+    struct epoll_event events[NOMINATIM_ASYNC_MAX_EVENTS];
+    bool timeout = false;
+    int running = 0;
+    int nevents;
+
+    nevents = epoll_wait(fsstate->epoll_fd, events, NOMINATIM_ASYNC_MAX_EVENTS, 0);
+
+    if (nevents < 0 && errno != EINTR)
+        elog(ERROR, "%s -> epoll_wait failed: %m", __func__);
+
+    for (int i = 0; i < nevents; i++)
+    {
+        if (events[i].data.fd == fsstate->timer_fd)
+        {
+            uint64 expirations;
+
+            if (read(fsstate->timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+                elog(ERROR, "%s -> unable to read timer: %m", __func__);
+
+            timeout = true;
+        }
+        else if (fsstate->sent)
+            curl_multi_socket_action(fsstate->multi, events[i].data.fd,
+                                     ((events[i].events & EPOLLIN) ? CURL_CSELECT_IN : 0) |
+                                         ((events[i].events & EPOLLOUT) ? CURL_CSELECT_OUT : 0) |
+                                         ((events[i].events & (EPOLLERR | EPOLLHUP)) ? CURL_CSELECT_ERR : 0),
+                                     &running);
+    }
+
+    if (timeout && fsstate->sent)
+        curl_multi_socket_action(fsstate->multi, CURL_SOCKET_TIMEOUT, 0, &running);
+    else if (timeout)
+    {
+        long delay = AsyncResumeDelay(fsstate);
+
+        if (delay > 0)
+        {
+            if (!SetAsyncTimer(fsstate, delay))
+                elog(ERROR, "%s -> unable to set timer: %m", __func__);
+
+            return false;
+        }
+
+        SendAsyncRequest(node);
+    }
+
+    if (!fsstate->sent)
+        return false;
+
+    return CollectAsyncResponse(node);
+}
+
+/*
+ * SendAsyncRequest
+ * ----------
+ * Adds the request in progress (or its next attempt) to the multi handle
+ * and lets cURL start it.
+ */
+static void SendAsyncRequest(ForeignScanState *node)
+{
+    NominatimFDWScanState *fsstate = (NominatimFDWScanState *)node->fdw_state;
+    int running = 0;
+
+    if (fsstate->request_async.retries > 0)
+        ReportRequestRetry(&fsstate->request_async, fsstate->request_async.retries + 1);
+    else
+    {
+        /* AsyncResumeDelay is over, so this does not wait */
+        ThrottleRequest(fsstate->pending, &fsstate->request_async);
+        ReportRequestStart(fsstate->pending, &fsstate->request_async);
+    }
+
+    curl_multi_add_handle(fsstate->multi, fsstate->request_async.curl);
+    fsstate->sent = true;
+
+    curl_multi_socket_action(fsstate->multi, CURL_SOCKET_TIMEOUT, 0, &running);
+}
+
+/*
+ * StartAsyncRequest
+ * ----------
+ * Builds the request of the current (re)scan and sends it with the multi
+ * handle of the scan, instead of waiting for the response. If the server's
+ * max_requests_per_second does not allow it yet, the request is sent once
+ * the timer of the scan fires.
+ */
+static void StartAsyncRequest(ForeignScanState *node)
+{
+    NominatimFDWScanState *fsstate = (NominatimFDWScanState *)node->fdw_state;
+    NominatimFDWState *state = InitScanRequest(node);
+    MemoryContext oldcontext;
+    long delay;
+
+    fsstate->executed = true;
+
+    /* nothing to ask the server */
+    if (!state)
+        return;
+
+    if (!fsstate->multi)
+    {
+        struct epoll_event event;
+
+        fsstate->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+        if (fsstate->epoll_fd < 0)
+            elog(ERROR, "%s -> unable to create epoll set: %m", __func__);
+
+        fsstate->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+        if (fsstate->timer_fd < 0)
+            elog(ERROR, "%s -> unable to create timer: %m", __func__);
+
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.fd = fsstate->timer_fd;
+
+        if (epoll_ctl(fsstate->epoll_fd, EPOLL_CTL_ADD, fsstate->timer_fd, &event) != 0)
+            elog(ERROR, "%s -> unable to add timer to epoll set: %m", __func__);
+
+        fsstate->multi = curl_multi_init();
+
+        if (!fsstate->multi)
+            elog(ERROR, "%s -> unable to create cURL multi handle", __func__);
+
+        curl_multi_setopt(fsstate->multi, CURLMOPT_SOCKETFUNCTION, AsyncSocketCallback);
+        curl_multi_setopt(fsstate->multi, CURLMOPT_SOCKETDATA, fsstate);
+        curl_multi_setopt(fsstate->multi, CURLMOPT_TIMERFUNCTION, AsyncTimerCallback);
+        curl_multi_setopt(fsstate->multi, CURLMOPT_TIMERDATA, fsstate);
+    }
+
+    oldcontext = MemoryContextSwitchTo(fsstate->batch_context);
+
+    if (PrepareRequest(state, &fsstate->request_async) != REQUEST_SUCCESS)
+        elog(ERROR, "%s -> request failed: '%s'", __func__, state->url);
+
+    MemoryContextSwitchTo(oldcontext);
+
+    fsstate->pending = state;
+    fsstate->sent = false;
+    fsstate->resume_at = 0;
+
+    delay = AsyncResumeDelay(fsstate);
+
+    if (delay > 0)
+    {
+        if (!SetAsyncTimer(fsstate, delay))
+            elog(ERROR, "%s -> unable to set timer: %m", __func__);
+
+        return;
+    }
+
+    SendAsyncRequest(node);
+
+    /* the request may be over already, e.g. if the connection was refused */
+    CollectAsyncResponse(node);
+}
+
+/*
+ * AbortAsyncRequest
+ * ----------
+ * Cancels the request in progress, e.g. if the scan is restarted before its
+ * response arrived.
+ */
+static void AbortAsyncRequest(NominatimFDWScanState *fsstate)
+{
+    if (!fsstate->pending)
+        return;
+
+    if (activity_chunk == &fsstate->request_async.chunk)
+        ReportRequestIdle();
+
+    if (fsstate->sent)
+        curl_multi_remove_handle(fsstate->multi, fsstate->request_async.curl);
+
+    curl_slist_free_all(fsstate->request_async.headers);
+    fsstate->request_async.headers = NULL;
+    fsstate->pending = NULL;
+    fsstate->sent = false;
+
+    SetAsyncTimer(fsstate, -1);
+}
+
+/*
+ * nominatimForeignAsyncRequest
+ * ----------
+ * Returns the next record of the scan, or tells the executor to wait if
+ * the response hasn't arrived yet. The request is sent when the first
+ * record is requested.
+ */
+static void nominatimForeignAsyncRequest(AsyncRequest *areq)
+{
+    ForeignScanState *node = (ForeignScanState *)areq->requestee;
+    NominatimFDWScanState *fsstate = (NominatimFDWScanState *)node->fdw_state;
+
+    /* recorded and replayed requests, and the elements of arrays, are sent synchronously */
+    if (!fsstate->executed && transport == NOMINATIM_TRANSPORT_LIVE && fsstate->array_param < 0)
+        StartAsyncRequest(node);
+
+    if (fsstate->pending)
+        ExecAsyncRequestPending(areq);
+    else
+        ExecAsyncRequestDone(areq, nominatimIterateForeignScan(node));
+}
+
+/*
+ * nominatimForeignAsyncConfigureWait
+ * ----------
+ * Adds the epoll set of the scan to the events the executor waits on: it
+ * becomes readable when a socket of the request in progress is ready or
+ * when the timer of the scan fires.
+ */
+static void nominatimForeignAsyncConfigureWait(AsyncRequest *areq)
+{
+    ForeignScanState *node = (ForeignScanState *)areq->requestee;
+    NominatimFDWScanState *fsstate = (NominatimFDWScanState *)node->fdw_state;
+    AppendState *requestor = (AppendState *)areq->requestor;
+
+    Assert(areq->callback_pending);
+
+    if (fsstate->pending)
+        AddWaitEventToSet(requestor->as_eventset, WL_SOCKET_READABLE, fsstate->epoll_fd, NULL, areq);
+}
+
+/*
+ * nominatimForeignAsyncNotify
+ * ----------
+ * Processes the sockets and the timer of the request in progress and
+ * returns the first record once the response has been parsed.
+ */
+static void nominatimForeignAsyncNotify(AsyncRequest *areq)
+{
+    ForeignScanState *node = (ForeignScanState *)areq->requestee;
+    NominatimFDWScanState *fsstate = (NominatimFDWScanState *)node->fdw_state;
+
+    if (fsstate->pending && !ProcessAsyncRequest(node))
+    {
+        ExecAsyncRequestPending(areq);
+        return;
+    }
+
+    ExecAsyncRequestDone(areq, nominatimIterateForeignScan(node));
+}
+#endif
+
+/*
+ * InitReverseRequest
+ * ----------
+ * Loads the arguments of a reverse call into a new NominatimFDWState and
+ * validates them. The argument list is shared by nominatim_reverse and its
+ * variants, so they all go through this function.
+ *
+ * fcinfo: call info of the SQL function
+ *
+ * returns NominatimFDWState ready to be sent to the server
+ */
+static NominatimFDWState *InitReverseRequest(FunctionCallInfo fcinfo)
+{
+    text *srvname_text = PG_GETARG_TEXT_P(0);
+    float8 lon = PG_GETARG_FLOAT8(1);
+    float8 lat = PG_GETARG_FLOAT8(2);
+    int zoom = PG_GETARG_INT32(3);
+    text *layer = PG_GETARG_TEXT_P(4);
+    bool extratags = PG_GETARG_BOOL(5);
+    bool addressdetails = PG_GETARG_BOOL(6);
+    bool namedetails = PG_GETARG_BOOL(7);
+    text *polygon_text = PG_GETARG_TEXT_P(8);
+    text *language_text = PG_GETARG_TEXT_P(9);
+    bool entrances = PG_GETARG_BOOL(10);
+    float8 polygon_threshold = PG_GETARG_FLOAT8(11);
+    text *email_text = PG_GETARG_TEXT_P(12);
+    NominatimFDWState *state = InitSession(text_to_cstring(srvname_text));
+
+    if (language_text && strlen(text_to_cstring(language_text)) > 0)
+        state->accept_language = text_to_cstring(language_text);
+
+    state->lon = lon;
+    state->lat = lat;
+    state->zoom = zoom;
+    state->layer = strcmp(text_to_cstring(layer), "") == 0 ? NULL : text_to_cstring(layer);
+    state->polygon_type = text_to_cstring(polygon_text);
+    state->extratags = extratags;
+    state->addressdetails = addressdetails;
+    state->namedetails = namedetails;
+    state->entrances = entrances;
+    state->polygon_threshold = polygon_threshold;
+    state->email = text_to_cstring(email_text);
+    state->request_type = NOMINATIM_REQUEST_REVERSE;
+    state->cached = func_volatile(fcinfo->flinfo->fn_oid) != PROVOLATILE_VOLATILE;
+
+    ValidateReverseRequest(state);
+
+    return state;
+}
+
+/*
+ * ValidateReverseRequest
+ * ----------
+ * Checks the parameters of a reverse request before it is sent to the
+ * server, so that requests doomed to fail are rejected locally.
+ *
+ * state: NominatimFDWState containing all session data
+ */
+static void ValidateReverseRequest(NominatimFDWState *state)
+{
+    if (state->layer && !IsLayerValid(state->layer))
+        ereport(WARNING,
+                (errcode(ERRCODE_FDW_INVALID_STRING_FORMAT),
+                 errmsg("unrecognised layer '%s'", state->layer),
+                 errhint("Known values are: address, poi, railway, natural, manmade")));
+
+    if (state->feature_type && !IsFeatureTypeValid(state->feature_type))
+        ereport(WARNING,
+                (errmsg("unrecognized featureType '%s'", state->feature_type),
+                 errhint("Known values are: country, state, city, settlement.")));
+
+
+    if (!IsPolygonTypeSupported(state->polygon_type))
+        ereport(ERROR, (errcode(ERRCODE_FDW_INVALID_STRING_FORMAT),
+                        errmsg("invalid polygon type '%s'", state->polygon_type),
+                        errhint("this parameter expects one of the following formats: polygon_geojson, polygon_kml, polygon_svg, polygon_text")));
+
+    if (state->lat < -90.0 || state->lat > 90.0)
+        ereport(ERROR,
+                (errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+                 errmsg("latitude out of range: %f", state->lat),
+                 errhint("latitude must be between -90 and 90")));
+
+    if (state->lon < -180.0 || state->lon > 180.0)
+        ereport(ERROR,
+                (errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+                 errmsg("longitude out of range: %f", state->lon),
+                 errhint("longitude must be between -180 and 180")));
+
+    elog(DEBUG2, "\n\n\t=== %s ===\n\tlon: '%f'\n\tlat: '%f'\n\tzoom: '%d'\n\tpolygon_type: '%s'\n\tlayer: '%s'\n", __func__,
+         state->lon,
+         state->lat,
+         state->zoom,
+         state->polygon_type,
+         state->layer);
+}
+
+/*
+ * InitSearchRequest
+ * ----------
+ * Loads the arguments of a search call into a new NominatimFDWState and
+ * validates them. The argument list is shared by nominatim_search and its
+ * variants, so they all go through this function.
+ *
+ * fcinfo: call info of the SQL function
+ *
+ * returns NominatimFDWState ready to be sent to the server
+ */
+static NominatimFDWState *InitSearchRequest(FunctionCallInfo fcinfo)
+{
+    text *srvname_text = PG_GETARG_TEXT_P(0);
+    text *query_text = PG_GETARG_TEXT_P(1);
+    text *amenity_text = PG_GETARG_TEXT_P(2);
+    text *street = PG_GETARG_TEXT_P(3);
+    text *city = PG_GETARG_TEXT_P(4);
+    text *county = PG_GETARG_TEXT_P(5);
+    text *tstate = PG_GETARG_TEXT_P(6);
+    text *country = PG_GETARG_TEXT_P(7);
+    text *postalcode = PG_GETARG_TEXT_P(8);
+    bool extratags = PG_GETARG_BOOL(9);
+    bool addressdetails = PG_GETARG_BOOL(10);
+    bool namedetails = PG_GETARG_BOOL(11);
+    text *polygon_text = PG_GETARG_TEXT_P(12);
+    text *language_text = PG_GETARG_TEXT_P(13);
+    text *countrycodes_text = PG_GETARG_TEXT_P(14);
+    text *layer_text = PG_GETARG_TEXT_P(15);
+    text *featuretype_text = PG_GETARG_TEXT_P(16);
+    text *excludeids_text = PG_GETARG_TEXT_P(17);
+    text *viewbox_text = PG_GETARG_TEXT_P(18);
+    bool bounded = PG_GETARG_BOOL(19);
+    float8 polygon_threshold = PG_GETARG_FLOAT8(20);
+    text *email_text = PG_GETARG_TEXT_P(21);
+    bool dedupe = PG_GETARG_BOOL(22);
+    int limit = PG_GETARG_INT32(23);
+    bool entrances = PG_GETARG_BOOL(24);
+    NominatimFDWState *state = InitSession(text_to_cstring(srvname_text));
+
+    if (language_text && strlen(text_to_cstring(language_text)) > 0)
+        state->accept_language = text_to_cstring(language_text);
+
+    state->query = text_to_cstring(query_text);
+    state->amenity = text_to_cstring(amenity_text);
+    state->street = text_to_cstring(street);
+    state->city = text_to_cstring(city);
+    state->county = text_to_cstring(county);
+    state->state = text_to_cstring(tstate);
+    state->country = text_to_cstring(country);
+    state->postalcode = text_to_cstring(postalcode);
+    state->polygon_type = text_to_cstring(polygon_text);
+    state->countrycodes = text_to_cstring(countrycodes_text);
+    state->layer = text_to_cstring(layer_text);
+    state->feature_type = text_to_cstring(featuretype_text);
+    state->exclude_place_ids = text_to_cstring(excludeids_text);
+    state->viewbox = text_to_cstring(viewbox_text);
+    state->bounded = bounded;
+    state->polygon_threshold = polygon_threshold;
+    state->email = text_to_cstring(email_text);
+    state->dedupe = dedupe;
+    state->extratags = extratags;
+    state->addressdetails = addressdetails;
+    state->namedetails = namedetails;
+    state->limit = limit;
+    state->entrances = entrances;
+    state->request_type = NOMINATIM_REQUEST_SEARCH;
+    state->cached = func_volatile(fcinfo->flinfo->fn_oid) != PROVOLATILE_VOLATILE;
+
+    ValidateSearchRequest(state);
+
+    return state;
+}
+
+/*
+ * ValidateSearchRequest
+ * ----------
+ * Checks the parameters of a search request before it is sent to the
+ * server, so that requests doomed to fail are rejected locally.
+ *
+ * state: NominatimFDWState containing all session data
+ */
+static void ValidateSearchRequest(NominatimFDWState *state)
+{
+    if (((state->amenity && strlen(state->amenity) > 0) ||
+         (state->street && strlen(state->street) > 0) ||
+         (state->city && strlen(state->city) > 0) ||
+         (state->county && strlen(state->county) > 0) ||
+         (state->state && strlen(state->state) > 0) ||
+         (state->country && strlen(state->country) > 0) ||
+         (state->postalcode && strlen(state->postalcode) > 0)) &&
+        state->query && strlen(state->query) > 0)
+        ereport(ERROR, (errcode(ERRCODE_FDW_ERROR),
+                        errmsg("bad request => structured query parameters (amenity, street, city, county, state, postalcode, country) cannot be used together with 'q' parameter")));
+
+    if ((strlen(state->amenity) == 0 && strlen(state->street) == 0 && strlen(state->city) == 0 && strlen(state->county) == 0 && strlen(state->state) == 0 && strlen(state->country) == 0 && strlen(state->postalcode) == 0) &&
+        strlen(state->query) == 0)
+        ereport(ERROR, (errcode(ERRCODE_FDW_ERROR),
+                        errmsg("bad request => nothing to search for."),
+                        errhint("a 'nominatim_fdw_search' request requires either a 'q' (free form parameter) or one of the structured query parameteres (amenity, street, city, county, state, postalcode, country)")));
+
+    if (state->layer && !IsLayerValid(state->layer))
+        ereport(WARNING,
+                (errcode(ERRCODE_FDW_INVALID_STRING_FORMAT),
+                 errmsg("unrecognised layer '%s'", state->layer),
+                 errhint("Known values are: address, poi, railway, natural, manmade")));
+
+    if (state->feature_type && !IsFeatureTypeValid(state->feature_type))
+        ereport(WARNING,
+                (errmsg("unrecognized featureType '%s'", state->feature_type),
+                 errhint("Known values are: country, state, city, settlement.")));
+
+    if (!IsPolygonTypeSupported(state->polygon_type))
+        ereport(ERROR, (errcode(ERRCODE_FDW_INVALID_STRING_FORMAT),
+                        errmsg("invalid polygon type '%s'", state->polygon_type),
+                        errhint("this parameter expects one of the following formats: polygon_geojson, polygon_kml, polygon_svg, polygon_text")));
+
+    elog(DEBUG2, "\n\n\t=== %s ===\n\tq:'%s'\n\tpolygon_type: '%s'\n", __func__,
+         state->query,
+         state->polygon_type);
+}
+
+/*
+ * InitLookupRequest
+ * ----------
+ * Loads the arguments of a lookup call into a new NominatimFDWState and
+ * validates them. The argument list is shared by nominatim_lookup and its
+ * variants, so they all go through this function.
+ *
+ * fcinfo: call info of the SQL function
+ *
+ * returns NominatimFDWState ready to be sent to the server
+ */
+static NominatimFDWState *InitLookupRequest(FunctionCallInfo fcinfo)
+{
+    text *srvname_text = PG_GETARG_TEXT_P(0);
+    text *osm_ids_text = PG_GETARG_TEXT_P(1);
+    bool extratags = PG_GETARG_BOOL(2);
+    bool addressdetails = PG_GETARG_BOOL(3);
+    bool namedetails = PG_GETARG_BOOL(4);
+    text *polygon_text = PG_GETARG_TEXT_P(5);
+    bool entrances = PG_GETARG_BOOL(6);
+    text *language_text = PG_GETARG_TEXT_P(7);
+    float8 polygon_threshold = PG_GETARG_FLOAT8(8);
+    text *email_text = PG_GETARG_TEXT_P(9);
+    NominatimFDWState *state = InitSession(text_to_cstring(srvname_text));
+
+    state->osm_ids = text_to_cstring(osm_ids_text);
+
+    if (!state->osm_ids || strlen(state->osm_ids) == 0)
+        ereport(ERROR, (errcode(ERRCODE_FDW_ERROR),
+                        errmsg("bad request => nothing to look up."),
+                        errhint("a nominatim lookup request requires the 'osm_ids' parameter (a comma-separated list of OSM ids)")));
+
+    state->extratags = extratags;
+    state->addressdetails = addressdetails;
+    state->namedetails = namedetails;
+    state->polygon_type = text_to_cstring(polygon_text);
+    state->entrances = entrances;
+    state->accept_language = text_to_cstring(language_text);
+    state->polygon_threshold = polygon_threshold;
+    state->email = text_to_cstring(email_text);
+    state->request_type = NOMINATIM_REQUEST_LOOKUP;
+    state->cached = func_volatile(fcinfo->flinfo->fn_oid) != PROVOLATILE_VOLATILE;
+
+    if (!IsPolygonTypeSupported(state->polygon_type))
+        ereport(ERROR, (errcode(ERRCODE_FDW_INVALID_STRING_FORMAT),
+                        errmsg("invalid polygon type '%s'", state->polygon_type),
+                        errhint("this parameter expects one of the following formats: polygon_geojson, polygon_kml, polygon_svg, polygon_text")));
+
+    elog(DEBUG2, "\n\n\t=== %s ===\n\tosm_ids:'%s'\n\tpolygon_type: '%s'\n", __func__,
+         state->osm_ids,
+         state->polygon_type);
+
+    return state;
+}
+
+/*
+ * nominatim_fdw_reverse
+ * ----------
+ * Reverse geocoding generates an address from a coordinate given as latitude
+ * and longitude.
+ *
+ * returns SETOF NominatimRecord
+ */
+Datum nominatim_fdw_reverse(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+    TupleDesc tupdesc;
+
+    if (SRF_IS_FIRSTCALL())
+    {
+        MemoryContext oldcontext;
+        NominatimFDWState *state;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        state = InitReverseRequest(fcinfo);
+
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+            ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                            errmsg("function returning record called in context that cannot accept type record")));
+        tupdesc = BlessTupleDesc(tupdesc);
+
+        AdjustRequestToResultType(state, tupdesc);
+
+        ParseNominatimReverseData(state);
+
+        funcctx->user_fctx = state->records;
+
+        if (state->records)
+            funcctx->max_calls = state->records->length;
+
+        elog(DEBUG2, "  %s: number of records retrieved = %ld ", __func__, funcctx->max_calls);
+
+        funcctx->attinmeta = TupleDescGetAttInMetadata(tupdesc);
+
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+
+    if (funcctx->call_cntr < funcctx->max_calls)
+    {
+        int natts = funcctx->attinmeta->tupdesc->natts;
+        Datum *values = palloc(natts * sizeof(Datum));
+        bool *nulls = palloc(natts * sizeof(bool));
+        HeapTuple tuple;
+        Datum result;
+        NominatimRecord *place =
+            (NominatimRecord *)list_nth((List *)funcctx->user_fctx,
+                                        (int)funcctx->call_cntr);
+
+        memset(nulls, 0, natts * sizeof(bool));
+
+        for (int i = 0; i < natts; i++)
+        {
+            Form_pg_attribute att = TupleDescAttr(funcctx->attinmeta->tupdesc, i);
+            char *value = GetAttributeValue(att, place);
+
+            if (value)
+                values[i] = CreateDatum(att->atttypid, att->atttypmod, value);
+            else
+                nulls[i] = true;
+
+            elog(DEBUG2, "%s: %s = '%s'", __func__, att->attname.data, value);
+        }
+
+        elog(DEBUG2, "%s: creating heap tuple", __func__);
+
+        tuple = heap_form_tuple(funcctx->attinmeta->tupdesc, values, nulls);
+        result = HeapTupleGetDatum(tuple);
+
+        SRF_RETURN_NEXT(funcctx, result);
+    }
+    else
+        SRF_RETURN_DONE(funcctx);
+}
+
+/*
+ * nominatim_fdw_search
+ * ----------
+ * Look up a location from a textual description or structured address.
+ *
+ * returns SETOF NominatimRecord
+ */
+Datum nominatim_fdw_search(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+    TupleDesc tupdesc;
+    NominatimFDWState *state;
+
+    if (SRF_IS_FIRSTCALL())
+    {
+        MemoryContext oldcontext;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        state = InitSearchRequest(fcinfo);
+
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+            ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                            errmsg("function returning record called in context that cannot accept type record")));
+        tupdesc = BlessTupleDesc(tupdesc);
+
+        AdjustRequestToResultType(state, tupdesc);
+
+        ParseNominatimSearchData(state);
+
+        funcctx->user_fctx = state->records;
+
+        if (state->records)
+            funcctx->max_calls = state->records->length;
+
+        elog(DEBUG2, "  %s: number of records retrieved = %ld ", __func__, funcctx->max_calls);
+
+        funcctx->attinmeta = TupleDescGetAttInMetadata(tupdesc);
+
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+
+    if (funcctx->call_cntr < funcctx->max_calls)
+    {
+        int natts = funcctx->attinmeta->tupdesc->natts;
+        Datum *values = palloc(natts * sizeof(Datum));
+        bool *nulls = palloc(natts * sizeof(bool));
+        HeapTuple tuple;
+        Datum result;
+        NominatimRecord *place =
+            (NominatimRecord *)list_nth((List *)funcctx->user_fctx,
+                                        (int)funcctx->call_cntr);
+
+        memset(nulls, 0, natts * sizeof(bool));
+
+        for (int i = 0; i < natts; i++)
+        {
+            Form_pg_attribute att = TupleDescAttr(funcctx->attinmeta->tupdesc, i);
+            char *value = GetAttributeValue(att, place);
+
+            if (value)
+                values[i] = CreateDatum(att->atttypid, att->atttypmod, value);
+            else
+                nulls[i] = true;
+        }
+
+        tuple = heap_form_tuple(funcctx->attinmeta->tupdesc, values, nulls);
+        result = HeapTupleGetDatum(tuple);
+
+        SRF_RETURN_NEXT(funcctx, result);
+    }
+    else
+        SRF_RETURN_DONE(funcctx);
+}
+
+/*
+ * nominatim_fdw_lookup
+ * ----------
+ * Query the address and other details of one or multiple OSM objects like node,
+ * way or relation.
+ *
+ * returns SETOF NominatimRecord
+ */
+Datum nominatim_fdw_lookup(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+    TupleDesc tupdesc;
+    NominatimFDWState *state;
+
+    if (SRF_IS_FIRSTCALL())
+    {
+        MemoryContext oldcontext;
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        state = InitLookupRequest(fcinfo);
+
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+            ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                            errmsg("function returning record called in context that cannot accept type record")));
+        tupdesc = BlessTupleDesc(tupdesc);
+
+        AdjustRequestToResultType(state, tupdesc);
+
+        ParseNominatimSearchData(state);
+
+        funcctx->user_fctx = state->records;
+
+        if (state->records)
+            funcctx->max_calls = state->records->length;
+
+        elog(DEBUG2, "  %s: number of records retrieved = %ld ", __func__, funcctx->max_calls);
+
+        funcctx->attinmeta = TupleDescGetAttInMetadata(tupdesc);
+
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+
+    if (funcctx->call_cntr < funcctx->max_calls)
+    {
+        int natts = funcctx->attinmeta->tupdesc->natts;
+        Datum *values = palloc(natts * sizeof(Datum));
+        bool *nulls = palloc(natts * sizeof(bool));
+        HeapTuple tuple;
+        Datum result;
+        NominatimRecord *place = (NominatimRecord *)list_nth((List *)funcctx->user_fctx,
+                                                             (int)funcctx->call_cntr);
+
+        memset(nulls, 0, natts * sizeof(bool));
+
+        for (int i = 0; i < natts; i++)
+        {
+            Form_pg_attribute att = TupleDescAttr(funcctx->attinmeta->tupdesc, i);
+            char *value = GetAttributeValue(att, place);
+
+            if (value)
+                values[i] = CreateDatum(att->atttypid, att->atttypmod, value);
+            else
+                nulls[i] = true;
+        }
+
+        tuple = heap_form_tuple(funcctx->attinmeta->tupdesc, values, nulls);
+        result = HeapTupleGetDatum(tuple);
+
+        SRF_RETURN_NEXT(funcctx, result);
+    }
+    else
+        SRF_RETURN_DONE(funcctx);
+}
+
+/*
+ * nominatim_fdw_search_paged
+ * ----------
+ * Same as nominatim_fdw_search, but instead of a single request it keeps
+ * fetching pages of NOMINATIM_MAX_PAGE_SIZE results on demand, passing the
+ * place ids of the previous pages in 'exclude_place_ids', until the server
+ * has no further results, 'limit_result' records have been returned or the
+ * caller stops asking for rows.
+ *
+ * returns SETOF NominatimRecord
+ */
+Datum nominatim_fdw_search_paged(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+    NominatimFDWState *state;
+
+    if (SRF_IS_FIRSTCALL())
+    {
+        MemoryContext oldcontext;
+        TupleDesc tupdesc;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        state = InitSearchRequest(fcinfo);
+
+        /* in paging mode 'limit_result' limits the total number of records */
+        state->max_records = state->limit;
+        state->page_context = AllocSetContextCreate(funcctx->multi_call_memory_ctx,
+                                                    "nominatim_fdw page",
+                                                    ALLOCSET_DEFAULT_SIZES);
+
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+            ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                            errmsg("function returning record called in context that cannot accept type record")));
+        tupdesc = BlessTupleDesc(tupdesc);
+
+        AdjustRequestToResultType(state, tupdesc);
+
+        funcctx->attinmeta = TupleDescGetAttInMetadata(tupdesc);
+        funcctx->user_fctx = state;
+
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+    state = (NominatimFDWState *)funcctx->user_fctx;
+
+    while (state->page_position >= list_length(state->records) && !state->exhausted)
+    {
+        MemoryContext oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        FetchNextSearchPage(state);
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    if (state->page_position < list_length(state->records))
+    {
+        NominatimRecord *place = (NominatimRecord *)list_nth(state->records,
+                                                             state->page_position++);
+        HeapTuple tuple = CreateRecordTuple(funcctx->attinmeta, place);
+
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+    else
+        SRF_RETURN_DONE(funcctx);
+}
+
+/*
+ * FetchNextSearchPage
+ * ----------
+ * Requests the next page of a paged search. The records of the previous
+ * page are discarded, and the place ids returned by the server in
+ * 'exclude_place_ids' are used to exclude the places already returned
+ * from the next request. The search is marked as exhausted once the
+ * server returns less records than requested, the total limit is reached
+ * or the server stops extending the list of excluded place ids.
+ *
+ * state: NominatimFDWState containing all session data
+ */
+static void FetchNextSearchPage(NominatimFDWState *state)
+{
+    MemoryContext oldcontext;
+    NominatimRecord *last;
+    char *exclude_place_ids;
+    int page_size = NOMINATIM_MAX_PAGE_SIZE;
+
+    if (state->max_records > 0)
+        page_size = Min(page_size, state->max_records - state->fetched);
+
+    /* records of the previous page are no longer needed */
+    MemoryContextReset(state->page_context);
+    state->records = NIL;
+    state->page_position = 0;
+    state->limit = page_size;
+
+    oldcontext = MemoryContextSwitchTo(state->page_context);
+    ParseNominatimSearchData(state);
+    MemoryContextSwitchTo(oldcontext);
+
+    state->pages++;
+    state->fetched += list_length(state->records);
+
+    elog(DEBUG1, "%s: page %ld, %d records (%ld in total)", __func__,
+         state->pages, list_length(state->records), state->fetched);
+
+    if (list_length(state->records) < page_size ||
+        (state->max_records > 0 && state->fetched >= state->max_records))
+    {
+        state->exhausted = true;
+        return;
+    }
+
+    /*
+     * The exclude_place_ids returned by the server contains the place ids of
+     * this page and the ones we excluded in this request. If it is missing,
+     * we build it ourselves.
+     */
+    last = (NominatimRecord *)llast(state->records);
+
+    if (last->exclude_place_ids && strlen(last->exclude_place_ids) > 0)
+        exclude_place_ids = pstrdup(last->exclude_place_ids);
+    else
+    {
+        StringInfoData buffer;
+        ListCell *cell;
+
+        initStringInfo(&buffer);
+
+        if (state->exclude_place_ids && strlen(state->exclude_place_ids) > 0)
+            appendStringInfoString(&buffer, state->exclude_place_ids);
+
+        foreach (cell, state->records)
+        {
+            NominatimRecord *place = (NominatimRecord *)lfirst(cell);
+
+            if (!place->place_id)
+                continue;
+
+            if (buffer.len > 0)
+                appendStringInfoChar(&buffer, ',');
+
+            appendStringInfoString(&buffer, place->place_id);
+        }
+
+        exclude_place_ids = buffer.data;
+    }
+
+    /* nothing new to exclude, so the next page would be the same as this one */
+    if (state->exclude_place_ids && strcmp(exclude_place_ids, state->exclude_place_ids) == 0)
+        state->exhausted = true;
+
+    state->exclude_place_ids = exclude_place_ids;
+}
+
+/*
+ * CreateRecordTuple
+ * ----------
+ * Creates a tuple of the function's result type out of a parsed
+ * NominatimRecord, matching the attributes by name.
+ *
+ * attinmeta: attribute metadata of the function's result type
+ * place: a NominatimRecord variable
+ *
+ * returns HeapTuple
+ */
+static HeapTuple CreateRecordTuple(AttInMetadata *attinmeta, NominatimRecord *place)
+{
+    int natts = attinmeta->tupdesc->natts;
+    Datum *values = palloc(natts * sizeof(Datum));
+    bool *nulls = palloc(natts * sizeof(bool));
+
+    memset(nulls, 0, natts * sizeof(bool));
+
+    for (int i = 0; i < natts; i++)
+    {
+        Form_pg_attribute att = TupleDescAttr(attinmeta->tupdesc, i);
+        char *value = GetAttributeValue(att, place);
+
+        if (value)
+            values[i] = CreateDatum(att->atttypid, att->atttypmod, value);
+        else
+            nulls[i] = true;
+    }
+
+    return heap_form_tuple(attinmeta->tupdesc, values, nulls);
+}
+
+/*
+ * ExecuteRawRequest
+ * ----------
+ * Sends the request described in state to the server and returns the
+ * response body as it is, without parsing it into records. The response
+ * format depends on the declared return type of the calling function:
+ * jsonb functions request 'jsonv2' and xml functions request 'xml'.
+ *
+ * fcinfo: call info of the SQL function
+ * state: NominatimFDWState containing all session data
+ *
+ * returns a jsonb or xml Datum
+ */
+static Datum ExecuteRawRequest(FunctionCallInfo fcinfo, NominatimFDWState *state)
+{
+    Oid rettype = get_fn_expr_rettype(fcinfo->flinfo);
+
+    if (rettype == JSONBOID)
+        state->format = NOMINATIM_FORMAT_JSONV2;
+    else if (rettype == XMLOID)
+        state->format = NOMINATIM_FORMAT_XML;
+    else
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("unsupported return type for raw nominatim request: %s", format_type_be(rettype)),
+                 errhint("raw requests can only return jsonb or xml")));
+
+    state->raw = true;
+
+    if (ExecuteRequest(state) != REQUEST_SUCCESS)
+        elog(ERROR, "%s -> request failed: '%s'", __func__, state->url);
+
+    if (rettype == JSONBOID)
+        return DirectFunctionCall1(jsonb_in, CStringGetDatum(state->raw_response));
+
+    return DirectFunctionCall1(xml_in, CStringGetDatum(state->raw_response));
+}
+
+/*
+ * nominatim_fdw_reverse_raw / nominatim_fdw_search_raw / nominatim_fdw_lookup_raw
+ * ----------
+ * Same as their SETOF counterparts, but return the unparsed response
+ * body as a single jsonb or xml value.
+ */
+Datum nominatim_fdw_reverse_raw(PG_FUNCTION_ARGS)
+{
+    NominatimFDWState *state = InitReverseRequest(fcinfo);
+
+    PG_RETURN_DATUM(ExecuteRawRequest(fcinfo, state));
+}
+
+Datum nominatim_fdw_search_raw(PG_FUNCTION_ARGS)
+{
+    NominatimFDWState *state = InitSearchRequest(fcinfo);
+
+    PG_RETURN_DATUM(ExecuteRawRequest(fcinfo, state));
+}
+
+Datum nominatim_fdw_lookup_raw(PG_FUNCTION_ARGS)
+{
+    NominatimFDWState *state = InitLookupRequest(fcinfo);
+
+    PG_RETURN_DATUM(ExecuteRawRequest(fcinfo, state));
+}
+
+/*
+ * nominatim_fdw_search_point
+ * ----------
+ * Slim version of nominatim_fdw_search that only retrieves the ids,
+ * coordinates and display name of each place. Address details, extra tags,
+ * name details and polygons are neither requested nor parsed.
+ *
+ * returns SETOF NominatimPoint
+ */
+Datum nominatim_fdw_search_point(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+    TupleDesc tupdesc;
+
+    if (SRF_IS_FIRSTCALL())
+    {
+        MemoryContext oldcontext;
+        NominatimFDWState *state;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        state = InitSession(text_to_cstring(PG_GETARG_TEXT_P(0)));
+
+        state->query = text_to_cstring(PG_GETARG_TEXT_P(1));
+        state->amenity = text_to_cstring(PG_GETARG_TEXT_P(2));
+        state->street = text_to_cstring(PG_GETARG_TEXT_P(3));
+        state->city = text_to_cstring(PG_GETARG_TEXT_P(4));
+        state->county = text_to_cstring(PG_GETARG_TEXT_P(5));
+        state->state = text_to_cstring(PG_GETARG_TEXT_P(6));
+        state->country = text_to_cstring(PG_GETARG_TEXT_P(7));
+        state->postalcode = text_to_cstring(PG_GETARG_TEXT_P(8));
+
+        if (strlen(text_to_cstring(PG_GETARG_TEXT_P(9))) > 0)
+            state->accept_language = text_to_cstring(PG_GETARG_TEXT_P(9));
+
+        state->countrycodes = text_to_cstring(PG_GETARG_TEXT_P(10));
+        state->layer = text_to_cstring(PG_GETARG_TEXT_P(11));
+        state->feature_type = text_to_cstring(PG_GETARG_TEXT_P(12));
+        state->exclude_place_ids = text_to_cstring(PG_GETARG_TEXT_P(13));
+        state->viewbox = text_to_cstring(PG_GETARG_TEXT_P(14));
+        state->bounded = PG_GETARG_BOOL(15);
+        state->email = text_to_cstring(PG_GETARG_TEXT_P(16));
+        state->dedupe = PG_GETARG_BOOL(17);
+        state->limit = PG_GETARG_INT32(18);
+        state->polygon_type = "";
+        state->points_only = true;
+        state->request_type = NOMINATIM_REQUEST_SEARCH;
+
+        ValidateSearchRequest(state);
+
+        ParseNominatimSearchData(state);
+
+        funcctx->user_fctx = state->records;
+
+        if (state->records)
+            funcctx->max_calls = state->records->length;
+
+        elog(DEBUG2, "  %s: number of records retrieved = %ld ", __func__, funcctx->max_calls);
+
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+            ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                            errmsg("function returning record called in context that cannot accept type record")));
+
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+
+    if (funcctx->call_cntr < funcctx->max_calls)
+    {
+        NominatimRecord *place = (NominatimRecord *)list_nth((List *)funcctx->user_fctx,
+                                                             (int)funcctx->call_cntr);
+        HeapTuple tuple = CreatePointTuple(funcctx->tuple_desc, place);
+
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+    else
+        SRF_RETURN_DONE(funcctx);
+}
+
+/*
+ * nominatim_fdw_reverse_point
+ * ----------
+ * Slim version of nominatim_fdw_reverse that only retrieves the ids,
+ * coordinates and display name of the place found at the given coordinate.
+ *
+ * returns SETOF NominatimPoint
+ */
+Datum nominatim_fdw_reverse_point(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+    TupleDesc tupdesc;
+
+    if (SRF_IS_FIRSTCALL())
+    {
+        MemoryContext oldcontext;
+        NominatimFDWState *state;
+        char *layer;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        state = InitSession(text_to_cstring(PG_GETARG_TEXT_P(0)));
+
+        state->lon = PG_GETARG_FLOAT8(1);
+        state->lat = PG_GETARG_FLOAT8(2);
+        state->zoom = PG_GETARG_INT32(3);
+
+        layer = text_to_cstring(PG_GETARG_TEXT_P(4));
+        state->layer = strlen(layer) == 0 ? NULL : layer;
+
+        if (strlen(text_to_cstring(PG_GETARG_TEXT_P(5))) > 0)
+            state->accept_language = text_to_cstring(PG_GETARG_TEXT_P(5));
+
+        state->email = text_to_cstring(PG_GETARG_TEXT_P(6));
+        state->polygon_type = "";
+        state->points_only = true;
+        state->request_type = NOMINATIM_REQUEST_REVERSE;
+
+        ValidateReverseRequest(state);
+
+        ParseNominatimReverseData(state);
+
+        funcctx->user_fctx = state->records;
+
+        if (state->records)
+            funcctx->max_calls = state->records->length;
+
+        elog(DEBUG2, "  %s: number of records retrieved = %ld ", __func__, funcctx->max_calls);
+
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+            ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                            errmsg("function returning record called in context that cannot accept type record")));
+
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+
+    if (funcctx->call_cntr < funcctx->max_calls)
+    {
+        NominatimRecord *place = (NominatimRecord *)list_nth((List *)funcctx->user_fctx,
+                                                             (int)funcctx->call_cntr);
+        HeapTuple tuple = CreatePointTuple(funcctx->tuple_desc, place);
+
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+    else
+        SRF_RETURN_DONE(funcctx);
+}
+
+/*
+ * CreatePointTuple
+ * ----------
+ * Creates a NominatimPoint tuple (place_id, osm_id, osm_type, display_name,
+ * lon, lat) out of a parsed NominatimRecord. As the layout of this type is
+ * fixed, the values are converted directly instead of going through the
+ * type input functions used by CreateDatum.
+ *
+ * tupdesc: a blessed NominatimPoint tuple descriptor
+ * place: a NominatimRecord variable
+ *
+ * returns HeapTuple
+ */
+static HeapTuple CreatePointTuple(TupleDesc tupdesc, NominatimRecord *place)
+{
+    Datum values[NOMINATIM_POINT_NATTS];
+    bool nulls[NOMINATIM_POINT_NATTS];
+
+    if (tupdesc->natts != NOMINATIM_POINT_NATTS)
+        ereport(ERROR,
+                (errcode(ERRCODE_DATATYPE_MISMATCH),
+                 errmsg("unexpected number of attributes in NominatimPoint: %d", tupdesc->natts)));
+
+    memset(nulls, 0, sizeof(nulls));
+
+    nulls[0] = place->place_id == NULL;
+    if (place->place_id)
+        values[0] = Int64GetDatum(strtoll(place->place_id, NULL, 10));
+
+    nulls[1] = place->osm_id == NULL;
+    if (place->osm_id)
+        values[1] = Int64GetDatum(strtoll(place->osm_id, NULL, 10));
+
+    nulls[2] = place->osm_type == NULL;
+    if (place->osm_type)
+        values[2] = CStringGetTextDatum(place->osm_type);
+
+    nulls[3] = place->display_name == NULL;
+    if (place->display_name)
+        values[3] = CStringGetTextDatum(place->display_name);
+
+    nulls[4] = place->lon == NULL;
+    if (place->lon)
+        values[4] = Float8GetDatum(strtod(place->lon, NULL));
+
+    nulls[5] = place->lat == NULL;
+    if (place->lat)
+        values[5] = Float8GetDatum(strtod(place->lat, NULL));
+
+    return heap_form_tuple(tupdesc, values, nulls);
+}
+
+/*
+ * GetAttributeValue
+ * ----------
+ * Extracts the value of a given attribute and sets the correspondent property
+ * in the NominatimRecord struct. It returs NULL in case of no match.
+ *
+ * att: a Form_pg_attribute attribute
+ * place: a NominatimRecord variable
+ *
+ * returns SETOF NominatimRecord
+ */
+static char *GetAttributeValue(Form_pg_attribute att, struct NominatimRecord *place)
+{
+
+    if (strcmp(NameStr(att->attname), "osm_id") == 0)
+        return place->osm_id;
+    else if (strcmp(NameStr(att->attname), "osm_type") == 0)
+        return place->osm_type;
+    else if (strcmp(NameStr(att->attname), "ref") == 0)
+        return place->ref;
+    else if (strcmp(NameStr(att->attname), "class") == 0)
+        return place->class;
+    else if (strcmp(NameStr(att->attname), "type") == 0)
+        return place->type;
+    else if (strcmp(NameStr(att->attname), "display_name") == 0)
         return place->display_name;
     else if (strcmp(NameStr(att->attname), "place_id") == 0)
         return place->place_id;
@@ -768,10 +4150,19 @@ static char *GetAttributeValue(Form_pg_attribute att, struct NominatimRecord *pl
         return place->place_rank;
     else if (strcmp(NameStr(att->attname), "address_rank") == 0)
         return place->address_rank;
+    else if (att->atttypid != TEXTOID &&
+             (strcmp(NameStr(att->attname), "geom") == 0 ||
+              strcmp(NameStr(att->attname), "envelope") == 0 ||
+              strcmp(NameStr(att->attname), "polygon") == 0))
+        return GetGeometryValue(att, place);
     else if (strcmp(NameStr(att->attname), "lon") == 0)
         return place->lon;
     else if (strcmp(NameStr(att->attname), "lat") == 0)
         return place->lat;
+    else if (strcmp(NameStr(att->attname), "place_lon") == 0)
+        return place->lon;
+    else if (strcmp(NameStr(att->attname), "place_lat") == 0)
+        return place->lat;
     else if (strcmp(NameStr(att->attname), "boundingbox") == 0)
         return place->boundingbox;
     else if (strcmp(NameStr(att->attname), "importance") == 0)
@@ -805,896 +4196,4646 @@ static char *GetAttributeValue(Form_pg_attribute att, struct NominatimRecord *pl
 }
 
 /*
- * CreateDatum
+ * GetGeometryValue
+ * ----------
+ * Creates the EWKT representation of the geometry attributes of a place,
+ * which can be directly fed into the input function of the PostGIS
+ * geometry type. This spares users from converting lon/lat, the bounding
+ * box or the WKT polygon themselves after the call.
+ *
+ * geom: POINT built from lon and lat
+ * envelope: POLYGON built from the boundingbox (minlat,maxlat,minlon,maxlon)
+ * polygon: polygon retrieved with polygon_text
+ *
+ * att: a Form_pg_attribute attribute
+ * place: a NominatimRecord variable
+ *
+ * returns EWKT string or NULL if the place has no such geometry
+ */
+static char *GetGeometryValue(Form_pg_attribute att, struct NominatimRecord *place)
+{
+    if (strcmp(NameStr(att->attname), "geom") == 0)
+    {
+        if (!place->lon || !place->lat)
+            return NULL;
+
+        return psprintf("SRID=%d;POINT(%s %s)", NOMINATIM_SRID, place->lon, place->lat);
+    }
+    else if (strcmp(NameStr(att->attname), "envelope") == 0)
+    {
+        float8 minlat, maxlat, minlon, maxlon;
+
+        if (!place->boundingbox ||
+            sscanf(place->boundingbox, "%lf,%lf,%lf,%lf", &minlat, &maxlat, &minlon, &maxlon) != 4)
+            return NULL;
+
+        return psprintf("SRID=%d;POLYGON((%.7f %.7f,%.7f %.7f,%.7f %.7f,%.7f %.7f,%.7f %.7f))",
+                        NOMINATIM_SRID,
+                        minlon, minlat,
+                        minlon, maxlat,
+                        maxlon, maxlat,
+                        maxlon, minlat,
+                        minlon, minlat);
+    }
+    else if (strcmp(NameStr(att->attname), "polygon") == 0)
+    {
+        if (!place->polygon)
+            return NULL;
+
+        return psprintf("SRID=%d;%s", NOMINATIM_SRID, place->polygon);
+    }
+
+    return NULL;
+}
+
+/*
+ * AdjustRequestToResultType
+ * ----------
+ * Adjusts the request to the result type of the calling function, so that
+ * we don't ask the server for data the result type cannot hold, e.g.
+ * NominatimGeometry has no jsonb attributes for address details, extra
+ * tags, name details or entrances. If the 'polygon' attribute is a
+ * geometry the polygon is requested as WKT (polygon_text), regardless of
+ * the requested format, as this is the only one that can be converted
+ * into a geometry on our side.
+ *
+ * state: NominatimFDWState containing all session data
+ * tupdesc: tuple descriptor of the function's result type
+ */
+static void AdjustRequestToResultType(NominatimFDWState *state, TupleDesc tupdesc)
+{
+    bool has_addressdetails = false;
+    bool has_extratags = false;
+    bool has_namedetails = false;
+    bool has_entrances = false;
+
+    for (int i = 0; i < tupdesc->natts; i++)
+    {
+        Form_pg_attribute att = TupleDescAttr(tupdesc, i);
+
+        if (att->attisdropped)
+            continue;
+
+        if (strcmp(NameStr(att->attname), "addressdetails") == 0 ||
+            strcmp(NameStr(att->attname), "addressparts") == 0)
+            has_addressdetails = true;
+        else if (strcmp(NameStr(att->attname), "extratags") == 0)
+            has_extratags = true;
+        else if (strcmp(NameStr(att->attname), "namedetails") == 0)
+            has_namedetails = true;
+        else if (strcmp(NameStr(att->attname), "entrances") == 0)
+            has_entrances = true;
+        else if (strcmp(NameStr(att->attname), "polygon") == 0 &&
+                 att->atttypid != TEXTOID &&
+                 state->polygon_type && strlen(state->polygon_type) > 0)
+        {
+            elog(DEBUG2, "%s: geometry output, replacing '%s' with 'polygon_text'", __func__, state->polygon_type);
+            state->polygon_type = "polygon_text";
+        }
+    }
+
+    state->addressdetails = state->addressdetails && has_addressdetails;
+    state->extratags = state->extratags && has_extratags;
+    state->namedetails = state->namedetails && has_namedetails;
+    state->entrances = state->entrances && has_entrances;
+}
+
+/*
+ * CreateDatum
+ * ----------
+ *
+ * Creates a Datum from a given value based on the postgres types and modifiers.
+ *
+ * tuple: a Heaptuple
+ * pgtype: postgres type
+ * pgtypemod: postgres type modifier
+ * value: value to be converted
+ *
+ * returns Datum
+ */
+static Datum CreateDatum(int pgtype, int pgtypmod, char *value)
+{
+    regproc typinput;
+    HeapTuple tuple = SearchSysCache1(TYPEOID, ObjectIdGetDatum(pgtype));
+
+    if (!HeapTupleIsValid(tuple))
+        ereport(ERROR,
+                (errcode(ERRCODE_FDW_INVALID_DATA_TYPE),
+                 errmsg("cache lookup failed for type %u", pgtype)));
+
+    typinput = ((Form_pg_type)GETSTRUCT(tuple))->typinput;
+    ReleaseSysCache(tuple);
+
+    if (pgtype == FLOAT4OID ||
+        pgtype == FLOAT8OID ||
+        pgtype == NUMERICOID ||
+        pgtype == TIMESTAMPOID ||
+        pgtype == TIMESTAMPTZOID ||
+        pgtype == VARCHAROID ||
+        pgtypmod >= 0)
+        return OidFunctionCall3(
+            typinput,
+            CStringGetDatum(value),
+            ObjectIdGetDatum(InvalidOid),
+            Int32GetDatum(pgtypmod));
+    else
+        return OidFunctionCall1(typinput, CStringGetDatum(value));
+}
+
+static void LoadNominatimUserMapping(NominatimFDWState *state)
+{
+    Datum datum;
+    HeapTuple tp;
+    bool isnull;
+    UserMapping *um;
+    List *options = NIL;
+    ListCell *cell;
+    bool usermatch = true;
+
+    elog(DEBUG2, "%s called", __func__);
+
+    tp = SearchSysCache2(USERMAPPINGUSERSERVER,
+                         ObjectIdGetDatum(GetUserId()),
+                         ObjectIdGetDatum(state->server->serverid));
+
+    if (!HeapTupleIsValid(tp))
+    {
+        elog(DEBUG2, "%s: not found for the specific user -- try PUBLIC", __func__);
+        tp = SearchSysCache2(USERMAPPINGUSERSERVER,
+                             ObjectIdGetDatum(InvalidOid),
+                             ObjectIdGetDatum(state->server->serverid));
+    }
+
+    if (!HeapTupleIsValid(tp))
+    {
+        elog(DEBUG2, "%s: user mapping not found for user \"%s\", server \"%s\"",
+             __func__, MappingUserName(GetUserId()), state->server->servername);
+
+        usermatch = false;
+    }
+
+    if (usermatch)
+    {
+        elog(DEBUG2, "%s: setting UserMapping", __func__);
+        um = (UserMapping *)palloc(sizeof(UserMapping));
+#if PG_VERSION_NUM >= 120000
+		um->umid = ((Form_pg_user_mapping)GETSTRUCT(tp))->oid;
+#elif PG_VERSION_NUM >= 90600
+		um->umid = HeapTupleGetOid(tp);
+#endif
+        um->userid = GetUserId();
+        um->serverid = state->server->serverid;
+
+        elog(DEBUG2, "%s: extract the umoptions", __func__);
+        datum = SysCacheGetAttr(USERMAPPINGUSERSERVER,
+                                tp,
+                                Anum_pg_user_mapping_umoptions,
+                                &isnull);
+        if (isnull)
+            um->options = NIL;
+        else
+            um->options = untransformRelOptions(datum);
+
+        if (um->options != NIL)
+        {
+            options = list_concat(options, um->options);
+
+            foreach (cell, options)
+            {
+                DefElem *def = (DefElem *)lfirst(cell);
+
+                if (strcmp(def->defname, NOMINATIM_USERMAPPING_OPTION_PROXYUSER) == 0)
+                {
+                    state->proxy_user = pstrdup(defGetString(def));
+                    elog(DEBUG2, "%s: proxy user '%s'", __func__, def->defname);
+                }
+                else if (strcmp(def->defname, NOMINATIM_USERMAPPING_OPTION_PROXYPASSWORD) == 0)
+                {
+                    state->proxy_user_password = pstrdup(defGetString(def));
+                    elog(DEBUG2, "%s: proxy password '*******'", __func__);
+                }
+            }
+        }
+
+        ReleaseSysCache(tp);
+    }
+
+    elog(DEBUG2, "%s exit", __func__);
+}
+/*
+ * InitSession
+ * ----------
+ *
+ * This function loads all session info from a specific foreign server data
+ * into a NominatimFDWState.
+ *
+ * srvname: foreign server's name
+ *
+ * returns NominatimFDWState with the loaded session values
+ */
+static NominatimFDWState *InitSession(const char *srvname)
+{
+    NominatimFDWState *state = (NominatimFDWState *)palloc0(sizeof(NominatimFDWState));
+    ForeignServer *server = GetForeignServerByName(srvname, true);
+    ListCell *cell;
+
+    state->request_redirect = 1L;
+    state->max_retries = NOMINATIM_DEFAULT_MAXRETRY;
+    state->request_max_redirect = NOMINATIM_DEFAULT_MAXREDIRECT;
+    state->accept_language = NOMINATIM_DEFAULT_LANGUAGE;
+    state->connect_timeout = NOMINATIM_DEFAULT_CONNECTTIMEOUT;
+    state->max_concurrent_requests = NOMINATIM_DEFAULT_CONCURRENT_REQUESTS;
+    state->format = NOMINATIM_FORMAT_XML;
+
+    if (!server)
+        ereport(ERROR,
+                (errcode(ERRCODE_CONNECTION_DOES_NOT_EXIST),
+                 errmsg("FOREIGN SERVER does not exist: '%s'", srvname)));
+
+    state->server = server;
+    LoadNominatimUserMapping(state);
+
+    elog(DEBUG2, "%s called: '%s'", __func__, srvname);
+
+    foreach (cell, server->options)
+    {
+        DefElem *def = lfirst_node(DefElem, cell);
+
+        elog(DEBUG2, "  %s parsing node '%s': %s", __func__, def->defname, defGetString(def));
+
+        if (strcmp(def->defname, NOMINATIM_SERVER_OPTION_URL) == 0)
+            state->url = defGetString(def);
+
+        if (strcmp(def->defname, NOMINATIM_SERVER_OPTION_HTTP_PROXY) == 0)
+        {
+            state->proxy = defGetString(def);
+            state->proxy_type = NOMINATIM_SERVER_OPTION_HTTP_PROXY;
+        }
+
+        if (strcmp(def->defname, NOMINATIM_SERVER_OPTION_CONNECTTIMEOUT) == 0)
+        {
+            char *tailpt;
+            char *timeout_str = defGetString(def);
+
+            state->connect_timeout = strtol(timeout_str, &tailpt, 0);
+        }
+
+        if (strcmp(def->defname, NOMINATIM_SERVER_OPTION_MAXREDIRECT) == 0)
+        {
+            char *tailpt;
+            char *maxredirect_str = defGetString(def);
+
+            state->request_max_redirect = strtol(maxredirect_str, &tailpt, 10);
+        }
+
+        if (strcmp(def->defname, NOMINATIM_SERVER_OPTION_MAXCONNECTRETRY) == 0)
+        {
+            char *tailpt;
+            char *val = defGetString(def);
+
+            state->max_retries = strtol(val, &tailpt, 10);
+        }
+
+        if (strcmp(def->defname, NOMINATIM_SERVER_OPTION_LANGUAGE) == 0)
+            state->accept_language = defGetString(def);
+
+        if (strcmp(def->defname, NOMINATIM_SERVER_OPTION_CACHE_TTL) == 0)
+            state->cache_ttl = (int)strtol(defGetString(def), NULL, 10);
+
+        if (strcmp(def->defname, NOMINATIM_SERVER_OPTION_CACHE_NEGATIVE_TTL) == 0)
+            state->cache_negative_ttl = (int)strtol(defGetString(def), NULL, 10);
+
+        if (strcmp(def->defname, NOMINATIM_SERVER_OPTION_CACHE_TABLE) == 0)
+            state->cache_table = defGetString(def);
+
+        if (strcmp(def->defname, NOMINATIM_SERVER_OPTION_REVERSE_GRID) == 0)
+            state->reverse_grid = (int)strtol(defGetString(def), NULL, 10);
+
+        if (strcmp(def->defname, NOMINATIM_SERVER_OPTION_MAX_REQUESTS_PER_SECOND) == 0)
+            state->max_requests_per_second = strtod(defGetString(def), NULL);
+
+        if (strcmp(def->defname, NOMINATIM_SERVER_OPTION_MAX_CONCURRENT_REQUESTS) == 0)
+            state->max_concurrent_requests = (int)strtol(defGetString(def), NULL, 10);
+    }
+
+    return state;
+}
+
+static size_t WriteMemoryCallback(void *contents, size_t size, size_t nmemb, void *userp)
+{
+    size_t realsize = size * nmemb;
+    struct MemoryStruct *mem = (struct MemoryStruct *)userp;
+    char *ptr = repalloc(mem->memory, mem->size + realsize + 1);
+
+    if (!ptr)
+        ereport(ERROR,
+                (errcode(ERRCODE_FDW_OUT_OF_MEMORY),
+                 errmsg("out of memory (repalloc returned NULL)")));
+
+    mem->memory = ptr;
+    memcpy(&(mem->memory[mem->size]), contents, realsize);
+    mem->size += realsize;
+    mem->memory[mem->size] = 0;
+
+    if (mem == activity_chunk)
+    {
+        activity_slot->changecount++;
+        pg_write_barrier();
+        activity_slot->bytes = mem->size;
+        pg_write_barrier();
+        activity_slot->changecount++;
+    }
+
+    return realsize;
+}
+static size_t HeaderCallbackFunction(char *contents, size_t size, size_t nmemb, void *userp)
+{
+    size_t realsize = size * nmemb;
+    struct MemoryStruct *mem = (struct MemoryStruct *)userp;
+    char *ptr;
+
+    Assert(contents);
+
+    elog(DEBUG2, "%s: header = \"%s\"", __func__, contents);
+
+    ptr = repalloc(mem->memory, mem->size + realsize + 1);
+
+    if (!ptr)
+        ereport(ERROR,
+                (errcode(ERRCODE_FDW_OUT_OF_MEMORY),
+                 errmsg("[%s] out of memory (repalloc returned NULL)", __func__)));
+
+    mem->memory = ptr;
+    memcpy(&(mem->memory[mem->size]), contents, realsize);
+    mem->size += realsize;
+    mem->memory[mem->size] = 0;
+
+    return realsize;
+}
+
+/*
+ * ParserAlloc / ParserRealloc
+ * ----------
+ *
+ * NominatimAllocator of the parser: records and URLs are built in the
+ * current memory context.
+ */
+static void *ParserAlloc(size_t size, void *arg)
+{
+    return palloc0(size);
+}
+
+static void *ParserRealloc(void *ptr, size_t size, void *arg)
+{
+    return ptr ? repalloc(ptr, size) : palloc(size);
+}
+
+static const NominatimAllocator parser_allocator = {ParserAlloc, ParserRealloc, NULL};
+
+/*
+ * CollectRecord
+ * ----------
+ * NominatimRecordCallback appending the parsed records to state->records.
+ */
+static void CollectRecord(NominatimRecord *place, void *arg)
+{
+    NominatimFDWState *state = (NominatimFDWState *)arg;
+
+    state->records = lappend(state->records, place);
+}
+
+/*
+ * CheckParserResult
+ * ----------
+ * Raises an error if the response could not be parsed.
+ *
+ * state: NominatimFDWState containing all session data
+ * rc: result of nominatim_parse_search or nominatim_parse_reverse
+ */
+static void CheckParserResult(NominatimFDWState *state, int rc)
+{
+    if (rc == NOMINATIM_PARSE_NO_ROOT)
+        elog(ERROR, "unable to parse XML document: '%s'", state->url);
+
+    if (rc == NOMINATIM_PARSE_KML_FAILED)
+        elog(ERROR, "unable to dump XML node: '%s'", state->url);
+}
+
+/*
+ * ParseNominatimReverseData
+ * ----------
+ *
+ * Parses the XML document returned from the Nominatim reverse endpoint
+ * and creates a List of NominatimRecord. The paresed records are stored
+ * in state->records.
+ *
+ * state: NominatimFDWState containing all session data
+ *
+ */
+static void ParseNominatimReverseData(NominatimFDWState *state)
+{
+    int rc;
+
+    elog(DEBUG2, "%s called", __func__);
+
+    /* asynchronous foreign scans have already collected the response */
+    if (!state->xmldoc)
+    {
+        rc = ExecuteRequest(state);
+
+        /* the shared cache returns the records already parsed */
+        if (rc == REQUEST_CACHED)
+            return;
+
+        if (rc != REQUEST_SUCCESS)
+            elog(ERROR, "%s -> request failed: '%s'", __func__, state->url);
+    }
+
+    Assert(state->xmldoc);
+
+    rc = nominatim_parse_reverse(state->xmldoc, state->points_only ? NOMINATIM_PARSE_POINTS_ONLY : 0,
+                                 &parser_allocator, CollectRecord, state);
+    CheckParserResult(state, rc);
+
+    xmlFreeDoc(state->xmldoc);
+    state->xmldoc = NULL;
+
+    CacheParsedRecords(state);
+}
+
+/*
+ * ParseNominatimSearchData
+ * ----------
+ *
+ * Parses the XML document returned from the Nominatim search and lookup
+ * endpoints, and creates a List of NominatimRecord. The paresed records
+ * are stored in state->records.
+ *
+ * state: NominatimFDWState containing all session data
+ *
+ */
+static void ParseNominatimSearchData(NominatimFDWState *state)
+{
+    int rc;
+
+    state->records = NIL;
+
+    elog(DEBUG2, "%s called", __func__);
+
+    /* asynchronous foreign scans have already collected the response */
+    if (!state->xmldoc)
+    {
+        rc = ExecuteRequest(state);
+
+        /* the shared cache returns the records already parsed */
+        if (rc == REQUEST_CACHED)
+            return;
+
+        if (rc != REQUEST_SUCCESS)
+            elog(ERROR, "%s -> request failed: '%s'", __func__, state->url);
+    }
+
+    Assert(state->xmldoc);
+
+    rc = nominatim_parse_search(state->xmldoc, state->points_only ? NOMINATIM_PARSE_POINTS_ONLY : 0,
+                                &parser_allocator, CollectRecord, state);
+    CheckParserResult(state, rc);
+
+    xmlFreeDoc(state->xmldoc);
+    state->xmldoc = NULL;
+
+    CacheParsedRecords(state);
+}
+
+/*
+ * BuildRequestURL
+ * ----------
+ * Appends the request URL to url: the endpoint of the server followed by
+ * all parameters set in the state.
+ *
+ * state: NominatimFDWState containing all session data
+ * url: StringInfo the URL is appended to
+ */
+static void BuildRequestURL(NominatimFDWState *state, StringInfo url)
+{
+    NominatimRequestParams params;
+    NominatimBuffer buf;
+
+    memset(&params, 0, sizeof(params));
+    params.url = state->url;
+    params.request_type = state->request_type;
+    params.format = state->format;
+    params.query = state->query;
+    params.amenity = state->amenity;
+    params.osm_ids = state->osm_ids;
+    params.street = state->street;
+    params.city = state->city;
+    params.county = state->county;
+    params.state = state->state;
+    params.country = state->country;
+    params.postalcode = state->postalcode;
+    params.polygon_type = state->polygon_type;
+    params.accept_language = state->accept_language;
+    params.countrycodes = state->countrycodes;
+    params.layer = state->layer;
+    params.feature_type = state->feature_type;
+    params.exclude_place_ids = state->exclude_place_ids;
+    params.viewbox = state->viewbox;
+    params.email = state->email;
+    params.lon = state->lon;
+    params.lat = state->lat;
+    params.polygon_threshold = state->polygon_threshold;
+    params.zoom = state->zoom;
+    params.limit = state->limit;
+    params.reverse_grid = state->reverse_grid;
+    params.bounded = state->bounded;
+    params.dedupe = state->dedupe;
+    params.entrances = state->entrances;
+    params.extratags = state->extratags;
+    params.namedetails = state->namedetails;
+    params.addressdetails = state->addressdetails;
+
+    nominatim_buffer_init(&buf, &parser_allocator);
+    nominatim_build_url(&params, &buf);
+
+    appendBinaryStringInfo(url, buf.data, buf.len);
+    pfree(buf.data);
+}
+
+/*
+ * PrepareRequest
+ * ----------
+ * Builds the request URL out of the request parameters and sets up the cURL
+ * handle to perform it. The request can then either be performed right away
+ * (ExecuteRequest) or added to a multi handle and performed asynchronously,
+ * as in asynchronous foreign scans. In both cases CompleteRequest collects
+ * the response.
+ *
+ * state: NominatimFDWState containing all session data
+ * req: NominatimRequest to be set up
+ *
+ * returns REQUEST_SUCCESS or REQUEST_FAIL if no cURL handle could be created
+ */
+static int PrepareRequest(NominatimFDWState *state, NominatimRequest *req)
+{
+    CURL *curl;
+    StringInfoData accept_header;
+    StringInfoData user_agent;
+
+    req->chunk.memory = palloc(1);
+    req->chunk.size = 0; /* no data at this point */
+    req->chunk_header.memory = palloc(1);
+    req->chunk_header.size = 0; /* no data at this point */
+    req->headers = NULL;
+    req->waiting = false;
+    req->retries = 0;
+    req->connected = false;
+    INSTR_TIME_SET_CURRENT(req->started);
+
+    elog(DEBUG2, "%s called", __func__);
+
+    /*
+     * Scans that send several requests keep their handle open, so that the
+     * connection to the server can be reused instead of going through the
+     * TCP and TLS handshakes again on every rescan.
+     */
+    if (state->curl)
+    {
+        curl = state->curl;
+        curl_easy_reset(curl);
+    }
+    else
+        curl = curl_easy_init();
+
+    req->curl = curl;
+
+    if (!curl)
+        return REQUEST_FAIL;
+
+    initStringInfo(&req->url);
+
+    /* replayed requests (cache refresh) already have their URL */
+    if (state->request_url)
+        appendStringInfoString(&req->url, state->request_url);
+    else
+        BuildRequestURL(state, &req->url);
+
+    req->errbuf[0] = 0;
+
+    elog(DEBUG1, "ExecuteRequest: GET \"%s\"", req->url.data);
+
+    curl_easy_setopt(curl, CURLOPT_URL, req->url.data);
+
+#if ((LIBCURL_VERSION_MAJOR == 7 && LIBCURL_VERSION_MINOR < 85) || LIBCURL_VERSION_MAJOR < 7)
+    curl_easy_setopt(curl, CURLOPT_PROTOCOLS, CURLPROTO_HTTP | CURLPROTO_HTTPS);
+#else
+    curl_easy_setopt(curl, CURLOPT_PROTOCOLS_STR, "http,https");
+#endif
+
+    curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, req->errbuf);
+
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, state->connect_timeout);
+    elog(DEBUG2, "  %s: timeout > %ld", __func__, state->connect_timeout);
+    elog(DEBUG2, "  %s: max retry > %ld", __func__, state->max_retries);
+
+    if (state->proxy)
+    {
+        elog(DEBUG2, "  %s: proxy URL > '%s'", __func__, state->proxy);
+
+        curl_easy_setopt(curl, CURLOPT_PROXY, state->proxy);
+
+        if (strcmp(state->proxy_type, NOMINATIM_SERVER_OPTION_HTTP_PROXY) == 0)
+        {
+            elog(DEBUG2, "  %s: proxy protocol > 'HTTP'", __func__);
+            curl_easy_setopt(curl, CURLOPT_PROXYTYPE, CURLPROXY_HTTP);
+        }
+        if (state->proxy_user)
+        {
+            elog(DEBUG2, "  %s: entering proxy user ('%s').", __func__, state->proxy_user);
+            curl_easy_setopt(curl, CURLOPT_PROXYUSERNAME, state->proxy_user);
+        }
+
+        if (state->proxy_user_password)
+        {
+            elog(DEBUG2, "  %s: entering proxy user's password.", __func__);
+            curl_easy_setopt(curl, CURLOPT_PROXYPASSWORD, state->proxy_user_password);
+        }
+    }
+
+    if (state->request_redirect)
+    {
+        elog(DEBUG2, "  %s: setting request redirect: %d (%s)", __func__, state->request_redirect, state->request_redirect ? "true" : "false");
+        curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+
+        if (state->request_max_redirect)
+        {
+            elog(DEBUG2, "  %s: setting maxredirs: %ld", __func__, state->request_max_redirect);
+            curl_easy_setopt(curl, CURLOPT_MAXREDIRS, state->request_max_redirect);
+        }
+    }
+
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, HeaderCallbackFunction);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, (void *)&req->chunk_header);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&req->chunk);
+    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+    curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, ProgressCallback);
+    curl_easy_setopt(curl, CURLOPT_XFERINFODATA, (void *)req);
+
+    curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 1L);
+
+    initStringInfo(&user_agent);
+    appendStringInfo(&user_agent, "PostgreSQL/%s nominatim_fdw/%s libxml2/%s %s", PG_VERSION, FDW_VERSION, LIBXML_DOTTED_VERSION, curl_version());
+
+    elog(DEBUG2, "  %s: \"Agent: %s\"", __func__, user_agent.data);
+
+    curl_easy_setopt(curl, CURLOPT_USERAGENT, user_agent.data);
+
+    initStringInfo(&accept_header);
+    appendStringInfo(&accept_header, "Accept-Language: %s", state->accept_language);
+    req->headers = curl_slist_append(req->headers, accept_header.data);
+    elog(DEBUG2, "  adding header: %s", accept_header.data);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, req->headers);
+
+    elog(DEBUG2, "  %s: performing cURL request ... ", __func__);
+
+    return REQUEST_SUCCESS;
+}
+
+/*
+ * PrepareRetry
+ * ----------
+ * Counts a failed attempt of a request and discards whatever it left
+ * behind, so that the request can be performed again.
+ *
+ * state: NominatimFDWState containing all session data
+ * req: the failed request
+ */
+static void PrepareRetry(NominatimFDWState *state, NominatimRequest *req)
+{
+    req->retries++;
+
+    elog(WARNING, "ExecuteRequest: request to '%s' failed (%ld/%ld)",
+         state->url, req->retries, state->max_retries);
+
+    if (state->stats)
+        state->stats->retries++;
+
+    req->chunk.size = 0;
+    req->chunk.memory[0] = '\0';
+    req->chunk_header.size = 0;
+    req->chunk_header.memory[0] = '\0';
+}
+
+/*
+ * CompleteRequest
+ * ----------
+ * Collects the response of a request set up by PrepareRequest. Failed
+ * requests are retried (synchronously) up to max_retries times, counting
+ * the attempts already retried by the caller. The response
+ * is stored in state->xmldoc, or in state->raw_response for raw requests.
+ *
+ * state: NominatimFDWState containing all session data
+ * req: NominatimRequest set up by PrepareRequest
+ * res: result of the first attempt to perform the request
+ *
+ * returns REQUEST_SUCCESS or REQUEST_FAIL
+ */
+static int CompleteRequest(NominatimFDWState *state, NominatimRequest *req, CURLcode res)
+{
+    long retries;
+    char *slow_request;
+    double duration = 0;
+
+    while (res != CURLE_OK && req->retries < state->max_retries)
+    {
+        PrepareRetry(state, req);
+
+        /* just being polite to the public server */
+        RegisterWaitEvents();
+        pgstat_report_wait_start(wait_event_retry);
+        pg_usleep(NOMINATIM_RETRY_PAUSE_MS * 1000L);
+        pgstat_report_wait_end();
+
+        ReportRequestRetry(req, req->retries + 1);
+        res = PerformRequest(req);
+    }
+
+    retries = req->retries;
+
+    RecordServerStats(state, req, retries);
+    ReportRequestEnd(req, retries);
+    CaptureRequest(state, req, retries);
+
+    slow_request = DescribeSlowRequest(req, retries, &duration);
+
+    if (res != CURLE_OK)
+    {
+        long response_code = 0;
+        curl_easy_getinfo(req->curl, CURLINFO_RESPONSE_CODE, &response_code);
+
+        if (slow_request)
+            LogSlowRequest(state, duration, slow_request);
+
+        xmlFreeDoc(state->xmldoc);
+        pfree(req->chunk.memory);
+        pfree(req->chunk_header.memory);
+        curl_slist_free_all(req->headers);
+        if (!state->curl)
+            curl_easy_cleanup(req->curl);
+
+        ereport(ERROR,
+                (errcode(ERRCODE_FDW_UNABLE_TO_CREATE_EXECUTION),
+                 errmsg("nominatim request failed with HTTP status %ld", response_code),
+                 errhint("Check your request parameters and try again."),
+                 errdetail("URL: \"%s\"", req->url.data)));
+    }
+    else
+    {
+        long response_code;
+        double total_time;
+        curl_easy_getinfo(req->curl, CURLINFO_RESPONSE_CODE, &response_code);
+
+        if (state->cached)
+            CacheResponse(req->url.data, req->chunk.memory, req->chunk.size);
+
+        if (transport == NOMINATIM_TRANSPORT_RECORD)
+            RecordResponse(state, req);
+
+        /*
+         * Raw requests hand the response body over to the caller as is,
+         * so there is no need to build a DOM out of it.
+         */
+        if (state->raw)
+        {
+            if (req->chunk.size > 0)
+            {
+                state->raw_response = req->chunk.memory;
+                req->chunk.memory = palloc(1);
+            }
+
+            if (slow_request)
+                LogSlowRequest(state, duration, slow_request);
+        }
+        else
+        {
+            instr_time start;
+            instr_time parse_time;
+
+            INSTR_TIME_SET_CURRENT(start);
+
+            state->xmldoc = xmlReadMemory(req->chunk.memory, req->chunk.size, NULL, NULL,
+                                          XML_PARSE_NOBLANKS | XML_PARSE_NONET);
+
+            INSTR_TIME_SET_CURRENT(parse_time);
+            INSTR_TIME_SUBTRACT(parse_time, start);
+
+            if (state->stats)
+                state->stats->parse_ms += INSTR_TIME_GET_MILLISEC(parse_time);
+
+            /* logged by CacheParsedRecords, once the records are built */
+            if (slow_request)
+            {
+                state->slow_request = psprintf("%s, XML parsing: %.3f ms", slow_request,
+                                               INSTR_TIME_GET_MILLISEC(parse_time));
+                state->slow_request_ms = duration + INSTR_TIME_GET_MILLISEC(parse_time);
+                INSTR_TIME_SET_CURRENT(state->slow_request_parsed);
+            }
+        }
+
+        if (state->stats)
+            CollectRequestStats(state->stats, req);
+
+        if (curl_easy_getinfo(req->curl, CURLINFO_TOTAL_TIME, &total_time) == CURLE_OK)
+            RecordRequestLatency(state->server->servername, total_time * 1000.0);
+
+        elog(DEBUG1, "ExecuteRequest: HTTP %ld, %ld bytes", response_code, req->chunk.size);
+        elog(DEBUG2, "  %s: http response header = \n%s", __func__, req->chunk_header.memory);
+    }
+
+    pfree(req->chunk.memory);
+    pfree(req->chunk_header.memory);
+    curl_slist_free_all(req->headers);
+    if (!state->curl)
+        curl_easy_cleanup(req->curl);
+
+    /*
+     * We thrown an error in case the server returns an empty XML doc
+     */
+    if (state->raw ? !state->raw_response : !state->xmldoc)
+        return REQUEST_FAIL;
+
+    return REQUEST_SUCCESS;
+}
+
+/*
+ * RegisterWaitEvents
+ * ----------
+ * Registers the wait events of nominatim_fdw (PostgreSQL 17+), so that
+ * backends waiting for a server show up as e.g. NominatimResponse in
+ * pg_stat_activity instead of the generic Extension wait event.
+ */
+static void RegisterWaitEvents(void)
+{
+    if (wait_events_registered)
+        return;
+
+#if PG_VERSION_NUM >= 170000
+    wait_event_connect = WaitEventExtensionNew("NominatimConnect");
+    wait_event_response = WaitEventExtensionNew("NominatimResponse");
+    wait_event_retry = WaitEventExtensionNew("NominatimRetryBackoff");
+    wait_event_inflight = WaitEventExtensionNew("NominatimInFlight");
+    wait_event_ratelimit = WaitEventExtensionNew("NominatimRateLimit");
+#endif
+
+    wait_events_registered = true;
+}
+
+/*
+ * PerformRequest
+ * ----------
+ * Sends a request and waits for its response, reporting NominatimConnect
+ * while the connection is being set up and NominatimResponse from then on
+ * (see ProgressCallback).
+ *
+ * req: the request
+ *
+ * returns the result of curl_easy_perform
+ */
+static CURLcode PerformRequest(NominatimRequest *req)
+{
+    CURLcode res;
+
+    RegisterWaitEvents();
+
+    req->waiting = true;
+    req->connected = false;
+
+    pgstat_report_wait_start(wait_event_connect);
+    res = curl_easy_perform(req->curl);
+    pgstat_report_wait_end();
+
+    req->waiting = false;
+
+    return res;
+}
+
+/*
+ * ProgressCallback
+ * ----------
+ * cURL progress callback: switches the wait event of a backend waiting in
+ * PerformRequest to NominatimResponse once the connection (including TLS
+ * and proxy handshakes) is established.
+ *
+ * returns 0 (go on with the request)
+ */
+static int ProgressCallback(void *clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow)
+{
+    NominatimRequest *req = (NominatimRequest *)clientp;
+    double pretransfer = 0;
+
+    if (!req->waiting || req->connected)
+        return 0;
+
+    if (curl_easy_getinfo(req->curl, CURLINFO_PRETRANSFER_TIME, &pretransfer) == CURLE_OK && pretransfer > 0)
+    {
+        pgstat_report_wait_start(wait_event_response);
+        req->connected = true;
+    }
+
+    return 0;
+}
+
+/*
+ * DescribeSlowRequest
+ * ----------
+ * Describes a request that took at least nominatim_fdw.log_min_duration:
+ * redacted URL, HTTP status, retries, size of the response and the timing
+ * breakdown of the last attempt as reported by cURL (cumulative since the
+ * start of the attempt).
+ *
+ * req: the request, after its last attempt
+ * retries: number of failed attempts that were retried
+ * duration: set to the duration of the request in milliseconds, including
+ *           retries
+ *
+ * returns the description, or NULL if the request is not to be logged
+ */
+static char *DescribeSlowRequest(NominatimRequest *req, long retries, double *duration)
+{
+    instr_time elapsed;
+    long response_code = 0;
+    double namelookup = 0;
+    double connect = 0;
+    double appconnect = 0;
+    double starttransfer = 0;
+    double total = 0;
+    char *url;
+    char *detail;
+
+    if (log_min_duration < 0)
+        return NULL;
+
+    INSTR_TIME_SET_CURRENT(elapsed);
+    INSTR_TIME_SUBTRACT(elapsed, req->started);
+    *duration = INSTR_TIME_GET_MILLISEC(elapsed);
+
+    if (*duration < log_min_duration)
+        return NULL;
+
+    curl_easy_getinfo(req->curl, CURLINFO_RESPONSE_CODE, &response_code);
+    curl_easy_getinfo(req->curl, CURLINFO_NAMELOOKUP_TIME, &namelookup);
+    curl_easy_getinfo(req->curl, CURLINFO_CONNECT_TIME, &connect);
+    curl_easy_getinfo(req->curl, CURLINFO_APPCONNECT_TIME, &appconnect);
+    curl_easy_getinfo(req->curl, CURLINFO_STARTTRANSFER_TIME, &starttransfer);
+    curl_easy_getinfo(req->curl, CURLINFO_TOTAL_TIME, &total);
+
+    url = RedactURL(req->url.data);
+    detail = psprintf("URL: \"%s\", HTTP status: %ld, retries: %ld, bytes: %zu, "
+                      "namelookup: %.3f ms, connect: %.3f ms, appconnect: %.3f ms, starttransfer: %.3f ms, total: %.3f ms",
+                      url, response_code, retries, req->chunk.size,
+                      namelookup * 1000.0, connect * 1000.0, appconnect * 1000.0,
+                      starttransfer * 1000.0, total * 1000.0);
+    pfree(url);
+
+    return detail;
+}
+
+/*
+ * LogSlowRequest
+ * ----------
+ * Logs a request that took at least nominatim_fdw.log_min_duration.
+ *
+ * state: NominatimFDWState containing all session data
+ * duration: duration of the request in milliseconds
+ * detail: description of the request (DescribeSlowRequest)
+ */
+static void LogSlowRequest(NominatimFDWState *state, double duration, const char *detail)
+{
+    ereport(LOG,
+            (errmsg("duration: %.3f ms  nominatim %s request to server '%s'",
+                    duration, state->request_type, state->server->servername),
+             errdetail_internal("%s", detail)));
+}
+
+/*
+ * ExecuteRequest
+ * ----------
+ * Sends a request to the Nominatim server and waits for the response,
+ * unless it is found in one of the caches.
+ *
+ * state: NominatimFDWState containing all session data
+ *
+ * returns REQUEST_SUCCESS, REQUEST_CACHED or REQUEST_FAIL
+ */
+static int ExecuteRequest(NominatimFDWState *state)
+{
+    NominatimRequest req;
+    int rc;
+
+    if (PrepareRequest(state, &req) != REQUEST_SUCCESS)
+        return REQUEST_FAIL;
+
+    rc = LookupRequest(state, &req, true);
+
+    if (rc != REQUEST_PENDING)
+        return rc;
+
+    return SendRequest(state, &req);
+}
+
+/*
+ * LookupRequest
+ * ----------
+ * Looks for the response of a request set up by PrepareRequest in the
+ * shared cache, in the cache table of the server and in the statement
+ * cache. Requests answered from a cache are released.
+ *
+ * state: NominatimFDWState containing all session data
+ * req: NominatimRequest set up by PrepareRequest
+ * coalesce: wait for another backend sending the same request and take its
+ *           records, instead of sending the request as well
+ *
+ * returns REQUEST_CACHED (records in state->records), REQUEST_SUCCESS
+ * (response in state->xmldoc or state->raw_response), REQUEST_FAIL, or
+ * REQUEST_PENDING if the request has to be sent to the server
+ */
+static int LookupRequest(NominatimFDWState *state, NominatimRequest *req, bool coalesce)
+{
+    NominatimCachedResponse *cached;
+
+    state->cache_key = NULL;
+    state->cache_url = NULL;
+    state->slow_request = NULL;
+
+    /*
+     * Parsed records can be shared with all backends and kept in the cache
+     * table of the server. Replayed requests (cache refresh) only update
+     * the caches.
+     */
+    if (!state->raw && shared_cache && (state->cache_ttl > 0 || state->cache_negative_ttl > 0))
+    {
+        char *key = psprintf("%s%s", req->url.data, state->points_only ? " points" : "");
+
+        if (!state->request_url && SharedCacheLookup(state, key))
+        {
+            elog(DEBUG1, "ExecuteRequest: shared cache hit, %d records", list_length(state->records));
+            RecordCacheHit(state);
+            ReleaseRequest(state, req);
+            return REQUEST_CACHED;
+        }
+
+        /* another backend is sending the same request: take its records */
+        if (coalesce && !state->request_url && AwaitInFlightRequest(key) && SharedCacheLookup(state, key))
+        {
+            elog(DEBUG1, "ExecuteRequest: coalesced, %d records", list_length(state->records));
+            pg_atomic_fetch_add_u64(&nominatim_shared->coalesced, 1);
+            RecordCacheHit(state);
+            ReleaseRequest(state, req);
+            return REQUEST_CACHED;
+        }
+
+        state->cache_key = key;
+    }
+
+    if (!state->raw && state->cache_table)
+    {
+        if (!state->request_url && PersistentCacheLookup(state, req->url.data))
+        {
+            elog(DEBUG1, "ExecuteRequest: cache table hit, %d records", list_length(state->records));
+            RecordCacheHit(state);
+            SharedCacheStore(state);
+            ReleaseInFlightRequest();
+            ReleaseRequest(state, req);
+            return REQUEST_CACHED;
+        }
+
+        state->cache_url = pstrdup(req->url.data);
+    }
+
+    if (!state->cached)
+        return REQUEST_PENDING;
+
+    cached = (NominatimCachedResponse *)hash_search(GetStatementCache(), &req->url.data, HASH_FIND, NULL);
+
+    if (!cached)
+        return REQUEST_PENDING;
+
+    elog(DEBUG1, "ExecuteRequest: cached response, %ld bytes", cached->size);
+    RecordCacheHit(state);
+
+    ReleaseRequest(state, req);
+
+    if (state->raw)
+        state->raw_response = cached->size > 0 ? pnstrdup(cached->body, cached->size) : NULL;
+    else
+        state->xmldoc = xmlReadMemory(cached->body, cached->size, NULL, NULL,
+                                      XML_PARSE_NOBLANKS | XML_PARSE_NONET);
+
+    if (state->raw ? !state->raw_response : !state->xmldoc)
+        return REQUEST_FAIL;
+
+    return REQUEST_SUCCESS;
+}
+
+/*
+ * SendRequest
+ * ----------
+ * Sends a request set up by PrepareRequest to the server, as soon as its
+ * max_requests_per_second allows, and collects its response, or answers
+ * it from the recorded responses in replay mode.
+ *
+ * state: NominatimFDWState containing all session data
+ * req: NominatimRequest set up by PrepareRequest
+ *
+ * returns REQUEST_SUCCESS or REQUEST_FAIL
+ */
+static int SendRequest(NominatimFDWState *state, NominatimRequest *req)
+{
+    if (transport == NOMINATIM_TRANSPORT_REPLAY)
+        return ReplayRequest(state, req);
+
+    ThrottleRequest(state, req);
+    ReportRequestStart(state, req);
+    return CompleteRequest(state, req, PerformRequest(req));
+}
+
+/*
+ * GetRecordingPath
+ * ----------
+ * Path of the files holding the recorded response of a request, without
+ * extension: the directory set in nominatim_fdw.transport_directory and
+ * the hash of the request URL.
+ *
+ * url: request URL
+ *
+ * returns the palloc'd path
+ */
+static char *GetRecordingPath(const char *url)
+{
+    if (!transport_directory || strlen(transport_directory) == 0)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("nominatim_fdw.transport_directory is not set"),
+                 errhint("Set it to the directory of the recorded responses to use nominatim_fdw.transport '%s'.",
+                         transport == NOMINATIM_TRANSPORT_RECORD ? "record" : "replay")));
+
+    return psprintf("%s/%016llx", transport_directory, (unsigned long long)HashCacheKey(url));
+}
+
+/*
+ * ReadRecordingFile
+ * ----------
+ * Reads a file of a recording.
+ *
+ * path: file to read
+ * size: set to the size of the file
+ *
+ * returns the palloc'd, null-terminated contents of the file, or NULL if
+ * the file does not exist
+ */
+static char *ReadRecordingFile(const char *path, size_t *size)
+{
+    struct stat st;
+    FILE *file;
+    char *data;
+
+    if (stat(path, &st) != 0)
+    {
+        if (errno == ENOENT)
+            return NULL;
+
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not stat file \"%s\": %m", path)));
+    }
+
+    file = AllocateFile(path, PG_BINARY_R);
+
+    if (!file)
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not open file \"%s\" for reading: %m", path)));
+
+    data = palloc(st.st_size + 1);
+    *size = fread(data, 1, st.st_size, file);
+
+    if (ferror(file))
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not read file \"%s\": %m", path)));
+
+    FreeFile(file);
+    data[*size] = '\0';
+
+    return data;
+}
+
+/*
+ * WriteRecordingFile
+ * ----------
+ * Writes a file of a recording. The contents go to a temporary file first,
+ * so that backends replaying the request never see a partial file.
+ *
+ * path: file to write
+ * data: contents of the file
+ * size: size of data
+ */
+static void WriteRecordingFile(const char *path, const char *data, size_t size)
+{
+    char *tmppath = psprintf("%s.tmp.%d", path, MyProcPid);
+    FILE *file = AllocateFile(tmppath, PG_BINARY_W);
+
+    if (!file)
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not create file \"%s\": %m", tmppath),
+                 errhint("Check that nominatim_fdw.transport_directory exists and is writable by the server.")));
+
+    if (fwrite(data, 1, size, file) != size || FreeFile(file) != 0)
+    {
+        int save_errno = errno;
+
+        unlink(tmppath);
+        errno = save_errno;
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not write file \"%s\": %m", tmppath)));
+    }
+
+    if (rename(tmppath, path) != 0)
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not rename file \"%s\" to \"%s\": %m", tmppath, path)));
+}
+
+/*
+ * RecordResponse
+ * ----------
+ * Saves the URL and the response body of a successful request in the
+ * directory set in nominatim_fdw.transport_directory (record mode), as
+ * <hash>.url and <hash>.xml (or .json for jsonv2 responses).
+ *
+ * state: NominatimFDWState containing all session data
+ * req: the completed request
+ */
+static void RecordResponse(NominatimFDWState *state, NominatimRequest *req)
+{
+    char *path = GetRecordingPath(req->url.data);
+    const char *extension = strcmp(state->format, NOMINATIM_FORMAT_JSONV2) == 0 ? "json" : "xml";
+
+    WriteRecordingFile(psprintf("%s.%s", path, extension), req->chunk.memory, req->chunk.size);
+    WriteRecordingFile(psprintf("%s.url", path), req->url.data, req->url.len);
+
+    elog(DEBUG1, "RecordResponse: %ld bytes recorded in \"%s.%s\"", req->chunk.size, path, extension);
+}
+
+/*
+ * ReplayRequest
+ * ----------
+ * Answers a request from the responses recorded in the directory set in
+ * nominatim_fdw.transport_directory (replay mode), without contacting the
+ * server. The response is stored in state->xmldoc, or in
+ * state->raw_response for raw requests.
+ *
+ * state: NominatimFDWState containing all session data
+ * req: NominatimRequest set up by PrepareRequest
+ *
+ * returns REQUEST_SUCCESS or REQUEST_FAIL
+ */
+static int ReplayRequest(NominatimFDWState *state, NominatimRequest *req)
+{
+    char *path = GetRecordingPath(req->url.data);
+    const char *extension = strcmp(state->format, NOMINATIM_FORMAT_JSONV2) == 0 ? "json" : "xml";
+    char *url;
+    char *body = NULL;
+    size_t size = 0;
+
+    /* the URL tells hash collisions apart */
+    url = ReadRecordingFile(psprintf("%s.url", path), &size);
+
+    if (url && strcmp(url, req->url.data) == 0)
+        body = ReadRecordingFile(psprintf("%s.%s", path, extension), &size);
+
+    if (!body)
+        ereport(ERROR,
+                (errcode(ERRCODE_FDW_UNABLE_TO_CREATE_EXECUTION),
+                 errmsg("no recorded response for nominatim request"),
+                 errdetail("URL: \"%s\"", req->url.data),
+                 errhint("Record it with nominatim_fdw.transport set to 'record'.")));
+
+    elog(DEBUG1, "ReplayRequest: %zu bytes replayed from \"%s.%s\"", size, path, extension);
+
+    ReleaseRequest(state, req);
+
+    if (state->cached)
+        CacheResponse(req->url.data, body, size);
+
+    if (state->stats)
+    {
+        state->stats->requests++;
+        state->stats->bytes += size;
+        resetStringInfo(state->stats->url);
+        appendStringInfoString(state->stats->url, req->url.data);
+    }
+
+    if (state->raw)
+        state->raw_response = size > 0 ? body : NULL;
+    else
+    {
+        instr_time start;
+        instr_time parse_time;
+
+        INSTR_TIME_SET_CURRENT(start);
+
+        state->xmldoc = xmlReadMemory(body, size, NULL, NULL, XML_PARSE_NOBLANKS | XML_PARSE_NONET);
+
+        INSTR_TIME_SET_CURRENT(parse_time);
+        INSTR_TIME_SUBTRACT(parse_time, start);
+
+        if (state->stats)
+            state->stats->parse_ms += INSTR_TIME_GET_MILLISEC(parse_time);
+
+        pfree(body);
+    }
+
+    if (state->raw ? !state->raw_response : !state->xmldoc)
+        return REQUEST_FAIL;
+
+    return REQUEST_SUCCESS;
+}
+
+/*
+ * AppendCaptureInt
+ * ----------
+ * Appends an unsigned integer to a capture record, little-endian.
+ *
+ * buf: the record
+ * value: the integer
+ * bytes: width of the integer in the record (1, 2, 4 or 8)
+ */
+static void AppendCaptureInt(StringInfo buf, uint64 value, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+        appendStringInfoChar(buf, (char)((value >> (8 * i)) & 0xFF));
+}
+
+/*
+ * CaptureRequest
+ * ----------
+ * Appends a request sent to a server to nominatim_fdw.capture_file, so that
+ * the workload can be replayed later (bench/replay_capture.py). Each record
+ * is written with a single write() to a file opened with O_APPEND, so that
+ * the records of concurrent backends do not interleave. All integers are
+ * little-endian:
+ *
+ *   uint32  length of the rest of the record
+ *   uint8   version (NOMINATIM_CAPTURE_VERSION)
+ *   uint8   request type (index in request_types[])
+ *   uint16  HTTP status (0 if no response was received)
+ *   int64   start of the request, in microseconds since the Unix epoch
+ *   uint32  duration of the request in microseconds, including retries
+ *   uint32  process ID of the backend
+ *   uint8   retries
+ *   uint16  length of the server name, followed by the name
+ *   uint32  length of the parameters, followed by the query string of the
+ *           request (the email parameter is redacted)
+ *
+ * A capture file that cannot be written raises a WARNING, as the request
+ * itself has succeeded.
+ *
+ * state: NominatimFDWState containing all session data
+ * req: the completed request
+ * retries: number of times the request was retried
+ */
+static void CaptureRequest(NominatimFDWState *state, NominatimRequest *req, long retries)
+{
+    StringInfoData record;
+    instr_time elapsed;
+    uint64 duration;
+    TimestampTz started;
+    long response_code = 0;
+    const char *servername = state->server ? state->server->servername : "";
+    char *url;
+    char *params;
+    int type = 0;
+    int fd;
+
+    if (!capture_file || capture_file[0] == '\0')
+        return;
+
+    INSTR_TIME_SET_CURRENT(elapsed);
+    INSTR_TIME_SUBTRACT(elapsed, req->started);
+    duration = INSTR_TIME_GET_MICROSEC(elapsed);
+    started = GetCurrentTimestamp() - (TimestampTz)duration;
+
+    curl_easy_getinfo(req->curl, CURLINFO_RESPONSE_CODE, &response_code);
+
+    for (int i = 0; i < lengthof(request_types); i++)
+        if (state->request_type && strcmp(state->request_type, request_types[i]) == 0)
+            type = i;
+
+    url = RedactURL(req->url.data);
+    params = strchr(url, '?');
+    params = params ? params + 1 : "";
+
+    initStringInfo(&record);
+    AppendCaptureInt(&record, 0, 4); /* length, set below */
+    AppendCaptureInt(&record, NOMINATIM_CAPTURE_VERSION, 1);
+    AppendCaptureInt(&record, type, 1);
+    AppendCaptureInt(&record, Min(Max(response_code, 0), PG_UINT16_MAX), 2);
+    AppendCaptureInt(&record,
+                     (uint64)(started + (POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE) * SECS_PER_DAY * USECS_PER_SEC),
+                     8);
+    AppendCaptureInt(&record, Min(duration, PG_UINT32_MAX), 4);
+    AppendCaptureInt(&record, MyProcPid, 4);
+    AppendCaptureInt(&record, Min(retries, PG_UINT8_MAX), 1);
+    AppendCaptureInt(&record, strlen(servername), 2);
+    appendStringInfoString(&record, servername);
+    AppendCaptureInt(&record, strlen(params), 4);
+    appendStringInfoString(&record, params);
+
+    for (int i = 0; i < 4; i++)
+        record.data[i] = (char)(((uint32)(record.len - 4) >> (8 * i)) & 0xFF);
+
+#if PG_VERSION_NUM >= 110000
+    fd = OpenTransientFile(capture_file, O_WRONLY | O_APPEND | O_CREAT | PG_BINARY);
+#else
+    fd = OpenTransientFile(capture_file, O_WRONLY | O_APPEND | O_CREAT | PG_BINARY, S_IRUSR | S_IWUSR);
+#endif
+
+    if (fd < 0)
+        ereport(WARNING,
+                (errcode_for_file_access(),
+                 errmsg("could not open capture file \"%s\": %m", capture_file),
+                 errhint("Check that nominatim_fdw.capture_file is writable by the server.")));
+    else
+    {
+        if (write(fd, record.data, record.len) != record.len)
+            ereport(WARNING,
+                    (errcode_for_file_access(),
+                     errmsg("could not write capture file \"%s\": %m", capture_file)));
+
+        CloseTransientFile(fd);
+    }
+
+    pfree(record.data);
+    pfree(url);
+}
+
+/*
+ * ReleaseRequest
+ * ----------
+ * Releases the resources of a request set up by PrepareRequest that is
+ * answered without contacting the server.
+ */
+static void ReleaseRequest(NominatimFDWState *state, NominatimRequest *req)
+{
+    pfree(req->chunk.memory);
+    pfree(req->chunk_header.memory);
+    curl_slist_free_all(req->headers);
+    if (!state->curl)
+        curl_easy_cleanup(req->curl);
+}
+
+/*
+ * CollectRequestStats
+ * ----------
+ * Adds a successful request to the counters of a foreign table scan: its
+ * size and how long each phase of the transfer took, as reported by cURL.
+ *
+ * stats: counters of the scan
+ * req: the completed request
+ */
+static void CollectRequestStats(NominatimRequestStats *stats, NominatimRequest *req)
+{
+    double namelookup = 0;
+    double connect = 0;
+    double appconnect = 0;
+    double starttransfer = 0;
+    double total = 0;
+
+    curl_easy_getinfo(req->curl, CURLINFO_NAMELOOKUP_TIME, &namelookup);
+    curl_easy_getinfo(req->curl, CURLINFO_CONNECT_TIME, &connect);
+    curl_easy_getinfo(req->curl, CURLINFO_APPCONNECT_TIME, &appconnect);
+    curl_easy_getinfo(req->curl, CURLINFO_STARTTRANSFER_TIME, &starttransfer);
+    curl_easy_getinfo(req->curl, CURLINFO_TOTAL_TIME, &total);
+
+    /* the times are cumulative since the start of the request; reused connections skip the handshakes */
+    stats->requests++;
+    stats->bytes += req->chunk.size;
+    stats->dns_ms += namelookup * 1000.0;
+    stats->connect_ms += Max(connect - namelookup, 0) * 1000.0;
+    stats->tls_ms += (appconnect > 0 ? Max(appconnect - connect, 0) : 0) * 1000.0;
+    stats->first_byte_ms += Max(starttransfer - Max(connect, appconnect), 0) * 1000.0;
+    stats->transfer_ms += Max(total - starttransfer, 0) * 1000.0;
+
+    resetStringInfo(stats->url);
+    appendStringInfoString(stats->url, req->url.data);
+}
+
+/*
+ * GetStatementCache
+ * ----------
+ * Returns the response cache of the current statement, creating it if the
+ * cache at hand belongs to a previous statement. It lives in a child of
+ * TopTransactionContext, so it goes away with the transaction at the latest.
+ *
+ * returns HTAB of NominatimCachedResponse, keyed by request URL
+ */
+static HTAB *GetStatementCache(void)
+{
+    HASHCTL ctl;
+    MemoryContextCallback *callback;
+
+    if (statement_cache && statement_cache_start == GetCurrentStatementStartTimestamp())
+        return statement_cache;
+
+    if (statement_cache_context)
+        MemoryContextDelete(statement_cache_context);
+
+    statement_cache_context = AllocSetContextCreate(TopTransactionContext,
+                                                    "nominatim_fdw statement cache",
+                                                    ALLOCSET_DEFAULT_SIZES);
+
+    callback = (MemoryContextCallback *)MemoryContextAllocZero(statement_cache_context, sizeof(MemoryContextCallback));
+    callback->func = ForgetStatementCache;
+    MemoryContextRegisterResetCallback(statement_cache_context, callback);
+
+    memset(&ctl, 0, sizeof(ctl));
+    ctl.keysize = sizeof(char *);
+    ctl.entrysize = sizeof(NominatimCachedResponse);
+    ctl.hash = StatementCacheHash;
+    ctl.match = StatementCacheMatch;
+    ctl.hcxt = statement_cache_context;
+    statement_cache = hash_create("nominatim_fdw statement cache", 64, &ctl,
+                                  HASH_ELEM | HASH_FUNCTION | HASH_COMPARE | HASH_CONTEXT);
+    statement_cache_start = GetCurrentStatementStartTimestamp();
+
+    return statement_cache;
+}
+
+/*
+ * ForgetStatementCache
+ * ----------
+ * Memory context callback: the statement cache is about to be freed (new
+ * statement or end of transaction).
+ */
+static void ForgetStatementCache(void *arg)
+{
+    statement_cache = NULL;
+    statement_cache_context = NULL;
+}
+
+/*
+ * StatementCacheHash
+ * ----------
+ * Hashes the request URL a statement cache key points to (FNV-1a).
+ */
+static uint32 StatementCacheHash(const void *key, Size keysize)
+{
+    const unsigned char *c = *(const unsigned char *const *)key;
+    uint32 hash = 2166136261u;
+
+    for (; *c; c++)
+        hash = (hash ^ *c) * 16777619u;
+
+    return hash;
+}
+
+/*
+ * StatementCacheMatch
+ * ----------
+ * Compares the request URLs two statement cache keys point to.
+ */
+static int StatementCacheMatch(const void *key1, const void *key2, Size keysize)
+{
+    return strcmp(*(const char *const *)key1, *(const char *const *)key2);
+}
+
+/*
+ * CacheResponse
+ * ----------
+ * Keeps a copy of a response body in the statement cache.
+ *
+ * url: request URL
+ * body: response body
+ * size: size of the response body
+ */
+static void CacheResponse(const char *url, const char *body, size_t size)
+{
+    HTAB *cache = GetStatementCache();
+    NominatimCachedResponse *entry;
+    bool found;
+
+    entry = (NominatimCachedResponse *)hash_search(cache, &url, HASH_ENTER, &found);
+
+    if (found)
+        return;
+
+    /* the key still points to the caller's URL */
+    entry->url = MemoryContextStrdup(statement_cache_context, url);
+    entry->body = MemoryContextAlloc(statement_cache_context, size + 1);
+    memcpy(entry->body, body, size);
+    entry->body[size] = '\0';
+    entry->size = size;
+}
+
+/*
+ * GetServerLatency
+ * ----------
+ * Session entry of a server, created on first use.
+ *
+ * servername: foreign server's name
+ *
+ * returns NominatimServerLatency of the server
+ */
+static NominatimServerLatency *GetServerLatency(const char *servername)
+{
+    NominatimServerLatency *entry;
+    char key[NAMEDATALEN];
+    bool found;
+
+    if (!server_latency)
+    {
+        HASHCTL ctl;
+
+        memset(&ctl, 0, sizeof(ctl));
+        ctl.keysize = NAMEDATALEN;
+        ctl.entrysize = sizeof(NominatimServerLatency);
+        ctl.hcxt = TopMemoryContext;
+        server_latency = hash_create("nominatim_fdw server latency", 8, &ctl,
+                                     HASH_ELEM | HASH_CONTEXT
+#if PG_VERSION_NUM >= 140000
+                                     | HASH_STRINGS
+#endif
+        );
+    }
+
+    memset(key, 0, sizeof(key));
+    strlcpy(key, servername, NAMEDATALEN);
+
+    entry = (NominatimServerLatency *)hash_search(server_latency, key, HASH_ENTER, &found);
+
+    if (!found)
+    {
+        entry->requests = 0;
+        entry->total_ms = 0.0;
+        entry->throttled = false;
+    }
+
+    return entry;
+}
+
+/*
+ * RecordRequestLatency
+ * ----------
+ * Adds the duration of a successful request to the latency statistics of
+ * the server, which are kept for the whole session.
+ *
+ * servername: foreign server's name
+ * ms: duration of the request in milliseconds
+ */
+static void RecordRequestLatency(const char *servername, double ms)
+{
+    NominatimServerLatency *entry = GetServerLatency(servername);
+
+    entry->requests++;
+    entry->total_ms += ms;
+}
+
+/*
+ * GetRequestCost
+ * ----------
+ * Estimates the cost of a request to the server, based on the average
+ * latency of the requests sent to it in this session. Servers that haven't
+ * been asked anything yet are assumed to answer in NOMINATIM_DEFAULT_LATENCY_MS.
+ *
+ * servername: foreign server's name (NULL if unknown)
+ *
+ * returns Cost of a single request
+ */
+static Cost GetRequestCost(const char *servername)
+{
+    NominatimServerLatency *entry = NULL;
+    char key[NAMEDATALEN];
+
+    if (server_latency && servername)
+    {
+        memset(key, 0, sizeof(key));
+        strlcpy(key, servername, NAMEDATALEN);
+        entry = (NominatimServerLatency *)hash_search(server_latency, key, HASH_FIND, NULL);
+    }
+
+    if (!entry || entry->requests == 0)
+        return NOMINATIM_REQUEST_COST;
+
+    return (entry->total_ms / entry->requests) * NOMINATIM_COST_PER_MS;
+}
+
+/*
+ * ThrottleDelay
+ * ----------
+ * Milliseconds until the server's max_requests_per_second allows this
+ * backend to send the next request. The limit applies to each backend, or
+ * is split between the workers of nominatim_geocode_table.
+ *
+ * state: NominatimFDWState containing all session data
+ *
+ * returns 0 if the request can be sent right away
+ */
+static double ThrottleDelay(NominatimFDWState *state)
+{
+    NominatimServerLatency *entry;
+    instr_time elapsed;
+    double remaining_ms;
+
+    if (state->max_requests_per_second <= 0 || !state->server)
+        return 0;
+
+    entry = GetServerLatency(state->server->servername);
+
+    if (!entry->throttled)
+        return 0;
+
+    INSTR_TIME_SET_CURRENT(elapsed);
+    INSTR_TIME_SUBTRACT(elapsed, entry->last_request);
+    remaining_ms = 1000.0 * throttle_share / state->max_requests_per_second - INSTR_TIME_GET_MILLISEC(elapsed);
+
+    return Max(remaining_ms, 0);
+}
+
+/*
+ * ThrottleRequest
+ * ----------
+ * Waits until ThrottleDelay allows this backend to send the next request,
+ * and marks it as sent. The wait is reported as NominatimRateLimit and is
+ * not counted in the duration of the request.
+ *
+ * state: NominatimFDWState containing all session data
+ * req: request about to be sent
+ */
+static void ThrottleRequest(NominatimFDWState *state, NominatimRequest *req)
+{
+    NominatimServerLatency *entry;
+    double remaining_ms;
+
+    if (state->max_requests_per_second <= 0 || !state->server)
+        return;
+
+    while ((remaining_ms = ThrottleDelay(state)) > 0)
+    {
+        CHECK_FOR_INTERRUPTS();
+
+        RegisterWaitEvents();
+        pgstat_report_wait_start(wait_event_ratelimit);
+        pg_usleep((long)(Min(remaining_ms, 100.0) * 1000.0));
+        pgstat_report_wait_end();
+    }
+
+    entry = GetServerLatency(state->server->servername);
+    INSTR_TIME_SET_CURRENT(entry->last_request);
+    entry->throttled = true;
+    req->started = entry->last_request;
+}
+
+#if PG_VERSION_NUM >= 120000
+/*
+ * GetConstArg
+ * ----------
+ * Returns the argument of a function call with the given parameter name if
+ * it is a non-null constant, so that the planner support function can look
+ * into it. The planner has already put the arguments in positional order
+ * and added the defaults.
+ *
+ * expr: the function call
+ * name: name of the parameter in the function's declaration
+ *
+ * returns Const or NULL
+ */
+static Const *GetConstArg(FuncExpr *expr, const char *name)
+{
+    HeapTuple proctup;
+    Oid *argtypes;
+    char **argnames;
+    char *argmodes;
+    int nargs;
+    int n = 0;
+    Node *arg;
+
+    proctup = SearchSysCache1(PROCOID, ObjectIdGetDatum(expr->funcid));
+
+    if (!HeapTupleIsValid(proctup))
+        return NULL;
+
+    nargs = get_func_arg_info(proctup, &argtypes, &argnames, &argmodes);
+    ReleaseSysCache(proctup);
+
+    if (!argnames)
+        return NULL;
+
+    for (int i = 0; i < nargs; i++)
+    {
+        /* output parameters are not part of the call */
+        if (argmodes && (argmodes[i] == PROARGMODE_OUT || argmodes[i] == PROARGMODE_TABLE))
+            continue;
+
+        if (strcmp(argnames[i], name) == 0)
+            break;
+
+        n++;
+    }
+
+    if (list_length(expr->args) <= n)
+        return NULL;
+
+    arg = (Node *)list_nth(expr->args, n);
+
+    if (!IsA(arg, Const) || ((Const *)arg)->constisnull)
+        return NULL;
+
+    return (Const *)arg;
+}
+
+/*
+ * EstimateFunctionCall
+ * ----------
+ * Estimates how many rows a call of one of the nominatim functions returns
+ * and how many requests it sends, based on its constant arguments: reverse
+ * returns at most one place, search at most 'limit_result' places (up to
+ * 40, or 10 if no limit is given, as the server does), lookup at most one
+ * place per OSM id, and the paged search one request per 40 places. The
+ * functions are told apart by their C function, so that the variants
+ * sharing one (e.g. _cached and _geom) are estimated alike.
+ */
+static void EstimateFunctionCall(FuncExpr *expr, double *rows, double *requests)
+{
+    HeapTuple proctup;
+    Datum datum;
+    bool isnull;
+    char *prosrc;
+    Const *arg;
+
+    *rows = NOMINATIM_DEFAULT_RESULT_ROWS;
+    *requests = 1;
+
+    proctup = SearchSysCache1(PROCOID, ObjectIdGetDatum(expr->funcid));
+
+    if (!HeapTupleIsValid(proctup))
+        return;
+
+    datum = SysCacheGetAttr(PROCOID, proctup, Anum_pg_proc_prosrc, &isnull);
+    prosrc = isnull ? NULL : TextDatumGetCString(datum);
+    ReleaseSysCache(proctup);
+
+    if (!prosrc)
+        return;
+
+    if (strcmp(prosrc, "nominatim_fdw_reverse") == 0 ||
+        strcmp(prosrc, "nominatim_fdw_reverse_point") == 0)
+        *rows = 1;
+    else if (strcmp(prosrc, "nominatim_fdw_lookup") == 0)
+    {
+        *rows = NOMINATIM_MAX_LOOKUP_IDS;
+
+        if ((arg = GetConstArg(expr, "osm_ids")) != NULL)
+        {
+            char *osm_ids = TextDatumGetCString(arg->constvalue);
+            char *c;
+
+            *rows = strlen(osm_ids) > 0 ? 1 : 0;
+
+            for (c = osm_ids; *c; c++)
+                if (*c == ',')
+                    (*rows)++;
+        }
+    }
+    else if (strcmp(prosrc, "nominatim_fdw_search_paged") == 0)
+    {
+        *rows = NOMINATIM_DEFAULT_PAGED_ROWS;
+
+        if ((arg = GetConstArg(expr, "limit_result")) != NULL && DatumGetInt32(arg->constvalue) > 0)
+            *rows = DatumGetInt32(arg->constvalue);
+
+        *requests = ceil(*rows / NOMINATIM_MAX_PAGE_SIZE);
+    }
+    else if (strcmp(prosrc, "nominatim_fdw_search") == 0 ||
+             strcmp(prosrc, "nominatim_fdw_search_point") == 0)
+    {
+        if ((arg = GetConstArg(expr, "limit_result")) != NULL && DatumGetInt32(arg->constvalue) > 0)
+            *rows = Min(DatumGetInt32(arg->constvalue), NOMINATIM_MAX_PAGE_SIZE);
+    }
+
+    pfree(prosrc);
+}
+#endif
+
+/*
+ * nominatim_fdw_support
+ * ----------
+ * Planner support function of the nominatim functions (PostgreSQL 12+). It
+ * replaces the default estimates of 1000 rows and a negligible cost per call
+ * with the number of rows each call can actually return and the cost of the
+ * requests it sends to the server, so that the planner doesn't materialize
+ * the geocoder side of a join or order nested loops the wrong way around.
+ */
+Datum nominatim_fdw_support(PG_FUNCTION_ARGS)
+{
+#if PG_VERSION_NUM >= 120000
+    Node *rawreq = (Node *)PG_GETARG_POINTER(0);
+    double rows;
+    double requests;
+
+    if (IsA(rawreq, SupportRequestRows))
+    {
+        SupportRequestRows *req = (SupportRequestRows *)rawreq;
+
+        if (req->node && IsA(req->node, FuncExpr))
+        {
+            EstimateFunctionCall((FuncExpr *)req->node, &rows, &requests);
+            req->rows = Max(rows, 1);
+
+            PG_RETURN_POINTER(req);
+        }
+    }
+    else if (IsA(rawreq, SupportRequestCost))
+    {
+        SupportRequestCost *req = (SupportRequestCost *)rawreq;
+
+        if (req->node && IsA(req->node, FuncExpr))
+        {
+            FuncExpr *expr = (FuncExpr *)req->node;
+            Const *server = GetConstArg(expr, "server_name");
+
+            EstimateFunctionCall(expr, &rows, &requests);
+            req->startup = 0;
+            req->per_tuple = requests * GetRequestCost(server ? TextDatumGetCString(server->constvalue) : NULL);
+
+            PG_RETURN_POINTER(req);
+        }
+    }
+#endif
+
+    PG_RETURN_POINTER(NULL);
+}
+
+/*
+ * SharedStateSize
+ * ----------
+ * Size of the shared memory reserved by nominatim_fdw: the shared state,
+ * the DSA area holding the cached records and the cache's hash table.
+ */
+static Size SharedStateSize(void)
+{
+    Size size = MAXALIGN(sizeof(NominatimSharedState));
+
+    if (cache_size > 0)
+    {
+        size = add_size(size, SharedCacheAreaSize());
+        size = add_size(size, hash_estimate_size(SharedCacheMaxEntries(), sizeof(NominatimCacheEntry)));
+    }
+
+    return size;
+}
+
+/*
+ * SharedCacheAreaSize
+ * ----------
+ * Size of the DSA area holding the cached records (nominatim_fdw.cache_size).
+ */
+static Size SharedCacheAreaSize(void)
+{
+    return Max((Size)cache_size * 1024, dsa_minimum_size());
+}
+
+/*
+ * SharedCacheMaxEntries
+ * ----------
+ * Number of entries the cache's hash table can hold, derived from
+ * nominatim_fdw.cache_size and the typical size of a response.
+ */
+static long SharedCacheMaxEntries(void)
+{
+    return Max(SharedCacheAreaSize() / NOMINATIM_CACHE_ENTRY_SIZE, 64);
+}
+
+#if PG_VERSION_NUM >= 150000
+/*
+ * nominatim_shmem_request
+ * ----------
+ * shmem_request_hook: reserves the shared memory and the locks of
+ * nominatim_fdw.
+ */
+static void nominatim_shmem_request(void)
+{
+    if (prev_shmem_request_hook)
+        prev_shmem_request_hook();
+
+    RequestAddinShmemSpace(SharedStateSize());
+    RequestNamedLWLockTranche("nominatim_fdw", 2);
+}
+#endif
+
+/*
+ * nominatim_shmem_startup
+ * ----------
+ * shmem_startup_hook: initializes the shared state of nominatim_fdw, or
+ * attaches to it in EXEC_BACKEND builds.
+ */
+static void nominatim_shmem_startup(void)
+{
+    HASHCTL info;
+    bool found;
+
+    if (prev_shmem_startup_hook)
+        prev_shmem_startup_hook();
+
+    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+    nominatim_shared = ShmemInitStruct("nominatim_fdw", SharedStateSize(), &found);
+
+    if (!found)
+    {
+        nominatim_shared->lock = &(GetNamedLWLockTranche("nominatim_fdw"))[0].lock;
+        nominatim_shared->cache_lock = &(GetNamedLWLockTranche("nominatim_fdw"))[1].lock;
+        dlist_init(&nominatim_shared->cache_lru);
+        pg_atomic_init_u64(&nominatim_shared->cache_hits, 0);
+        pg_atomic_init_u64(&nominatim_shared->cache_misses, 0);
+        pg_atomic_init_u64(&nominatim_shared->cache_evictions, 0);
+        pg_atomic_init_u64(&nominatim_shared->coalesced, 0);
+
+        for (int i = 0; i < NOMINATIM_MAX_IN_FLIGHT; i++)
+        {
+            nominatim_shared->inflight[i].leader = 0;
+            ConditionVariableInit(&nominatim_shared->inflight[i].cv);
+        }
+
+        pg_atomic_init_u32(&nominatim_shared->num_server_stats, 0);
+
+        for (int i = 0; i < NOMINATIM_MAX_SERVER_STATS; i++)
+            ResetServerStats(&nominatim_shared->server_stats[i], true);
+
+        for (int i = 0; i < NOMINATIM_MAX_ACTIVITY; i++)
+        {
+            nominatim_shared->activity[i].pid = 0;
+            nominatim_shared->activity[i].changecount = 0;
+            nominatim_shared->activity[i].active = false;
+        }
+
+        nominatim_shared->recent_count = 0;
+
+        if (cache_size > 0)
+        {
+            dsa_area *area;
+
+            nominatim_shared->cache_tranche = LWLockNewTrancheId();
+            area = dsa_create_in_place(NOMINATIM_SHARED_CACHE_AREA(nominatim_shared),
+                                       SharedCacheAreaSize(),
+                                       nominatim_shared->cache_tranche, NULL);
+            /* the cache must not grow beyond nominatim_fdw.cache_size */
+            dsa_set_size_limit(area, SharedCacheAreaSize());
+            dsa_pin(area);
+            dsa_detach(area);
+        }
+    }
+
+    if (cache_size > 0)
+    {
+        memset(&info, 0, sizeof(info));
+        info.keysize = sizeof(uint64);
+        info.entrysize = sizeof(NominatimCacheEntry);
+        shared_cache = ShmemInitHash("nominatim_fdw cache",
+                                     SharedCacheMaxEntries(), SharedCacheMaxEntries(),
+                                     &info, HASH_ELEM | HASH_BLOBS);
+    }
+
+    LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * GetSharedCacheArea
+ * ----------
+ * Attaches this backend to the DSA area of the shared cache.
+ *
+ * returns dsa_area or NULL if there is no shared cache
+ */
+static dsa_area *GetSharedCacheArea(void)
+{
+    MemoryContext oldcontext;
+
+    if (shared_cache_area)
+        return shared_cache_area;
+
+    if (!nominatim_shared || !shared_cache)
+        return NULL;
+
+    oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+    LWLockRegisterTranche(nominatim_shared->cache_tranche, "nominatim_fdw cache");
+    shared_cache_area = dsa_attach_in_place(NOMINATIM_SHARED_CACHE_AREA(nominatim_shared), NULL);
+    dsa_pin_mapping(shared_cache_area);
+    MemoryContextSwitchTo(oldcontext);
+
+    return shared_cache_area;
+}
+
+/*
+ * HashCacheKey
+ * ----------
+ * Fingerprint of a cache key (64-bit FNV-1a). Collisions are detected by
+ * comparing the key stored with the records.
+ */
+static uint64 HashCacheKey(const char *key)
+{
+    const unsigned char *c;
+    uint64 hash = UINT64CONST(14695981039346656037);
+
+    for (c = (const unsigned char *)key; *c; c++)
+        hash = (hash ^ *c) * UINT64CONST(1099511628211);
+
+    return hash;
+}
+
+/*
+ * SerializeRecords
+ * ----------
+ * Appends the records to buf in the compact form kept in the shared cache:
+ * the number of records, followed by the length (-1 for NULL) and the
+ * content of each field of each record.
+ */
+static void SerializeRecords(StringInfo buf, List *records)
+{
+    int32 count = list_length(records);
+    ListCell *cell;
+
+    appendBinaryStringInfo(buf, (char *)&count, sizeof(int32));
+
+    foreach (cell, records)
+    {
+        NominatimRecord *place = (NominatimRecord *)lfirst(cell);
+
+        for (int i = 0; i < lengthof(record_fields); i++)
+        {
+            char *value = *(char **)((char *)place + record_fields[i]);
+            int32 len = value ? strlen(value) : -1;
+
+            appendBinaryStringInfo(buf, (char *)&len, sizeof(int32));
+            if (value)
+                appendBinaryStringInfo(buf, value, len);
+        }
+    }
+}
+
+/*
+ * DeserializeRecords
+ * ----------
+ * Rebuilds the records serialized by SerializeRecords in the current memory
+ * context.
+ *
+ * returns List of NominatimRecord
+ */
+static List *DeserializeRecords(const char *data)
+{
+    List *records = NIL;
+    int32 count;
+
+    memcpy(&count, data, sizeof(int32));
+    data += sizeof(int32);
+
+    for (int32 r = 0; r < count; r++)
+    {
+        NominatimRecord *place = (NominatimRecord *)palloc0(sizeof(NominatimRecord));
+
+        for (int i = 0; i < lengthof(record_fields); i++)
+        {
+            int32 len;
+
+            memcpy(&len, data, sizeof(int32));
+            data += sizeof(int32);
+
+            if (len >= 0)
+            {
+                *(char **)((char *)place + record_fields[i]) = pnstrdup(data, len);
+                data += len;
+            }
+        }
+
+        records = lappend(records, place);
+    }
+
+    return records;
+}
+
+/*
+ * SharedCacheLookup
+ * ----------
+ * Looks for the records of a request in the shared cache.
+ *
+ * state: NominatimFDWState of the request; state->records is set on a hit
+ * key: cache key of the request
+ *
+ * returns true if the records were found
+ */
+static bool SharedCacheLookup(NominatimFDWState *state, const char *key)
+{
+    dsa_area *area = GetSharedCacheArea();
+    uint64 fingerprint = HashCacheKey(key);
+    NominatimCacheEntry *entry;
+    char *data = NULL;
+    bool hit = false;
+
+    if (!area)
+        return false;
+
+    LWLockAcquire(nominatim_shared->cache_lock, LW_SHARED);
+
+    entry = (NominatimCacheEntry *)hash_search(shared_cache, &fingerprint, HASH_FIND, NULL);
+
+    if (entry && entry->expires > GetCurrentTimestamp())
+    {
+        char *cached = (char *)dsa_get_address(area, entry->data);
+
+        /* copy the records out, so that other backends don't wait for the parsing */
+        if (strcmp(cached, key) == 0)
+        {
+            data = (char *)palloc(entry->size);
+            memcpy(data, cached, entry->size);
+            /* a racy update under the shared lock is good enough for the eviction */
+            entry->referenced = true;
+        }
+    }
+
+    LWLockRelease(nominatim_shared->cache_lock);
+
+    if (data)
+    {
+        state->records = DeserializeRecords(data + strlen(key) + 1);
+        pfree(data);
+        hit = true;
+    }
+
+    pg_atomic_fetch_add_u64(hit ? &nominatim_shared->cache_hits : &nominatim_shared->cache_misses, 1);
+
+    elog(DEBUG2, "  %s: %s \"%s\"", __func__, hit ? "hit" : "miss", key);
+
+    return hit;
+}
+
+/*
+ * EvictSharedCacheEntry
+ * ----------
+ * Removes an entry from the shared cache: the one at the tail of the
+ * eviction list, unless it was hit since it got there, in which case it is
+ * moved back to the head (second chance). The caller must hold the cache
+ * lock exclusively.
+ *
+ * returns false if the cache is empty
+ */
+static bool EvictSharedCacheEntry(dsa_area *area)
+{
+    NominatimCacheEntry *victim;
+    TimestampTz now = GetCurrentTimestamp();
+
+    for (;;)
+    {
+        if (dlist_is_empty(&nominatim_shared->cache_lru))
+            return false;
+
+        victim = dlist_tail_element(NominatimCacheEntry, lru, &nominatim_shared->cache_lru);
+
+        if (!victim->referenced || victim->expires <= now)
+            break;
+
+        victim->referenced = false;
+        dlist_move_head(&nominatim_shared->cache_lru, &victim->lru);
+    }
+
+    RemoveSharedCacheEntry(area, victim);
+    pg_atomic_fetch_add_u64(&nominatim_shared->cache_evictions, 1);
+
+    return true;
+}
+
+/*
+ * RemoveSharedCacheEntry
+ * ----------
+ * Frees the records of an entry and removes it from the shared cache and
+ * its eviction list. The caller must hold the cache lock exclusively.
+ */
+static void RemoveSharedCacheEntry(dsa_area *area, NominatimCacheEntry *entry)
+{
+    uint64 fingerprint = entry->fingerprint;
+
+    dsa_free(area, entry->data);
+    dlist_delete(&entry->lru);
+    hash_search(shared_cache, &fingerprint, HASH_REMOVE, NULL);
+}
+
+/*
+ * SharedCacheStore
+ * ----------
+ * Keeps the records of a successful request in the shared cache, for as
+ * long as the server's cache_ttl (or cache_negative_ttl for empty results)
+ * says. If the cache is full, entries are evicted in the order they were
+ * stored, skipping once those that were hit in the meantime (CLOCK).
+ *
+ * state: NominatimFDWState of the request, with its parsed records
+ */
+static void SharedCacheStore(NominatimFDWState *state)
+{
+    dsa_area *area = GetSharedCacheArea();
+    int ttl = state->records ? state->cache_ttl : state->cache_negative_ttl;
+    NominatimCacheEntry *entry;
+    StringInfoData buf;
+    uint64 fingerprint;
+    dsa_pointer data;
+
+    if (!area || !state->cache_key || ttl <= 0)
+        return;
+
+    initStringInfo(&buf);
+    appendBinaryStringInfo(&buf, state->cache_key, strlen(state->cache_key) + 1);
+    SerializeRecords(&buf, state->records);
+    fingerprint = HashCacheKey(state->cache_key);
+
+    LWLockAcquire(nominatim_shared->cache_lock, LW_EXCLUSIVE);
+
+    /* replace what is already there, e.g. an expired entry */
+    entry = (NominatimCacheEntry *)hash_search(shared_cache, &fingerprint, HASH_FIND, NULL);
+    if (entry)
+        RemoveSharedCacheEntry(area, entry);
+
+    while (hash_get_num_entries(shared_cache) >= SharedCacheMaxEntries() &&
+           EvictSharedCacheEntry(area))
+        ;
+
+    data = dsa_allocate_extended(area, buf.len, DSA_ALLOC_NO_OOM);
+    while (!DsaPointerIsValid(data) && EvictSharedCacheEntry(area))
+        data = dsa_allocate_extended(area, buf.len, DSA_ALLOC_NO_OOM);
+
+    if (DsaPointerIsValid(data))
+    {
+        entry = (NominatimCacheEntry *)hash_search(shared_cache, &fingerprint, HASH_ENTER_NULL, NULL);
+
+        if (entry)
+        {
+            memcpy(dsa_get_address(area, data), buf.data, buf.len);
+            entry->data = data;
+            entry->size = buf.len;
+            entry->expires = TimestampTzPlusMilliseconds(GetCurrentTimestamp(), (int64)ttl * 1000);
+            entry->referenced = false;
+            dlist_push_head(&nominatim_shared->cache_lru, &entry->lru);
+        }
+        else
+            dsa_free(area, data);
+    }
+
+    LWLockRelease(nominatim_shared->cache_lock);
+
+    pfree(buf.data);
+}
+
+/*
+ * nominatim_fdw_cache_stats
+ * ----------
+ * Number of entries and hit, miss and eviction counters of the shared cache,
+ * and the number of requests coalesced with identical in-flight requests.
+ *
+ * returns record
+ */
+Datum nominatim_fdw_cache_stats(PG_FUNCTION_ARGS)
+{
+    TupleDesc tupdesc;
+    Datum values[5];
+    bool nulls[5] = {false, false, false, false, false};
+    long entries;
+
+    if (!nominatim_shared)
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("nominatim_fdw must be loaded via \"shared_preload_libraries\"")));
+
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+        ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                        errmsg("function returning record called in context that cannot accept type record")));
+
+    LWLockAcquire(nominatim_shared->cache_lock, LW_SHARED);
+    entries = shared_cache ? hash_get_num_entries(shared_cache) : 0;
+    LWLockRelease(nominatim_shared->cache_lock);
+
+    values[0] = Int64GetDatum(entries);
+    values[1] = Int64GetDatum((int64)pg_atomic_read_u64(&nominatim_shared->cache_hits));
+    values[2] = Int64GetDatum((int64)pg_atomic_read_u64(&nominatim_shared->cache_misses));
+    values[3] = Int64GetDatum((int64)pg_atomic_read_u64(&nominatim_shared->cache_evictions));
+    values[4] = Int64GetDatum((int64)pg_atomic_read_u64(&nominatim_shared->coalesced));
+
+    PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(BlessTupleDesc(tupdesc), values, nulls)));
+}
+
+/*
+ * nominatim_fdw_cache_reset
+ * ----------
+ * Removes all entries from the shared cache and resets its counters.
+ */
+Datum nominatim_fdw_cache_reset(PG_FUNCTION_ARGS)
+{
+    dsa_area *area;
+
+    if (!nominatim_shared)
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("nominatim_fdw must be loaded via \"shared_preload_libraries\"")));
+
+    area = GetSharedCacheArea();
+
+    LWLockAcquire(nominatim_shared->cache_lock, LW_EXCLUSIVE);
+
+    if (area)
+    {
+        while (!dlist_is_empty(&nominatim_shared->cache_lru))
+            RemoveSharedCacheEntry(area, dlist_head_element(NominatimCacheEntry, lru, &nominatim_shared->cache_lru));
+    }
+
+    pg_atomic_write_u64(&nominatim_shared->cache_hits, 0);
+    pg_atomic_write_u64(&nominatim_shared->cache_misses, 0);
+    pg_atomic_write_u64(&nominatim_shared->cache_evictions, 0);
+    pg_atomic_write_u64(&nominatim_shared->coalesced, 0);
+
+    LWLockRelease(nominatim_shared->cache_lock);
+
+    PG_RETURN_VOID();
+}
+
+/*
+ * ResetServerStats
+ * ----------
+ * Sets the counters of a request statistics entry to zero.
+ *
+ * entry: statistics entry
+ * init: initialize the counters instead (shared memory startup)
+ */
+static void ResetServerStats(NominatimServerStats *entry, bool init)
+{
+    pg_atomic_uint64 *counters[] = {&entry->calls, &entry->failures, &entry->retries, &entry->bytes,
+                                    &entry->cache_hits, &entry->total_time, &entry->min_time, &entry->max_time};
+
+    for (int i = 0; i < lengthof(counters); i++)
+    {
+        /* min_time starts above any request time */
+        uint64 value = counters[i] == &entry->min_time ? PG_UINT64_MAX : 0;
+
+        if (init)
+            pg_atomic_init_u64(counters[i], value);
+        else
+            pg_atomic_write_u64(counters[i], value);
+    }
+
+    for (int i = 0; i < NOMINATIM_STATS_STATUS_CLASSES; i++)
+    {
+        if (init)
+            pg_atomic_init_u64(&entry->status[i], 0);
+        else
+            pg_atomic_write_u64(&entry->status[i], 0);
+    }
+
+    for (int i = 0; i < NOMINATIM_STATS_BUCKETS; i++)
+    {
+        if (init)
+            pg_atomic_init_u64(&entry->histogram[i], 0);
+        else
+            pg_atomic_write_u64(&entry->histogram[i], 0);
+    }
+}
+
+/*
+ * GetServerStats
+ * ----------
+ * Looks up the request statistics entry of the server and request type of
+ * a request, adding it on the first request. Existing entries are found
+ * without taking the lock.
+ *
+ * state: NominatimFDWState containing all session data
+ *
+ * returns the statistics entry, or NULL if nominatim_fdw is not loaded via
+ * shared_preload_libraries or there is no room for another entry
+ */
+static NominatimServerStats *GetServerStats(NominatimFDWState *state)
+{
+    NominatimServerStats *entry = NULL;
+    int type = -1;
+    uint32 n;
+
+    if (!nominatim_shared || !state->server || !state->request_type)
+        return NULL;
+
+    for (int i = 0; i < lengthof(request_types); i++)
+        if (strcmp(state->request_type, request_types[i]) == 0)
+            type = i;
+
+    if (type < 0)
+        return NULL;
+
+    n = pg_atomic_read_u32(&nominatim_shared->num_server_stats);
+    pg_read_barrier();
+
+    for (uint32 i = 0; i < n; i++)
+    {
+        NominatimServerStats *stats = &nominatim_shared->server_stats[i];
+
+        if (stats->dbid == MyDatabaseId && stats->serverid == state->server->serverid && stats->request_type == type)
+            return stats;
+    }
+
+    LWLockAcquire(nominatim_shared->lock, LW_EXCLUSIVE);
+
+    /* another backend may have added it in the meantime */
+    n = pg_atomic_read_u32(&nominatim_shared->num_server_stats);
+
+    for (uint32 i = 0; i < n && !entry; i++)
+    {
+        NominatimServerStats *stats = &nominatim_shared->server_stats[i];
+
+        if (stats->dbid == MyDatabaseId && stats->serverid == state->server->serverid && stats->request_type == type)
+            entry = stats;
+    }
+
+    if (!entry && n < NOMINATIM_MAX_SERVER_STATS)
+    {
+        entry = &nominatim_shared->server_stats[n];
+        entry->dbid = MyDatabaseId;
+        entry->serverid = state->server->serverid;
+        entry->request_type = type;
+        namestrcpy(&entry->servername, state->server->servername);
+
+        /* publish the entry only once it is complete */
+        pg_write_barrier();
+        pg_atomic_write_u32(&nominatim_shared->num_server_stats, n + 1);
+    }
+
+    LWLockRelease(nominatim_shared->lock);
+
+    if (!entry)
+        elog(DEBUG1, "%s: no room for the statistics of server '%s'", __func__, state->server->servername);
+
+    return entry;
+}
+
+/*
+ * RecordServerStats
+ * ----------
+ * Adds a request sent to the server to the statistics of its server and
+ * request type: HTTP status class, retries, bytes received and time of the
+ * last attempt.
+ *
+ * state: NominatimFDWState containing all session data
+ * req: the request, after its last attempt
+ * retries: number of failed attempts that were retried
+ */
+static void RecordServerStats(NominatimFDWState *state, NominatimRequest *req, long retries)
+{
+    NominatimServerStats *entry = GetServerStats(state);
+    long response_code = 0;
+    double total_time = 0;
+    uint64 us;
+    uint64 current;
+    int bucket = 0;
+
+    if (!entry)
+        return;
+
+    curl_easy_getinfo(req->curl, CURLINFO_RESPONSE_CODE, &response_code);
+    curl_easy_getinfo(req->curl, CURLINFO_TOTAL_TIME, &total_time);
+    us = (uint64)(total_time * 1000000.0);
+
+    pg_atomic_fetch_add_u64(&entry->calls, 1);
+
+    if (response_code >= 200 && response_code < 600)
+        pg_atomic_fetch_add_u64(&entry->status[response_code / 100 - 2], 1);
+    else
+        pg_atomic_fetch_add_u64(&entry->failures, 1);
+
+    pg_atomic_fetch_add_u64(&entry->retries, retries);
+    pg_atomic_fetch_add_u64(&entry->bytes, req->chunk.size);
+    pg_atomic_fetch_add_u64(&entry->total_time, us);
+
+    current = pg_atomic_read_u64(&entry->min_time);
+    while (us < current && !pg_atomic_compare_exchange_u64(&entry->min_time, &current, us))
+        ;
+
+    current = pg_atomic_read_u64(&entry->max_time);
+    while (us > current && !pg_atomic_compare_exchange_u64(&entry->max_time, &current, us))
+        ;
+
+    while (bucket < NOMINATIM_STATS_BUCKETS - 1 && us >= (UINT64CONST(1000) << bucket))
+        bucket++;
+
+    pg_atomic_fetch_add_u64(&entry->histogram[bucket], 1);
+}
+
+/*
+ * RecordCacheHit
+ * ----------
+ * Adds a request answered by one of the caches to the statistics of its
+ * server and request type.
+ *
+ * state: NominatimFDWState containing all session data
+ */
+static void RecordCacheHit(NominatimFDWState *state)
+{
+    NominatimServerStats *entry = GetServerStats(state);
+
+    if (entry)
+        pg_atomic_fetch_add_u64(&entry->cache_hits, 1);
+}
+
+/*
+ * nominatim_fdw_stats
+ * ----------
+ * Request statistics of the foreign servers of the current database, one
+ * row per server and request type. Times are in milliseconds.
+ *
+ * returns SETOF record
+ */
+Datum nominatim_fdw_stats(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+
+    if (!nominatim_shared)
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("nominatim_fdw must be loaded via \"shared_preload_libraries\"")));
+
+    if (SRF_IS_FIRSTCALL())
+    {
+        MemoryContext oldcontext;
+        TupleDesc tupdesc;
+        List *entries = NIL;
+        uint32 n;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+            ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                            errmsg("function returning record called in context that cannot accept type record")));
+
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+        n = pg_atomic_read_u32(&nominatim_shared->num_server_stats);
+        pg_read_barrier();
+
+        for (uint32 i = 0; i < n; i++)
+            if (nominatim_shared->server_stats[i].dbid == MyDatabaseId)
+                entries = lappend(entries, &nominatim_shared->server_stats[i]);
+
+        funcctx->user_fctx = entries;
+        funcctx->max_calls = list_length(entries);
+
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+
+    if (funcctx->call_cntr < funcctx->max_calls)
+    {
+        NominatimServerStats *entry = list_nth((List *)funcctx->user_fctx, funcctx->call_cntr);
+        Datum values[16];
+        bool nulls[16];
+        Datum buckets[NOMINATIM_STATS_BUCKETS];
+        uint64 calls = pg_atomic_read_u64(&entry->calls);
+        double total_time = pg_atomic_read_u64(&entry->total_time) / 1000.0;
+
+        memset(nulls, 0, sizeof(nulls));
+
+        values[0] = CStringGetTextDatum(NameStr(entry->servername));
+        values[1] = CStringGetTextDatum(request_types[entry->request_type]);
+        values[2] = Int64GetDatum((int64)calls);
+
+        for (int i = 0; i < NOMINATIM_STATS_STATUS_CLASSES; i++)
+            values[3 + i] = Int64GetDatum((int64)pg_atomic_read_u64(&entry->status[i]));
+
+        values[7] = Int64GetDatum((int64)pg_atomic_read_u64(&entry->failures));
+        values[8] = Int64GetDatum((int64)pg_atomic_read_u64(&entry->retries));
+        values[9] = Int64GetDatum((int64)pg_atomic_read_u64(&entry->bytes));
+        values[10] = Int64GetDatum((int64)pg_atomic_read_u64(&entry->cache_hits));
+        values[11] = Float8GetDatum(total_time);
+
+        if (calls > 0)
+        {
+            values[12] = Float8GetDatum(pg_atomic_read_u64(&entry->min_time) / 1000.0);
+            values[13] = Float8GetDatum(pg_atomic_read_u64(&entry->max_time) / 1000.0);
+            values[14] = Float8GetDatum(total_time / calls);
+        }
+        else
+            nulls[12] = nulls[13] = nulls[14] = true;
+
+        for (int i = 0; i < NOMINATIM_STATS_BUCKETS; i++)
+            buckets[i] = Int64GetDatum((int64)pg_atomic_read_u64(&entry->histogram[i]));
+
+        values[15] = PointerGetDatum(construct_array(buckets, NOMINATIM_STATS_BUCKETS, INT8OID,
+                                                     sizeof(int64), FLOAT8PASSBYVAL, 'd'));
+
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(heap_form_tuple(funcctx->tuple_desc, values, nulls)));
+    }
+
+    SRF_RETURN_DONE(funcctx);
+}
+
+/*
+ * nominatim_fdw_stats_reset
+ * ----------
+ * Resets the request statistics of all servers.
+ */
+Datum nominatim_fdw_stats_reset(PG_FUNCTION_ARGS)
+{
+    uint32 n;
+
+    if (!nominatim_shared)
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("nominatim_fdw must be loaded via \"shared_preload_libraries\"")));
+
+    n = pg_atomic_read_u32(&nominatim_shared->num_server_stats);
+    pg_read_barrier();
+
+    for (uint32 i = 0; i < n; i++)
+        ResetServerStats(&nominatim_shared->server_stats[i], false);
+
+    PG_RETURN_VOID();
+}
+
+/*
+ * RedactURL
+ * ----------
+ * Copy of a request URL that can be shown to other users: credentials in
+ * the URL and the value of the email parameter are masked.
+ *
+ * url: request URL
+ *
+ * returns redacted URL
+ */
+static char *RedactURL(const char *url)
+{
+    StringInfoData buf;
+    const char *host = strstr(url, "://");
+    const char *p = url;
+
+    initStringInfo(&buf);
+
+    if (host)
+    {
+        const char *authority = host + 3;
+        const char *at = memchr(authority, '@', strcspn(authority, "/?"));
+
+        if (at)
+        {
+            appendBinaryStringInfo(&buf, url, authority - url);
+            appendStringInfoString(&buf, "***");
+            p = at;
+        }
+    }
+
+    /* copy the URL one parameter at a time, each starting with '?' or '&' */
+    while (*p)
+    {
+        size_t len = strcspn(p + 1, "?&") + 1;
+
+        if ((*p == '?' || *p == '&') && strncmp(p + 1, "email=", 6) == 0)
+        {
+            appendBinaryStringInfo(&buf, p, 7);
+            appendStringInfoString(&buf, "***");
+        }
+        else
+            appendBinaryStringInfo(&buf, p, len);
+
+        p += len;
+    }
+
+    return buf.data;
+}
+
+/*
+ * GetActivitySlot
+ * ----------
+ * Activity slot of this backend, claimed on its first request and freed
+ * when it exits.
+ *
+ * returns the slot, or NULL if nominatim_fdw is not loaded via
+ * shared_preload_libraries or all slots are taken
+ */
+static NominatimActivity *GetActivitySlot(void)
+{
+    if (activity_slot || !nominatim_shared)
+        return activity_slot;
+
+    LWLockAcquire(nominatim_shared->lock, LW_EXCLUSIVE);
+
+    for (int i = 0; i < NOMINATIM_MAX_ACTIVITY && !activity_slot; i++)
+    {
+        if (nominatim_shared->activity[i].pid == 0)
+        {
+            activity_slot = &nominatim_shared->activity[i];
+            activity_slot->pid = MyProcPid;
+            activity_slot->active = false;
+        }
+    }
+
+    LWLockRelease(nominatim_shared->lock);
+
+    if (!activity_slot)
+    {
+        elog(DEBUG1, "%s: no free activity slot", __func__);
+        return NULL;
+    }
+
+    RegisterXactCallback(ActivityXactCallback, NULL);
+    before_shmem_exit(ActivityExitCallback, (Datum)0);
+
+    return activity_slot;
+}
+
+/*
+ * ReportRequestStart
+ * ----------
+ * Shows a request about to be sent in this backend's activity slot.
+ *
+ * state: NominatimFDWState containing all session data
+ * req: the request
+ */
+static void ReportRequestStart(NominatimFDWState *state, NominatimRequest *req)
+{
+    NominatimActivity *slot = GetActivitySlot();
+    char *url;
+    int type = -1;
+
+    if (!slot)
+        return;
+
+    url = RedactURL(req->url.data);
+
+    for (int i = 0; i < lengthof(request_types); i++)
+        if (state->request_type && strcmp(state->request_type, request_types[i]) == 0)
+            type = i;
+
+    slot->changecount++;
+    pg_write_barrier();
+
+    slot->active = true;
+    namestrcpy(&slot->servername, state->server ? state->server->servername : "");
+    slot->request_type = type;
+    strlcpy(slot->url, url, NOMINATIM_ACTIVITY_URL_SIZE);
+    slot->started_at = GetCurrentTimestamp();
+    slot->attempt = 1;
+    slot->userid = GetUserId();
+    slot->bytes = 0;
+
+    pg_write_barrier();
+    slot->changecount++;
+
+    activity_chunk = &req->chunk;
+
+    pfree(url);
+}
+
+/*
+ * ReportRequestRetry
+ * ----------
+ * Shows the next attempt of the request in this backend's activity slot.
+ *
+ * req: the request
+ * attempt: attempt about to be made
+ */
+static void ReportRequestRetry(NominatimRequest *req, long attempt)
+{
+    if (activity_chunk != &req->chunk)
+        return;
+
+    activity_slot->changecount++;
+    pg_write_barrier();
+    activity_slot->attempt = (int)attempt;
+    activity_slot->bytes = 0;
+    pg_write_barrier();
+    activity_slot->changecount++;
+}
+
+/*
+ * ReportRequestEnd
+ * ----------
+ * Adds the request shown in this backend's activity slot to the ring
+ * buffer of recent requests once it is done, and clears the slot.
+ *
+ * req: the request, after its last attempt
+ * retries: number of failed attempts that were retried
+ */
+static void ReportRequestEnd(NominatimRequest *req, long retries)
+{
+    NominatimRecentRequest *recent;
+    long response_code = 0;
+
+    if (activity_chunk != &req->chunk)
+        return;
+
+    curl_easy_getinfo(req->curl, CURLINFO_RESPONSE_CODE, &response_code);
+
+    LWLockAcquire(nominatim_shared->lock, LW_EXCLUSIVE);
+
+    recent = &nominatim_shared->recent[nominatim_shared->recent_count % NOMINATIM_RECENT_REQUESTS];
+    recent->pid = MyProcPid;
+    recent->userid = activity_slot->userid;
+    recent->servername = activity_slot->servername;
+    recent->request_type = activity_slot->request_type;
+    memcpy(recent->url, activity_slot->url, NOMINATIM_ACTIVITY_URL_SIZE);
+    recent->started_at = activity_slot->started_at;
+    recent->duration = (GetCurrentTimestamp() - activity_slot->started_at) / 1000.0;
+    recent->http_status = response_code;
+    recent->retries = retries;
+    recent->bytes = req->chunk.size;
+    nominatim_shared->recent_count++;
+
+    LWLockRelease(nominatim_shared->lock);
+
+    ReportRequestIdle();
+}
+
+/*
+ * ReportRequestIdle
+ * ----------
+ * Marks this backend's activity slot as idle.
+ */
+static void ReportRequestIdle(void)
+{
+    activity_chunk = NULL;
+
+    if (!activity_slot || !activity_slot->active)
+        return;
+
+    activity_slot->changecount++;
+    pg_write_barrier();
+    activity_slot->active = false;
+    pg_write_barrier();
+    activity_slot->changecount++;
+}
+
+/*
+ * ActivityXactCallback
+ * ----------
+ * Clears the activity slot of a request interrupted by an error.
+ */
+static void ActivityXactCallback(XactEvent event, void *arg)
+{
+    if (event == XACT_EVENT_ABORT || event == XACT_EVENT_PARALLEL_ABORT)
+        ReportRequestIdle();
+}
+
+/*
+ * ActivityExitCallback
+ * ----------
+ * Frees the activity slot of an exiting backend.
+ */
+static void ActivityExitCallback(int code, Datum arg)
+{
+    ReportRequestIdle();
+
+    LWLockAcquire(nominatim_shared->lock, LW_EXCLUSIVE);
+    activity_slot->pid = 0;
+    LWLockRelease(nominatim_shared->lock);
+
+    activity_slot = NULL;
+}
+
+/*
+ * CanSeeRequestURL
+ * ----------
+ * Checks if the current user may see the URL of a request, which contains
+ * the addresses or coordinates being geocoded. As with the query text in
+ * pg_stat_activity, only the user that sent the request, the roles it is a
+ * member of and members of pg_read_all_stats may see it.
+ *
+ * userid: user that sent the request
+ *
+ * returns boolean (true: the URL can be shown, false: it is shown as NULL)
+ */
+static bool CanSeeRequestURL(Oid userid)
+{
+#if PG_VERSION_NUM >= 140000
+    return has_privs_of_role(GetUserId(), userid) ||
+           has_privs_of_role(GetUserId(), ROLE_PG_READ_ALL_STATS);
+#else
+    return has_privs_of_role(GetUserId(), userid) ||
+           has_privs_of_role(GetUserId(), DEFAULT_ROLE_READ_ALL_STATS);
+#endif
+}
+
+/*
+ * nominatim_fdw_activity
+ * ----------
+ * Requests being sent by all backends: one row per backend with a request
+ * in progress. The URL is only shown to users allowed to see it (see
+ * CanSeeRequestURL).
+ *
+ * returns SETOF record
+ */
+Datum nominatim_fdw_activity(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+
+    if (!nominatim_shared)
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("nominatim_fdw must be loaded via \"shared_preload_libraries\"")));
+
+    if (SRF_IS_FIRSTCALL())
+    {
+        MemoryContext oldcontext;
+        TupleDesc tupdesc;
+        List *entries = NIL;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+            ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                            errmsg("function returning record called in context that cannot accept type record")));
+
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+        for (int i = 0; i < NOMINATIM_MAX_ACTIVITY; i++)
+        {
+            volatile NominatimActivity *slot = &nominatim_shared->activity[i];
+            NominatimActivity *copy = palloc(sizeof(NominatimActivity));
+
+            /* take a consistent copy of the slot, see NominatimActivity */
+            for (;;)
+            {
+                uint32 before = slot->changecount;
+
+                pg_read_barrier();
+                memcpy(copy, (NominatimActivity *)slot, sizeof(NominatimActivity));
+                pg_read_barrier();
+
+                if (before == slot->changecount && (before & 1) == 0)
+                    break;
+
+                CHECK_FOR_INTERRUPTS();
+            }
+
+            if (copy->pid != 0 && copy->active)
+                entries = lappend(entries, copy);
+            else
+                pfree(copy);
+        }
+
+        funcctx->user_fctx = entries;
+        funcctx->max_calls = list_length(entries);
+
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+
+    if (funcctx->call_cntr < funcctx->max_calls)
+    {
+        NominatimActivity *slot = list_nth((List *)funcctx->user_fctx, funcctx->call_cntr);
+        Datum values[7];
+        bool nulls[7] = {false, false, false, false, false, false, false};
+
+        values[0] = Int32GetDatum(slot->pid);
+        values[1] = CStringGetTextDatum(NameStr(slot->servername));
+
+        if (slot->request_type >= 0)
+            values[2] = CStringGetTextDatum(request_types[slot->request_type]);
+        else
+            nulls[2] = true;
+
+        if (CanSeeRequestURL(slot->userid))
+            values[3] = CStringGetTextDatum(slot->url);
+        else
+            nulls[3] = true;
+
+        values[4] = TimestampTzGetDatum(slot->started_at);
+        values[5] = Int32GetDatum(slot->attempt);
+        values[6] = Int64GetDatum((int64)slot->bytes);
+
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(heap_form_tuple(funcctx->tuple_desc, values, nulls)));
+    }
+
+    SRF_RETURN_DONE(funcctx);
+}
+
+/*
+ * nominatim_fdw_recent_requests
+ * ----------
+ * The last NOMINATIM_RECENT_REQUESTS requests completed by all backends,
+ * most recent first. The URL is only shown to users allowed to see it (see
+ * CanSeeRequestURL).
+ *
+ * returns SETOF record
+ */
+Datum nominatim_fdw_recent_requests(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+
+    if (!nominatim_shared)
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("nominatim_fdw must be loaded via \"shared_preload_libraries\"")));
+
+    if (SRF_IS_FIRSTCALL())
+    {
+        MemoryContext oldcontext;
+        TupleDesc tupdesc;
+        NominatimRecentRequest *recent;
+        List *entries = NIL;
+        uint64 count;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+            ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                            errmsg("function returning record called in context that cannot accept type record")));
+
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+        recent = palloc(sizeof(nominatim_shared->recent));
+
+        LWLockAcquire(nominatim_shared->lock, LW_SHARED);
+        count = nominatim_shared->recent_count;
+        memcpy(recent, nominatim_shared->recent, sizeof(nominatim_shared->recent));
+        LWLockRelease(nominatim_shared->lock);
+
+        /* walk the ring buffer backwards from the last request added */
+        for (uint64 i = count; i > 0 && count - i < NOMINATIM_RECENT_REQUESTS; i--)
+            entries = lappend(entries, &recent[(i - 1) % NOMINATIM_RECENT_REQUESTS]);
+
+        funcctx->user_fctx = entries;
+        funcctx->max_calls = list_length(entries);
+
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+
+    if (funcctx->call_cntr < funcctx->max_calls)
+    {
+        NominatimRecentRequest *recent = list_nth((List *)funcctx->user_fctx, funcctx->call_cntr);
+        Datum values[9];
+        bool nulls[9] = {false, false, false, false, false, false, false, false, false};
+
+        values[0] = Int32GetDatum(recent->pid);
+        values[1] = CStringGetTextDatum(NameStr(recent->servername));
+
+        if (recent->request_type >= 0)
+            values[2] = CStringGetTextDatum(request_types[recent->request_type]);
+        else
+            nulls[2] = true;
+
+        if (CanSeeRequestURL(recent->userid))
+            values[3] = CStringGetTextDatum(recent->url);
+        else
+            nulls[3] = true;
+
+        values[4] = TimestampTzGetDatum(recent->started_at);
+        values[5] = Float8GetDatum(recent->duration);
+
+        if (recent->http_status > 0)
+            values[6] = Int32GetDatum((int32)recent->http_status);
+        else
+            nulls[6] = true;
+
+        values[7] = Int32GetDatum((int32)recent->retries);
+        values[8] = Int64GetDatum((int64)recent->bytes);
+
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(heap_form_tuple(funcctx->tuple_desc, values, nulls)));
+    }
+
+    SRF_RETURN_DONE(funcctx);
+}
+
+/*
+ * GetCacheTableName
+ * ----------
+ * Resolves the cache_table option of a server into a quoted, schema
+ * qualified table name.
+ *
+ * returns table name usable in SQL statements
+ */
+static char *GetCacheTableName(const char *name)
+{
+    List *names;
+    Oid relid;
+
+#if PG_VERSION_NUM >= 160000
+    names = stringToQualifiedNameList(name, NULL);
+#else
+    names = stringToQualifiedNameList(name);
+#endif
+    relid = RangeVarGetRelid(makeRangeVarFromNameList(names), NoLock, true);
+
+    if (!OidIsValid(relid))
+        ereport(ERROR,
+                (errcode(ERRCODE_UNDEFINED_TABLE),
+                 errmsg("cache table '%s' does not exist", name),
+                 errhint("create it with nominatim_fdw_cache_create() or drop the server option '%s'", NOMINATIM_SERVER_OPTION_CACHE_TABLE)));
+
+    return quote_qualified_identifier(get_namespace_name(get_rel_namespace(relid)), get_rel_name(relid));
+}
+
+/*
+ * PersistentCacheLookup
+ * ----------
+ * Looks for the records of a request in the cache table of the server.
+ *
+ * state: NominatimFDWState of the request; state->records is set on a hit
+ * url: request URL
+ *
+ * returns true if the records were found
+ */
+static bool PersistentCacheLookup(NominatimFDWState *state, const char *url)
+{
+    MemoryContext callercontext = CurrentMemoryContext;
+    Oid argtypes[2] = {TEXTOID, BOOLOID};
+    Datum args[2];
+    bool hit = false;
+    char *sql;
+
+    args[0] = CStringGetTextDatum(url);
+    args[1] = BoolGetDatum(state->points_only);
+    sql = psprintf("SELECT records FROM %s WHERE request_url = $1 AND points_only = $2",
+                   GetCacheTableName(state->cache_table));
+
+    SPI_connect();
+
+    if (SPI_execute_with_args(sql, 2, argtypes, args, NULL, true, 1) == SPI_OK_SELECT && SPI_processed == 1)
+    {
+        bool isnull;
+        Datum records = SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isnull);
+
+        if (!isnull)
+        {
+            bytea *data = DatumGetByteaPP(records);
+            MemoryContext spicontext = MemoryContextSwitchTo(callercontext);
+
+            state->records = DeserializeRecords(VARDATA_ANY(data));
+            MemoryContextSwitchTo(spicontext);
+            hit = true;
+        }
+    }
+
+    SPI_finish();
+
+    elog(DEBUG2, "  %s: %s \"%s\"", __func__, hit ? "hit" : "miss", url);
+
+    return hit;
+}
+
+/*
+ * PersistentCacheStore
+ * ----------
+ * Writes the records of a request through to the cache table of the server.
+ * Empty results are not kept. Nothing is written where the table can't be
+ * written, e.g. on hot standbys, which read the table replicated from the
+ * primary.
+ *
+ * The write must neither block nor fail the query that sent the request, so
+ * it runs in a subtransaction whose errors are reported as warnings, and an
+ * entry another transaction is writing is left alone instead of waiting for
+ * it (lock_timeout). Only nominatim_fdw_cache_refresh replaces entries.
+ *
+ * state: NominatimFDWState of the request, with its parsed records
+ */
+static void PersistentCacheStore(NominatimFDWState *state)
+{
+    MemoryContext callercontext = CurrentMemoryContext;
+    ResourceOwner callerowner = CurrentResourceOwner;
+    Oid argtypes[3] = {TEXTOID, BOOLOID, BYTEAOID};
+    Datum args[3];
+    StringInfoData buf;
+    char *sql;
+
+    if (!state->cache_url || !state->records)
+        return;
+
+    if (RecoveryInProgress() || XactReadOnly || IsInParallelMode())
+        return;
+
+    initStringInfo(&buf);
+    appendStringInfoSpaces(&buf, VARHDRSZ);
+    SerializeRecords(&buf, state->records);
+    SET_VARSIZE(buf.data, buf.len);
+
+    args[0] = CStringGetTextDatum(state->cache_url);
+    args[1] = BoolGetDatum(state->points_only);
+    args[2] = PointerGetDatum(buf.data);
+    sql = psprintf("INSERT INTO %s (request_url, points_only, records, fetched_at) VALUES ($1, $2, $3, now()) %s",
+                   GetCacheTableName(state->cache_table),
+                   state->request_url
+                       ? "ON CONFLICT (request_url, points_only) DO UPDATE SET records = EXCLUDED.records, fetched_at = EXCLUDED.fetched_at"
+                       : "ON CONFLICT (request_url, points_only) DO NOTHING");
+
+    BeginInternalSubTransaction(NULL);
+    MemoryContextSwitchTo(callercontext);
+
+    PG_TRY();
+    {
+        int save_nestlevel = NewGUCNestLevel();
+
+        if (!state->request_url)
+            (void)set_config_option("lock_timeout", NOMINATIM_CACHE_LOCK_TIMEOUT, PGC_USERSET, PGC_S_SESSION,
+                                    GUC_ACTION_SAVE, true, 0, false);
+
+        SPI_connect();
+
+        if (SPI_execute_with_args(sql, 3, argtypes, args, NULL, false, 0) != SPI_OK_INSERT)
+            elog(WARNING, "%s: unable to write to cache table '%s'", __func__, state->cache_table);
+
+        SPI_finish();
+
+        AtEOXact_GUC(true, save_nestlevel);
+        ReleaseCurrentSubTransaction();
+        MemoryContextSwitchTo(callercontext);
+        CurrentResourceOwner = callerowner;
+    }
+    PG_CATCH();
+    {
+        ErrorData *edata;
+
+        MemoryContextSwitchTo(callercontext);
+        edata = CopyErrorData();
+        FlushErrorState();
+
+        RollbackAndReleaseCurrentSubTransaction();
+        MemoryContextSwitchTo(callercontext);
+        CurrentResourceOwner = callerowner;
+
+        /* another transaction is writing the same entry */
+        ereport(edata->sqlerrcode == ERRCODE_LOCK_NOT_AVAILABLE ? DEBUG1 : WARNING,
+                (errmsg("%s: unable to write to cache table '%s': %s", __func__, state->cache_table, edata->message)));
+
+        FreeErrorData(edata);
+    }
+    PG_END_TRY();
+
+    pfree(buf.data);
+}
+
+/*
+ * CacheParsedRecords
  * ----------
- *
- * Creates a Datum from a given value based on the postgres types and modifiers.
- *
- * tuple: a Heaptuple
- * pgtype: postgres type
- * pgtypemod: postgres type modifier
- * value: value to be converted
- *
- * returns Datum
+ * Keeps the records of a request parsed from the server's response in the
+ * shared and in the persistent cache, if enabled for the request.
  */
-static Datum CreateDatum(int pgtype, int pgtypmod, char *value)
+static void CacheParsedRecords(NominatimFDWState *state)
 {
-    regproc typinput;
-    HeapTuple tuple = SearchSysCache1(TYPEOID, ObjectIdGetDatum(pgtype));
+    SharedCacheStore(state);
+    ReleaseInFlightRequest();
+    PersistentCacheStore(state);
 
-    if (!HeapTupleIsValid(tuple))
-        ereport(ERROR,
-                (errcode(ERRCODE_FDW_INVALID_DATA_TYPE),
-                 errmsg("cache lookup failed for type %u", pgtype)));
+    if (state->slow_request)
+    {
+        instr_time records_time;
+        char *detail;
 
-    typinput = ((Form_pg_type)GETSTRUCT(tuple))->typinput;
-    ReleaseSysCache(tuple);
+        INSTR_TIME_SET_CURRENT(records_time);
+        INSTR_TIME_SUBTRACT(records_time, state->slow_request_parsed);
 
-    if (pgtype == FLOAT4OID ||
-        pgtype == FLOAT8OID ||
-        pgtype == NUMERICOID ||
-        pgtype == TIMESTAMPOID ||
-        pgtype == TIMESTAMPTZOID ||
-        pgtype == VARCHAROID)
-        return OidFunctionCall3(
-            typinput,
-            CStringGetDatum(value),
-            ObjectIdGetDatum(InvalidOid),
-            Int32GetDatum(pgtypmod));
-    else
-        return OidFunctionCall1(typinput, CStringGetDatum(value));
+        detail = psprintf("%s, building records: %.3f ms", state->slow_request,
+                          INSTR_TIME_GET_MILLISEC(records_time));
+        LogSlowRequest(state, state->slow_request_ms + INSTR_TIME_GET_MILLISEC(records_time), detail);
+
+        pfree(detail);
+        pfree(state->slow_request);
+        state->slow_request = NULL;
+    }
 }
 
-static void LoadNominatimUserMapping(NominatimFDWState *state)
+/*
+ * AwaitInFlightRequest
+ * ----------
+ * Registers a cacheable request about to be sent, unless a request with the
+ * same cache key is already being sent by another backend. In that case it
+ * waits until that request is done, so that its records can be taken from
+ * the shared cache. The registration is released by ReleaseInFlightRequest
+ * once the records are in the shared cache, or if the transaction fails.
+ *
+ * key: cache key of the request
+ *
+ * returns true if it waited for another backend
+ */
+static bool AwaitInFlightRequest(const char *key)
 {
-    Datum datum;
-    HeapTuple tp;
-    bool isnull;
-    UserMapping *um;
-    List *options = NIL;
-    ListCell *cell;
-    bool usermatch = true;
+    uint64 fingerprint = HashCacheKey(key);
+    NominatimInFlightRequest *leader = NULL;
+    int leader_pid = 0;
+    int free_slot = -1;
 
-    elog(DEBUG2, "%s called", __func__);
-
-    tp = SearchSysCache2(USERMAPPINGUSERSERVER,
-                         ObjectIdGetDatum(GetUserId()),
-                         ObjectIdGetDatum(state->server->serverid));
+    LWLockAcquire(nominatim_shared->lock, LW_EXCLUSIVE);
 
-    if (!HeapTupleIsValid(tp))
+    for (int i = 0; i < NOMINATIM_MAX_IN_FLIGHT; i++)
     {
-        elog(DEBUG2, "%s: not found for the specific user -- try PUBLIC", __func__);
-        tp = SearchSysCache2(USERMAPPINGUSERSERVER,
-                             ObjectIdGetDatum(InvalidOid),
-                             ObjectIdGetDatum(state->server->serverid));
+        NominatimInFlightRequest *slot = &nominatim_shared->inflight[i];
+
+        if (slot->leader != 0 && slot->leader != MyProcPid && slot->fingerprint == fingerprint)
+        {
+            leader = slot;
+            leader_pid = slot->leader;
+            break;
+        }
+
+        if (slot->leader == 0 && free_slot < 0)
+            free_slot = i;
     }
 
-    if (!HeapTupleIsValid(tp))
+    /* become the leader, unless there are too many requests in flight */
+    if (!leader && free_slot >= 0 && inflight_slot < 0)
     {
-        elog(DEBUG2, "%s: user mapping not found for user \"%s\", server \"%s\"",
-             __func__, MappingUserName(GetUserId()), state->server->servername);
-
-        usermatch = false;
+        nominatim_shared->inflight[free_slot].fingerprint = fingerprint;
+        nominatim_shared->inflight[free_slot].leader = MyProcPid;
+        inflight_slot = free_slot;
     }
 
-    if (usermatch)
+    LWLockRelease(nominatim_shared->lock);
+
+    if (inflight_slot >= 0 && !inflight_cleanup_registered)
     {
-        elog(DEBUG2, "%s: setting UserMapping", __func__);
-        um = (UserMapping *)palloc(sizeof(UserMapping));
-#if PG_VERSION_NUM >= 120000
-		um->umid = ((Form_pg_user_mapping)GETSTRUCT(tp))->oid;
-#elif PG_VERSION_NUM >= 90600
-		um->umid = HeapTupleGetOid(tp);
-#endif
-        um->userid = GetUserId();
-        um->serverid = state->server->serverid;
+        RegisterXactCallback(InFlightXactCallback, NULL);
+        RegisterSubXactCallback(InFlightSubXactCallback, NULL);
+        before_shmem_exit(InFlightExitCallback, (Datum)0);
+        inflight_cleanup_registered = true;
+    }
 
-        elog(DEBUG2, "%s: extract the umoptions", __func__);
-        datum = SysCacheGetAttr(USERMAPPINGUSERSERVER,
-                                tp,
-                                Anum_pg_user_mapping_umoptions,
-                                &isnull);
-        if (isnull)
-            um->options = NIL;
-        else
-            um->options = untransformRelOptions(datum);
+    if (!leader)
+        return false;
 
-        if (um->options != NIL)
-        {
-            options = list_concat(options, um->options);
+    elog(DEBUG2, "  %s: waiting for backend %d", __func__, leader_pid);
 
-            foreach (cell, options)
-            {
-                DefElem *def = (DefElem *)lfirst(cell);
+    RegisterWaitEvents();
 
-                if (strcmp(def->defname, NOMINATIM_USERMAPPING_OPTION_PROXYUSER) == 0)
-                {
-                    state->proxy_user = pstrdup(defGetString(def));
-                    elog(DEBUG2, "%s: proxy user '%s'", __func__, def->defname);
-                }
-                else if (strcmp(def->defname, NOMINATIM_USERMAPPING_OPTION_PROXYPASSWORD) == 0)
-                {
-                    state->proxy_user_password = pstrdup(defGetString(def));
-                    elog(DEBUG2, "%s: proxy password '*******'", __func__);
-                }
-            }
-        }
+    ConditionVariablePrepareToSleep(&leader->cv);
 
-        ReleaseSysCache(tp);
+    for (;;)
+    {
+        bool done;
+
+        LWLockAcquire(nominatim_shared->lock, LW_SHARED);
+        done = leader->leader != leader_pid || leader->fingerprint != fingerprint;
+        LWLockRelease(nominatim_shared->lock);
+
+        if (done)
+            break;
+
+        ConditionVariableSleep(&leader->cv, wait_event_inflight);
     }
 
-    elog(DEBUG2, "%s exit", __func__);
+    ConditionVariableCancelSleep();
+
+    return true;
 }
+
 /*
- * InitSession
+ * ReleaseInFlightRequest
  * ----------
- *
- * This function loads all session info from a specific foreign server data
- * into a NominatimFDWState.
- *
- * srvname: foreign server's name
- *
- * returns NominatimFDWState with the loaded session values
+ * Releases the request registered by AwaitInFlightRequest, if any, and wakes
+ * up the backends waiting for it.
  */
-static NominatimFDWState *InitSession(const char *srvname)
+static void ReleaseInFlightRequest(void)
 {
-    NominatimFDWState *state = (NominatimFDWState *)palloc0(sizeof(NominatimFDWState));
-    ForeignServer *server = GetForeignServerByName(srvname, true);
-    ListCell *cell;
+    NominatimInFlightRequest *slot;
 
-    state->request_redirect = 1L;
-    state->max_retries = NOMINATIM_DEFAULT_MAXRETRY;
-    state->request_max_redirect = NOMINATIM_DEFAULT_MAXREDIRECT;
-    state->accept_language = NOMINATIM_DEFAULT_LANGUAGE;
-    state->connect_timeout = NOMINATIM_DEFAULT_CONNECTTIMEOUT;
+    if (inflight_slot < 0)
+        return;
 
-    if (!server)
-        ereport(ERROR,
-                (errcode(ERRCODE_CONNECTION_DOES_NOT_EXIST),
-                 errmsg("FOREIGN SERVER does not exist: '%s'", srvname)));
+    slot = &nominatim_shared->inflight[inflight_slot];
+    inflight_slot = -1;
 
-    state->server = server;
-    LoadNominatimUserMapping(state);
+    LWLockAcquire(nominatim_shared->lock, LW_EXCLUSIVE);
+    slot->leader = 0;
+    LWLockRelease(nominatim_shared->lock);
 
-    elog(DEBUG2, "%s called: '%s'", __func__, srvname);
+    ConditionVariableBroadcast(&slot->cv);
+}
 
-    foreach (cell, server->options)
-    {
-        DefElem *def = lfirst_node(DefElem, cell);
+/*
+ * InFlightXactCallback
+ * ----------
+ * Releases the in-flight request of a failed transaction, so that the
+ * backends waiting for it send it themselves.
+ */
+static void InFlightXactCallback(XactEvent event, void *arg)
+{
+    if (event == XACT_EVENT_ABORT || event == XACT_EVENT_PARALLEL_ABORT)
+        ReleaseInFlightRequest();
+}
 
-        elog(DEBUG2, "  %s parsing node '%s': %s", __func__, def->defname, defGetString(def));
+/*
+ * InFlightSubXactCallback
+ * ----------
+ * Same as InFlightXactCallback for failed subtransactions, e.g. in PL/pgSQL
+ * exception blocks.
+ */
+static void InFlightSubXactCallback(SubXactEvent event, SubTransactionId mySubid,
+                                    SubTransactionId parentSubid, void *arg)
+{
+    if (event == SUBXACT_EVENT_ABORT_SUB)
+        ReleaseInFlightRequest();
+}
 
-        if (strcmp(def->defname, NOMINATIM_SERVER_OPTION_URL) == 0)
-            state->url = defGetString(def);
+/*
+ * InFlightExitCallback
+ * ----------
+ * Releases the in-flight request of a terminating backend.
+ */
+static void InFlightExitCallback(int code, Datum arg)
+{
+    ReleaseInFlightRequest();
+}
 
-        if (strcmp(def->defname, NOMINATIM_SERVER_OPTION_HTTP_PROXY) == 0)
+/*
+ * InitCacheMaintenance
+ * ----------
+ * Session of a cache maintenance function: the server has to have a cache
+ * table.
+ *
+ * returns NominatimFDWState of the server
+ */
+static NominatimFDWState *InitCacheMaintenance(text *srvname)
+{
+    NominatimFDWState *state = InitSession(text_to_cstring(srvname));
+
+    if (!state->cache_table)
+        ereport(ERROR,
+                (errcode(ERRCODE_FDW_OPTION_NAME_NOT_FOUND),
+                 errmsg("server '%s' has no cache table", state->server->servername),
+                 errhint("create one with nominatim_fdw_cache_create()")));
+
+    return state;
+}
+
+/*
+ * nominatim_fdw_cache_refresh
+ * ----------
+ * Sends the requests of the oldest entries of the server's cache table again
+ * and stores the new records, e.g. in a nightly job, so that the entries are
+ * refreshed at a pace the server can cope with.
+ *
+ * returns number of refreshed entries
+ */
+Datum nominatim_fdw_cache_refresh(PG_FUNCTION_ARGS)
+{
+    NominatimFDWState *state = InitCacheMaintenance(PG_GETARG_TEXT_P(0));
+    Interval *older_than = PG_GETARG_INTERVAL_P(1);
+    int max_requests = PG_GETARG_INT32(2);
+    MemoryContext callercontext = CurrentMemoryContext;
+    Oid argtypes[3] = {INTERVALOID, INT4OID, TEXTOID};
+    Datum args[3];
+    List *urls = NIL;
+    List *points = NIL;
+    ListCell *url;
+    ListCell *points_only;
+    int64 refreshed = 0;
+
+    args[0] = IntervalPGetDatum(older_than);
+    args[1] = Int32GetDatum(max_requests);
+    args[2] = CStringGetTextDatum(state->url);
+
+    SPI_connect();
+
+    /* entries of an earlier url of the server are left to nominatim_fdw_cache_expire */
+    if (SPI_execute_with_args(psprintf("SELECT request_url, points_only FROM %s "
+                                       "WHERE fetched_at < now() - $1 AND left(request_url, length($3)) = $3 "
+                                       "ORDER BY fetched_at LIMIT $2",
+                                       GetCacheTableName(state->cache_table)),
+                              3, argtypes, args, NULL, true, 0) == SPI_OK_SELECT)
+    {
+        MemoryContext spicontext = MemoryContextSwitchTo(callercontext);
+
+        for (uint64 i = 0; i < SPI_processed; i++)
         {
-            state->proxy = defGetString(def);
-            state->proxy_type = NOMINATIM_SERVER_OPTION_HTTP_PROXY;
+            urls = lappend(urls, SPI_getvalue(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 1));
+            points = lappend_int(points, strcmp(SPI_getvalue(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 2), "t") == 0);
         }
 
-        if (strcmp(def->defname, NOMINATIM_SERVER_OPTION_CONNECTTIMEOUT) == 0)
-        {
-            char *tailpt;
-            char *timeout_str = defGetString(def);
+        MemoryContextSwitchTo(spicontext);
+    }
 
-            state->connect_timeout = strtol(timeout_str, &tailpt, 0);
-        }
+    SPI_finish();
 
-        if (strcmp(def->defname, NOMINATIM_SERVER_OPTION_MAXREDIRECT) == 0)
-        {
-            char *tailpt;
-            char *maxredirect_str = defGetString(def);
+    forboth(url, urls, points_only, points)
+    {
+        NominatimFDWState *request;
+        char *path;
 
-            state->request_max_redirect = strtol(maxredirect_str, &tailpt, 10);
+        /* entries of an earlier url of the server would go to the old host */
+        if (strncmp((char *)lfirst(url), state->url, strlen(state->url)) != 0)
+        {
+            elog(DEBUG1, "%s: skipping \"%s\"", __func__, (char *)lfirst(url));
+            continue;
         }
 
-        if (strcmp(def->defname, NOMINATIM_SERVER_OPTION_MAXCONNECTRETRY) == 0)
-        {
-            char *tailpt;
-            char *val = defGetString(def);
+        request = (NominatimFDWState *)palloc(sizeof(NominatimFDWState));
+        path = (char *)lfirst(url) + strlen(state->url);
 
-            state->max_retries = strtol(val, &tailpt, 10);
+        memcpy(request, state, sizeof(NominatimFDWState));
+        request->request_url = (char *)lfirst(url);
+        request->points_only = lfirst_int(points_only);
+        request->records = NIL;
+
+        if (strncmp(path, "/" NOMINATIM_REQUEST_REVERSE "?", strlen("/" NOMINATIM_REQUEST_REVERSE "?")) == 0)
+        {
+            request->request_type = NOMINATIM_REQUEST_REVERSE;
+            ParseNominatimReverseData(request);
+        }
+        else
+        {
+            request->request_type = NOMINATIM_REQUEST_SEARCH;
+            ParseNominatimSearchData(request);
         }
 
-        if (strcmp(def->defname, NOMINATIM_SERVER_OPTION_LANGUAGE) == 0)
-            state->accept_language = defGetString(def);
+        refreshed++;
     }
 
-    return state;
+    PG_RETURN_INT64(refreshed);
 }
 
-static size_t WriteMemoryCallback(void *contents, size_t size, size_t nmemb, void *userp)
+/*
+ * nominatim_fdw_cache_prewarm
+ * ----------
+ * Loads the entries of the server's cache table into the shared cache, e.g.
+ * after a restart or a failover, so that the shared cache doesn't have to be
+ * filled by requests to the server.
+ *
+ * returns number of loaded entries
+ */
+Datum nominatim_fdw_cache_prewarm(PG_FUNCTION_ARGS)
 {
-    size_t realsize = size * nmemb;
-    struct MemoryStruct *mem = (struct MemoryStruct *)userp;
-    char *ptr = repalloc(mem->memory, mem->size + realsize + 1);
+    NominatimFDWState *state = InitCacheMaintenance(PG_GETARG_TEXT_P(0));
+    MemoryContext rowcontext = AllocSetContextCreate(CurrentMemoryContext,
+                                                     "nominatim_fdw prewarm",
+                                                     ALLOCSET_DEFAULT_SIZES);
+    int64 loaded = 0;
 
-    if (!ptr)
+    if (!shared_cache)
         ereport(ERROR,
-                (errcode(ERRCODE_FDW_OUT_OF_MEMORY),
-                 errmsg("out of memory (repalloc returned NULL)")));
-
-    mem->memory = ptr;
-    memcpy(&(mem->memory[mem->size]), contents, realsize);
-    mem->size += realsize;
-    mem->memory[mem->size] = 0;
-
-    return realsize;
-}
-static size_t HeaderCallbackFunction(char *contents, size_t size, size_t nmemb, void *userp)
-{
-    size_t realsize = size * nmemb;
-    struct MemoryStruct *mem = (struct MemoryStruct *)userp;
-    char *ptr;
-
-    Assert(contents);
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("the shared cache is disabled"),
+                 errhint("load nominatim_fdw via \"shared_preload_libraries\" and set \"nominatim_fdw.cache_size\"")));
 
-    elog(DEBUG2, "%s: header = \"%s\"", __func__, contents);
-
-    ptr = repalloc(mem->memory, mem->size + realsize + 1);
-
-    if (!ptr)
+    if (state->cache_ttl <= 0)
         ereport(ERROR,
-                (errcode(ERRCODE_FDW_OUT_OF_MEMORY),
-                 errmsg("[%s] out of memory (repalloc returned NULL)", __func__)));
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("server '%s' has no %s", state->server->servername, NOMINATIM_SERVER_OPTION_CACHE_TTL)));
 
-    mem->memory = ptr;
-    memcpy(&(mem->memory[mem->size]), contents, realsize);
-    mem->size += realsize;
-    mem->memory[mem->size] = 0;
+    SPI_connect();
+
+    if (SPI_execute(psprintf("SELECT request_url, points_only, records FROM %s",
+                             GetCacheTableName(state->cache_table)),
+                    true, 0) == SPI_OK_SELECT)
+    {
+        for (uint64 i = 0; i < SPI_processed; i++)
+        {
+            HeapTuple tuple = SPI_tuptable->vals[i];
+            bool isnull;
+            bool points_only = DatumGetBool(SPI_getbinval(tuple, SPI_tuptable->tupdesc, 2, &isnull));
+            MemoryContext spicontext = MemoryContextSwitchTo(rowcontext);
+            bytea *data = DatumGetByteaPP(SPI_getbinval(tuple, SPI_tuptable->tupdesc, 3, &isnull));
+
+            state->cache_key = psprintf("%s%s", SPI_getvalue(tuple, SPI_tuptable->tupdesc, 1), points_only ? " points" : "");
+            state->records = DeserializeRecords(VARDATA_ANY(data));
+            SharedCacheStore(state);
+
+            MemoryContextSwitchTo(spicontext);
+            MemoryContextReset(rowcontext);
+            loaded++;
+        }
+    }
 
-    return realsize;
+    SPI_finish();
+    MemoryContextDelete(rowcontext);
+
+    PG_RETURN_INT64(loaded);
 }
 
 /*
- * xml_get_prop / xml_node_content
+ * ReleaseBenchHandles
  * ----------
- *
- * Wrappers around xmlGetProp / xmlNodeGetContent that copy the result
- * into palloc'd memory and immediately free the libxml2 heap string.
- * Returns NULL when the attribute or content is absent.
+ * Memory context reset callback releasing the cURL handles of a
+ * nominatim_fdw_bench call, also if it is cancelled or fails.
  */
-static char *
-xml_get_prop(xmlNodePtr node, const char *name)
+static void ReleaseBenchHandles(void *arg)
 {
-    xmlChar *val = xmlGetProp(node, (xmlChar *)name);
-    char *result = val ? pstrdup((char *)val) : NULL;
+    NominatimBench *bench = (NominatimBench *)arg;
 
-    xmlFree(val);
-    return result;
-}
+    for (int i = 0; i < bench->concurrency; i++)
+    {
+        NominatimBenchSlot *slot = &bench->slots[i];
 
-static char *
-xml_node_content(xmlNodePtr node)
-{
-    xmlChar *val = xmlNodeGetContent(node);
-    char *result = val ? pstrdup((char *)val) : NULL;
+        if (slot->busy)
+        {
+            curl_multi_remove_handle(bench->multi, slot->state.curl);
+            curl_slist_free_all(slot->req.headers);
+            slot->busy = false;
+        }
 
-    xmlFree(val);
-    return result;
+        if (slot->state.curl)
+        {
+            curl_easy_cleanup(slot->state.curl);
+            slot->state.curl = NULL;
+        }
+    }
+
+    if (bench->multi)
+    {
+        curl_multi_cleanup(bench->multi);
+        bench->multi = NULL;
+    }
 }
 
 /*
- * ParseNominatimReverseData
+ * StartBenchRequest
  * ----------
+ * Builds the request of a sample and adds it to the multi handle.
  *
- * Parses the XML document returned from the Nominatim reverse endpoint
- * and creates a List of NominatimRecord. The paresed records are stored
- * in state->records.
- *
- * state: NominatimFDWState containing all session data
- *
+ * bench: NominatimBench of the call
+ * slot: idle slot sending the request
+ * sample: index of the sample in bench->samples
  */
-static void ParseNominatimReverseData(NominatimFDWState *state)
+static void StartBenchRequest(NominatimBench *bench, NominatimBenchSlot *slot, long sample)
 {
-    struct NominatimRecord *place;
-    xmlNodePtr reversegeocode;
-    xmlNodePtr tag;
-    xmlNodePtr root;
-    StringInfoData addressparts;
-    StringInfoData extratags;
-    StringInfoData namedetails;
-    StringInfoData entrances;
-    bool found = false;
-
-    elog(DEBUG2, "%s called", __func__);
+    NominatimFDWState *state = &slot->state;
+    MemoryContext oldcontext = MemoryContextSwitchTo(slot->context);
 
-    if (ExecuteRequest(state) != REQUEST_SUCCESS)
-        elog(ERROR, "%s -> request failed: '%s'", __func__, state->url);
-
-    Assert(state->xmldoc);
-
-    root = xmlDocGetRootElement(state->xmldoc);
+    state->records = NIL;
 
-    if (!root)
-        elog(ERROR, "unable to parse root element: '%s'", state->url);
+    if (strcmp(state->request_type, NOMINATIM_REQUEST_REVERSE) == 0)
+    {
+        state->lon = bench->lons[sample];
+        state->lat = bench->lats[sample];
+    }
+    else if (strcmp(state->request_type, NOMINATIM_REQUEST_LOOKUP) == 0)
+        state->osm_ids = bench->samples[sample];
+    else
+        state->query = bench->samples[sample];
 
-    place = (struct NominatimRecord *)palloc0(sizeof(struct NominatimRecord));
+    if (PrepareRequest(state, &slot->req) != REQUEST_SUCCESS)
+        elog(ERROR, "%s -> request failed: '%s'", __func__, state->url);
 
-    initStringInfo(&addressparts);
-    initStringInfo(&extratags);
-    initStringInfo(&namedetails);
-    initStringInfo(&entrances);
-    appendStringInfoChar(&addressparts, '{');
-    appendStringInfoChar(&extratags, '{');
-    appendStringInfoChar(&namedetails, '{');
-    appendStringInfoChar(&entrances, '[');
+    curl_easy_setopt(slot->req.curl, CURLOPT_PRIVATE, (void *)slot);
+    curl_multi_add_handle(bench->multi, slot->req.curl);
+    slot->busy = true;
 
-    place->timestamp = xml_get_prop(root, "timestamp");
-    place->attribution = xml_get_prop(root, "attribution");
-    place->querystring = xml_get_prop(root, "querystring");
+    MemoryContextSwitchTo(oldcontext);
+}
 
-    for (reversegeocode = root->children; reversegeocode != NULL; reversegeocode = reversegeocode->next)
+/*
+ * FinishBenchRequest
+ * ----------
+ * Parses the response of a finished request into records, as a query
+ * would, and adds the request to the results of the call. Failed requests
+ * are counted as errors instead of being retried.
+ *
+ * bench: NominatimBench of the call
+ * slot: slot of the request, already removed from the multi handle
+ * res: result of the request
+ */
+static void FinishBenchRequest(NominatimBench *bench, NominatimBenchSlot *slot, CURLcode res)
+{
+    NominatimRequest *req = &slot->req;
+    MemoryContext oldcontext = MemoryContextSwitchTo(slot->context);
+    long response_code = 0;
+    long connects = 0;
+    double connect = 0;
+    double appconnect = 0;
+    instr_time elapsed;
+    char *error = NULL;
+
+    curl_easy_getinfo(req->curl, CURLINFO_RESPONSE_CODE, &response_code);
+    curl_easy_getinfo(req->curl, CURLINFO_NUM_CONNECTS, &connects);
+    curl_easy_getinfo(req->curl, CURLINFO_CONNECT_TIME, &connect);
+    curl_easy_getinfo(req->curl, CURLINFO_APPCONNECT_TIME, &appconnect);
+
+    RecordServerStats(&slot->state, req, 0);
+    CaptureRequest(&slot->state, req, 0);
+
+    if (res != CURLE_OK)
+        error = psprintf("HTTP status %ld: %s", response_code,
+                         req->errbuf[0] ? req->errbuf : curl_easy_strerror(res));
+    else
     {
-        if (xmlStrcmp(reversegeocode->name, (xmlChar *)"result") == 0)
-        {
-            found = true;
-            place->ref = xml_get_prop(reversegeocode, "ref");
-            place->address_rank = xml_get_prop(reversegeocode, "address_rank");
-            place->boundingbox = xml_get_prop(reversegeocode, "boundingbox");
-            place->class = xml_get_prop(reversegeocode, "class");
-            place->type = xml_get_prop(reversegeocode, "type");
-            place->icon = xml_get_prop(reversegeocode, "icon");
-            place->importance = xml_get_prop(reversegeocode, "importance");
-            place->lat = xml_get_prop(reversegeocode, "lat");
-            place->lon = xml_get_prop(reversegeocode, "lon");
-            place->osm_id = xml_get_prop(reversegeocode, "osm_id");
-            place->osm_type = xml_get_prop(reversegeocode, "osm_type");
-            place->place_id = xml_get_prop(reversegeocode, "place_id");
-            place->place_rank = xml_get_prop(reversegeocode, "place_rank");
-
-            place->polygon = xml_get_prop(reversegeocode, "geotext");
-            if (!place->polygon)
-                place->polygon = xml_get_prop(reversegeocode, "geojson");
-            if (!place->polygon)
-                place->polygon = xml_get_prop(reversegeocode, "geosvg");
+        xmlDocPtr doc = xmlReadMemory(req->chunk.memory, req->chunk.size, NULL, NULL,
+                                      XML_PARSE_NOBLANKS | XML_PARSE_NONET);
+        int rc = NOMINATIM_PARSE_NO_ROOT;
 
-            place->display_name = xml_node_content(reversegeocode);
-        }
-        else if (xmlStrcmp(reversegeocode->name, (xmlChar *)"addressparts") == 0)
-        {
-            for (tag = reversegeocode->children; tag != NULL; tag = tag->next)
-            {
-                char *content = xml_node_content(tag);
-                if (addressparts.len > 1)
-                    appendStringInfoChar(&addressparts, ',');
-                escape_json(&addressparts, (char *)tag->name);
-                appendStringInfoChar(&addressparts, ':');
-                escape_json(&addressparts, content ? content : "");
-            }
-        }
-        else if (xmlStrcmp(reversegeocode->name, (xmlChar *)"extratags") == 0)
-        {
-            for (tag = reversegeocode->children; tag != NULL; tag = tag->next)
-            {
-                char *key = xml_get_prop(tag, "key");
-                char *value = xml_get_prop(tag, "value");
-                if (extratags.len > 1)
-                    appendStringInfoChar(&extratags, ',');
-                escape_json(&extratags, key ? key : "");
-                appendStringInfoChar(&extratags, ':');
-                escape_json(&extratags, value ? value : "");
-            }
-        }
-        else if (xmlStrcmp(reversegeocode->name, (xmlChar *)"geokml") == 0)
+        if (doc)
         {
-            int bytes;
-            xmlBufferPtr buffer = xmlBufferCreate();
-            bytes = xmlNodeDump(buffer, state->xmldoc, reversegeocode->children, 0, 0);
-
-            if (bytes == -1)
-                elog(ERROR, "unable to dump XML node: '%s'", state->url);
+            if (strcmp(slot->state.request_type, NOMINATIM_REQUEST_REVERSE) == 0)
+                rc = nominatim_parse_reverse(doc, 0, &parser_allocator, CollectRecord, &slot->state);
+            else
+                rc = nominatim_parse_search(doc, 0, &parser_allocator, CollectRecord, &slot->state);
 
-            place->polygon = pstrdup((char *)buffer->content);
-            xmlBufferFree(buffer);
+            xmlFreeDoc(doc);
         }
-        else if (xmlStrcmp(reversegeocode->name, (xmlChar *)"entrances") == 0)
-        {
-            bool first_entrance = true;
 
-            for (tag = reversegeocode->children; tag != NULL; tag = tag->next)
-            {
-                xmlAttrPtr attr;
-                bool first_attr = true;
+        if (rc != NOMINATIM_PARSE_OK)
+            error = psprintf("unable to parse XML document (%zu bytes)", req->chunk.size);
+    }
 
-                if (!first_entrance)
-                    appendStringInfoChar(&entrances, ',');
-                first_entrance = false;
+    INSTR_TIME_SET_CURRENT(elapsed);
+    INSTR_TIME_SUBTRACT(elapsed, req->started);
 
-                appendStringInfoChar(&entrances, '{');
+    bench->requests++;
+    bench->bytes += req->chunk.size;
 
-                for (attr = tag->properties; attr != NULL; attr = attr->next)
-                {
-                    char *value = xml_get_prop(tag, (const char *)attr->name);
+    if (connects > 0)
+    {
+        bench->connections += connects;
+        bench->connect_ms += (appconnect > 0 ? appconnect : connect) * 1000.0;
+    }
 
-                    if (!first_attr)
-                        appendStringInfoChar(&entrances, ',');
-                    first_attr = false;
+    if (error)
+    {
+        bench->errors++;
 
-                    escape_json(&entrances, (char *)attr->name);
-                    appendStringInfoChar(&entrances, ':');
-                    escape_json(&entrances, value ? value : "");
-                }
+        if (bench->last_error)
+            pfree(bench->last_error);
 
-                appendStringInfoChar(&entrances, '}');
-            }
-        }
-        else if (xmlStrcmp(reversegeocode->name, (xmlChar *)"namedetails") == 0)
+        bench->last_error = MemoryContextStrdup(bench->context, error);
+    }
+    else
+    {
+        if (bench->nlatencies == bench->maxlatencies)
         {
-            for (tag = reversegeocode->children; tag != NULL; tag = tag->next)
-            {
-                char *desc = xml_get_prop(tag, "desc");
-                char *content = xml_node_content(tag);
-                if (namedetails.len > 1)
-                    appendStringInfoChar(&namedetails, ',');
-                escape_json(&namedetails, desc ? desc : "");
-                appendStringInfoChar(&namedetails, ':');
-                escape_json(&namedetails, content ? content : "");
-            }
+            bench->maxlatencies *= 2;
+            bench->latencies = (double *)repalloc(bench->latencies, bench->maxlatencies * sizeof(double));
         }
+
+        bench->latencies[bench->nlatencies++] = INSTR_TIME_GET_MILLISEC(elapsed);
     }
 
-    appendStringInfoChar(&addressparts, '}');
-    appendStringInfoChar(&extratags, '}');
-    appendStringInfoChar(&namedetails, '}');
-    appendStringInfoChar(&entrances, ']');
+    curl_slist_free_all(req->headers);
+    req->headers = NULL;
+    slot->busy = false;
 
-    place->addressparts = addressparts.data;
-    place->extratags = extratags.data;
-    place->namedetails = namedetails.data;
-    place->entrances = entrances.data;
+    MemoryContextSwitchTo(oldcontext);
+    MemoryContextReset(slot->context);
+}
 
-    if (found)
-        state->records = lappend(state->records, place);
+static int CompareLatency(const void *a, const void *b)
+{
+    double la = *(const double *)a;
+    double lb = *(const double *)b;
 
-    xmlFreeDoc(state->xmldoc);
-    state->xmldoc = NULL;
+    return (la > lb) - (la < lb);
 }
 
 /*
- * ParseNominatimSearchData
+ * LatencyPercentile
  * ----------
+ * Nearest-rank percentile of the sorted latencies of a nominatim_fdw_bench
+ * call.
  *
- * Parses the XML document returned from the Nominatim search and lookup
- * endpoints, and creates a List of NominatimRecord. The paresed records
- * are stored in state->records.
- *
- * state: NominatimFDWState containing all session data
+ * returns the percentile in ms
+ */
+static double LatencyPercentile(NominatimBench *bench, double p)
+{
+    long rank = (long)ceil(p / 100.0 * bench->nlatencies);
+
+    return bench->latencies[Max(rank, 1) - 1];
+}
+
+/*
+ * nominatim_fdw_bench
+ * ----------
+ * Sends requests built from the given samples to a server for the given
+ * duration, keeping 'concurrency' requests in flight, and parses their
+ * responses into records. The requests go through the same request
+ * building, cURL options (timeouts, proxy, TLS) and parser as queries, but
+ * bypass all caches and nominatim_fdw.transport.
  *
+ * returns record with throughput, errors and latency percentiles
  */
-static void ParseNominatimSearchData(NominatimFDWState *state)
+Datum nominatim_fdw_bench(PG_FUNCTION_ARGS)
 {
-    xmlNodePtr searchresults;
-    xmlNodePtr places;
-    xmlNodePtr tag;
-    xmlNodePtr root;
+    NominatimFDWState *session = InitSession(text_to_cstring(PG_GETARG_TEXT_P(0)));
+    char *request_type = text_to_cstring(PG_GETARG_TEXT_P(1));
+    ArrayType *sample_array = PG_GETARG_ARRAYTYPE_P(2);
+    Interval *duration = PG_GETARG_INTERVAL_P(3);
+    int concurrency = PG_GETARG_INT32(4);
+    MemoryContext benchcontext;
+    MemoryContext oldcontext;
+    MemoryContextCallback *callback;
+    NominatimBench *bench;
+    TupleDesc tupdesc;
+    HeapTuple tuple;
+    Datum *elems;
+    bool *elemnulls;
+    int nelems;
+    int64 duration_us;
+    int64 elapsed_us = 0;
+    instr_time start;
+    instr_time now;
+    long next = 0;
+    int busy = 0;
+    Datum values[12];
+    bool nulls[12] = {false, false, false, false, false, false, false, false, false, false, false, false};
+
+    if (strcmp(request_type, NOMINATIM_REQUEST_SEARCH) == 0)
+        request_type = NOMINATIM_REQUEST_SEARCH;
+    else if (strcmp(request_type, NOMINATIM_REQUEST_REVERSE) == 0)
+        request_type = NOMINATIM_REQUEST_REVERSE;
+    else if (strcmp(request_type, NOMINATIM_REQUEST_LOOKUP) == 0)
+        request_type = NOMINATIM_REQUEST_LOOKUP;
+    else
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("invalid request type '%s'", request_type),
+                 errhint("Valid request types are: search, reverse, lookup.")));
 
-    state->records = NIL;
+    if (concurrency < 1 || concurrency > NOMINATIM_BENCH_MAX_CONCURRENCY)
+        ereport(ERROR,
+                (errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+                 errmsg("concurrency out of range: %d", concurrency),
+                 errhint("concurrency must be between 1 and %d", NOMINATIM_BENCH_MAX_CONCURRENCY)));
 
-    elog(DEBUG2, "%s called", __func__);
+    duration_us = duration->time + (duration->day + (int64)duration->month * DAYS_PER_MONTH) * USECS_PER_DAY;
 
-    if (ExecuteRequest(state) != REQUEST_SUCCESS)
-        elog(ERROR, "%s -> request failed: '%s'", __func__, state->url);
+    if (duration_us <= 0)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("duration must be greater than zero")));
 
-    Assert(state->xmldoc);
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+        ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                        errmsg("function returning record called in context that cannot accept type record")));
 
-    root = xmlDocGetRootElement(state->xmldoc);
+    benchcontext = AllocSetContextCreate(CurrentMemoryContext,
+                                         "nominatim_fdw bench",
+                                         ALLOCSET_DEFAULT_SIZES);
+    oldcontext = MemoryContextSwitchTo(benchcontext);
 
-    if (!root)
-        elog(ERROR, "unable to parse XML document: '%s'", state->url);
+    bench = (NominatimBench *)palloc0(sizeof(NominatimBench));
+    bench->context = benchcontext;
+    bench->slots = (NominatimBenchSlot *)palloc0(concurrency * sizeof(NominatimBenchSlot));
+    bench->maxlatencies = 1024;
+    bench->latencies = (double *)palloc(bench->maxlatencies * sizeof(double));
 
-    for (searchresults = root->children; searchresults != NULL; searchresults = searchresults->next)
-    {
-
-        if (xmlStrcmp(searchresults->name, (xmlChar *)"place") == 0)
-        {
-
-            struct NominatimRecord *place = (struct NominatimRecord *)palloc0(sizeof(struct NominatimRecord));
-            StringInfoData xtags;
-            StringInfoData addressdetails;
-            StringInfoData namedetails;
-            StringInfoData entrances;
-
-            initStringInfo(&xtags);
-            initStringInfo(&addressdetails);
-            initStringInfo(&namedetails);
-            initStringInfo(&entrances);
-
-            appendStringInfo(&xtags, "{");
-            appendStringInfo(&addressdetails, "{");
-            appendStringInfo(&namedetails, "{");
-            appendStringInfoChar(&entrances, '[');
-
-            place->ref = xml_get_prop(searchresults, "ref");
-            place->address_rank = xml_get_prop(searchresults, "address_rank");
-            place->attribution = xml_get_prop(xmlDocGetRootElement(state->xmldoc), "attribution");
-            place->boundingbox = xml_get_prop(searchresults, "boundingbox");
-            place->class = xml_get_prop(searchresults, "class");
-            place->type = xml_get_prop(searchresults, "type");
-            place->display_name = xml_get_prop(searchresults, "display_name");
-            place->exclude_place_ids = xml_get_prop(xmlDocGetRootElement(state->xmldoc), "exclude_place_ids");
-            place->icon = xml_get_prop(searchresults, "icon");
-            place->importance = xml_get_prop(searchresults, "importance");
-            place->lat = xml_get_prop(searchresults, "lat");
-            place->lon = xml_get_prop(searchresults, "lon");
-            place->more_url = xml_get_prop(xmlDocGetRootElement(state->xmldoc), "more_url");
-            place->osm_id = xml_get_prop(searchresults, "osm_id");
-            place->osm_type = xml_get_prop(searchresults, "osm_type");
-            place->place_id = xml_get_prop(searchresults, "place_id");
-            place->place_rank = xml_get_prop(searchresults, "place_rank");
-
-            place->polygon = xml_get_prop(searchresults, "geotext");
-            if (!place->polygon)
-                place->polygon = xml_get_prop(searchresults, "geojson");
-            if (!place->polygon)
-                place->polygon = xml_get_prop(searchresults, "geosvg");
-
-            place->querystring = xml_get_prop(xmlDocGetRootElement(state->xmldoc), "querystring");
-            place->timestamp = xml_get_prop(xmlDocGetRootElement(state->xmldoc), "timestamp");
-
-            for (places = searchresults->children; places != NULL; places = places->next)
-            {
-                if (xmlStrcmp(places->name, (xmlChar *)"extratags") == 0)
-                {
-                    for (tag = places->children; tag != NULL; tag = tag->next)
-                    {
-                        char *key = xml_get_prop(tag, "key");
-                        char *value = xml_get_prop(tag, "value");
-                        if (xtags.len > 1)
-                            appendStringInfoChar(&xtags, ',');
-                        escape_json(&xtags, key ? key : "");
-                        appendStringInfoChar(&xtags, ':');
-                        escape_json(&xtags, value ? value : "");
-                    }
-                }
-                else if (xmlStrcmp(places->name, (xmlChar *)"namedetails") == 0)
-                {
-                    for (tag = places->children; tag != NULL; tag = tag->next)
-                    {
-                        char *desc = xml_get_prop(tag, "desc");
-                        char *content = xml_node_content(tag);
-                        if (namedetails.len > 1)
-                            appendStringInfoChar(&namedetails, ',');
-                        escape_json(&namedetails, desc ? desc : "");
-                        appendStringInfoChar(&namedetails, ':');
-                        escape_json(&namedetails, content ? content : "");
-                    }
-                }
-                else if (xmlStrcmp(places->name, (xmlChar *)"geokml") == 0)
-                {
-                    int bytes;
-                    xmlBufferPtr buffer = xmlBufferCreate();
-                    bytes = xmlNodeDump(buffer, state->xmldoc, places->children, 0, 0);
+    deconstruct_array(sample_array, TEXTOID, -1, false, 'i', &elems, &elemnulls, &nelems);
 
-                    if (bytes == -1)
-                        elog(ERROR, "unable to dump XML node: '%s'", state->url);
+    bench->samples = (char **)palloc0(Max(nelems, 1) * sizeof(char *));
+    bench->lons = (float8 *)palloc0(Max(nelems, 1) * sizeof(float8));
+    bench->lats = (float8 *)palloc0(Max(nelems, 1) * sizeof(float8));
 
-                    place->polygon = pstrdup((char *)buffer->content);
-                    xmlBufferFree(buffer);
-                }
-                else if (xmlStrcmp(places->name, (xmlChar *)"entrances") == 0)
-                {
-                    bool first_entrance = true;
+    for (int i = 0; i < nelems; i++)
+    {
+        char *sample;
+
+        if (elemnulls[i])
+            continue;
+
+        sample = TextDatumGetCString(elems[i]);
 
-                    for (tag = places->children; tag != NULL; tag = tag->next)
-                    {
-                        xmlAttrPtr attr;
-                        bool first_attr = true;
+        if (strlen(sample) == 0)
+            continue;
 
-                        if (!first_entrance)
-                            appendStringInfoChar(&entrances, ',');
-                        first_entrance = false;
+        if (strcmp(request_type, NOMINATIM_REQUEST_REVERSE) == 0)
+        {
+            float8 lon;
+            float8 lat;
+            char extra;
+
+            if (sscanf(sample, "%lf,%lf %c", &lon, &lat, &extra) != 2)
+                ereport(ERROR,
+                        (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+                         errmsg("invalid reverse sample '%s'", sample),
+                         errhint("reverse samples are \"lon,lat\" pairs, e.g. '7.6261,51.9607'")));
+
+            if (lat < -90.0 || lat > 90.0)
+                ereport(ERROR,
+                        (errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+                         errmsg("latitude out of range: %f", lat),
+                         errhint("latitude must be between -90 and 90")));
+
+            if (lon < -180.0 || lon > 180.0)
+                ereport(ERROR,
+                        (errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+                         errmsg("longitude out of range: %f", lon),
+                         errhint("longitude must be between -180 and 180")));
+
+            bench->lons[bench->nsamples] = lon;
+            bench->lats[bench->nsamples] = lat;
+        }
 
-                        appendStringInfoChar(&entrances, '{');
+        bench->samples[bench->nsamples++] = sample;
+    }
 
-                        for (attr = tag->properties; attr != NULL; attr = attr->next)
-                        {
-                            char *value = xml_get_prop(tag, (const char *)attr->name);
+    if (bench->nsamples == 0)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("no sample queries given"),
+                 errhint("pass free-form queries for search, \"lon,lat\" pairs for reverse and osm_ids lists for lookup")));
 
-                            if (!first_attr)
-                                appendStringInfoChar(&entrances, ',');
-                            first_attr = false;
+    callback = (MemoryContextCallback *)palloc0(sizeof(MemoryContextCallback));
+    callback->func = ReleaseBenchHandles;
+    callback->arg = bench;
+    MemoryContextRegisterResetCallback(benchcontext, callback);
 
-                            escape_json(&entrances, (char *)attr->name);
-                            appendStringInfoChar(&entrances, ':');
-                            escape_json(&entrances, value ? value : "");
-                        }
+    bench->multi = curl_multi_init();
 
-                        appendStringInfoChar(&entrances, '}');
-                    }
-                }
-                else
-                {
-                    char *content = xml_node_content(places);
-                    if (addressdetails.len > 1)
-                        appendStringInfoChar(&addressdetails, ',');
-                    escape_json(&addressdetails, (char *)places->name);
-                    appendStringInfoChar(&addressdetails, ':');
-                    escape_json(&addressdetails, content ? content : "");
-                }
-            }
+    if (!bench->multi)
+        elog(ERROR, "%s -> unable to create cURL multi handle", __func__);
+
+    for (int i = 0; i < concurrency; i++)
+    {
+        NominatimBenchSlot *slot = &bench->slots[i];
+
+        memcpy(&slot->state, session, sizeof(NominatimFDWState));
+        slot->state.request_type = request_type;
+        slot->state.format = NOMINATIM_FORMAT_XML;
+        slot->state.polygon_type = "";
+        slot->state.zoom = -1;
+        slot->state.dedupe = true;
+        slot->state.addressdetails = true;
+        slot->state.curl = curl_easy_init();
+        slot->context = AllocSetContextCreate(benchcontext,
+                                              "nominatim_fdw bench request",
+                                              ALLOCSET_DEFAULT_SIZES);
+        bench->concurrency++;
+
+        if (!slot->state.curl)
+            elog(ERROR, "%s -> unable to create cURL handle", __func__);
+    }
+
+    RegisterWaitEvents();
+    INSTR_TIME_SET_CURRENT(start);
+
+    for (;;)
+    {
+        CURLMsg *msg;
+        int running = 0;
+        int msgs;
+        bool finished = false;
+
+        CHECK_FOR_INTERRUPTS();
+
+        INSTR_TIME_SET_CURRENT(now);
+        INSTR_TIME_SUBTRACT(now, start);
+        elapsed_us = (int64)INSTR_TIME_GET_MICROSEC(now);
 
-            appendStringInfo(&xtags, "}");
-            appendStringInfo(&addressdetails, "}");
-            appendStringInfo(&namedetails, "}");
-            appendStringInfoChar(&entrances, ']');
+        /* keep all slots busy until the duration is over, then drain them */
+        for (int i = 0; i < concurrency && elapsed_us < duration_us; i++)
+        {
+            if (bench->slots[i].busy)
+                continue;
+
+            StartBenchRequest(bench, &bench->slots[i], next++ % bench->nsamples);
+            busy++;
+        }
+
+        if (busy == 0)
+            break;
 
-            place->extratags = xtags.data;
-            place->addressdetails = addressdetails.data;
-            place->namedetails = namedetails.data;
-            place->entrances = entrances.data;
+        curl_multi_perform(bench->multi, &running);
 
-            state->records = lappend(state->records, place);
+        while ((msg = curl_multi_info_read(bench->multi, &msgs)) != NULL)
+        {
+            NominatimBenchSlot *slot = NULL;
+            CURL *easy = msg->easy_handle;
+            CURLcode res = msg->data.result;
+
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+
+            curl_easy_getinfo(easy, CURLINFO_PRIVATE, (char **)&slot);
+            curl_multi_remove_handle(bench->multi, easy);
+            FinishBenchRequest(bench, slot, res);
+            busy--;
+            finished = true;
+        }
+
+        if (!finished)
+        {
+            pgstat_report_wait_start(wait_event_response);
+            curl_multi_wait(bench->multi, NULL, 0, 100, NULL);
+            pgstat_report_wait_end();
         }
     }
 
-    xmlFreeDoc(state->xmldoc);
-    state->xmldoc = NULL;
+    INSTR_TIME_SET_CURRENT(now);
+    INSTR_TIME_SUBTRACT(now, start);
+
+    qsort(bench->latencies, bench->nlatencies, sizeof(double), CompareLatency);
+
+    values[0] = Int64GetDatum(bench->requests);
+    values[1] = Int64GetDatum(bench->errors);
+    values[2] = Float8GetDatum(bench->requests / Max(INSTR_TIME_GET_DOUBLE(now), 1e-6));
+    values[3] = Int64GetDatum(bench->bytes);
+    values[4] = Int64GetDatum(bench->connections);
+    nulls[5] = bench->connections == 0;
+    values[5] = Float8GetDatum(bench->connections > 0 ? bench->connect_ms / bench->connections : 0);
+
+    if (bench->nlatencies > 0)
+    {
+        double total = 0;
+
+        for (long i = 0; i < bench->nlatencies; i++)
+            total += bench->latencies[i];
+
+        values[6] = Float8GetDatum(total / bench->nlatencies);
+        values[7] = Float8GetDatum(LatencyPercentile(bench, 50));
+        values[8] = Float8GetDatum(LatencyPercentile(bench, 90));
+        values[9] = Float8GetDatum(LatencyPercentile(bench, 99));
+        values[10] = Float8GetDatum(bench->latencies[bench->nlatencies - 1]);
+    }
+    else
+        for (int i = 6; i <= 10; i++)
+            nulls[i] = true;
+
+    nulls[11] = bench->last_error == NULL;
+    values[11] = bench->last_error ? CStringGetTextDatum(bench->last_error) : (Datum)0;
+
+    MemoryContextSwitchTo(oldcontext);
+
+    /* the tuple holds a copy of the results, so the handles can go away */
+    tuple = heap_form_tuple(BlessTupleDesc(tupdesc), values, nulls);
+    MemoryContextDelete(benchcontext);
+
+    PG_RETURN_DATUM(HeapTupleGetDatum(tuple));
 }
 
-static void AppendUrlParam(StringInfo buf, CURL *curl, const char *param, const char *value)
+/*
+ * FloorDiv
+ * ----------
+ * Integer division rounding towards minus infinity, so that negative keys
+ * fall into the same batches on every call.
+ */
+static int64 FloorDiv(int64 a, int64 b)
 {
-    char *escaped = curl_easy_escape(curl, value, 0);
-    appendStringInfo(buf, "%s=%s&", param, escaped);
-    curl_free(escaped);
+    return a >= 0 ? a / b : -((-a + b - 1) / b);
 }
 
-static int ExecuteRequest(NominatimFDWState *state)
+/*
+ * BuildGeocodeUpdate
+ * ----------
+ * UPDATE statement geocoding the rows of a batch, whose first and last key
+ * are $1 and $2. Each target is a column filled with the NominatimRecord
+ * field of the same name, or a "column=field" pair, taken from the first
+ * result of nominatim_search for the address of the row.
+ *
+ * relation: qualified name of the table
+ * keycolumn: its primary key
+ * schema: schema of the extension
+ * servername: foreign server
+ * address_expr: expression over the columns of the table giving the address
+ * targets: text[] of target columns
+ *
+ * returns the statement
+ */
+static char *BuildGeocodeUpdate(const char *relation, const char *keycolumn, const char *schema,
+                                const char *servername, const char *address_expr, ArrayType *targets)
 {
-    CURL *curl;
-    CURLcode res;
-    StringInfoData url_buffer;
-    StringInfoData accept_header;
-    StringInfoData user_agent;
-    char errbuf[CURL_ERROR_SIZE];
-    struct MemoryStruct chunk;
-    struct MemoryStruct chunk_header;
-    struct curl_slist *headers = NULL;
+    StringInfoData columns;
+    StringInfoData fields;
+    Datum *elems;
+    bool *elemnulls;
+    int nelems;
 
-    chunk.memory = palloc(1);
-    chunk.size = 0; /* no data at this point */
-    chunk_header.memory = palloc(1);
-    chunk_header.size = 0; /* no data at this point */
+    deconstruct_array(targets, TEXTOID, -1, false, 'i', &elems, &elemnulls, &nelems);
 
-    elog(DEBUG2, "%s called", __func__);
+    if (nelems == 0)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("no target columns given"),
+                 errhint("pass the columns to fill with the NominatimRecord field of the same name, or \"column=field\" pairs, e.g. ARRAY['lon', 'lat', 'address=display_name']")));
+
+    initStringInfo(&columns);
+    initStringInfo(&fields);
+
+    for (int i = 0; i < nelems; i++)
+    {
+        char *column;
+        char *field;
 
-    curl = curl_easy_init();
+        if (elemnulls[i] || strlen(column = TextDatumGetCString(elems[i])) == 0)
+            ereport(ERROR,
+                    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                     errmsg("target columns cannot be empty")));
+
+        field = strchr(column, '=');
 
-    initStringInfo(&url_buffer);
-    appendStringInfo(&url_buffer, "%s", state->url);
+        if (field)
+            *field++ = '\0';
+        else
+            field = column;
 
-    appendStringInfo(&url_buffer, "/%s?", state->request_type);
+        appendStringInfo(&columns, "%s%s", i > 0 ? ", " : "", quote_identifier(column));
+        appendStringInfo(&fields, "%sr.%s", i > 0 ? ", " : "", quote_identifier(field));
+    }
 
-    if (state->query && strlen(state->query) > 0)
-        AppendUrlParam(&url_buffer, curl, "q", state->query);
+    return psprintf("UPDATE %s AS t SET %s%s%s = (SELECT %s FROM %s.nominatim_search(%s, q => (%s)::text, limit_result => 1) AS r LIMIT 1) "
+                    "WHERE t.%s BETWEEN $1 AND $2",
+                    relation,
+                    nelems > 1 ? "(" : "", columns.data, nelems > 1 ? ")" : "",
+                    fields.data,
+                    quote_identifier(schema),
+                    quote_literal_cstr(servername),
+                    address_expr,
+                    quote_identifier(keycolumn));
+}
 
-    if (state->amenity && strlen(state->amenity) > 0)
-        AppendUrlParam(&url_buffer, curl, "amenity", state->amenity);
+/*
+ * nominatim_geocode_table
+ * ----------
+ * Geocodes the rows of a table with background workers. The primary key
+ * range of the table is split into batches, which the workers geocode and
+ * commit one at a time, recording each in nominatim_geocode_progress, so
+ * that calling the procedure again after an interruption skips the batches
+ * already done. Once the workers are started it commits the transaction of
+ * the CALL, so that it holds no snapshot that would keep the row versions
+ * replaced by the workers from being vacuumed, and waits for them to finish.
+ *
+ * returns record with the number of rows updated by this call (INOUT updated)
+ */
+Datum nominatim_geocode_table(PG_FUNCTION_ARGS)
+{
+    NominatimFDWState *state;
+    Oid relid;
+    char *address_expr;
+    ArrayType *targets;
+    int workers;
+    int batch_size;
+    MemoryContext callercontext = CurrentMemoryContext;
+    char *relation;
+    char *schema;
+    char *progress_table;
+    char *keycolumn = NULL;
+    char *update_sql = NULL;
+    Oid keytype = InvalidOid;
+    Oid argtypes[2] = {INT8OID, INT8OID};
+    Oid relidtype[1] = {OIDOID};
+    Datum args[1];
+    int64 min_key = 0;
+    int64 max_key = 0;
+    bool empty = true;
+    dsm_segment *seg;
+    NominatimGeocodeJob *job;
+    BackgroundWorker worker;
+    BackgroundWorkerHandle **handles;
+    int launched = 0;
+    uint32 finished;
+    int64 updated;
+    int64 skipped;
+    int64 batches;
+    Size size;
+
+    /* procedures cannot be STRICT */
+    for (int i = 0; i < 6; i++)
+        if (PG_ARGISNULL(i))
+            ereport(ERROR,
+                    (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+                     errmsg("arguments of nominatim_geocode_table must not be NULL")));
 
-    if (state->osm_ids && strlen(state->osm_ids) > 0)
-        AppendUrlParam(&url_buffer, curl, "osm_ids", state->osm_ids);
+    state = InitSession(text_to_cstring(PG_GETARG_TEXT_P(0)));
+    relid = PG_GETARG_OID(1);
+    address_expr = text_to_cstring(PG_GETARG_TEXT_P(2));
+    targets = PG_GETARG_ARRAYTYPE_P(3);
+    workers = PG_GETARG_INT32(4);
+    batch_size = PG_GETARG_INT32(5);
 
-    if (state->street && strlen(state->street) > 0)
-        AppendUrlParam(&url_buffer, curl, "street", state->street);
+    if (workers < 1 || workers > NOMINATIM_GEOCODE_MAX_WORKERS)
+        ereport(ERROR,
+                (errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+                 errmsg("workers out of range: %d", workers),
+                 errhint("workers must be between 1 and %d", NOMINATIM_GEOCODE_MAX_WORKERS)));
 
-    if (state->city && strlen(state->city) > 0)
-        AppendUrlParam(&url_buffer, curl, "city", state->city);
+    if (batch_size < 1)
+        ereport(ERROR,
+                (errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+                 errmsg("batch_size out of range: %d", batch_size),
+                 errhint("batch_size must be greater than zero")));
 
-    if (state->county && strlen(state->county) > 0)
-        AppendUrlParam(&url_buffer, curl, "county", state->county);
+    /*
+     * The transaction of the CALL is committed before waiting for the
+     * workers, which is only possible outside a transaction block.
+     */
+#if PG_VERSION_NUM >= 110000
+    if (!fcinfo->context || !IsA(fcinfo->context, CallContext) || ((CallContext *)fcinfo->context)->atomic)
+#endif
+        ereport(ERROR,
+                (errcode(ERRCODE_ACTIVE_SQL_TRANSACTION),
+                 errmsg("nominatim_geocode_table cannot run inside a transaction block"),
+                 errhint("Its workers commit every batch in transactions of their own.")));
 
-    if (state->state && strlen(state->state) > 0)
-        AppendUrlParam(&url_buffer, curl, "state", state->state);
+    if (get_rel_persistence(relid) == RELPERSISTENCE_TEMP)
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("cannot geocode temporary table \"%s\"", get_rel_name(relid)),
+                 errhint("Background workers cannot access the temporary tables of other sessions.")));
 
-    if (state->country && strlen(state->country) > 0)
-        AppendUrlParam(&url_buffer, curl, "country", state->country);
+    relation = quote_qualified_identifier(get_namespace_name(get_rel_namespace(relid)), get_rel_name(relid));
+    schema = get_namespace_name(get_func_namespace(fcinfo->flinfo->fn_oid));
+    progress_table = quote_qualified_identifier(schema, "nominatim_geocode_progress");
 
-    if (state->postalcode && strlen(state->postalcode) > 0)
-        AppendUrlParam(&url_buffer, curl, "postalcode", state->postalcode);
+    args[0] = ObjectIdGetDatum(relid);
 
-    appendStringInfo(&url_buffer, "format=xml&");
+    SPI_connect();
 
-    if (strcmp(state->request_type, NOMINATIM_REQUEST_REVERSE) == 0)
+    if (SPI_execute_with_args("SELECT a.attname, a.atttypid FROM pg_index i "
+                              "JOIN pg_attribute a ON a.attrelid = i.indrelid AND a.attnum = i.indkey[0] "
+                              "WHERE i.indrelid = $1 AND i.indisprimary AND i.indnatts = 1",
+                              1, relidtype, args, NULL, true, 1) == SPI_OK_SELECT &&
+        SPI_processed == 1)
     {
-        appendStringInfo(&url_buffer, "lon=%.8f&", state->lon);
-        appendStringInfo(&url_buffer, "lat=%.8f&", state->lat);
+        bool isnull;
+
+        keycolumn = MemoryContextStrdup(callercontext, SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1));
+        keytype = DatumGetObjectId(SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 2, &isnull));
     }
 
-    if (strcmp(state->request_type, NOMINATIM_REQUEST_REVERSE) == 0 &&
-        state->zoom >= 0)
-        appendStringInfo(&url_buffer, "zoom=%d&", state->zoom);
+    if (keytype != INT2OID && keytype != INT4OID && keytype != INT8OID)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_TABLE_DEFINITION),
+                 errmsg("table \"%s\" has no integer primary key", get_rel_name(relid)),
+                 errhint("nominatim_geocode_table hands out ranges of a single-column integer primary key to its workers")));
+
+    /* errors in the address expression or the targets are raised here, not in the workers */
+    update_sql = BuildGeocodeUpdate(relation, keycolumn, schema, state->server->servername, address_expr, targets);
+    SPI_freeplan(SPI_prepare(update_sql, 2, argtypes));
+    update_sql = MemoryContextStrdup(callercontext, update_sql);
+
+    if (SPI_execute(psprintf("SELECT min(%s)::bigint, max(%s)::bigint FROM %s",
+                             quote_identifier(keycolumn), quote_identifier(keycolumn), relation),
+                    true, 1) == SPI_OK_SELECT &&
+        SPI_processed == 1)
+    {
+        bool isnull;
 
-    if (state->entrances)
-        appendStringInfo(&url_buffer, "entrances=1&");
+        min_key = DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isnull));
+        empty = isnull;
 
-    if (state->extratags)
-        appendStringInfo(&url_buffer, "extratags=1&");
+        if (!empty)
+            max_key = DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 2, &isnull));
+    }
 
-    if (state->namedetails)
-        appendStringInfo(&url_buffer, "namedetails=1&");
+    SPI_finish();
+
+    if (empty)
+        return GeocodeTableResult(fcinfo, 0);
+
+    size = offsetof(NominatimGeocodeJob, data) + strlen(update_sql) + strlen(progress_table) + strlen(relation) + 3;
+    seg = dsm_create(size, 0);
+    job = (NominatimGeocodeJob *)dsm_segment_address(seg);
+
+    memset(job, 0, size);
+    job->database = MyDatabaseId;
+    job->user = GetUserId();
+    job->batch_size = batch_size;
+    job->first_batch = FloorDiv(min_key, batch_size);
+    job->batches = FloorDiv(max_key, batch_size) - job->first_batch + 1;
+    pg_atomic_init_u64(&job->next_batch, 0);
+    pg_atomic_init_u64(&job->updated, 0);
+    pg_atomic_init_u64(&job->skipped, 0);
+    pg_atomic_init_u32(&job->launched, 0);
+    pg_atomic_init_u32(&job->finished, 0);
+
+    /* calls with other parameters would geocode the rows differently: they are other jobs */
+    snprintf(job->job, sizeof(job->job), "%016llx",
+             (unsigned long long)HashCacheKey(psprintf("%s|%d|%s", state->server->servername, batch_size, update_sql)));
+
+    job->update_sql = 0;
+    strcpy(job->data + job->update_sql, update_sql);
+    job->progress_table = job->update_sql + strlen(update_sql) + 1;
+    strcpy(job->data + job->progress_table, progress_table);
+    job->relation = job->progress_table + strlen(progress_table) + 1;
+    strcpy(job->data + job->relation, relation);
+
+    memset(&worker, 0, sizeof(worker));
+    worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+    worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+    worker.bgw_restart_time = BGW_NEVER_RESTART;
+    snprintf(worker.bgw_library_name, BGW_MAXLEN, "nominatim_fdw");
+    snprintf(worker.bgw_function_name, BGW_MAXLEN, "nominatim_geocode_worker_main");
+#if PG_VERSION_NUM >= 110000
+    snprintf(worker.bgw_type, BGW_MAXLEN, "nominatim_fdw geocode worker");
+#endif
+    worker.bgw_main_arg = UInt32GetDatum(dsm_segment_handle(seg));
+    worker.bgw_notify_pid = MyProcPid;
 
-    if (state->addressdetails)
-        appendStringInfo(&url_buffer, "addressdetails=1&");
+    handles = (BackgroundWorkerHandle **)palloc0(workers * sizeof(BackgroundWorkerHandle *));
 
-    if (state->polygon_type && strlen(state->polygon_type) > 0)
-        appendStringInfo(&url_buffer, "%s=1&", state->polygon_type);
+    for (; launched < workers; launched++)
+    {
+        snprintf(worker.bgw_name, BGW_MAXLEN, "nominatim_fdw geocode worker %d for %s", launched + 1, get_rel_name(relid));
 
-    if (state->accept_language && strlen(state->accept_language) > 0)
-        AppendUrlParam(&url_buffer, curl, "accept-language", state->accept_language);
+        if (!RegisterDynamicBackgroundWorker(&worker, &handles[launched]))
+            break;
+    }
 
-    if (state->countrycodes && strlen(state->countrycodes) > 0)
-        AppendUrlParam(&url_buffer, curl, "countrycodes", state->countrycodes);
+    /* the workers wait for this before taking their first batch */
+    pg_atomic_write_u32(&job->launched, (uint32)launched);
 
-    if (state->layer && strlen(state->layer) > 0)
-        AppendUrlParam(&url_buffer, curl, "layer", state->layer);
+    if (launched == 0)
+        ereport(ERROR,
+                (errcode(ERRCODE_INSUFFICIENT_RESOURCES),
+                 errmsg("could not register background worker for nominatim_geocode_table"),
+                 errhint("Increase max_worker_processes.")));
 
-    if (state->feature_type && strlen(state->feature_type) > 0)
-        AppendUrlParam(&url_buffer, curl, "featureType", state->feature_type);
+    if (launched < workers)
+        ereport(WARNING,
+                (errcode(ERRCODE_INSUFFICIENT_RESOURCES),
+                 errmsg("only %d of %d workers could be started", launched, workers),
+                 errhint("Increase max_worker_processes.")));
 
-    if (state->exclude_place_ids && strlen(state->exclude_place_ids) > 0)
-        AppendUrlParam(&url_buffer, curl, "exclude_place_ids", state->exclude_place_ids);
+    /* keep the segment across the commit below, until the workers are done */
+    dsm_pin_mapping(seg);
 
-    if (state->viewbox && strlen(state->viewbox) > 0)
-        AppendUrlParam(&url_buffer, curl, "viewbox", state->viewbox);
+    /* a cancelled call stops its workers: the batches they committed are kept */
+    PG_TRY();
+    {
+#if PG_VERSION_NUM >= 110000
+        /* end the transaction of the CALL, releasing its snapshot and xmin */
+        SPI_connect_ext(SPI_OPT_NONATOMIC);
+        SPI_commit();
+#if PG_VERSION_NUM < 150000
+        SPI_start_transaction();
+#endif
+        SPI_finish();
+#endif
 
-    if (strcmp(state->request_type, NOMINATIM_REQUEST_SEARCH) == 0)
+        for (int i = 0; i < launched; i++)
+            WaitForBackgroundWorkerShutdown(handles[i]);
+    }
+    PG_CATCH();
     {
-        appendStringInfo(&url_buffer, "bounded=%d&", state->bounded ? 1 : 0);
-        if (!state->dedupe)
-            appendStringInfo(&url_buffer, "dedupe=0&");
+        for (int i = 0; i < launched; i++)
+            TerminateBackgroundWorker(handles[i]);
+
+        dsm_detach(seg);
+
+        PG_RE_THROW();
     }
+    PG_END_TRY();
 
-    if (state->polygon_threshold != 0.0)
-        appendStringInfo(&url_buffer, "polygon_threshold=%f&", state->polygon_threshold);
+    finished = pg_atomic_read_u32(&job->finished);
+    updated = (int64)pg_atomic_read_u64(&job->updated);
+    skipped = (int64)pg_atomic_read_u64(&job->skipped);
+    batches = job->batches;
 
-    if (state->email && strlen(state->email) > 0)
-        AppendUrlParam(&url_buffer, curl, "email", state->email);
+    dsm_detach(seg);
 
-    if (state->limit > 0)
-        appendStringInfo(&url_buffer, "limit=%d&", state->limit);
+    if (finished < (uint32)launched)
+        ereport(ERROR,
+                (errcode(ERRCODE_FDW_UNABLE_TO_CREATE_EXECUTION),
+                 errmsg("nominatim_geocode_table stopped before all batches were done"),
+                 errdetail("%u of %d workers failed, see the server log.", launched - finished, launched),
+                 errhint("The batches done so far are kept: call nominatim_geocode_table again to resume.")));
 
-    if (curl)
-    {
-        errbuf[0] = 0;
+    elog(DEBUG1, "nominatim_geocode_table: %ld rows updated, %ld of %ld batches already done",
+         (long)updated, (long)skipped, (long)batches);
 
-        elog(DEBUG1, "%s: GET \"%s\"", __func__, url_buffer.data);
+    return GeocodeTableResult(fcinfo, updated);
+}
 
-        curl_easy_setopt(curl, CURLOPT_URL, url_buffer.data);
+/*
+ * GeocodeTableResult
+ * ----------
+ * Result of a nominatim_geocode_table call: a record with its INOUT
+ * parameter updated, as procedures return their output parameters.
+ *
+ * updated: rows updated by the call
+ *
+ * returns record
+ */
+static Datum GeocodeTableResult(FunctionCallInfo fcinfo, int64 updated)
+{
+    TupleDesc tupdesc;
+    Datum values[1];
+    bool nulls[1] = {false};
 
-#if ((LIBCURL_VERSION_MAJOR == 7 && LIBCURL_VERSION_MINOR < 85) || LIBCURL_VERSION_MAJOR < 7)
-        curl_easy_setopt(curl, CURLOPT_PROTOCOLS, CURLPROTO_HTTP | CURLPROTO_HTTPS);
-#else
-        curl_easy_setopt(curl, CURLOPT_PROTOCOLS_STR, "http,https");
-#endif
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+        ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                        errmsg("function returning record called in context that cannot accept type record")));
 
-        curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, errbuf);
+    values[0] = Int64GetDatum(updated);
 
-        curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, state->connect_timeout);
-        elog(DEBUG2, "  %s: timeout > %ld", __func__, state->connect_timeout);
-        elog(DEBUG2, "  %s: max retry > %ld", __func__, state->max_retries);
+    return HeapTupleGetDatum(heap_form_tuple(BlessTupleDesc(tupdesc), values, nulls));
+}
 
-        if (state->proxy)
-        {
-            elog(DEBUG2, "  %s: proxy URL > '%s'", __func__, state->proxy);
+/*
+ * nominatim_geocode_worker_main
+ * ----------
+ * Background worker of nominatim_geocode_table: takes batches of the job
+ * until none is left, and geocodes each in a transaction of its own that
+ * also records the batch in the progress table. Batches found there are
+ * skipped. The server's max_requests_per_second is split between the
+ * workers of the job.
+ *
+ * main_arg: handle of the DSM segment holding the NominatimGeocodeJob
+ */
+void nominatim_geocode_worker_main(Datum main_arg)
+{
+    dsm_segment *seg;
+    NominatimGeocodeJob *job;
+    char *check_sql;
+    char *insert_sql;
+    char *relation;
+    uint32 launched;
 
-            curl_easy_setopt(curl, CURLOPT_PROXY, state->proxy);
+    pqsignal(SIGTERM, die);
+    BackgroundWorkerUnblockSignals();
 
-            if (strcmp(state->proxy_type, NOMINATIM_SERVER_OPTION_HTTP_PROXY) == 0)
-            {
-                elog(DEBUG2, "  %s: proxy protocol > 'HTTP'", __func__);
-                curl_easy_setopt(curl, CURLOPT_PROXYTYPE, CURLPROXY_HTTP);
-            }
-            if (state->proxy_user)
-            {
-                elog(DEBUG2, "  %s: entering proxy user ('%s').", __func__, state->proxy_user);
-                curl_easy_setopt(curl, CURLOPT_PROXYUSERNAME, state->proxy_user);
-            }
+    CurrentResourceOwner = ResourceOwnerCreate(NULL, "nominatim_fdw geocode worker");
+    seg = dsm_attach(DatumGetUInt32(main_arg));
 
-            if (state->proxy_user_password)
-            {
-                elog(DEBUG2, "  %s: entering proxy user's password.", __func__);
-                curl_easy_setopt(curl, CURLOPT_PROXYPASSWORD, state->proxy_user_password);
-            }
-        }
+    if (!seg)
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("could not map dynamic shared memory segment of nominatim_geocode_table")));
 
-        if (state->request_redirect)
-        {
-            elog(DEBUG2, "  %s: setting request redirect: %d (%s)", __func__, state->request_redirect, state->request_redirect ? "true" : "false");
-            curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    /* keep the mapping across the transactions of the batches */
+    dsm_pin_mapping(seg);
+    job = (NominatimGeocodeJob *)dsm_segment_address(seg);
 
-            if (state->request_max_redirect)
-            {
-                elog(DEBUG2, "  %s: setting maxredirs: %ld", __func__, state->request_max_redirect);
-                curl_easy_setopt(curl, CURLOPT_MAXREDIRS, state->request_max_redirect);
-            }
-        }
+#if PG_VERSION_NUM >= 110000
+    BackgroundWorkerInitializeConnectionByOid(job->database, job->user, 0);
+#else
+    BackgroundWorkerInitializeConnectionByOid(job->database, job->user);
+#endif
+
+    /* max_requests_per_second is split between the workers actually started */
+    while ((launched = pg_atomic_read_u32(&job->launched)) == 0)
+    {
+        CHECK_FOR_INTERRUPTS();
+        pg_usleep(10000L);
+    }
 
-        curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, HeaderCallbackFunction);
-        curl_easy_setopt(curl, CURLOPT_HEADERDATA, (void *)&chunk_header);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
-        curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+    throttle_share = (int)launched;
+    relation = job->data + job->relation;
+    check_sql = psprintf("SELECT 1 FROM %s WHERE relation = $1 AND job = $2 AND batch_start = $3",
+                         job->data + job->progress_table);
+    insert_sql = psprintf("INSERT INTO %s (relation, job, batch_start, batch_end, updated) VALUES ($1, $2, $3, $4, $5) "
+                          "ON CONFLICT DO NOTHING",
+                          job->data + job->progress_table);
 
-        curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
-        curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 1L);
+    for (;;)
+    {
+        uint64 batch = pg_atomic_fetch_add_u64(&job->next_batch, 1);
+        Oid argtypes[5] = {TEXTOID, TEXTOID, INT8OID, INT8OID, INT8OID};
+        Datum args[5];
+        uint64 updated = 0;
+        int64 start;
+        int64 end;
 
-        initStringInfo(&user_agent);
-        appendStringInfo(&user_agent, "PostgreSQL/%s nominatim_fdw/%s libxml2/%s %s", PG_VERSION, FDW_VERSION, LIBXML_DOTTED_VERSION, curl_version());
+        if (batch >= (uint64)job->batches)
+            break;
 
-        elog(DEBUG2, "  %s: \"Agent: %s\"", __func__, user_agent.data);
+        start = (job->first_batch + (int64)batch) * job->batch_size;
+        end = start + job->batch_size - 1;
 
-        curl_easy_setopt(curl, CURLOPT_USERAGENT, user_agent.data);
+        CHECK_FOR_INTERRUPTS();
 
-        initStringInfo(&accept_header);
-        appendStringInfo(&accept_header, "Accept-Language: %s", state->accept_language);
-        headers = curl_slist_append(headers, accept_header.data);
-        elog(DEBUG2, "  adding header: %s", accept_header.data);
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+        SetCurrentStatementStartTimestamp();
+        StartTransactionCommand();
+        SPI_connect();
+        PushActiveSnapshot(GetTransactionSnapshot());
+        pgstat_report_activity(STATE_RUNNING, job->data + job->update_sql);
 
-        elog(DEBUG2, "  %s: performing cURL request ... ", __func__);
+        args[0] = CStringGetTextDatum(relation);
+        args[1] = CStringGetTextDatum(job->job);
+        args[2] = Int64GetDatum(start);
+        args[3] = Int64GetDatum(end);
 
-        res = curl_easy_perform(curl);
+        if (SPI_execute_with_args(check_sql, 3, argtypes, args, NULL, true, 1) != SPI_OK_SELECT)
+            elog(ERROR, "%s -> unable to read the progress of batch %ld", __func__, (long)start);
 
-        for (long i = 1; res != CURLE_OK && i <= state->max_retries; i++)
+        if (SPI_processed > 0)
+            pg_atomic_fetch_add_u64(&job->skipped, 1);
+        else
         {
-            long response_code = 0;
-            curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
-            elog(WARNING, "%s: request to '%s' failed (%ld/%ld)",
-                 __func__, state->url, i, state->max_retries);
+            if (SPI_execute_with_args(job->data + job->update_sql, 2, &argtypes[2], &args[2], NULL, false, 0) != SPI_OK_UPDATE)
+                elog(ERROR, "%s -> unable to geocode batch %ld", __func__, (long)start);
 
-            /* discard whatever the failed attempt left behind before retrying */
-            chunk.size = 0;
-            chunk.memory[0] = '\0';
-            chunk_header.size = 0;
-            chunk_header.memory[0] = '\0';
+            updated = SPI_processed;
+            args[4] = Int64GetDatum((int64)updated);
 
-            /* just being polite to the public server */
-            pg_usleep(1000000L);
-            res = curl_easy_perform(curl);
+            if (SPI_execute_with_args(insert_sql, 5, argtypes, args, NULL, false, 0) != SPI_OK_INSERT)
+                elog(ERROR, "%s -> unable to record the progress of batch %ld", __func__, (long)start);
         }
 
-        if (res != CURLE_OK)
-        {
-            long response_code = 0;
-            curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
-
-            xmlFreeDoc(state->xmldoc);
-            pfree(chunk.memory);
-            pfree(chunk_header.memory);
-            curl_slist_free_all(headers);
-            curl_easy_cleanup(curl);
+        SPI_finish();
+        PopActiveSnapshot();
+        CommitTransactionCommand();
+        pgstat_report_stat(false);
+        pgstat_report_activity(STATE_IDLE, NULL);
 
-            ereport(ERROR,
-                    (errcode(ERRCODE_FDW_UNABLE_TO_CREATE_EXECUTION),
-                     errmsg("nominatim request failed with HTTP status %ld", response_code),
-                     errhint("Check your request parameters and try again."),
-                     errdetail("URL: \"%s\"", url_buffer.data)));
-          }
-        else
-        {
-            long response_code;
-            curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
-            state->xmldoc = xmlReadMemory(chunk.memory, chunk.size, NULL, NULL,
-                                          XML_PARSE_NOBLANKS | XML_PARSE_NONET);
+        pg_atomic_fetch_add_u64(&job->updated, updated);
 
-            elog(DEBUG1, "%s: HTTP %ld, %ld bytes", __func__, response_code, chunk.size);
-            elog(DEBUG2, "  %s: http response header = \n%s", __func__, chunk_header.memory);
-        }
+        elog(DEBUG1, "%s: batch %ld to %ld of %s, %lu rows", __func__, (long)start, (long)end, relation, (unsigned long)updated);
     }
 
-    pfree(chunk.memory);
-    pfree(chunk_header.memory);
-    curl_slist_free_all(headers);
-    curl_easy_cleanup(curl);
-
-    /*
-     * We thrown an error in case the server returns an empty XML doc
-     */
-    if (!state->xmldoc)
-        return REQUEST_FAIL;
+    pg_atomic_fetch_add_u32(&job->finished, 1);
 
-    return REQUEST_SUCCESS;
+    dsm_detach(seg);
+    proc_exit(0);
 }
 
 /*
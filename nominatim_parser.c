@@ -0,0 +1,723 @@
+/**********************************************************************
+ *
+ * nominatim_fdw - PostgreSQL Nominatim Extension
+ *
+ * nominatim_fdw is free software: you can redistribute it and/or modify
+ * it under the terms of the MIT Licence.
+ *
+ * Copyright (C) 2024-2026 Jim Jones <jim.jones@uni-muenster.de>
+ *
+ **********************************************************************/
+
+/*
+ * Request building and response parsing, kept free of PostgreSQL so that
+ * it can be benchmarked on its own (see nominatim_parser.h).
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <libxml/tree.h>
+
+#include "nominatim_parser.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define NOMINATIM_MIN(a, b) ((a) < (b) ? (a) : (b))
+#define NOMINATIM_MAX(a, b) ((a) > (b) ? (a) : (b))
+
+/* initial size of a NominatimBuffer, as a StringInfo */
+#define NOMINATIM_BUFFER_INITIAL_SIZE 1024
+
+/*
+ * Reverse grid: map tiles of 256 pixels, Web Mercator latitude limit and
+ * the zoom the server uses when none is given.
+ */
+#define NOMINATIM_GRID_TILE_SIZE 256
+#define NOMINATIM_GRID_MAX_LATITUDE 85.05112878
+#define NOMINATIM_GRID_DEFAULT_ZOOM 18
+
+static void buffer_enlarge(NominatimBuffer *buf, size_t needed);
+static void buffer_append_char(NominatimBuffer *buf, char c);
+static void append_url_param(NominatimBuffer *buf, const char *param, const char *value);
+static char *copy_string(const NominatimAllocator *allocator, const char *str);
+static char *xml_copy(const NominatimAllocator *allocator, xmlChar *val);
+static char *xml_get_prop(const NominatimAllocator *allocator, xmlNodePtr node, const char *name);
+static char *xml_node_content(const NominatimAllocator *allocator, xmlNodePtr node);
+static char *xml_dump_children(const NominatimAllocator *allocator, xmlDocPtr doc, xmlNodePtr node);
+static void append_json_pair(NominatimBuffer *buf, const char *key, const char *value);
+static void append_entrances(NominatimBuffer *buf, const NominatimAllocator *allocator, xmlNodePtr node);
+
+/*
+ * nominatim_buffer_init
+ * ----------
+ * Initializes an empty buffer.
+ *
+ * buf: NominatimBuffer to initialize
+ * allocator: NominatimAllocator providing the memory of the buffer
+ */
+void nominatim_buffer_init(NominatimBuffer *buf, const NominatimAllocator *allocator)
+{
+    buf->allocator = allocator;
+    buf->size = NOMINATIM_BUFFER_INITIAL_SIZE;
+    buf->data = allocator->realloc(NULL, buf->size, allocator->arg);
+    buf->data[0] = '\0';
+    buf->len = 0;
+}
+
+static void buffer_enlarge(NominatimBuffer *buf, size_t needed)
+{
+    size_t size = buf->size;
+
+    needed += buf->len + 1;
+
+    if (needed <= size)
+        return;
+
+    while (size < needed)
+        size *= 2;
+
+    buf->data = buf->allocator->realloc(buf->data, size, buf->allocator->arg);
+    buf->size = size;
+}
+
+/*
+ * nominatim_buffer_append
+ * ----------
+ * Appends len bytes of data to the buffer, keeping it null-terminated.
+ */
+void nominatim_buffer_append(NominatimBuffer *buf, const char *data, size_t len)
+{
+    buffer_enlarge(buf, len);
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    buf->data[buf->len] = '\0';
+}
+
+static void buffer_append_char(NominatimBuffer *buf, char c)
+{
+    buffer_enlarge(buf, 1);
+    buf->data[buf->len++] = c;
+    buf->data[buf->len] = '\0';
+}
+
+/*
+ * nominatim_buffer_printf
+ * ----------
+ * Appends a string formatted as in printf to the buffer.
+ */
+void nominatim_buffer_printf(NominatimBuffer *buf, const char *fmt, ...)
+{
+    va_list args;
+    int len;
+
+    va_start(args, fmt);
+    len = vsnprintf(buf->data + buf->len, buf->size - buf->len, fmt, args);
+    va_end(args);
+
+    if (len < 0)
+        return;
+
+    if ((size_t)len >= buf->size - buf->len)
+    {
+        buffer_enlarge(buf, len);
+
+        va_start(args, fmt);
+        vsnprintf(buf->data + buf->len, buf->size - buf->len, fmt, args);
+        va_end(args);
+    }
+
+    buf->len += len;
+}
+
+/*
+ * nominatim_escape_json
+ * ----------
+ * Appends str to the buffer as a JSON string literal, escaped exactly as
+ * PostgreSQL's escape_json() does.
+ */
+void nominatim_escape_json(NominatimBuffer *buf, const char *str)
+{
+    const char *p;
+    const char *start = str;
+
+    buffer_append_char(buf, '"');
+
+    for (p = str; *p; p++)
+    {
+        const char *escaped = NULL;
+        char hex[8];
+
+        switch (*p)
+        {
+        case '\b':
+            escaped = "\\b";
+            break;
+        case '\f':
+            escaped = "\\f";
+            break;
+        case '\n':
+            escaped = "\\n";
+            break;
+        case '\r':
+            escaped = "\\r";
+            break;
+        case '\t':
+            escaped = "\\t";
+            break;
+        case '"':
+            escaped = "\\\"";
+            break;
+        case '\\':
+            escaped = "\\\\";
+            break;
+        default:
+            if ((unsigned char)*p < ' ')
+            {
+                snprintf(hex, sizeof(hex), "\\u%04x", (int)*p);
+                escaped = hex;
+            }
+            break;
+        }
+
+        /* copy the characters that need no escaping in one go */
+        if (escaped)
+        {
+            nominatim_buffer_append(buf, start, p - start);
+            nominatim_buffer_append(buf, escaped, strlen(escaped));
+            start = p + 1;
+        }
+    }
+
+    nominatim_buffer_append(buf, start, p - start);
+    buffer_append_char(buf, '"');
+}
+
+/*
+ * nominatim_escape_url
+ * ----------
+ * Appends str to the buffer URL-encoded: all characters but the unreserved
+ * ones of RFC 3986 are percent-encoded, as curl_easy_escape() does.
+ */
+void nominatim_escape_url(NominatimBuffer *buf, const char *str)
+{
+    static const char hex[] = "0123456789ABCDEF";
+
+    buffer_enlarge(buf, strlen(str) * 3);
+
+    for (const unsigned char *p = (const unsigned char *)str; *p; p++)
+    {
+        if ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || (*p >= '0' && *p <= '9') ||
+            *p == '-' || *p == '.' || *p == '_' || *p == '~')
+            buf->data[buf->len++] = *p;
+        else
+        {
+            buf->data[buf->len++] = '%';
+            buf->data[buf->len++] = hex[*p >> 4];
+            buf->data[buf->len++] = hex[*p & 0x0F];
+        }
+    }
+
+    buf->data[buf->len] = '\0';
+}
+
+static void append_url_param(NominatimBuffer *buf, const char *param, const char *value)
+{
+    if (!value || !*value)
+        return;
+
+    nominatim_buffer_append(buf, param, strlen(param));
+    buffer_append_char(buf, '=');
+    nominatim_escape_url(buf, value);
+    buffer_append_char(buf, '&');
+}
+
+/*
+ * nominatim_build_url
+ * ----------
+ * Appends the request URL to url: the endpoint of the server followed by
+ * all parameters set in params.
+ *
+ * params: NominatimRequestParams of the request
+ * url: NominatimBuffer the URL is appended to
+ */
+void nominatim_build_url(const NominatimRequestParams *params, NominatimBuffer *url)
+{
+    int reverse = strcmp(params->request_type, NOMINATIM_REQUEST_REVERSE) == 0;
+
+    nominatim_buffer_printf(url, "%s/%s?", params->url, params->request_type);
+
+    append_url_param(url, "q", params->query);
+    append_url_param(url, "amenity", params->amenity);
+    append_url_param(url, "osm_ids", params->osm_ids);
+    append_url_param(url, "street", params->street);
+    append_url_param(url, "city", params->city);
+    append_url_param(url, "county", params->county);
+    append_url_param(url, "state", params->state);
+    append_url_param(url, "country", params->country);
+    append_url_param(url, "postalcode", params->postalcode);
+
+    nominatim_buffer_printf(url, "format=%s&", params->format);
+
+    if (reverse)
+    {
+        double lon = params->lon;
+        double lat = params->lat;
+
+        if (params->reverse_grid > 0)
+            nominatim_snap_to_grid(params->zoom, params->reverse_grid, &lon, &lat);
+
+        nominatim_buffer_printf(url, "lon=%.8f&", lon);
+        nominatim_buffer_printf(url, "lat=%.8f&", lat);
+
+        if (params->zoom >= 0)
+            nominatim_buffer_printf(url, "zoom=%d&", params->zoom);
+    }
+
+    if (params->entrances)
+        nominatim_buffer_printf(url, "entrances=1&");
+
+    if (params->extratags)
+        nominatim_buffer_printf(url, "extratags=1&");
+
+    if (params->namedetails)
+        nominatim_buffer_printf(url, "namedetails=1&");
+
+    if (params->addressdetails)
+        nominatim_buffer_printf(url, "addressdetails=1&");
+
+    if (params->polygon_type && *params->polygon_type)
+        nominatim_buffer_printf(url, "%s=1&", params->polygon_type);
+
+    append_url_param(url, "accept-language", params->accept_language);
+    append_url_param(url, "countrycodes", params->countrycodes);
+    append_url_param(url, "layer", params->layer);
+    append_url_param(url, "featureType", params->feature_type);
+    append_url_param(url, "exclude_place_ids", params->exclude_place_ids);
+    append_url_param(url, "viewbox", params->viewbox);
+
+    if (strcmp(params->request_type, NOMINATIM_REQUEST_SEARCH) == 0)
+    {
+        nominatim_buffer_printf(url, "bounded=%d&", params->bounded ? 1 : 0);
+        if (!params->dedupe)
+            nominatim_buffer_printf(url, "dedupe=0&");
+    }
+
+    if (params->polygon_threshold != 0.0)
+        nominatim_buffer_printf(url, "polygon_threshold=%f&", params->polygon_threshold);
+
+    append_url_param(url, "email", params->email);
+
+    if (params->limit > 0)
+        nominatim_buffer_printf(url, "limit=%d&", params->limit);
+}
+
+/*
+ * nominatim_snap_to_grid
+ * ----------
+ * Moves the coordinates of a reverse request to the center of their cell in
+ * a grid laid over the Web Mercator map at the requested zoom (the server's
+ * default zoom if none is given), with cells of grid pixels. All points
+ * within a cell send the same request, so they share its cached results.
+ * The cells get smaller as the zoom (and therefore the level of detail of
+ * the result) increases: 16 pixels are about 2.4 km at zoom 10 and about
+ * 10 m at zoom 18 at the equator.
+ *
+ * zoom: zoom of the request (-1 = server default)
+ * grid: edge of the cells in pixels
+ * lon, lat: coordinates of the request, replaced by the center of the cell
+ */
+void nominatim_snap_to_grid(int zoom, int grid, double *lon, double *lat)
+{
+    double size;
+    double clamped = NOMINATIM_MAX(NOMINATIM_MIN(*lat, NOMINATIM_GRID_MAX_LATITUDE), -NOMINATIM_GRID_MAX_LATITUDE);
+    double sinlat = sin(clamped * M_PI / 180.0);
+    double cells;
+    double x;
+    double y;
+
+    zoom = zoom >= 0 ? NOMINATIM_MIN(zoom, NOMINATIM_GRID_DEFAULT_ZOOM) : NOMINATIM_GRID_DEFAULT_ZOOM;
+    size = ldexp(NOMINATIM_GRID_TILE_SIZE, zoom);
+    cells = ceil(size / grid);
+    x = (*lon + 180.0) / 360.0 * size;
+    y = (0.5 - log((1.0 + sinlat) / (1.0 - sinlat)) / (4.0 * M_PI)) * size;
+
+    /* points on the edges of the map (lon 180, the clamped latitudes) belong to the outer cells */
+    x = (NOMINATIM_MIN(NOMINATIM_MAX(floor(x / grid), 0), cells - 1) + 0.5) * grid;
+    y = (NOMINATIM_MIN(NOMINATIM_MAX(floor(y / grid), 0), cells - 1) + 0.5) * grid;
+
+    *lon = NOMINATIM_MIN(x / size * 360.0 - 180.0, 180.0);
+    *lat = atan(sinh(M_PI * (1.0 - 2.0 * NOMINATIM_MIN(y, size) / size))) * 180.0 / M_PI;
+}
+
+static char *copy_string(const NominatimAllocator *allocator, const char *str)
+{
+    size_t len = strlen(str);
+    char *result = allocator->realloc(NULL, len + 1, allocator->arg);
+
+    memcpy(result, str, len + 1);
+    return result;
+}
+
+/*
+ * xml_get_prop / xml_node_content
+ * ----------
+ *
+ * Wrappers around xmlGetProp / xmlNodeGetContent that copy the result
+ * into memory of the allocator and immediately free the libxml2 heap
+ * string. Returns NULL when the attribute or content is absent.
+ */
+static char *xml_copy(const NominatimAllocator *allocator, xmlChar *val)
+{
+    char *result = val ? copy_string(allocator, (char *)val) : NULL;
+
+    xmlFree(val);
+    return result;
+}
+
+static char *xml_get_prop(const NominatimAllocator *allocator, xmlNodePtr node, const char *name)
+{
+    return xml_copy(allocator, xmlGetProp(node, (xmlChar *)name));
+}
+
+static char *xml_node_content(const NominatimAllocator *allocator, xmlNodePtr node)
+{
+    return xml_copy(allocator, xmlNodeGetContent(node));
+}
+
+/* serializes the children of a node (KML polygons), NULL on failure */
+static char *xml_dump_children(const NominatimAllocator *allocator, xmlDocPtr doc, xmlNodePtr node)
+{
+    xmlBufferPtr buffer = xmlBufferCreate();
+    char *result = NULL;
+
+    if (xmlNodeDump(buffer, doc, node->children, 0, 0) != -1)
+        result = copy_string(allocator, (char *)buffer->content);
+
+    xmlBufferFree(buffer);
+
+    return result;
+}
+
+/* appends "key":"value" to a JSON object being built in buf */
+static void append_json_pair(NominatimBuffer *buf, const char *key, const char *value)
+{
+    if (buf->len > 1)
+        buffer_append_char(buf, ',');
+    nominatim_escape_json(buf, key ? key : "");
+    buffer_append_char(buf, ':');
+    nominatim_escape_json(buf, value ? value : "");
+}
+
+/* appends the <entrances> of a place as a JSON array of objects, one per entrance */
+static void append_entrances(NominatimBuffer *buf, const NominatimAllocator *allocator, xmlNodePtr node)
+{
+    int first_entrance = 1;
+
+    for (xmlNodePtr tag = node->children; tag != NULL; tag = tag->next)
+    {
+        int first_attr = 1;
+
+        if (!first_entrance)
+            buffer_append_char(buf, ',');
+        first_entrance = 0;
+
+        buffer_append_char(buf, '{');
+
+        for (xmlAttrPtr attr = tag->properties; attr != NULL; attr = attr->next)
+        {
+            char *value = xml_get_prop(allocator, tag, (const char *)attr->name);
+
+            if (!first_attr)
+                buffer_append_char(buf, ',');
+            first_attr = 0;
+
+            nominatim_escape_json(buf, (char *)attr->name);
+            buffer_append_char(buf, ':');
+            nominatim_escape_json(buf, value ? value : "");
+        }
+
+        buffer_append_char(buf, '}');
+    }
+}
+
+/*
+ * nominatim_parse_reverse
+ * ----------
+ *
+ * Parses the XML document returned from the Nominatim reverse endpoint
+ * into a NominatimRecord, passed to callback if the document contains a
+ * result.
+ *
+ * doc: parsed response
+ * flags: NOMINATIM_PARSE_* flags
+ * allocator: NominatimAllocator providing the memory of the record
+ * callback: called with the record, and arg
+ *
+ * returns NOMINATIM_PARSE_OK or a NOMINATIM_PARSE_* error
+ */
+int nominatim_parse_reverse(xmlDocPtr doc, int flags, const NominatimAllocator *allocator,
+                            NominatimRecordCallback callback, void *arg)
+{
+    NominatimRecord *place;
+    xmlNodePtr reversegeocode;
+    xmlNodePtr tag;
+    xmlNodePtr root = xmlDocGetRootElement(doc);
+    NominatimBuffer addressparts;
+    NominatimBuffer extratags;
+    NominatimBuffer namedetails;
+    NominatimBuffer entrances;
+    int found = 0;
+
+    if (!root)
+        return NOMINATIM_PARSE_NO_ROOT;
+
+    place = allocator->alloc(sizeof(NominatimRecord), allocator->arg);
+
+    /*
+     * Point requests only need the identifiers, the coordinates and the
+     * display name, which are all part of the <result> node.
+     */
+    if (flags & NOMINATIM_PARSE_POINTS_ONLY)
+    {
+        for (reversegeocode = root->children; reversegeocode != NULL; reversegeocode = reversegeocode->next)
+        {
+            if (xmlStrcmp(reversegeocode->name, (xmlChar *)"result") == 0)
+            {
+                place->place_id = xml_get_prop(allocator, reversegeocode, "place_id");
+                place->osm_id = xml_get_prop(allocator, reversegeocode, "osm_id");
+                place->osm_type = xml_get_prop(allocator, reversegeocode, "osm_type");
+                place->lat = xml_get_prop(allocator, reversegeocode, "lat");
+                place->lon = xml_get_prop(allocator, reversegeocode, "lon");
+                place->display_name = xml_node_content(allocator, reversegeocode);
+
+                callback(place, arg);
+                break;
+            }
+        }
+
+        return NOMINATIM_PARSE_OK;
+    }
+
+    nominatim_buffer_init(&addressparts, allocator);
+    nominatim_buffer_init(&extratags, allocator);
+    nominatim_buffer_init(&namedetails, allocator);
+    nominatim_buffer_init(&entrances, allocator);
+    buffer_append_char(&addressparts, '{');
+    buffer_append_char(&extratags, '{');
+    buffer_append_char(&namedetails, '{');
+    buffer_append_char(&entrances, '[');
+
+    place->timestamp = xml_get_prop(allocator, root, "timestamp");
+    place->attribution = xml_get_prop(allocator, root, "attribution");
+    place->querystring = xml_get_prop(allocator, root, "querystring");
+
+    for (reversegeocode = root->children; reversegeocode != NULL; reversegeocode = reversegeocode->next)
+    {
+        if (xmlStrcmp(reversegeocode->name, (xmlChar *)"result") == 0)
+        {
+            found = 1;
+            place->ref = xml_get_prop(allocator, reversegeocode, "ref");
+            place->address_rank = xml_get_prop(allocator, reversegeocode, "address_rank");
+            place->boundingbox = xml_get_prop(allocator, reversegeocode, "boundingbox");
+            place->class = xml_get_prop(allocator, reversegeocode, "class");
+            place->type = xml_get_prop(allocator, reversegeocode, "type");
+            place->icon = xml_get_prop(allocator, reversegeocode, "icon");
+            place->importance = xml_get_prop(allocator, reversegeocode, "importance");
+            place->lat = xml_get_prop(allocator, reversegeocode, "lat");
+            place->lon = xml_get_prop(allocator, reversegeocode, "lon");
+            place->osm_id = xml_get_prop(allocator, reversegeocode, "osm_id");
+            place->osm_type = xml_get_prop(allocator, reversegeocode, "osm_type");
+            place->place_id = xml_get_prop(allocator, reversegeocode, "place_id");
+            place->place_rank = xml_get_prop(allocator, reversegeocode, "place_rank");
+
+            place->polygon = xml_get_prop(allocator, reversegeocode, "geotext");
+            if (!place->polygon)
+                place->polygon = xml_get_prop(allocator, reversegeocode, "geojson");
+            if (!place->polygon)
+                place->polygon = xml_get_prop(allocator, reversegeocode, "geosvg");
+
+            place->display_name = xml_node_content(allocator, reversegeocode);
+        }
+        else if (xmlStrcmp(reversegeocode->name, (xmlChar *)"addressparts") == 0)
+        {
+            for (tag = reversegeocode->children; tag != NULL; tag = tag->next)
+                append_json_pair(&addressparts, (char *)tag->name, xml_node_content(allocator, tag));
+        }
+        else if (xmlStrcmp(reversegeocode->name, (xmlChar *)"extratags") == 0)
+        {
+            for (tag = reversegeocode->children; tag != NULL; tag = tag->next)
+                append_json_pair(&extratags, xml_get_prop(allocator, tag, "key"), xml_get_prop(allocator, tag, "value"));
+        }
+        else if (xmlStrcmp(reversegeocode->name, (xmlChar *)"geokml") == 0)
+        {
+            place->polygon = xml_dump_children(allocator, doc, reversegeocode);
+
+            if (!place->polygon)
+                return NOMINATIM_PARSE_KML_FAILED;
+        }
+        else if (xmlStrcmp(reversegeocode->name, (xmlChar *)"entrances") == 0)
+        {
+            append_entrances(&entrances, allocator, reversegeocode);
+        }
+        else if (xmlStrcmp(reversegeocode->name, (xmlChar *)"namedetails") == 0)
+        {
+            for (tag = reversegeocode->children; tag != NULL; tag = tag->next)
+                append_json_pair(&namedetails, xml_get_prop(allocator, tag, "desc"), xml_node_content(allocator, tag));
+        }
+    }
+
+    buffer_append_char(&addressparts, '}');
+    buffer_append_char(&extratags, '}');
+    buffer_append_char(&namedetails, '}');
+    buffer_append_char(&entrances, ']');
+
+    place->addressparts = addressparts.data;
+    place->extratags = extratags.data;
+    place->namedetails = namedetails.data;
+    place->entrances = entrances.data;
+
+    if (found)
+        callback(place, arg);
+
+    return NOMINATIM_PARSE_OK;
+}
+
+/*
+ * nominatim_parse_search
+ * ----------
+ *
+ * Parses the XML document returned from the Nominatim search and lookup
+ * endpoints into a NominatimRecord per place, passed to callback.
+ *
+ * doc: parsed response
+ * flags: NOMINATIM_PARSE_* flags
+ * allocator: NominatimAllocator providing the memory of the records
+ * callback: called with every record, and arg
+ *
+ * returns NOMINATIM_PARSE_OK or a NOMINATIM_PARSE_* error
+ */
+int nominatim_parse_search(xmlDocPtr doc, int flags, const NominatimAllocator *allocator,
+                           NominatimRecordCallback callback, void *arg)
+{
+    xmlNodePtr searchresults;
+    xmlNodePtr places;
+    xmlNodePtr tag;
+    xmlNodePtr root = xmlDocGetRootElement(doc);
+
+    if (!root)
+        return NOMINATIM_PARSE_NO_ROOT;
+
+    for (searchresults = root->children; searchresults != NULL; searchresults = searchresults->next)
+    {
+        NominatimRecord *place;
+        NominatimBuffer xtags;
+        NominatimBuffer addressdetails;
+        NominatimBuffer namedetails;
+        NominatimBuffer entrances;
+
+        if (xmlStrcmp(searchresults->name, (xmlChar *)"place") != 0)
+            continue;
+
+        place = allocator->alloc(sizeof(NominatimRecord), allocator->arg);
+
+        /*
+         * Point requests only need the identifiers, the coordinates and
+         * the display name, so we don't bother looking at the rest.
+         */
+        if (flags & NOMINATIM_PARSE_POINTS_ONLY)
+        {
+            place->place_id = xml_get_prop(allocator, searchresults, "place_id");
+            place->osm_id = xml_get_prop(allocator, searchresults, "osm_id");
+            place->osm_type = xml_get_prop(allocator, searchresults, "osm_type");
+            place->display_name = xml_get_prop(allocator, searchresults, "display_name");
+            place->lat = xml_get_prop(allocator, searchresults, "lat");
+            place->lon = xml_get_prop(allocator, searchresults, "lon");
+
+            callback(place, arg);
+            continue;
+        }
+
+        nominatim_buffer_init(&xtags, allocator);
+        nominatim_buffer_init(&addressdetails, allocator);
+        nominatim_buffer_init(&namedetails, allocator);
+        nominatim_buffer_init(&entrances, allocator);
+        buffer_append_char(&xtags, '{');
+        buffer_append_char(&addressdetails, '{');
+        buffer_append_char(&namedetails, '{');
+        buffer_append_char(&entrances, '[');
+
+        place->ref = xml_get_prop(allocator, searchresults, "ref");
+        place->address_rank = xml_get_prop(allocator, searchresults, "address_rank");
+        place->attribution = xml_get_prop(allocator, root, "attribution");
+        place->boundingbox = xml_get_prop(allocator, searchresults, "boundingbox");
+        place->class = xml_get_prop(allocator, searchresults, "class");
+        place->type = xml_get_prop(allocator, searchresults, "type");
+        place->display_name = xml_get_prop(allocator, searchresults, "display_name");
+        place->exclude_place_ids = xml_get_prop(allocator, root, "exclude_place_ids");
+        place->icon = xml_get_prop(allocator, searchresults, "icon");
+        place->importance = xml_get_prop(allocator, searchresults, "importance");
+        place->lat = xml_get_prop(allocator, searchresults, "lat");
+        place->lon = xml_get_prop(allocator, searchresults, "lon");
+        place->more_url = xml_get_prop(allocator, root, "more_url");
+        place->osm_id = xml_get_prop(allocator, searchresults, "osm_id");
+        place->osm_type = xml_get_prop(allocator, searchresults, "osm_type");
+        place->place_id = xml_get_prop(allocator, searchresults, "place_id");
+        place->place_rank = xml_get_prop(allocator, searchresults, "place_rank");
+
+        place->polygon = xml_get_prop(allocator, searchresults, "geotext");
+        if (!place->polygon)
+            place->polygon = xml_get_prop(allocator, searchresults, "geojson");
+        if (!place->polygon)
+            place->polygon = xml_get_prop(allocator, searchresults, "geosvg");
+
+        place->querystring = xml_get_prop(allocator, root, "querystring");
+        place->timestamp = xml_get_prop(allocator, root, "timestamp");
+
+        for (places = searchresults->children; places != NULL; places = places->next)
+        {
+            if (xmlStrcmp(places->name, (xmlChar *)"extratags") == 0)
+            {
+                for (tag = places->children; tag != NULL; tag = tag->next)
+                    append_json_pair(&xtags, xml_get_prop(allocator, tag, "key"), xml_get_prop(allocator, tag, "value"));
+            }
+            else if (xmlStrcmp(places->name, (xmlChar *)"namedetails") == 0)
+            {
+                for (tag = places->children; tag != NULL; tag = tag->next)
+                    append_json_pair(&namedetails, xml_get_prop(allocator, tag, "desc"), xml_node_content(allocator, tag));
+            }
+            else if (xmlStrcmp(places->name, (xmlChar *)"geokml") == 0)
+            {
+                place->polygon = xml_dump_children(allocator, doc, places);
+
+                if (!place->polygon)
+                    return NOMINATIM_PARSE_KML_FAILED;
+            }
+            else if (xmlStrcmp(places->name, (xmlChar *)"entrances") == 0)
+            {
+                append_entrances(&entrances, allocator, places);
+            }
+            else
+            {
+                append_json_pair(&addressdetails, (char *)places->name, xml_node_content(allocator, places));
+            }
+        }
+
+        buffer_append_char(&xtags, '}');
+        buffer_append_char(&addressdetails, '}');
+        buffer_append_char(&namedetails, '}');
+        buffer_append_char(&entrances, ']');
+
+        place->extratags = xtags.data;
+        place->addressdetails = addressdetails.data;
+        place->namedetails = namedetails.data;
+        place->entrances = entrances.data;
+
+        callback(place, arg);
+    }
+
+    return NOMINATIM_PARSE_OK;
+}
@@ -0,0 +1,152 @@
+/**********************************************************************
+ *
+ * nominatim_fdw - PostgreSQL Nominatim Extension
+ *
+ * nominatim_fdw is free software: you can redistribute it and/or modify
+ * it under the terms of the MIT Licence.
+ *
+ * Copyright (C) 2024-2026 Jim Jones <jim.jones@uni-muenster.de>
+ *
+ **********************************************************************/
+
+/*
+ * Request building and response parsing of nominatim_fdw.
+ *
+ * This unit depends on libxml2 only, so that it can be built and measured
+ * outside of PostgreSQL (see bench/parser). Memory is obtained through a
+ * NominatimAllocator: the extension passes palloc, the benchmarks a counting
+ * arena. Booleans are plain ints, as this header is included both with and
+ * without postgres.h.
+ */
+#ifndef NOMINATIM_PARSER_H
+#define NOMINATIM_PARSER_H
+
+#include <stddef.h>
+#include <libxml/tree.h>
+
+#ifdef __GNUC__
+#define NOMINATIM_PRINTF_FORMAT(f, a) __attribute__((format(printf, f, a)))
+#else
+#define NOMINATIM_PRINTF_FORMAT(f, a)
+#endif
+
+#define NOMINATIM_REQUEST_SEARCH "search"
+#define NOMINATIM_REQUEST_REVERSE "reverse"
+#define NOMINATIM_REQUEST_LOOKUP "lookup"
+
+/* results of nominatim_parse_search and nominatim_parse_reverse */
+#define NOMINATIM_PARSE_OK 0
+#define NOMINATIM_PARSE_NO_ROOT -1    /* the document has no root element */
+#define NOMINATIM_PARSE_KML_FAILED -2 /* a KML polygon could not be dumped */
+
+/* flags of nominatim_parse_search and nominatim_parse_reverse */
+#define NOMINATIM_PARSE_POINTS_ONLY 0x01 /* only ids, coordinates and display name */
+
+/*
+ * Memory of the parsed records and built URLs. alloc returns zeroed memory,
+ * realloc grows a block returned by alloc or realloc (or allocates one if
+ * ptr is NULL). Nothing is freed: the caller releases all memory at once.
+ */
+typedef struct NominatimAllocator
+{
+    void *(*alloc)(size_t size, void *arg);
+    void *(*realloc)(void *ptr, size_t size, void *arg);
+    void *arg;
+} NominatimAllocator;
+
+/* growable string, allocated with a NominatimAllocator */
+typedef struct NominatimBuffer
+{
+    char *data;
+    size_t len;
+    size_t size;
+    const NominatimAllocator *allocator;
+} NominatimBuffer;
+
+typedef struct NominatimRecord
+{
+    char *timestamp;
+    char *attribution;
+    char *querystring;
+    char *polygon;
+    char *exclude_place_ids;
+    char *more_url;
+    char *place_id;
+    char *osm_type;
+    char *osm_id;
+    char *ref;
+    char *lat;
+    char *lon;
+    char *boundingbox;
+    char *place_rank;
+    char *address_rank;
+    char *display_name;
+    char *class;
+    char *type;
+    char *importance;
+    char *icon;
+    char *extratags;
+    char *addressdetails;
+    char *namedetails;
+    char *addressparts;
+    char *entrances;
+} NominatimRecord;
+
+/* called for every place parsed from a response, in document order */
+typedef void (*NominatimRecordCallback)(NominatimRecord *place, void *arg);
+
+/*
+ * Parameters of a request. Strings may be NULL or empty if not set, and
+ * are escaped while building the URL.
+ */
+typedef struct NominatimRequestParams
+{
+    const char *url;               /* URL of the Nominatim server */
+    const char *request_type;      /* search, reverse or lookup */
+    const char *format;            /* xml or jsonv2 */
+    const char *query;
+    const char *amenity;
+    const char *osm_ids;
+    const char *street;
+    const char *city;
+    const char *county;
+    const char *state;
+    const char *country;
+    const char *postalcode;
+    const char *polygon_type;
+    const char *accept_language;
+    const char *countrycodes;
+    const char *layer;
+    const char *feature_type;
+    const char *exclude_place_ids;
+    const char *viewbox;
+    const char *email;
+    double lon;
+    double lat;
+    double polygon_threshold;      /* 0 = not sent */
+    int zoom;                      /* -1 = not sent */
+    int limit;                     /* 0 = not sent */
+    int reverse_grid;              /* edge of the cells reverse coordinates are snapped to (0 = disabled) */
+    int bounded;
+    int dedupe;
+    int entrances;
+    int extratags;
+    int namedetails;
+    int addressdetails;
+} NominatimRequestParams;
+
+extern void nominatim_buffer_init(NominatimBuffer *buf, const NominatimAllocator *allocator);
+extern void nominatim_buffer_append(NominatimBuffer *buf, const char *data, size_t len);
+extern void nominatim_buffer_printf(NominatimBuffer *buf, const char *fmt, ...) NOMINATIM_PRINTF_FORMAT(2, 3);
+extern void nominatim_escape_json(NominatimBuffer *buf, const char *str);
+extern void nominatim_escape_url(NominatimBuffer *buf, const char *str);
+
+extern void nominatim_build_url(const NominatimRequestParams *params, NominatimBuffer *url);
+extern void nominatim_snap_to_grid(int zoom, int grid, double *lon, double *lat);
+
+extern int nominatim_parse_search(xmlDocPtr doc, int flags, const NominatimAllocator *allocator,
+                                  NominatimRecordCallback callback, void *arg);
+extern int nominatim_parse_reverse(xmlDocPtr doc, int flags, const NominatimAllocator *allocator,
+                                   NominatimRecordCallback callback, void *arg);
+
+#endif /* NOMINATIM_PARSER_H */
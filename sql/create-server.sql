@@ -18,7 +18,7 @@ CREATE SERVER bad5 FOREIGN DATA WRAPPER nominatim_fdw
 CREATE SERVER bad6 FOREIGN DATA WRAPPER nominatim_fdw 
   OPTIONS (url 'https://x.org', bogus_option 'x');
 
-/* FOREIGN TABLE explicitly unsupported */
+/* FOREIGN TABLE requires an endpoint */
 CREATE SERVER osm 
 FOREIGN DATA WRAPPER nominatim_fdw 
 OPTIONS (url 'https://nominatim.openstreetmap.org');
@@ -98,7 +98,7 @@ SELECT * FROM nominatim_search(server_name => 'srv');
 /* bad request: invalid layer */
 SELECT * FROM nominatim_search(server_name => 'srv',  q => 'foo', layer => 'bar');
 
-/* FOREIGN TABLE not supported */
+/* invalid foreign table options */
 CREATE FOREIGN TABLE t (osm_id bigint OPTIONS (foo 'bar'))
 SERVER srv OPTIONS (foo 'bar');
 
@@ -107,3 +107,103 @@ CREATE USER MAPPING FOR postgres SERVER srv OPTIONS (foo 'bar');
 CREATE USER MAPPING FOR postgres SERVER srv OPTIONS (proxy_user 'u1', proxy_password '');
 CREATE USER MAPPING FOR postgres SERVER srv OPTIONS (proxy_user '', proxy_password 'pw1');
 CREATE USER MAPPING FOR postgres SERVER srv OPTIONS (proxy_user '', proxy_password '');
+
+/* raw variants validate their arguments just like the SETOF functions */
+SELECT nominatim_search_raw(server_name => 'srv');
+SELECT nominatim_reverse_raw(server_name => 'srv', lon => 200, lat => 50);
+SELECT nominatim_lookup_raw_xml(server_name => 'srv', osm_ids => '');
+
+/* point variants validate their arguments just like the SETOF functions */
+SELECT * FROM nominatim_search_point(server_name => 'srv', q => 'foo', city => 'bar');
+SELECT * FROM nominatim_reverse_point(server_name => 'srv', lon => 7.6, lat => 91);
+SELECT * FROM nominatim_search_paged(server_name => 'srv');
+
+/* foreign tables */
+CREATE FOREIGN TABLE ft_bad (osm_id bigint) SERVER srv OPTIONS (endpoint 'foo');
+CREATE FOREIGN TABLE ft_bad (osm_id bigint) SERVER srv OPTIONS (endpoint 'search', polygon 'foo');
+CREATE FOREIGN TABLE ft_search (q text, city text, osm_id bigint, display_name text)
+SERVER srv OPTIONS (endpoint 'search');
+CREATE FOREIGN TABLE ft_reverse (lon double precision, lat double precision, display_name text)
+SERVER srv OPTIONS (endpoint 'reverse');
+
+/* conditions on parameter columns and LIMIT are sent to the server */
+EXPLAIN (COSTS OFF) SELECT display_name FROM ft_search WHERE q = 'Muenster' LIMIT 5;
+EXPLAIN (COSTS OFF) SELECT display_name FROM ft_search WHERE q = 'Muenster' AND display_name LIKE '%Altstadt%' LIMIT 5;
+
+/* scans validate the pushed down parameters before sending the request */
+SELECT * FROM ft_search;
+SELECT * FROM ft_search WHERE q = 'foo' AND city = 'bar';
+SELECT * FROM ft_reverse WHERE lat = 51.9;
+
+/* join clauses on parameter columns make the scan parameterized */
+CREATE TEMPORARY TABLE addr (full_address text);
+INSERT INTO addr VALUES ('Muenster'), ('Osnabrueck');
+ANALYZE addr;
+EXPLAIN (COSTS OFF) SELECT p.display_name FROM addr a JOIN ft_search p ON p.q = a.full_address;
+DROP TABLE addr;
+
+/* "= ANY(array)" and IN on a parameter column send one request per element */
+EXPLAIN (COSTS OFF) SELECT display_name FROM ft_search WHERE q IN ('Muenster', 'Osnabrueck');
+/* only one array condition is sent to the server, further ones are checked locally */
+EXPLAIN (COSTS OFF) SELECT display_name FROM ft_search WHERE q = ANY(ARRAY['Muenster', 'Osnabrueck']) AND city = ANY(ARRAY['Muenster', 'Osnabrueck']);
+
+/* invalid async_capable */
+ALTER SERVER srv OPTIONS (ADD async_capable 'maybe');
+ALTER FOREIGN TABLE ft_search OPTIONS (ADD async_capable 'maybe');
+
+/* cached variants validate their arguments just like the VOLATILE functions */
+SELECT * FROM nominatim_lookup_cached(server_name => 'srv', osm_ids => '');
+SELECT * FROM nominatim_reverse_cached(server_name => 'srv', lon => 200, lat => 52);
+
+/* invalid cache_ttl and cache_negative_ttl */
+ALTER SERVER srv OPTIONS (ADD cache_ttl '-1');
+ALTER SERVER srv OPTIONS (ADD cache_negative_ttl 'foo');
+/* the shared cache requires shared_preload_libraries */
+SELECT * FROM nominatim_fdw_cache_stats();
+
+/* cache maintenance requires a cache table */
+SELECT nominatim_fdw_cache_refresh('srv');
+
+/* invalid reverse_grid */
+ALTER SERVER srv OPTIONS (ADD reverse_grid '1.5');
+
+/* request statistics require shared_preload_libraries */
+SELECT * FROM nominatim_fdw_stats;
+SELECT * FROM nominatim_fdw_activity;
+
+/* record and replay require a directory */
+SET nominatim_fdw.transport = 'replay';
+SELECT * FROM nominatim_reverse(server_name => 'srv', lon => 7.6, lat => 51.9);
+RESET nominatim_fdw.transport;
+SET nominatim_fdw.transport = 'tape';
+
+/* nominatim_fdw_bench checks its arguments before sending any request */
+SELECT * FROM nominatim_fdw_bench('srv', 'geocode', ARRAY['Muenster']);
+SELECT * FROM nominatim_fdw_bench('srv', 'search', ARRAY['Muenster'], concurrency => 0);
+SELECT * FROM nominatim_fdw_bench('srv', 'search', ARRAY['Muenster'], duration => '0 seconds');
+SELECT * FROM nominatim_fdw_bench('srv', 'search', ARRAY['', NULL]);
+SELECT * FROM nominatim_fdw_bench('srv', 'reverse', ARRAY['7.6261 51.9607']);
+SELECT * FROM nominatim_fdw_bench('srv', 'reverse', ARRAY['7.6261,91']);
+
+/* max_requests_per_second must be a positive number */
+ALTER SERVER srv OPTIONS (ADD max_requests_per_second '0');
+ALTER SERVER srv OPTIONS (ADD max_requests_per_second 'fast');
+/* max_concurrent_requests must be a positive integer */
+ALTER SERVER srv OPTIONS (ADD max_concurrent_requests '0');
+ALTER SERVER srv OPTIONS (ADD max_concurrent_requests '2.5');
+
+/* nominatim_geocode_table checks its arguments and the table before starting any worker */
+CREATE TABLE geo (id int PRIMARY KEY, address text, lon numeric, lat numeric);
+CREATE TEMPORARY TABLE geo_tmp (id int PRIMARY KEY, address text, lon numeric, lat numeric);
+CREATE TABLE geo_nopk (address text, lon numeric, lat numeric);
+CALL nominatim_geocode_table('srv', 'geo', 'address', ARRAY['lon', 'lat'], workers => 0);
+CALL nominatim_geocode_table('srv', 'geo', 'address', ARRAY['lon', 'lat'], batch_size => 0);
+BEGIN;
+CALL nominatim_geocode_table('srv', 'geo', 'address', ARRAY['lon', 'lat']);
+ROLLBACK;
+CALL nominatim_geocode_table('srv', 'geo_tmp', 'address', ARRAY['lon', 'lat']);
+CALL nominatim_geocode_table('srv', 'geo_nopk', 'address', ARRAY['lon', 'lat']);
+CALL nominatim_geocode_table('srv', 'geo', 'address', ARRAY[]::text[]);
+DROP TABLE geo, geo_tmp, geo_nopk;
+
+DROP FOREIGN TABLE ft_search, ft_reverse;
@@ -0,0 +1,36 @@
+CREATE SERVER osm_ft
+FOREIGN DATA WRAPPER nominatim_fdw
+OPTIONS (url 'https://nominatim.openstreetmap.org');
+
+CREATE FOREIGN TABLE ft_addresses (
+  lon double precision,
+  lat double precision,
+  zoom int,
+  display_name text,
+  place_lon double precision,
+  place_lat double precision
+)
+SERVER osm_ft OPTIONS (endpoint 'reverse');
+
+/* parameter columns return the values sent to the server, the place found is in place_lon and place_lat */
+SELECT lon, lat, zoom, display_name IS NOT NULL AS found,
+       abs(place_lon - lon) < 0.01 AND abs(place_lat - lat) < 0.01 AS nearby
+FROM ft_addresses
+WHERE lon = 7.6255 AND lat = 51.9629 AND zoom = 18;
+
+/* a second condition on a parameter column is checked locally against the value sent */
+SELECT lon, lat FROM ft_addresses WHERE lon = 7.6255 AND lat = 51.9629 AND lon = 7.7;
+
+/* the constants of the WHERE clause match the returned rows */
+SELECT count(*) FROM ft_addresses WHERE lon = 7.6255 AND lat = 51.9629
+  AND NOT (lon = 7.6255 AND lat = 51.9629);
+
+/* "= ANY(array)" sends one request per distinct element, up to max_concurrent_requests at once */
+ALTER SERVER osm_ft OPTIONS (ADD max_concurrent_requests '2');
+SELECT lon, lat, display_name IS NOT NULL AS found
+FROM ft_addresses
+WHERE lon = ANY('{7.6255,7.6261,7.6255}'::float8[]) AND lat = 51.9629 AND zoom = 18
+ORDER BY lon;
+
+DROP FOREIGN TABLE ft_addresses;
+DROP SERVER osm_ft;
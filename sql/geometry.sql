@@ -0,0 +1,41 @@
+/* the geometry functions are only created if PostGIS is installed before nominatim_fdw */
+SELECT count(*) > 0 AS has_postgis FROM pg_available_extensions WHERE name = 'postgis' \gset
+
+\if :has_postgis
+SET client_min_messages TO warning;
+DROP EXTENSION nominatim_fdw CASCADE;
+CREATE EXTENSION postgis;
+CREATE EXTENSION nominatim_fdw;
+RESET client_min_messages;
+
+CREATE SERVER osm_geom
+FOREIGN DATA WRAPPER nominatim_fdw
+OPTIONS (url 'https://nominatim.openstreetmap.org', max_requests_per_second '1');
+
+\x
+
+/* point, bounding box and polygon of the place as geometries in SRID 4326 */
+SELECT osm_id, osm_type, class, type,
+       ST_AsEWKT(geom) AS geom,
+       ST_AsEWKT(envelope) AS envelope,
+       ST_AsEWKT(polygon) AS polygon
+FROM nominatim_lookup_geom(
+      server_name => 'osm_geom',
+      osm_ids => 'W88291927',
+      polygon => 'polygon_text',
+      polygon_threshold => 0.1);
+
+\x
+
+/* the polygon is only there if it was requested */
+SELECT osm_id, polygon IS NULL AS no_polygon
+FROM nominatim_lookup_geom(server_name => 'osm_geom', osm_ids => 'W88291927');
+
+/* the place found by reverse lies close to the given point */
+SELECT GeometryType(geom) AS geom_type, ST_SRID(geom) AS srid,
+       ST_DWithin(geom, ST_SetSRID(ST_MakePoint(7.6255, 51.9629), 4326), 0.01) AS nearby,
+       GeometryType(envelope) AS envelope_type
+FROM nominatim_reverse_geom(server_name => 'osm_geom', lon => 7.6255, lat => 51.9629, zoom => 18);
+
+DROP SERVER osm_geom;
+\endif